@@ -27,21 +27,139 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "cortex.h"
+#include "cortex_parallel.h"
+#include "cortex_prof.h"
 
 enum PATH_TYPE {FLANK_5P,FLANK_3P,BRANCH1,BRANCH2};
 
 char *fail_msg = "FAILS CLASSIFIER:";
 char *discovery_msg = "DISCOVERY PHASE:";
 
+// Follow mode backoff between attempts to read more of a file (microseconds)
+#define FOLLOW_MIN_DELAY 1000
+#define FOLLOW_MAX_DELAY 250000
+
+unsigned long long _follow_now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// In follow mode a line without a newline hasn't finished being written (an
+// empty read is a record that hasn't been started).  Wait for the rest,
+// backing off, until it arrives, the writer finishes or the timeout passes
+t_buf_pos _follow_line(CORTEX_FILE* c_file, t_buf_pos chars_read)
+{
+  unsigned long long start = 0, last_growth = 0, now;
+  unsigned long delay = FOLLOW_MIN_DELAY;
+  StrBuf *sbuf = c_file->buffer;
+
+  while(strbuf_len(sbuf) == 0 || sbuf->buff[strbuf_len(sbuf)-1] != '\n')
+  {
+    if(__atomic_load_n(&c_file->follow_finished, __ATOMIC_ACQUIRE))
+    {
+      // Nothing more will be written; take whatever is left
+      chars_read += cortex_reader_readline(c_file->file, sbuf);
+      break;
+    }
+
+    now = _follow_now_ns();
+
+    if(start == 0)
+    {
+      start = last_growth = now;
+      c_file->follow_waits++;
+    }
+    else if(now - last_growth >= c_file->follow_timeout_ms * 1000000ULL)
+    {
+      break;
+    }
+
+    struct timespec sleep_time = {0, delay * 1000L};
+    nanosleep(&sleep_time, NULL);
+
+    t_buf_pos more = cortex_reader_readline(c_file->file, sbuf);
+
+    if(more > 0)
+    {
+      chars_read += more;
+      last_growth = _follow_now_ns();
+      delay = FOLLOW_MIN_DELAY;
+    }
+    else if(delay < FOLLOW_MAX_DELAY)
+    {
+      delay = 2 * delay < FOLLOW_MAX_DELAY ? 2 * delay : FOLLOW_MAX_DELAY;
+    }
+  }
+
+  if(start != 0)
+  {
+    c_file->follow_wait_ns += _follow_now_ns() - start;
+  }
+
+  return chars_read;
+}
+
+// Read a line from in-memory input (see cortex_parser_feed())
+t_buf_pos _mem_read_line(CORTEX_FILE* c_file)
+{
+  size_t remaining = c_file->mem_end - c_file->mem;
+  const char *end = (const char*) memchr(c_file->mem, '\n', remaining);
+  size_t len = (end == NULL ? remaining : (size_t)(end - c_file->mem) + 1);
+
+  c_file->line_offset = c_file->mem_start_offset +
+                        (c_file->mem - c_file->mem_start);
+
+  strbuf_reset(c_file->buffer);
+  strbuf_append_strn(c_file->buffer, c_file->mem, len);
+  c_file->mem += len;
+
+  return len;
+}
+
 t_buf_pos _cortex_read_line(CORTEX_FILE* c_file)
 {
-  t_buf_pos chars_read = strbuf_reset_gzreadline(c_file->buffer,
-                                                      c_file->file);
+  t_buf_pos chars_read;
+
+  CORTEX_PROF_ENTER(PROF_LINE_SPLIT);
+
+  if(c_file->file == NULL)
+  {
+    chars_read = _mem_read_line(c_file);
+  }
+  else
+  {
+    c_file->line_offset = cortex_reader_tell(c_file->file);
+
+    strbuf_reset(c_file->buffer);
+    chars_read = cortex_reader_readline(c_file->file, c_file->buffer);
+
+    if(c_file->follow_timeout_ms > 0)
+    {
+      chars_read = _follow_line(c_file, chars_read);
+    }
+  }
+
   strbuf_chomp(c_file->buffer);
-  c_file->line_number++;
+  c_file->line_eof = (chars_read == 0);
+
+  // Reading off the end of in-memory data isn't a line: the next chunk
+  // continues from here
+  if(c_file->file != NULL || chars_read > 0)
+  {
+    c_file->line_number++;
+  }
   
+  CORTEX_PROF_LEAVE();
+
   //printf("Read: %s\n", c_file->buffer->buff);
   
   return chars_read;
@@ -49,7 +167,15 @@ t_buf_pos _cortex_read_line(CORTEX_FILE* c_file)
 
 t_buf_pos _cortex_read_reset(CORTEX_FILE* c_file)
 {
-  gzrewind(c_file->file);
+  if(c_file->file == NULL)
+  {
+    c_file->mem = c_file->mem_start;
+  }
+  else
+  {
+    cortex_reader_seek(c_file->file, 0);
+  }
+
   c_file->line_number = 0;
   return _cortex_read_line(c_file);
 }
@@ -87,7 +213,7 @@ char* _parse_bubble_meta(const char* buff, const char* search,
   return hit;
 }
 
-inline void _set_kmer_size(char *buffer, CORTEX_FILE *c_file)
+void _set_kmer_size(char *buffer, CORTEX_FILE *c_file)
 {
   char *first_kmer = (char*)malloc(65*sizeof(char));
   _parse_bubble_meta(buffer, "fst_kmer:", first_kmer, c_file);
@@ -140,14 +266,20 @@ char _parse_alignment_colour_num(char* str, unsigned long* new_colour)
   return 0;
 }
 
-// If cannot open file or file is empty will print error and return NULL
-CORTEX_FILE* cortex_open(const char* path)
+// Allocate a CORTEX_FILE with no input.  path is only used in messages
+CORTEX_FILE* _cortex_file_alloc(const char* path)
 {
   CORTEX_FILE* c_file = (CORTEX_FILE*) malloc(sizeof(CORTEX_FILE));
 
   // Give initial values
+  c_file->file = NULL;
+  c_file->mem_start = c_file->mem = c_file->mem_end = NULL;
+  c_file->mem_start_offset = 0;
   c_file->buffer = strbuf_init(500); // Create read in buffer
   c_file->line_number = 0;
+  c_file->line_eof = 0;
+  c_file->line_offset = 0;
+  c_file->record_offset = 0;
   c_file->filetype = UNKNOWN_FILE;
   c_file->kmer_size = 0;
   c_file->num_of_colours = 0;
@@ -158,6 +290,18 @@ CORTEX_FILE* cortex_open(const char* path)
   c_file->is_diploid = 0;
   c_file->fails_classifier_line = 0;
   c_file->discovery_phase_line = 0;
+  c_file->read_bubble_head = NULL;
+  c_file->bubble_head_lines = 0;
+
+  // Stop at the first malformed record
+  c_file->error_budget = 0;
+  c_file->records_skipped = 0;
+
+  // Follow mode off
+  c_file->follow_timeout_ms = 0;
+  c_file->follow_finished = 0;
+  c_file->follow_waits = 0;
+  c_file->follow_wait_ns = 0;
 
   // Set path
   size_t path_len = strlen(path);
@@ -165,8 +309,17 @@ CORTEX_FILE* cortex_open(const char* path)
   strcpy(c_file->path, path);
   c_file->path[path_len] = '\0';
 
+  return c_file;
+}
+
+// Allocate a CORTEX_FILE and open path, without reading anything
+// If cannot open file will print error and return NULL
+CORTEX_FILE* _cortex_file_create(const char* path)
+{
+  CORTEX_FILE* c_file = _cortex_file_alloc(path);
+
   // Open file
-  c_file->file = gzopen(path, "r");
+  c_file->file = cortex_reader_open(path);
 
   if(c_file->file == NULL)
   {
@@ -175,6 +328,16 @@ CORTEX_FILE* cortex_open(const char* path)
     return NULL;
   }
 
+  return c_file;
+}
+
+// Work out the type, kmer size and colours of a newly created file, then
+// rewind it.  If the file is empty or not recognised, will print error, close
+// c_file and return NULL
+CORTEX_FILE* _cortex_sniff(CORTEX_FILE* c_file)
+{
+  const char *path = c_file->path;
+
   // Whilst still reading but lines empty (_cortex_read_line does chomp)
   t_buf_pos chars_read;
   
@@ -312,7 +475,7 @@ CORTEX_FILE* cortex_open(const char* path)
       while(isdigit(*digit_start)) {
         digit_start++;
       }
-      while(!isspace(*digit_start)) {
+      while(isspace(*digit_start)) {
         digit_start++;
       }
     }
@@ -386,6 +549,38 @@ CORTEX_FILE* cortex_open(const char* path)
   return NULL;
 }
 
+// If cannot open file or file is empty will print error and return NULL
+CORTEX_FILE* cortex_open(const char* path)
+{
+  CORTEX_FILE* c_file = _cortex_file_create(path);
+  return c_file == NULL ? NULL : _cortex_sniff(c_file);
+}
+
+CORTEX_FILE* cortex_open_follow(const char* path, unsigned long timeout_ms)
+{
+  // The writer may not have created the file yet
+  unsigned long long start = _follow_now_ns();
+  unsigned long delay = FOLLOW_MIN_DELAY;
+
+  while(access(path, F_OK) != 0 &&
+        _follow_now_ns() - start < timeout_ms * 1000000ULL)
+  {
+    struct timespec sleep_time = {0, delay * 1000L};
+    nanosleep(&sleep_time, NULL);
+    delay = 2 * delay < FOLLOW_MAX_DELAY ? 2 * delay : FOLLOW_MAX_DELAY;
+  }
+
+  CORTEX_FILE* c_file = _cortex_file_create(path);
+
+  if(c_file == NULL)
+  {
+    return NULL;
+  }
+
+  cortex_follow(c_file, timeout_ms);
+  return _cortex_sniff(c_file);
+}
+
 void cortex_close(CORTEX_FILE *c_file)
 {
   if(c_file->buffer != NULL)
@@ -395,7 +590,7 @@ void cortex_close(CORTEX_FILE *c_file)
 
   if(c_file->file != NULL)
   {
-    gzclose(c_file->file);
+    cortex_reader_close(c_file->file);
   }
 
   if(c_file->colour_arr != NULL)
@@ -453,183 +648,1090 @@ long cortex_file_get_colour_index(unsigned long colour,
   return -1;
 }
 
-COLOUR_COVG* _colour_covgs_create()
+char cortex_seek(CORTEX_FILE* c_file, long offset)
 {
-  COLOUR_COVG* covgs = (COLOUR_COVG*) malloc(sizeof(COLOUR_COVG));
-  covgs->colour_covgs = (unsigned long*) malloc(200 * sizeof(unsigned long));
-  covgs->capacity = 200;
-  covgs->length = 0;
+  if(c_file->file == NULL)
+  {
+    // In-memory input: only within the data being parsed
+    if(offset < c_file->mem_start_offset ||
+       offset > c_file->mem_start_offset + (c_file->mem_end - c_file->mem_start))
+    {
+      fprintf(stderr, "cortex.c: couldn't seek to offset %li (%s)\n",
+              offset, c_file->path);
+      return 0;
+    }
 
-  return covgs;
+    c_file->mem = c_file->mem_start + (offset - c_file->mem_start_offset);
+  }
+  else if(!cortex_reader_seek(c_file->file, offset))
+  {
+    fprintf(stderr, "cortex.c: couldn't seek to offset %li (%s)\n",
+            offset, c_file->path);
+    return 0;
+  }
+
+  c_file->line_number = 0;
+  _cortex_read_line(c_file);
+
+  return 1;
 }
 
-void _colour_covgs_reset(COLOUR_COVG* covgs)
+void cortex_follow(CORTEX_FILE* c_file, unsigned long timeout_ms)
 {
-  covgs->length = 0;
+  c_file->follow_timeout_ms = timeout_ms;
 }
 
-void _colour_covgs_free(COLOUR_COVG* covgs)
+void cortex_follow_finish(CORTEX_FILE* c_file)
 {
-  free(covgs->colour_covgs);
-  free(covgs);
+  __atomic_store_n(&c_file->follow_finished, 1, __ATOMIC_RELEASE);
 }
 
-CORTEX_BUBBLE* cortex_bubble_create(const CORTEX_FILE *c_file)
-{
-  CORTEX_BUBBLE* bubble = (CORTEX_BUBBLE*) malloc(sizeof(CORTEX_BUBBLE));
+//
+// Skipping malformed records
+//
 
-  unsigned long col;
-  int branch;
+void cortex_set_error_budget(CORTEX_FILE* c_file, unsigned long max_skipped)
+{
+  c_file->error_budget = max_skipped;
+}
 
-  for(branch = 0; branch < 2; branch++)
+// Does line start a bubble record?  Only the first few bytes are checked
+char _is_bubble_start(const CORTEX_FILE* c_file, const char* line)
+{
+  if(c_file->fails_classifier_line)
   {
-    bubble->branches_colour_covgs[branch]
-      = (COLOUR_COVG**) malloc(c_file->num_of_colours * sizeof(COLOUR_COVG*));
-  
-    for(col = 0; col < c_file->num_of_colours; col++)
-    {
-      bubble->branches_colour_covgs[branch][col] = _colour_covgs_create();
-    }
+    return strncasecmp(line, fail_msg, strlen(fail_msg)) == 0;
   }
-
-  bubble->flank_5p.seq = strbuf_init(200);
-  bubble->flank_3p.seq = strbuf_init(200);
-  bubble->branches[0].seq = strbuf_init(200);
-  bubble->branches[1].seq = strbuf_init(200);
-
-  if(bubble->branches[0].seq == NULL)
+  else if(c_file->discovery_phase_line)
   {
-    fprintf(stderr, "cortex.c: mem fail\n");
-    exit(EXIT_FAILURE);
+    return strncasecmp(line, discovery_msg, strlen(discovery_msg)) == 0;
   }
-
-  bubble->calls
-    = (HETEROGENEITY*) malloc(c_file->num_of_colours * sizeof(HETEROGENEITY));
-
-  bubble->llk_hom_br1 = (float*) malloc(c_file->num_of_colours * sizeof(float));
-  bubble->llk_het     = (float*) malloc(c_file->num_of_colours * sizeof(float));
-  bubble->llk_hom_br2 = (float*) malloc(c_file->num_of_colours * sizeof(float));
-
-  if(bubble->llk_hom_br1 == NULL || bubble->llk_het == NULL ||
-     bubble->llk_hom_br2 == NULL)
+  else if(c_file->has_likelihoods)
   {
-    fprintf(stderr, "cortex.c: Couldn't allocate enough memory\n");
-    exit(EXIT_FAILURE);
+    return strncasecmp(line, "Colour", strlen("Colour")) == 0;
+  }
+  else
+  {
+    return strncmp(line, ">var_", strlen(">var_")) == 0 &&
+           strstr(line, "_5p_flank") != NULL;
   }
-
-  return bubble;
 }
 
-void cortex_bubble_reset(CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
+// Does line start an alignment record?  (A name line, not a coverage header)
+char _is_alignment_start(const CORTEX_FILE* c_file, const char* line)
 {
-  strbuf_reset(bubble->flank_5p.seq);
-  strbuf_reset(bubble->flank_3p.seq);
-  strbuf_reset(bubble->branches[0].seq);
-  strbuf_reset(bubble->branches[1].seq);
+  (void)c_file;
+  return line[0] == '>' && strstr(line, "_kmer_coverages") == NULL;
+}
 
-  unsigned long col;
-  int branch;
+typedef char (*_record_start_func)(const CORTEX_FILE* c_file,
+                                   const char* line);
 
-  for(branch = 0; branch < 2; branch++)
+// Called after a record failed to parse.  If there is error budget left, skip
+// to the start of the next record and return 1 so the caller tries again.
+// Returns 0 when the caller should give up
+char _recover(CORTEX_FILE* c_file, _record_start_func is_start)
+{
+  // Only records that were there to read can be skipped.  Blank lines are
+  // part of records, so a failure on one can still be skipped
+  if(c_file->error_budget == 0 || c_file->line_eof ||
+     (c_file->filetype == BUBBLE_FILE && is_start != _is_bubble_start) ||
+     (c_file->filetype == ALIGNMENT_FILE && is_start != _is_alignment_start))
   {
-    for(col = 0; col < c_file->num_of_colours; col++)
-    {
-      _colour_covgs_reset(bubble->branches_colour_covgs[branch][col]);
-    }
+    return 0;
   }
-}
-
-void cortex_bubble_free(CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
-{
-  unsigned long col;
-  int branch;
 
-  for(branch = 0; branch < 2; branch++)
+  if(c_file->records_skipped == c_file->error_budget)
   {
-    for(col = 0; col < c_file->num_of_colours; col++)
-    {
-      _colour_covgs_free(bubble->branches_colour_covgs[branch][col]);
-    }
+    fprintf(stderr, "cortex.c: too many malformed records [%lu], giving up "
+                    "(%s:%lu)\n",
+            c_file->records_skipped, c_file->path, c_file->line_number);
+    return 0;
+  }
 
-    free(bubble->branches_colour_covgs[branch]);
+  c_file->records_skipped++;
+
+  unsigned long failed_line = c_file->line_number;
+
+  // The line that didn't parse may be the start of the next record (if the
+  // last one was cut short), but not if it started the record that failed.
+  // Blank lines are stepped over like any other line
+  if(c_file->line_offset == c_file->record_offset ||
+     !is_start(c_file, c_file->buffer->buff))
+  {
+    while(_cortex_read_line(c_file) > 0 &&
+          !is_start(c_file, c_file->buffer->buff));
   }
 
-  strbuf_free(bubble->flank_5p.seq);
-  strbuf_free(bubble->flank_3p.seq);
-  strbuf_free(bubble->branches[0].seq);
-  strbuf_free(bubble->branches[1].seq);
+  if(c_file->line_eof)
+  {
+    fprintf(stderr, "cortex.c: skipped malformed record at line %lu to the "
+                    "end of the file (%s)\n", failed_line, c_file->path);
+    return 0;
+  }
 
-  free(bubble->calls);
-  free(bubble->llk_hom_br1);
-  free(bubble->llk_het);
-  free(bubble->llk_hom_br2);
+  fprintf(stderr, "cortex.c: skipped malformed record at line %lu, carrying on "
+                  "at line %lu (%s)\n",
+          failed_line, c_file->line_number, c_file->path);
 
-  free(bubble);
+  return 1;
 }
 
-CORTEX_ALIGNMENT* cortex_alignment_create(const CORTEX_FILE *c_file)
+typedef struct
 {
-  CORTEX_ALIGNMENT* alignment
-    = (CORTEX_ALIGNMENT*) malloc(sizeof(CORTEX_ALIGNMENT));
+  const char **paths;
+  CORTEX_FILE **c_files;
+} _OPEN_MANY_ARGS;
 
-  alignment->name = strbuf_init(200);
-  alignment->seq = strbuf_init(200);
-
-  alignment->colour_covgs
-    = (COLOUR_COVG**) malloc(c_file->num_of_colours * sizeof(COLOUR_COVG*));
+void _open_many_file(size_t i, void *ptr)
+{
+  _OPEN_MANY_ARGS *args = (_OPEN_MANY_ARGS*)ptr;
+  args->c_files[i] = cortex_open(args->paths[i]);
+}
 
-  unsigned long col;
-  for(col = 0; col < c_file->num_of_colours; col++)
+enum CORTEX_OPEN_STATUS _open_many_compare(const CORTEX_FILE *first,
+                                           const CORTEX_FILE *c_file)
+{
+  if(c_file->filetype != first->filetype)
   {
-    alignment->colour_covgs[col] = _colour_covgs_create();
+    fprintf(stderr, "cortex.c: file type differs from %s (%s)\n",
+            first->path, c_file->path);
+    return OPEN_FILETYPE_DIFFERS;
   }
 
-  return alignment;
-}
-
-void cortex_alignment_reset(CORTEX_ALIGNMENT* alignment,
-                            const CORTEX_FILE *c_file)
-{
-  strbuf_reset(alignment->name);
-  strbuf_reset(alignment->seq);
+  if(c_file->kmer_size != first->kmer_size)
+  {
+    fprintf(stderr, "cortex.c: kmer size %u differs from %u in %s (%s)\n",
+            c_file->kmer_size, first->kmer_size, first->path, c_file->path);
+    return OPEN_KMER_SIZE_DIFFERS;
+  }
 
-  unsigned long col;
-  for(col = 0; col < c_file->num_of_colours; col++)
+  if(c_file->num_of_colours != first->num_of_colours ||
+     memcmp(c_file->colour_arr, first->colour_arr,
+            first->num_of_colours * sizeof(unsigned long)) != 0)
   {
-    _colour_covgs_reset(alignment->colour_covgs[col]);
+    fprintf(stderr, "cortex.c: colours differ from %s (%s)\n",
+            first->path, c_file->path);
+    return OPEN_COLOURS_DIFFER;
   }
+
+  return OPEN_OK;
 }
 
-void cortex_alignment_free(CORTEX_ALIGNMENT* alignment,
-                           const CORTEX_FILE *c_file)
+CORTEX_FILE** cortex_open_many(const char **paths, size_t num_files,
+                               unsigned int num_threads,
+                               CORTEX_OPEN_SUMMARY *summary)
 {
-  strbuf_free(alignment->name);
-  strbuf_free(alignment->seq);
+  CORTEX_FILE **c_files
+    = (CORTEX_FILE**) malloc(num_files * sizeof(CORTEX_FILE*));
 
-  unsigned long col;
-  for(col = 0; col < c_file->num_of_colours; col++)
+  // Allocate the summary before opening anything, so there is nothing to
+  // close if it fails
+  if(summary != NULL)
   {
-    _colour_covgs_free(alignment->colour_covgs[col]);
+    summary->status = (enum CORTEX_OPEN_STATUS*)
+                      malloc(num_files * sizeof(enum CORTEX_OPEN_STATUS));
+    summary->num_ok = summary->num_failed = summary->num_filetype_differs = 0;
+    summary->num_kmer_size_differs = summary->num_colours_differ = 0;
   }
 
-  free(alignment->colour_covgs);
-  free(alignment);
-}
-
-// line of numbers should have bean already read into c_file->buffer
-char _read_covg(CORTEX_FILE *c_file, COLOUR_COVG *covgs, size_t required_size)
-{
-  // Ensure size
-  if(covgs->capacity < required_size)
+  if(num_files > 0 &&
+     (c_files == NULL || (summary != NULL && summary->status == NULL)))
   {
-    // Enlarge for all colours
-    covgs->colour_covgs = realloc(covgs->colour_covgs,
-                                  required_size * sizeof(unsigned long));
+    fprintf(stderr, "cortex.c: out of memory opening %lu files\n",
+            (unsigned long)num_files);
+
+    free(c_files);
+
+    if(summary != NULL)
+    {
+      cortex_open_summary_free(summary);
+    }
+
+    return NULL;
+  }
+
+  // Opening is mostly waiting on reads and inflating the first records, so
+  // files are opened in parallel
+  _OPEN_MANY_ARGS args = {paths, c_files};
+  cortex_parallel_for(num_files, num_threads, _open_many_file, &args);
+
+  const CORTEX_FILE *first = NULL;
+  size_t i;
+
+  for(i = 0; i < num_files; i++)
+  {
+    enum CORTEX_OPEN_STATUS status;
+
+    if(c_files[i] == NULL)
+    {
+      status = OPEN_FAILED;
+    }
+    else if(first == NULL)
+    {
+      first = c_files[i];
+      status = OPEN_OK;
+    }
+    else
+    {
+      status = _open_many_compare(first, c_files[i]);
+    }
+
+    if(summary != NULL)
+    {
+      summary->status[i] = status;
+
+      switch(status)
+      {
+        case OPEN_OK: summary->num_ok++; break;
+        case OPEN_FAILED: summary->num_failed++; break;
+        case OPEN_FILETYPE_DIFFERS: summary->num_filetype_differs++; break;
+        case OPEN_KMER_SIZE_DIFFERS: summary->num_kmer_size_differs++; break;
+        case OPEN_COLOURS_DIFFER: summary->num_colours_differ++; break;
+      }
+    }
+  }
+
+  return c_files;
+}
+
+void cortex_open_summary_free(CORTEX_OPEN_SUMMARY *summary)
+{
+  free(summary->status);
+  summary->status = NULL;
+}
+
+//
+// Header cache
+//
+
+#define CORTEX_CACHE_MAGIC "CTXHDR01"
+// Bytes at the start of the file that are hashed to spot rewrites
+#define CORTEX_CACHE_HASH_BYTES 4096
+
+// Sidecar file layout (native byte order, the cache is local to a machine):
+// _CACHE_HEADER, then num_of_colours x uint64_t colours
+typedef struct
+{
+  char magic[8];
+  uint64_t file_size, header_hash;
+  int64_t mtime_sec, mtime_nsec;
+  uint8_t filetype, kmer_size, has_likelihoods,
+          fails_classifier_line, discovery_phase_line, padding[3];
+  uint64_t num_of_colours;
+} _CACHE_HEADER;
+
+// Fill in the magic, size, mtime and header hash of path.  Returns 0 if the
+// file can't be read
+char _cache_stamp(const char *path, _CACHE_HEADER *stamp)
+{
+  struct stat st;
+  unsigned char bytes[CORTEX_CACHE_HASH_BYTES];
+  int fd;
+  ssize_t num_bytes, i;
+
+  memset(stamp, 0, sizeof(_CACHE_HEADER));
+  memcpy(stamp->magic, CORTEX_CACHE_MAGIC, 8);
+
+  if((fd = open(path, O_RDONLY)) == -1)
+  {
+    return 0;
+  }
+
+  if(fstat(fd, &st) != 0 ||
+     (num_bytes = read(fd, bytes, CORTEX_CACHE_HASH_BYTES)) < 0)
+  {
+    close(fd);
+    return 0;
+  }
+
+  close(fd);
+
+  stamp->file_size = (uint64_t)st.st_size;
+  stamp->mtime_sec = (int64_t)st.st_mtime;
+#if defined(__APPLE__)
+  stamp->mtime_nsec = (int64_t)st.st_mtimespec.tv_nsec;
+#else
+  stamp->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+#endif
+
+  // FNV-1a
+  stamp->header_hash = 14695981039346656037ULL;
+
+  for(i = 0; i < num_bytes; i++)
+  {
+    stamp->header_hash = (stamp->header_hash ^ bytes[i]) * 1099511628211ULL;
+  }
+
+  return 1;
+}
+
+// Returns NULL if there is no valid sidecar for this stamp
+CORTEX_FILE* _cache_load(const char *path, const char *cache_path,
+                         const _CACHE_HEADER *stamp)
+{
+  FILE *fh = fopen(cache_path, "r");
+
+  if(fh == NULL)
+  {
+    return NULL;
+  }
+
+  _CACHE_HEADER header;
+  uint64_t *colours = NULL;
+
+  if(fread(&header, sizeof(_CACHE_HEADER), 1, fh) != 1 ||
+     memcmp(header.magic, stamp->magic, 8) != 0 ||
+     header.file_size != stamp->file_size ||
+     header.mtime_sec != stamp->mtime_sec ||
+     header.mtime_nsec != stamp->mtime_nsec ||
+     header.header_hash != stamp->header_hash ||
+     (header.filetype != BUBBLE_FILE && header.filetype != ALIGNMENT_FILE) ||
+     header.num_of_colours > stamp->file_size)
+  {
+    fclose(fh);
+    return NULL;
+  }
+
+  colours = (uint64_t*) malloc(header.num_of_colours * sizeof(uint64_t));
+
+  if(fread(colours, sizeof(uint64_t), header.num_of_colours, fh)
+       != header.num_of_colours)
+  {
+    free(colours);
+    fclose(fh);
+    return NULL;
+  }
+
+  fclose(fh);
+
+  CORTEX_FILE *c_file = _cortex_file_create(path);
+
+  if(c_file == NULL)
+  {
+    free(colours);
+    return NULL;
+  }
+
+  c_file->filetype = (enum CORTEX_FILE_TYPE)header.filetype;
+  c_file->kmer_size = header.kmer_size;
+  c_file->has_likelihoods = header.has_likelihoods;
+  c_file->fails_classifier_line = header.fails_classifier_line;
+  c_file->discovery_phase_line = header.discovery_phase_line;
+
+  c_file->num_of_colours = (unsigned long)header.num_of_colours;
+  c_file->colour_arr
+    = (unsigned long*) malloc(c_file->num_of_colours * sizeof(unsigned long));
+
+  unsigned long i;
+  for(i = 0; i < c_file->num_of_colours; i++)
+  {
+    c_file->colour_arr[i] = (unsigned long)colours[i];
+  }
+
+  free(colours);
+
+  // Leave the first line in the buffer, as cortex_open() does
+  _cortex_read_line(c_file);
+
+  return c_file;
+}
+
+// Write to a temporary file and rename it, so concurrent readers never see
+// half a sidecar.  Returns 1 on success, 0 on failure
+char _cache_save(const char *cache_path, const _CACHE_HEADER *stamp,
+                 const CORTEX_FILE *c_file)
+{
+  _CACHE_HEADER header = *stamp;
+  header.filetype = (uint8_t)c_file->filetype;
+  header.kmer_size = c_file->kmer_size;
+  header.has_likelihoods = c_file->has_likelihoods;
+  header.fails_classifier_line = c_file->fails_classifier_line;
+  header.discovery_phase_line = c_file->discovery_phase_line;
+  header.num_of_colours = (uint64_t)c_file->num_of_colours;
+
+  size_t tmp_len = strlen(cache_path) + 32;
+  char *tmp_path = (char*) malloc(tmp_len);
+  snprintf(tmp_path, tmp_len, "%s.%li.tmp", cache_path, (long)getpid());
+
+  FILE *fh = fopen(tmp_path, "w");
+  char success = (fh != NULL);
+
+  if(success)
+  {
+    unsigned long i;
+    success = (fwrite(&header, sizeof(_CACHE_HEADER), 1, fh) == 1);
+
+    for(i = 0; i < c_file->num_of_colours && success; i++)
+    {
+      uint64_t colour = (uint64_t)c_file->colour_arr[i];
+      success = (fwrite(&colour, sizeof(uint64_t), 1, fh) == 1);
+    }
+
+    success = (fclose(fh) == 0) && success;
+    success = success && (rename(tmp_path, cache_path) == 0);
+
+    if(!success)
+    {
+      remove(tmp_path);
+    }
+  }
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex.c: couldn't write header cache (%s)\n",
+            cache_path);
+  }
+
+  free(tmp_path);
+  return success;
+}
+
+CORTEX_FILE* cortex_open_cached(const char *path, const char *cache_path)
+{
+  char *sidecar;
+
+  if(cache_path != NULL)
+  {
+    sidecar = strdup(cache_path);
+  }
+  else
+  {
+    size_t sidecar_len = strlen(path) + strlen(".ctxhdr") + 1;
+    sidecar = (char*) malloc(sidecar_len);
+    snprintf(sidecar, sidecar_len, "%s.ctxhdr", path);
+  }
+
+  _CACHE_HEADER stamp;
+  CORTEX_FILE *c_file = NULL;
+
+  if(!_cache_stamp(path, &stamp))
+  {
+    // Let cortex_open report the problem
+    free(sidecar);
+    return cortex_open(path);
+  }
+
+  if((c_file = _cache_load(path, sidecar, &stamp)) == NULL &&
+     (c_file = cortex_open(path)) != NULL)
+  {
+    _cache_save(sidecar, &stamp, c_file);
+  }
+
+  free(sidecar);
+  return c_file;
+}
+
+//
+// Checkpoints
+//
+
+#define CORTEX_CHECKPOINT_MAGIC "CTXCKPT1"
+// Compressed bytes before a restart point that are hashed, to spot a
+// checkpoint being used on a different file with the same header
+#define CORTEX_CHECKPOINT_HASH_BYTES 4096
+#define CORTEX_CHECKPOINT_WINDOW 32768
+
+// Checkpoint file layout (native byte order): _CHECKPOINT_HEADER, then
+// window_len bytes of restart point window
+typedef struct
+{
+  char magic[8];
+  uint64_t header_hash, point_hash;
+  int64_t offset, point_out_offset, point_in_offset;
+  uint64_t line_number, records_skipped, num_of_colours, window_len;
+  uint8_t filetype, kmer_size, bits, padding[5];
+} _CHECKPOINT_HEADER;
+
+// FNV-1a of up to CORTEX_CHECKPOINT_HASH_BYTES of path before in_offset.
+// Returns 0 if they can't be read
+char _checkpoint_point_hash(const char *path, long in_offset, uint64_t *hash)
+{
+  unsigned char bytes[CORTEX_CHECKPOINT_HASH_BYTES];
+  long start = in_offset > CORTEX_CHECKPOINT_HASH_BYTES ?
+               in_offset - CORTEX_CHECKPOINT_HASH_BYTES : 0;
+  ssize_t num_bytes, i;
+  int fd;
+
+  if((fd = open(path, O_RDONLY)) == -1)
+  {
+    return 0;
+  }
+
+  num_bytes = pread(fd, bytes, (size_t)(in_offset - start), start);
+  close(fd);
+
+  if(num_bytes != in_offset - start)
+  {
+    return 0;
+  }
+
+  *hash = 14695981039346656037ULL;
+
+  for(i = 0; i < num_bytes; i++)
+  {
+    *hash = (*hash ^ bytes[i]) * 1099511628211ULL;
+  }
+
+  return 1;
+}
+
+char cortex_checkpoint(const CORTEX_FILE *c_file, const char *path)
+{
+  if(c_file->file == NULL)
+  {
+    fprintf(stderr, "cortex.c: can't checkpoint in-memory input (%s)\n",
+            c_file->path);
+    return 0;
+  }
+
+  _CACHE_HEADER stamp;
+  _CHECKPOINT_HEADER header;
+  CORTEX_READER_POINT point;
+
+  cortex_reader_point(c_file->file, c_file->line_offset, &point);
+
+  memset(&header, 0, sizeof(_CHECKPOINT_HEADER));
+  memcpy(header.magic, CORTEX_CHECKPOINT_MAGIC, 8);
+
+  if(!_cache_stamp(c_file->path, &stamp) ||
+     !_checkpoint_point_hash(c_file->path, point.in_offset, &header.point_hash))
+  {
+    fprintf(stderr, "cortex.c: couldn't read file to checkpoint (%s)\n",
+            c_file->path);
+    return 0;
+  }
+
+  header.header_hash = stamp.header_hash;
+  header.offset = (int64_t)c_file->line_offset;
+  header.point_out_offset = (int64_t)point.out_offset;
+  header.point_in_offset = (int64_t)point.in_offset;
+  // The line in the buffer is re-read on resume
+  header.line_number = (uint64_t)(c_file->line_number > 0 ?
+                                  c_file->line_number - 1 : 0);
+  header.records_skipped = (uint64_t)c_file->records_skipped;
+  header.num_of_colours = (uint64_t)c_file->num_of_colours;
+  header.window_len = (uint64_t)point.window_len;
+  header.filetype = (uint8_t)c_file->filetype;
+  header.kmer_size = c_file->kmer_size;
+  header.bits = (uint8_t)point.bits;
+
+  // As with the header cache: write elsewhere and rename, so a job killed
+  // mid-write leaves the previous checkpoint intact
+  size_t tmp_len = strlen(path) + 32;
+  char *tmp_path = (char*) malloc(tmp_len);
+  snprintf(tmp_path, tmp_len, "%s.%li.tmp", path, (long)getpid());
+
+  FILE *fh = fopen(tmp_path, "w");
+  char success = (fh != NULL);
+
+  if(success)
+  {
+    success = (fwrite(&header, sizeof(_CHECKPOINT_HEADER), 1, fh) == 1) &&
+              (point.window_len == 0 ||
+               fwrite(point.window, 1, point.window_len, fh)
+                 == point.window_len);
+
+    success = (fclose(fh) == 0) && success;
+    success = success && (rename(tmp_path, path) == 0);
+
+    if(!success)
+    {
+      remove(tmp_path);
+    }
+  }
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex.c: couldn't write checkpoint (%s)\n", path);
+  }
+
+  free(tmp_path);
+  return success;
+}
+
+char cortex_resume(CORTEX_FILE *c_file, const char *path)
+{
+  if(c_file->file == NULL)
+  {
+    fprintf(stderr, "cortex.c: can't resume in-memory input (%s)\n",
+            c_file->path);
+    return 0;
+  }
+
+  FILE *fh = fopen(path, "r");
+
+  if(fh == NULL)
+  {
+    fprintf(stderr, "cortex.c: couldn't open checkpoint (%s)\n", path);
+    return 0;
+  }
+
+  _CACHE_HEADER stamp;
+  _CHECKPOINT_HEADER header;
+  unsigned char *window = NULL;
+  uint64_t point_hash;
+  char success;
+
+  success = (fread(&header, sizeof(_CHECKPOINT_HEADER), 1, fh) == 1) &&
+            memcmp(header.magic, CORTEX_CHECKPOINT_MAGIC, 8) == 0 &&
+            header.window_len <= CORTEX_CHECKPOINT_WINDOW;
+
+  if(success && header.window_len > 0)
+  {
+    if((window = (unsigned char*) malloc(header.window_len)) == NULL)
+    {
+      fprintf(stderr, "cortex.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    success = (fread(window, 1, header.window_len, fh) == header.window_len);
+  }
+
+  fclose(fh);
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex.c: not a valid checkpoint (%s)\n", path);
+    free(window);
+    return 0;
+  }
+
+  // Must be the same file, read the same way
+  if(!_cache_stamp(c_file->path, &stamp) ||
+     stamp.header_hash != header.header_hash ||
+     header.filetype != (uint8_t)c_file->filetype ||
+     header.kmer_size != c_file->kmer_size ||
+     header.num_of_colours != (uint64_t)c_file->num_of_colours ||
+     header.point_in_offset < 0 ||
+     !_checkpoint_point_hash(c_file->path, (long)header.point_in_offset,
+                             &point_hash) ||
+     point_hash != header.point_hash)
+  {
+    fprintf(stderr, "cortex.c: checkpoint is for a different file (%s)\n",
+            path);
+    free(window);
+    return 0;
+  }
+
+  CORTEX_READER_POINT point;
+  point.out_offset = (long)header.point_out_offset;
+  point.in_offset = (long)header.point_in_offset;
+  point.bits = header.bits;
+  point.window = window;
+  point.window_len = (size_t)header.window_len;
+
+  success = cortex_reader_resume(c_file->file, &point, (long)header.offset);
+  free(window);
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex.c: couldn't resume from checkpoint (%s)\n", path);
+    return 0;
+  }
+
+  strbuf_reset(c_file->buffer);
+  c_file->line_number = (unsigned long)header.line_number;
+  c_file->records_skipped = (unsigned long)header.records_skipped;
+  _cortex_read_line(c_file);
+
+  return 1;
+}
+
+COLOUR_COVG* _colour_covgs_create()
+{
+  COLOUR_COVG* covgs = (COLOUR_COVG*) malloc(sizeof(COLOUR_COVG));
+  covgs->colour_covgs = (unsigned long*) malloc(200 * sizeof(unsigned long));
+  covgs->capacity = 200;
+  covgs->length = 0;
+
+  return covgs;
+}
+
+void _colour_covgs_reset(COLOUR_COVG* covgs)
+{
+  covgs->length = 0;
+}
+
+void _colour_covgs_free(COLOUR_COVG* covgs)
+{
+  free(covgs->colour_covgs);
+  free(covgs);
+}
+
+CORTEX_BUBBLE* cortex_bubble_create(const CORTEX_FILE *c_file)
+{
+  CORTEX_BUBBLE* bubble = (CORTEX_BUBBLE*) malloc(sizeof(CORTEX_BUBBLE));
+
+  unsigned long col;
+  int branch;
+
+  for(branch = 0; branch < 2; branch++)
+  {
+    bubble->branches_colour_covgs[branch]
+      = (COLOUR_COVG**) malloc(c_file->num_of_colours * sizeof(COLOUR_COVG*));
+  
+    for(col = 0; col < c_file->num_of_colours; col++)
+    {
+      bubble->branches_colour_covgs[branch][col] = _colour_covgs_create();
+    }
+  }
+
+  bubble->flank_5p.seq = strbuf_init(200);
+  bubble->flank_3p.seq = strbuf_init(200);
+  bubble->branches[0].seq = strbuf_init(200);
+  bubble->branches[1].seq = strbuf_init(200);
+
+  if(bubble->branches[0].seq == NULL)
+  {
+    fprintf(stderr, "cortex.c: mem fail\n");
+    exit(EXIT_FAILURE);
+  }
+
+  bubble->calls
+    = (HETEROGENEITY*) malloc(c_file->num_of_colours * sizeof(HETEROGENEITY));
+
+  bubble->llk_hom_br1 = (float*) malloc(c_file->num_of_colours * sizeof(float));
+  bubble->llk_het     = (float*) malloc(c_file->num_of_colours * sizeof(float));
+  bubble->llk_hom_br2 = (float*) malloc(c_file->num_of_colours * sizeof(float));
+
+  if(bubble->llk_hom_br1 == NULL || bubble->llk_het == NULL ||
+     bubble->llk_hom_br2 == NULL)
+  {
+    fprintf(stderr, "cortex.c: Couldn't allocate enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return bubble;
+}
+
+void cortex_bubble_reset(CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
+{
+  strbuf_reset(bubble->flank_5p.seq);
+  strbuf_reset(bubble->flank_3p.seq);
+  strbuf_reset(bubble->branches[0].seq);
+  strbuf_reset(bubble->branches[1].seq);
+
+  unsigned long col;
+  int branch;
+
+  for(branch = 0; branch < 2; branch++)
+  {
+    for(col = 0; col < c_file->num_of_colours; col++)
+    {
+      _colour_covgs_reset(bubble->branches_colour_covgs[branch][col]);
+    }
+  }
+}
+
+void cortex_bubble_free(CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
+{
+  unsigned long col;
+  int branch;
+
+  for(branch = 0; branch < 2; branch++)
+  {
+    for(col = 0; col < c_file->num_of_colours; col++)
+    {
+      _colour_covgs_free(bubble->branches_colour_covgs[branch][col]);
+    }
+
+    free(bubble->branches_colour_covgs[branch]);
+  }
+
+  strbuf_free(bubble->flank_5p.seq);
+  strbuf_free(bubble->flank_3p.seq);
+  strbuf_free(bubble->branches[0].seq);
+  strbuf_free(bubble->branches[1].seq);
+
+  free(bubble->calls);
+  free(bubble->llk_hom_br1);
+  free(bubble->llk_het);
+  free(bubble->llk_hom_br2);
+
+  free(bubble);
+}
+
+CORTEX_ALIGNMENT* cortex_alignment_create(const CORTEX_FILE *c_file)
+{
+  CORTEX_ALIGNMENT* alignment
+    = (CORTEX_ALIGNMENT*) malloc(sizeof(CORTEX_ALIGNMENT));
+
+  alignment->name = strbuf_init(200);
+  alignment->seq = strbuf_init(200);
+
+  alignment->colour_covgs
+    = (COLOUR_COVG**) malloc(c_file->num_of_colours * sizeof(COLOUR_COVG*));
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    alignment->colour_covgs[col] = _colour_covgs_create();
+  }
+
+  return alignment;
+}
+
+void cortex_alignment_reset(CORTEX_ALIGNMENT* alignment,
+                            const CORTEX_FILE *c_file)
+{
+  strbuf_reset(alignment->name);
+  strbuf_reset(alignment->seq);
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    _colour_covgs_reset(alignment->colour_covgs[col]);
+  }
+}
+
+void cortex_alignment_free(CORTEX_ALIGNMENT* alignment,
+                           const CORTEX_FILE *c_file)
+{
+  strbuf_free(alignment->name);
+  strbuf_free(alignment->seq);
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    _colour_covgs_free(alignment->colour_covgs[col]);
+  }
+
+  free(alignment->colour_covgs);
+  free(alignment);
+}
+
+// line of numbers should have bean already read into c_file->buffer
+char _read_covg(CORTEX_FILE *c_file, COLOUR_COVG *covgs, size_t required_size)
+{
+  // Ensure size
+  if(covgs->capacity < required_size)
+  {
+    // Enlarge for all colours
+    covgs->colour_covgs = realloc(covgs->colour_covgs,
+                                  required_size * sizeof(unsigned long));
 
     covgs->capacity = required_size;
   }
 
-  covgs->length = 0;
+  covgs->length = 0;
+
+  char* pos = c_file->buffer->buff;
+  char* new_pos;
+  unsigned long value;
+
+  value = strtoul(pos, &new_pos, 10);
+
+  while(pos != new_pos)
+  {
+    if(covgs->length == covgs->capacity)
+    {
+      fprintf(stderr, "cortex.c: more numbers than expected [%lu] (%s:%lu)\n",
+              required_size, c_file->path, c_file->line_number);
+    }
+
+    covgs->colour_covgs[covgs->length++] = value;
+
+    pos = new_pos;
+    value = strtoul(pos, &new_pos, 10);
+  }
+
+  if(!string_is_all_whitespace(new_pos))
+  {
+    fprintf(stderr, "cortex.c: unexpected content on the end of line ['%s'] "
+                    "(%s:%lu)\n",
+            new_pos, c_file->path, c_file->line_number);
+  }
+
+  return 1;
+}
+
+//
+// Alignments
+//
+
+// Read the name and sequence lines of an alignment.  Returns 0 at EOF or on
+// error
+char _read_alignment_head(CORTEX_FILE* c_file, StrBuf *name, StrBuf *seq)
+{
+  if(c_file->filetype != ALIGNMENT_FILE)
+  {
+    fprintf(stderr, "cortex.c: cortex_read_alignment cannot read from "
+                    "alignment file (%s:%lu)\n",
+            c_file->path, c_file->line_number);
+
+    return 0;
+  }
+
+  // Read until not whiteline
+  while(strbuf_len(c_file->buffer) == 0 &&
+        _cortex_read_line(c_file) > 0);
+
+  if(strbuf_len(c_file->buffer) == 0)
+  {
+    // EOF
+    return 0;
+  }
+
+  c_file->record_offset = c_file->line_offset;
+
+  if(strbuf_get_char(c_file->buffer, 0) != '>')
+  {
+    fprintf(stderr, "cortex.c: cortex_read_alignment line doesn't start '>' "
+                    "(%s:%lu)\n",
+            c_file->path, c_file->line_number);
+
+    return 0;
+  }
+
+  strbuf_copy(name, 0, c_file->buffer, 1,
+                   strbuf_len(c_file->buffer)-1);
+
+  if(_cortex_read_line(c_file) == 0)
+  {
+    fprintf(stderr, "cortex.c: alignment ended early (%s:%lu)\n",
+            c_file->path, c_file->line_number);
+    return 0;
+  }
+
+  strbuf_copy(seq, 0, c_file->buffer, 0,
+                   strbuf_len(c_file->buffer));
+
+  return 1;
+}
+
+char _read_alignment(CORTEX_ALIGNMENT* alignment, CORTEX_FILE* c_file)
+{
+  cortex_alignment_reset(alignment, c_file);
+
+  CORTEX_PROF_ENTER(PROF_HEADER);
+  char head_ok = _read_alignment_head(c_file, alignment->name, alignment->seq);
+  CORTEX_PROF_LEAVE();
+
+  if(!head_ok)
+  {
+    return 0;
+  }
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    if(_cortex_read_line(c_file) == 0 || _cortex_read_line(c_file) == 0)
+    {
+      fprintf(stderr, "cortex.c: alignment ended early (%s:%lu)\n",
+              c_file->path, c_file->line_number);
+      return 0;
+    }
+
+    CORTEX_PROF_ENTER(PROF_COVERAGE);
+    _read_covg(c_file, alignment->colour_covgs[col],
+               strbuf_len(alignment->seq));
+    CORTEX_PROF_LEAVE();
+  }
+
+  _cortex_read_line(c_file);
+
+  return 1;
+}
+
+char cortex_read_alignment(CORTEX_ALIGNMENT* alignment, CORTEX_FILE* c_file)
+{
+  while(!_read_alignment(alignment, c_file))
+  {
+    if(!_recover(c_file, _is_alignment_start))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void cortex_fprint_alignment(FILE *out, const CORTEX_ALIGNMENT* alignment,
+                             const CORTEX_FILE* c_file)
+{
+  fprintf(out, ">%s\n", alignment->name->buff);
+  fprintf(out, "%s\n", alignment->seq->buff);
+
+  unsigned long col, covgs_i;
+
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    COLOUR_COVG* covgs = alignment->colour_covgs[col];
+
+    fprintf(out, ">%s_colour_%lu_kmer_coverages\n",
+            alignment->name->buff, c_file->colour_arr[col]);
+
+    fprintf(out, "%lu", covgs->colour_covgs[0]);
+
+    for(covgs_i = 1; covgs_i < covgs->length; covgs_i++)
+    {
+      fprintf(out, " %lu", covgs->colour_covgs[covgs_i]);
+    }
+
+    fprintf(out, "\n");
+  }
+}
+
+void cortex_print_alignment(const CORTEX_ALIGNMENT* alignment,
+                            const CORTEX_FILE* c_file)
+{
+  cortex_fprint_alignment(stdout, alignment, c_file);
+}
+
+//
+// Alignments with run-length encoded coverage
+//
+
+COLOUR_COVG_RUNS* _covg_runs_create()
+{
+  COLOUR_COVG_RUNS* runs = (COLOUR_COVG_RUNS*) malloc(sizeof(COLOUR_COVG_RUNS));
+
+  if(runs == NULL)
+  {
+    fprintf(stderr, "cortex.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  runs->length = 0;
+  runs->num_runs = 0;
+  runs->capacity = 0;
+  runs->values = NULL;
+  runs->ends = NULL;
+
+  return runs;
+}
+
+void _covg_runs_free(COLOUR_COVG_RUNS* runs)
+{
+  free(runs->values);
+  free(runs->ends);
+  free(runs);
+}
+
+void _covg_runs_resize(COLOUR_COVG_RUNS* runs, unsigned long capacity)
+{
+  uint32_t *values = (uint32_t*) realloc(runs->values,
+                                         capacity * sizeof(uint32_t));
+  uint32_t *ends = (uint32_t*) realloc(runs->ends,
+                                       capacity * sizeof(uint32_t));
+
+  if((values == NULL || ends == NULL) && capacity > 0)
+  {
+    fprintf(stderr, "cortex.c: out of memory [%lu coverage runs]\n", capacity);
+    exit(EXIT_FAILURE);
+  }
+
+  runs->values = values;
+  runs->ends = ends;
+  runs->capacity = capacity;
+}
+
+// line of numbers should have bean already read into c_file->buffer
+char _read_covg_runs(CORTEX_FILE *c_file, COLOUR_COVG_RUNS *runs)
+{
+  runs->length = 0;
+  runs->num_runs = 0;
 
   char* pos = c_file->buffer->buff;
   char* new_pos;
@@ -639,156 +1741,383 @@ char _read_covg(CORTEX_FILE *c_file, COLOUR_COVG *covgs, size_t required_size)
 
   while(pos != new_pos)
   {
-    if(covgs->length == covgs->capacity)
+    if(value > UINT32_MAX)
     {
-      fprintf(stderr, "cortex.c: more numbers than expected [%lu] (%s:%lu)\n",
-              required_size, c_file->path, c_file->line_number);
+      fprintf(stderr, "cortex.c: coverage too large, capped [%lu] (%s:%lu)\n",
+              value, c_file->path, c_file->line_number);
+      value = UINT32_MAX;
     }
 
-    covgs->colour_covgs[covgs->length++] = value;
+    if(runs->length == UINT32_MAX)
+    {
+      fprintf(stderr, "cortex.c: alignment too long for coverage runs "
+                      "(%s:%lu)\n", c_file->path, c_file->line_number);
+      return 0;
+    }
+
+    runs->length++;
+
+    if(runs->num_runs > 0 && runs->values[runs->num_runs-1] == value)
+    {
+      runs->ends[runs->num_runs-1]++;
+    }
+    else
+    {
+      if(runs->num_runs == runs->capacity)
+      {
+        _covg_runs_resize(runs, runs->capacity < 16 ? 16 : 2 * runs->capacity);
+      }
+
+      runs->values[runs->num_runs] = value;
+      runs->ends[runs->num_runs] = runs->length;
+      runs->num_runs++;
+    }
 
     pos = new_pos;
     value = strtoul(pos, &new_pos, 10);
   }
 
-  if(!string_is_all_whitespace(new_pos))
+  if(!string_is_all_whitespace(new_pos))
+  {
+    fprintf(stderr, "cortex.c: unexpected content on the end of line ['%s'] "
+                    "(%s:%lu)\n",
+            new_pos, c_file->path, c_file->line_number);
+  }
+
+  return 1;
+}
+
+CORTEX_ALIGNMENT_RUNS* cortex_alignment_runs_create(const CORTEX_FILE *c_file)
+{
+  CORTEX_ALIGNMENT_RUNS* alignment
+    = (CORTEX_ALIGNMENT_RUNS*) malloc(sizeof(CORTEX_ALIGNMENT_RUNS));
+
+  alignment->name = strbuf_init(200);
+  alignment->seq = strbuf_init(200);
+
+  alignment->colour_runs = (COLOUR_COVG_RUNS**)
+    malloc(c_file->num_of_colours * sizeof(COLOUR_COVG_RUNS*));
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    alignment->colour_runs[col] = _covg_runs_create();
+  }
+
+  return alignment;
+}
+
+void cortex_alignment_runs_reset(CORTEX_ALIGNMENT_RUNS* alignment,
+                                 const CORTEX_FILE *c_file)
+{
+  strbuf_reset(alignment->name);
+  strbuf_reset(alignment->seq);
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    alignment->colour_runs[col]->length = 0;
+    alignment->colour_runs[col]->num_runs = 0;
+  }
+}
+
+void cortex_alignment_runs_free(CORTEX_ALIGNMENT_RUNS* alignment,
+                                const CORTEX_FILE *c_file)
+{
+  strbuf_free(alignment->name);
+  strbuf_free(alignment->seq);
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    _covg_runs_free(alignment->colour_runs[col]);
+  }
+
+  free(alignment->colour_runs);
+  free(alignment);
+}
+
+void cortex_alignment_runs_shrink(CORTEX_ALIGNMENT_RUNS* alignment,
+                                  const CORTEX_FILE *c_file)
+{
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    COLOUR_COVG_RUNS *runs = alignment->colour_runs[col];
+
+    if(runs->num_runs < runs->capacity)
+    {
+      _covg_runs_resize(runs, runs->num_runs);
+    }
+  }
+}
+
+char _read_alignment_runs(CORTEX_ALIGNMENT_RUNS* alignment,
+                          CORTEX_FILE* c_file)
+{
+  cortex_alignment_runs_reset(alignment, c_file);
+
+  CORTEX_PROF_ENTER(PROF_HEADER);
+  char head_ok = _read_alignment_head(c_file, alignment->name, alignment->seq);
+  CORTEX_PROF_LEAVE();
+
+  if(!head_ok)
+  {
+    return 0;
+  }
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    if(_cortex_read_line(c_file) == 0 || _cortex_read_line(c_file) == 0)
+    {
+      fprintf(stderr, "cortex.c: alignment ended early (%s:%lu)\n",
+              c_file->path, c_file->line_number);
+      return 0;
+    }
+
+    CORTEX_PROF_ENTER(PROF_COVERAGE);
+    char covg_ok = _read_covg_runs(c_file, alignment->colour_runs[col]);
+    CORTEX_PROF_LEAVE();
+
+    if(!covg_ok)
+    {
+      return 0;
+    }
+  }
+
+  _cortex_read_line(c_file);
+
+  return 1;
+}
+
+char cortex_read_alignment_runs(CORTEX_ALIGNMENT_RUNS* alignment,
+                                CORTEX_FILE* c_file)
+{
+  while(!_read_alignment_runs(alignment, c_file))
+  {
+    if(!_recover(c_file, _is_alignment_start))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void cortex_print_alignment_runs(const CORTEX_ALIGNMENT_RUNS* alignment,
+                                 const CORTEX_FILE* c_file)
+{
+  printf(">%s\n", alignment->name->buff);
+  printf("%s\n", alignment->seq->buff);
+
+  unsigned long col, r, kmer;
+
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    const COLOUR_COVG_RUNS* runs = alignment->colour_runs[col];
+
+    printf(">%s_colour_%lu_kmer_coverages\n",
+          alignment->name->buff, c_file->colour_arr[col]);
+
+    for(r = 0, kmer = 0; r < runs->num_runs; r++)
+    {
+      for(; kmer < runs->ends[r]; kmer++)
+      {
+        printf(kmer == 0 ? "%lu" : " %lu", (unsigned long)runs->values[r]);
+      }
+    }
+
+    printf("\n");
+  }
+}
+
+// Index of the run holding kmer (kmer < runs->length)
+unsigned long _covg_runs_find(const COLOUR_COVG_RUNS *runs, unsigned long kmer)
+{
+  unsigned long lo = 0, hi = runs->num_runs - 1, mid;
+
+  while(lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+
+    if(runs->ends[mid] > kmer)
+    {
+      hi = mid;
+    }
+    else
+    {
+      lo = mid + 1;
+    }
+  }
+
+  return lo;
+}
+
+// Clip [*start, *end) to the alignment and find the first and last runs in it.
+// Returns 0 if the range is empty
+char _covg_runs_range(const COLOUR_COVG_RUNS *runs,
+                      unsigned long start, unsigned long *end,
+                      unsigned long *first, unsigned long *last)
+{
+  if(*end > runs->length)
+  {
+    *end = runs->length;
+  }
+
+  if(start >= *end)
   {
-    fprintf(stderr, "cortex.c: unexpected content on the end of line ['%s'] "
-                    "(%s:%lu)\n",
-            new_pos, c_file->path, c_file->line_number);
+    return 0;
   }
 
+  *first = _covg_runs_find(runs, start);
+  *last = _covg_runs_find(runs, *end - 1);
+
   return 1;
 }
 
-//
-// Alignments
-//
-
-char cortex_read_alignment(CORTEX_ALIGNMENT* alignment, CORTEX_FILE* c_file)
+unsigned long cortex_covg_runs_get(const COLOUR_COVG_RUNS *runs,
+                                   unsigned long kmer)
 {
-  cortex_alignment_reset(alignment, c_file);
-
-  if(c_file->filetype != ALIGNMENT_FILE)
+  if(kmer >= runs->length)
   {
-    fprintf(stderr, "cortex.c: cortex_read_alignment cannot read from "
-                    "alignment file (%s:%lu)\n",
-            c_file->path, c_file->line_number);
-
     return 0;
   }
 
-  // Read until not whiteline
-  while(strbuf_len(c_file->buffer) == 0 &&
-        _cortex_read_line(c_file) > 0);
+  return runs->values[_covg_runs_find(runs, kmer)];
+}
 
-  if(strbuf_len(c_file->buffer) == 0)
+void cortex_covg_runs_decode(const COLOUR_COVG_RUNS *runs,
+                             unsigned long start, unsigned long end,
+                             unsigned long *covgs)
+{
+  unsigned long first, last, r, kmer = start;
+
+  if(!_covg_runs_range(runs, start, &end, &first, &last))
   {
-    // EOF
-    return 0;
+    return;
   }
 
-  if(strbuf_get_char(c_file->buffer, 0) != '>')
+  for(r = first; r <= last; r++)
   {
-    fprintf(stderr, "cortex.c: cortex_read_alignment line doesn't start '>' "
-                    "(%s:%lu)\n",
-            c_file->path, c_file->line_number);
+    const unsigned long value = runs->values[r];
+    const unsigned long run_end = r == last ? end : runs->ends[r];
 
-    return 0;
+    for(; kmer < run_end; kmer++)
+    {
+      covgs[kmer - start] = value;
+    }
   }
+}
 
-  strbuf_copy(alignment->name, 0, c_file->buffer, 1,
-                   strbuf_len(c_file->buffer)-1);
+unsigned long long cortex_covg_runs_sum(const COLOUR_COVG_RUNS *runs,
+                                        unsigned long start,
+                                        unsigned long end)
+{
+  unsigned long first, last, r;
 
-  if(_cortex_read_line(c_file) == 0)
+  if(!_covg_runs_range(runs, start, &end, &first, &last))
   {
-    fprintf(stderr, "cortex.c: alignment ended early (%s:%lu)\n",
-            c_file->path, c_file->line_number);
     return 0;
   }
 
-  strbuf_copy(alignment->seq, 0, c_file->buffer, 0,
-                   strbuf_len(c_file->buffer));
-
-  unsigned long col;
-  for(col = 0; col < c_file->num_of_colours; col++)
+  if(first == last)
   {
-    if(_cortex_read_line(c_file) == 0 || _cortex_read_line(c_file) == 0)
-    {
-      fprintf(stderr, "cortex.c: alignment ended early (%s:%lu)\n",
-              c_file->path, c_file->line_number);
-      return 0;
-    }
-
-    _read_covg(c_file, alignment->colour_covgs[col],
-               strbuf_len(alignment->seq));
+    return (unsigned long long)runs->values[first] * (end - start);
   }
 
-  _cortex_read_line(c_file);
+  unsigned long long sum
+    = (unsigned long long)runs->values[first] * (runs->ends[first] - start) +
+      (unsigned long long)runs->values[last] * (end - runs->ends[last-1]);
 
-  return 1;
+  // Whole runs in between.  Plain arrays and no branches, so this vectorises
+  const uint32_t *values = runs->values, *ends = runs->ends;
+
+  for(r = first + 1; r < last; r++)
+  {
+    sum += (unsigned long long)values[r] * (ends[r] - ends[r-1]);
+  }
+
+  return sum;
 }
 
-void cortex_print_alignment(const CORTEX_ALIGNMENT* alignment,
-                            const CORTEX_FILE* c_file)
+unsigned long cortex_covg_runs_min(const COLOUR_COVG_RUNS *runs,
+                                   unsigned long start, unsigned long end)
 {
-  printf(">%s\n", alignment->name->buff);
-  printf("%s\n", alignment->seq->buff);
+  unsigned long first, last, r;
 
-  unsigned long col, covgs_i;
+  if(!_covg_runs_range(runs, start, &end, &first, &last))
+  {
+    return 0;
+  }
 
-  for(col = 0; col < c_file->num_of_colours; col++)
+  // Every run from first to last covers part of the range
+  const uint32_t *values = runs->values;
+  uint32_t min = values[first];
+
+  for(r = first + 1; r <= last; r++)
   {
-    COLOUR_COVG* covgs = alignment->colour_covgs[col];
+    min = values[r] < min ? values[r] : min;
+  }
 
-    printf(">%s_colour_%lu_kmer_coverages\n",
-          alignment->name->buff, c_file->colour_arr[col]);
+  return min;
+}
 
-    printf("%lu", covgs->colour_covgs[0]);
+unsigned long cortex_covg_runs_max(const COLOUR_COVG_RUNS *runs,
+                                   unsigned long start, unsigned long end)
+{
+  unsigned long first, last, r;
 
-    for(covgs_i = 1; covgs_i < covgs->length; covgs_i++)
-    {
-      printf(" %lu", covgs->colour_covgs[covgs_i]);
-    }
+  if(!_covg_runs_range(runs, start, &end, &first, &last))
+  {
+    return 0;
+  }
 
-    printf("\n");
+  const uint32_t *values = runs->values;
+  uint32_t max = values[first];
+
+  for(r = first + 1; r <= last; r++)
+  {
+    max = values[r] > max ? values[r] : max;
   }
+
+  return max;
 }
 
 //
 // Bubbles
 //
 
-void _print_bubble_path(const unsigned long var_num,
+void _print_bubble_path(FILE *out, const unsigned long var_num,
                         const CORTEX_BUBBLE_PATH *bp,
                         enum PATH_TYPE path_type)
 {
   switch (path_type)
   {
     case FLANK_5P:
-      printf(">var_%lu_5p_flank ", var_num);
+      fprintf(out, ">var_%lu_5p_flank ", var_num);
       break;
     case BRANCH1:
-      printf(">branch_%lu_1 ", var_num);
+      fprintf(out, ">branch_%lu_1 ", var_num);
       break;
     case BRANCH2:
-      printf(">branch_%lu_2 ", var_num);
+      fprintf(out, ">branch_%lu_2 ", var_num);
       break;
     case FLANK_3P:
-      printf(">var_%lu_3p_flank ", var_num);
+      fprintf(out, ">var_%lu_3p_flank ", var_num);
       break;
     default:
       break;
   }
 
-  printf("length:%lu average_coverage: %f min_coverage:%lu max_coverage:%lu "
-         "fst_coverage:%lu fst_kmer:%s fst_r:%s fst_f:%s "
-         "lst_coverage:%lu lst_kmer:%s lst_r:%s lst_f:%s\n",
-         bp->seq_length, bp->mean_covg, bp->min_covg, bp->max_covg,
-         bp->fst_covg, bp->fst_kmer, bp->fst_r, bp->fst_f,
-         bp->lst_covg, bp->lst_kmer, bp->lst_r, bp->lst_f);
+  fprintf(out, "length:%lu average_coverage: %f min_coverage:%lu "
+               "max_coverage:%lu fst_coverage:%lu fst_kmer:%s fst_r:%s fst_f:%s "
+               "lst_coverage:%lu lst_kmer:%s lst_r:%s lst_f:%s\n",
+          bp->seq_length, bp->mean_covg, bp->min_covg, bp->max_covg,
+          bp->fst_covg, bp->fst_kmer, bp->fst_r, bp->fst_f,
+          bp->lst_covg, bp->lst_kmer, bp->lst_r, bp->lst_f);
 
-  printf("%s\n", bp->seq->buff);
+  fprintf(out, "%s\n", bp->seq->buff);
 }
 
 // Returns 1 (success) or 0 (failure).  Path argument is where to store result
@@ -865,132 +2194,306 @@ char _read_bubble_path(CORTEX_FILE *c_file, CORTEX_BUBBLE_PATH *path,
   return 1;
 }
 
-char cortex_read_bubble(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
+// Powers of ten that are exact as floats
+const float _llk_pow10[11] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                              1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+// Parse a likelihood, moving *ptr past it.  Likelihoods are written as short
+// fixed point numbers: with at most 7 digits and 10 decimal places both the
+// digits and the power of ten are exact floats, so a single division rounds
+// the same as strtof.  Anything else (exponents, inf, nan) goes to strtof
+char _parse_llk_float(const char **ptr, float *result)
 {
-  cortex_bubble_reset(bubble, c_file);
+  const char *str = *ptr;
+  char negative = 0;
+  unsigned long digits = 0;
+  int num_digits = 0, decimals = 0;
 
-  if(c_file->filetype != BUBBLE_FILE)
+  if(*str == '-' || *str == '+')
   {
-    fprintf(stderr, "cortex.c: cortex_read_bubble cannot read from "
-                    "alignment file (%s:%lu)\n",
-            c_file->path, c_file->line_number);
+    negative = (*str == '-');
+    str++;
+  }
 
-    return 0;
+  while(isdigit(*str))
+  {
+    digits = digits * 10 + (unsigned long)(*str++ - '0');
+    num_digits++;
   }
 
-  // Read until not whiteline
-  while(strbuf_len(c_file->buffer) == 0 &&
-        _cortex_read_line(c_file) > 0);
+  if(*str == '.')
+  {
+    for(str++; isdigit(*str); str++)
+    {
+      digits = digits * 10 + (unsigned long)(*str - '0');
+      num_digits++;
+      decimals++;
+    }
+  }
 
-  if(strbuf_len(c_file->buffer) == 0)
+  if(num_digits > 0 && num_digits <= 7 && decimals <= 10 &&
+     (*str == '\0' || isspace(*str)))
   {
-    // EOF
-    return 0;
+    float value = (float)digits / _llk_pow10[decimals];
+    *result = negative ? -value : value;
+    *ptr = str;
+    return 1;
   }
 
-  if((c_file->fails_classifier_line && (_cortex_read_line(c_file) == 0)) ||
-     (c_file->discovery_phase_line && (_cortex_read_line(c_file) == 0)))
+  char *end;
+  *result = strtof(*ptr, &end);
+
+  if(end == *ptr)
   {
-    fprintf(stderr, "cortex.c: premature end of call start (%s:%lu)\n",
-            c_file->path, c_file->line_number);
     return 0;
   }
 
-  if(c_file->has_likelihoods)
+  *ptr = end;
+  return 1;
+}
+
+// Calls are HOM1, HET or HOM2 in any case (HET may have a fourth character)
+HETEROGENEITY _parse_llk_call(const char *str, size_t len)
+{
+  if(len < 3 || toupper(str[0]) != 'H')
+  {
+    return UNKNOWN_HET;
+  }
+
+  switch(toupper(str[1]))
+  {
+    case 'E':
+      return toupper(str[2]) == 'T' ? HET : UNKNOWN_HET;
+    case 'O':
+      if(len == 4 && toupper(str[2]) == 'M')
+      {
+        switch(str[3])
+        {
+          case '1': return HOM1;
+          case '2': return HOM2;
+        }
+      }
+  }
+
+  return UNKNOWN_HET;
+}
+
+// Read the likelihood line for each colour, then the first line of the
+// bubble.  Lines are: <colour> <call> <llk_hom_br1> [<llk_het>] <llk_hom_br2>
+char _read_llk_lines(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file,
+                     const char diploid)
+{
+  unsigned long col;
+  float llks[3];
+  int num_llks = diploid ? 3 : 2, i;
+
+  for(col = 0; col < c_file->num_of_colours; col++)
   {
-    // Read in likelihoods
-    if(strncasecmp(c_file->buffer->buff, "Colour", strlen("Colour")) != 0)
+    if(_cortex_read_line(c_file) == 0 || !isdigit(c_file->buffer->buff[0]))
     {
-      fprintf(stderr, "cortex.c: premature end of file likelihoods (%s:%lu)\n",
-                c_file->path, c_file->line_number);
+      fprintf(stderr, "cortex.c: premature end of call likelihoods (%s:%lu)\n",
+              c_file->path, c_file->line_number);
       return 0;
     }
 
-    // Check if diploid (ie. has het. option)
-    if(strstr(c_file->buffer->buff, "llk_het") != NULL)
+    // Skip colour number
+    const char *str = c_file->buffer->buff;
+
+    while(isdigit(*str))
     {
-      c_file->is_diploid = 1;
+      str++;
     }
 
-    unsigned long col;
-    for(col = 0; col < c_file->num_of_colours; col++)
+    while(isspace(*str))
     {
-      if(_cortex_read_line(c_file) == 0 || !isdigit(c_file->buffer->buff[0]))
-      {
-        fprintf(stderr, "cortex.c: premature end of call likelihoods (%s:%lu)\n",
-                c_file->path, c_file->line_number);
-        return 0;
-      }
+      str++;
+    }
 
-      unsigned long col2;
-      char str[6];
-      float col_llk_hom_br1, col_llk_het, col_llk_hom_br2;
+    const char *call_str = str;
 
-      int items_read;
-      
-      if(c_file->is_diploid)
-      {
-        items_read = sscanf(c_file->buffer->buff, "%lu %4s %f %f %f",
-                            &col2, str, &col_llk_hom_br1, &col_llk_het,
-                            &col_llk_hom_br2);
-      }
-      else
+    while(*str != '\0' && !isspace(*str))
+    {
+      str++;
+    }
+
+    size_t call_len = (size_t)(str - call_str);
+
+    for(i = 0; i < num_llks; i++)
+    {
+      while(isspace(*str))
       {
-        // haploid - can't be het
-        items_read = sscanf(c_file->buffer->buff, "%lu %4s %f %f",
-                            &col2, str, &col_llk_hom_br1, &col_llk_hom_br2);
+        str++;
       }
 
-      if((c_file->is_diploid && items_read != 5) ||
-         (!c_file->is_diploid && items_read != 4))
+      if(!_parse_llk_float(&str, &llks[i]))
       {
-        fprintf(stderr, "cortex.c: invalid likelihood line ['%s'] (%s:%lu)\n",
-                c_file->buffer->buff, c_file->path, c_file->line_number);
-        return 0;
+        break;
       }
+    }
 
-      HETEROGENEITY call = UNKNOWN_HET;
+    if(call_len == 0 || call_len > 4 || i < num_llks)
+    {
+      fprintf(stderr, "cortex.c: invalid likelihood line ['%s'] (%s:%lu)\n",
+              c_file->buffer->buff, c_file->path, c_file->line_number);
+      return 0;
+    }
 
-      if(strncasecmp(str, "HOM1", strlen("HOM1")) == 0)
-      {
-        call = HOM1;
-      }
-      else if(strncasecmp(str, "HET", strlen("HET")) == 0)
-      {
-        call = HET;
-      }
-      else if(strncasecmp(str, "HOM2", strlen("HOM2")) == 0)
-      {
-        call = HOM2;
-      }
-      else
-      {
-        fprintf(stderr, "cortex.c: unexpected likelihood line ['%s'] (%s:%lu)\n",
-                str, c_file->path, c_file->line_number);
-        return 0;
-      }
+    HETEROGENEITY call = _parse_llk_call(call_str, call_len);
 
-      bubble->calls[col] = call;
-      bubble->llk_hom_br1[col] = col_llk_hom_br1;
+    if(call == UNKNOWN_HET)
+    {
+      fprintf(stderr, "cortex.c: unexpected likelihood line ['%.*s'] "
+                      "(%s:%lu)\n",
+              (int)call_len, call_str, c_file->path, c_file->line_number);
+      return 0;
+    }
 
-      if(c_file->is_diploid)
-      {
-        bubble->llk_het[col] = col_llk_het;
-      }
+    bubble->calls[col] = call;
+    bubble->llk_hom_br1[col] = llks[0];
 
-      bubble->llk_hom_br2[col] = col_llk_hom_br2;
+    if(diploid)
+    {
+      bubble->llk_het[col] = llks[1];
     }
-  
-    // Read first line of the bubble
-    _cortex_read_line(c_file);
+
+    bubble->llk_hom_br2[col] = llks[num_llks-1];
+  }
+
+  // Read first line of the bubble
+  _cortex_read_line(c_file);
+  return 1;
+}
+
+// Skip the classifier and discovery lines
+char _read_head_lines(CORTEX_FILE* c_file)
+{
+  unsigned char i;
+
+  for(i = 0; i < c_file->bubble_head_lines; i++)
+  {
+    if(_cortex_read_line(c_file) == 0)
+    {
+      fprintf(stderr, "cortex.c: premature end of call start (%s:%lu)\n",
+              c_file->path, c_file->line_number);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+char _read_llk_header(CORTEX_FILE* c_file)
+{
+  if(strncasecmp(c_file->buffer->buff, "Colour", strlen("Colour")) != 0)
+  {
+    fprintf(stderr, "cortex.c: premature end of file likelihoods (%s:%lu)\n",
+            c_file->path, c_file->line_number);
+    return 0;
+  }
+
+  return 1;
+}
+
+//
+// Bubble head readers, one per variant of the file format
+//
+
+char _read_head_plain(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
+{
+  (void)bubble;
+  return _read_head_lines(c_file);
+}
+
+char _read_head_haploid(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
+{
+  return _read_head_lines(c_file) && _read_llk_header(c_file) &&
+         _read_llk_lines(bubble, c_file, 0);
+}
+
+char _read_head_diploid(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
+{
+  return _read_head_lines(c_file) && _read_llk_header(c_file) &&
+         _read_llk_lines(bubble, c_file, 1);
+}
+
+// First bubble with likelihoods: the header says whether there is a het.
+// column, which fixes the reader for the rest of the file
+char _read_head_detect(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
+{
+  if(!_read_head_lines(c_file) || !_read_llk_header(c_file))
+  {
+    return 0;
+  }
+
+  if(strstr(c_file->buffer->buff, "llk_het") != NULL)
+  {
+    c_file->is_diploid = 1;
+  }
+
+  c_file->read_bubble_head = c_file->is_diploid ? _read_head_diploid
+                                                : _read_head_haploid;
+
+  return _read_llk_lines(bubble, c_file, c_file->is_diploid);
+}
+
+void _bubble_head_select(CORTEX_FILE* c_file)
+{
+  c_file->bubble_head_lines = (c_file->fails_classifier_line ? 1 : 0) +
+                              (c_file->discovery_phase_line ? 1 : 0);
+
+  c_file->read_bubble_head = c_file->has_likelihoods ? _read_head_detect
+                                                     : _read_head_plain;
+}
+
+char _read_bubble(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
+{
+  cortex_bubble_reset(bubble, c_file);
+
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex.c: cortex_read_bubble cannot read from "
+                    "alignment file (%s:%lu)\n",
+            c_file->path, c_file->line_number);
+
+    return 0;
+  }
+
+  // Read until not whiteline
+  while(strbuf_len(c_file->buffer) == 0 &&
+        _cortex_read_line(c_file) > 0);
+
+  if(strbuf_len(c_file->buffer) == 0)
+  {
+    // EOF
+    return 0;
+  }
+
+  c_file->record_offset = c_file->line_offset;
+
+  if(c_file->read_bubble_head == NULL)
+  {
+    _bubble_head_select(c_file);
+  }
+
+  CORTEX_PROF_ENTER(PROF_LIKELIHOODS);
+  char head_ok = c_file->read_bubble_head(bubble, c_file);
+  CORTEX_PROF_LEAVE();
+
+  if(!head_ok)
+  {
+    return 0;
   }
 
   unsigned long var_num1, var_num2, var_num3, var_num4;
 
-  if(!_read_bubble_path(c_file, &bubble->flank_5p, &var_num1) ||
-     !_read_bubble_path(c_file, &bubble->branches[0], &var_num2) ||
-     !_read_bubble_path(c_file, &bubble->branches[1], &var_num3) ||
-     !_read_bubble_path(c_file, &bubble->flank_3p, &var_num4))
+  CORTEX_PROF_ENTER(PROF_HEADER);
+  char paths_ok = _read_bubble_path(c_file, &bubble->flank_5p, &var_num1) &&
+                  _read_bubble_path(c_file, &bubble->branches[0], &var_num2) &&
+                  _read_bubble_path(c_file, &bubble->branches[1], &var_num3) &&
+                  _read_bubble_path(c_file, &bubble->flank_3p, &var_num4);
+  CORTEX_PROF_LEAVE();
+
+  if(!paths_ok)
   {
     fprintf(stderr, "cortex.c: cortex_read_bubble() failed (%s:%lu)\n",
             c_file->path, c_file->line_number);
@@ -1041,7 +2544,9 @@ char cortex_read_bubble(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
       }
 
       // Get coverage of branch 'branch' on colour 'col'
+      CORTEX_PROF_ENTER(PROF_COVERAGE);
       _read_covg(c_file, bubble->branches_colour_covgs[branch][col], branch_length);
+      CORTEX_PROF_LEAVE();
     }
 
     _cortex_read_line(c_file);
@@ -1054,28 +2559,43 @@ char cortex_read_bubble(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
   return 1;
 }
 
-void cortex_print_bubble(const CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
+char cortex_read_bubble(CORTEX_BUBBLE* bubble, CORTEX_FILE* c_file)
+{
+  while(!_read_bubble(bubble, c_file))
+  {
+    if(!_recover(c_file, _is_bubble_start))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void cortex_fprint_bubble(FILE *out, const CORTEX_BUBBLE* bubble,
+                          const CORTEX_FILE *c_file)
 {
   if(c_file->fails_classifier_line)
   {
-    printf("FAILS CLASSIFIER: fits repeat model better than variation model\n");
+    fprintf(out, "FAILS CLASSIFIER: fits repeat model better than "
+                 "variation model\n");
   }
 
   if(c_file->discovery_phase_line)
   {
-    printf("DISCOVERY PHASE:  VARIANT vs REPEAT MODEL "
-           "LOG_LIKELIHOODS:	llk_var:nan	llk_rep:-inf\n");
+    fprintf(out, "DISCOVERY PHASE:  VARIANT vs REPEAT MODEL "
+                 "LOG_LIKELIHOODS:	llk_var:nan	llk_rep:-inf\n");
   }
 
   if(c_file->has_likelihoods)
   {
     if(c_file->is_diploid)
     {
-      printf("Colour/sample	GT_call	llk_hom_br1	llk_het	llk_hom_br2\n");
+      fprintf(out, "Colour/sample	GT_call	llk_hom_br1	llk_het	llk_hom_br2\n");
     }
     else
     {
-      printf("Colour/sample	GT_call	llk_hom_br1	llk_hom_br2\n");
+      fprintf(out, "Colour/sample	GT_call	llk_hom_br1	llk_hom_br2\n");
     }
 
     unsigned long col;
@@ -1103,24 +2623,24 @@ void cortex_print_bubble(const CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
       if(c_file->is_diploid)
       {
         // Has het
-        printf("%lu	%s	%.2f	%.2f	%.2f\n", col, call,
-               bubble->llk_hom_br1[col], bubble->llk_het[col],
-               bubble->llk_hom_br2[col]);
+        fprintf(out, "%lu	%s	%.2f	%.2f	%.2f\n", col, call,
+                bubble->llk_hom_br1[col], bubble->llk_het[col],
+                bubble->llk_hom_br2[col]);
       }
       else
       {
-        printf("%lu	%s	%.2f	%.2f\n", col, call,
-               bubble->llk_hom_br1[col],  bubble->llk_hom_br2[col]);
+        fprintf(out, "%lu	%s	%.2f	%.2f\n", col, call,
+                bubble->llk_hom_br1[col],  bubble->llk_hom_br2[col]);
       }
     }
   }
 
-  _print_bubble_path(bubble->var_num, &bubble->flank_5p, FLANK_5P);
-  _print_bubble_path(bubble->var_num, &bubble->branches[0], BRANCH1);
-  _print_bubble_path(bubble->var_num, &bubble->branches[1], BRANCH2);
-  _print_bubble_path(bubble->var_num, &bubble->flank_3p, FLANK_3P);
+  _print_bubble_path(out, bubble->var_num, &bubble->flank_5p, FLANK_5P);
+  _print_bubble_path(out, bubble->var_num, &bubble->branches[0], BRANCH1);
+  _print_bubble_path(out, bubble->var_num, &bubble->branches[1], BRANCH2);
+  _print_bubble_path(out, bubble->var_num, &bubble->flank_3p, FLANK_3P);
 
-  printf("\n\n");
+  fprintf(out, "\n\n");
 
   // Print branches
   int branch;
@@ -1128,23 +2648,519 @@ void cortex_print_bubble(const CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
 
   for(branch = 0; branch < 2; branch++)
   {
-    printf("branch%i coverages\n", branch);
+    fprintf(out, "branch%i coverages\n", branch);
     
     for(col = 0; col < c_file->num_of_colours; col++)
     {
       COLOUR_COVG* covgs = bubble->branches_colour_covgs[branch][col];
 
-      printf("Covg in Colour %lu:\n", c_file->colour_arr[col]);
-      printf("%lu", covgs->colour_covgs[0]);
+      fprintf(out, "Covg in Colour %lu:\n", c_file->colour_arr[col]);
+      fprintf(out, "%lu", covgs->colour_covgs[0]);
 
       for(covgs_i = 1; covgs_i < covgs->length; covgs_i++)
       {
-        printf(" %lu", covgs->colour_covgs[covgs_i]);
+        fprintf(out, " %lu", covgs->colour_covgs[covgs_i]);
+      }
+
+      fprintf(out, "\n");
+    }
+  }
+
+  fprintf(out, "\n\n");
+}
+
+void cortex_print_bubble(const CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file)
+{
+  cortex_fprint_bubble(stdout, bubble, c_file);
+}
+
+//
+// Push parsing
+//
+
+struct CORTEX_PARSER
+{
+  CORTEX_FILE *c_file;
+  CORTEX_BUBBLE *bubble;
+  CORTEX_ALIGNMENT *alignment;
+
+  cortex_parser_func func;
+  void *arg;
+
+  // How to spot the first line of a record: it starts with start_prefix and
+  // contains start_word (if not NULL), or doesn't contain it for alignments
+  // (a '>' line that isn't a coverage header).  Guessed from the first line
+  // until the header has been parsed
+  const char *start_prefix, *start_word;
+  char alignment_starts, sniffed, finished, failed, stopped;
+
+  // Start of a record not yet completed, carried over from earlier chunks
+  // (before the header is parsed, everything so far)
+  char *pending;
+  size_t pending_len, pending_capacity;
+  long pending_offset;
+
+  long stream_offset;
+  unsigned long num_records;
+};
+
+CORTEX_PARSER* cortex_parser_create(const char *name, cortex_parser_func func,
+                                    void *arg)
+{
+  CORTEX_PARSER *parser = (CORTEX_PARSER*) malloc(sizeof(CORTEX_PARSER));
+
+  if(parser == NULL)
+  {
+    fprintf(stderr, "cortex.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  parser->c_file = _cortex_file_alloc(name);
+  parser->bubble = NULL;
+  parser->alignment = NULL;
+  parser->func = func;
+  parser->arg = arg;
+  parser->start_prefix = NULL;
+  parser->start_word = NULL;
+  parser->alignment_starts = 0;
+  parser->sniffed = 0;
+  parser->finished = 0;
+  parser->failed = 0;
+  parser->stopped = 0;
+  parser->pending = NULL;
+  parser->pending_len = 0;
+  parser->pending_capacity = 0;
+  parser->pending_offset = 0;
+  parser->stream_offset = 0;
+  parser->num_records = 0;
+
+  return parser;
+}
+
+void cortex_parser_free(CORTEX_PARSER *parser)
+{
+  if(parser->bubble != NULL)
+  {
+    cortex_bubble_free(parser->bubble, parser->c_file);
+  }
+
+  if(parser->alignment != NULL)
+  {
+    cortex_alignment_free(parser->alignment, parser->c_file);
+  }
+
+  if(parser->c_file != NULL)
+  {
+    cortex_close(parser->c_file);
+  }
+
+  free(parser->pending);
+  free(parser);
+}
+
+CORTEX_FILE* cortex_parser_file(CORTEX_PARSER *parser)
+{
+  return parser->c_file;
+}
+
+unsigned long cortex_parser_num_records(const CORTEX_PARSER *parser)
+{
+  return parser->num_records;
+}
+
+void _parser_append(CORTEX_PARSER *parser, const char *data, size_t len)
+{
+  if(parser->pending_len + len > parser->pending_capacity)
+  {
+    size_t capacity = parser->pending_capacity < 4096 ?
+                      4096 : parser->pending_capacity;
+
+    while(capacity < parser->pending_len + len)
+    {
+      capacity *= 2;
+    }
+
+    parser->pending = (char*) realloc(parser->pending, capacity);
+
+    if(parser->pending == NULL)
+    {
+      fprintf(stderr, "cortex.c: out of memory [%lu bytes]\n",
+              (unsigned long)capacity);
+      exit(EXIT_FAILURE);
+    }
+
+    parser->pending_capacity = capacity;
+  }
+
+  memcpy(parser->pending + parser->pending_len, data, len);
+  parser->pending_len += len;
+}
+
+// Records start the same way as in _is_bubble_start()/_is_alignment_start()
+void _parser_starts_like(CORTEX_PARSER *parser, const char *prefix,
+                         const char *word, char alignment)
+{
+  parser->start_prefix = prefix;
+  parser->start_word = word;
+  parser->alignment_starts = alignment;
+}
+
+// Decide how records start from a line (without its newline)
+void _parser_set_starts(CORTEX_PARSER *parser, const char *line, size_t len)
+{
+  const char *prefixes[3] = {fail_msg, discovery_msg, "Colour"};
+  int i;
+
+  for(i = 0; i < 3; i++)
+  {
+    size_t n = strlen(prefixes[i]);
+
+    if(len >= n && strncasecmp(line, prefixes[i], n) == 0)
+    {
+      _parser_starts_like(parser, prefixes[i], NULL, 0);
+      return;
+    }
+  }
+
+  if(len >= strlen(">var_") && strncmp(line, ">var_", strlen(">var_")) == 0)
+  {
+    _parser_starts_like(parser, ">var_", "_5p_flank", 0);
+  }
+  else if(len > 0 && line[0] == '>')
+  {
+    _parser_starts_like(parser, ">", "_kmer_coverages", 1);
+  }
+  else
+  {
+    _parser_starts_like(parser, NULL, NULL, 0);
+  }
+}
+
+// Does line[0..len) contain word?
+char _parser_line_has(const char *line, size_t len, const char *word)
+{
+  size_t n = strlen(word), i;
+
+  for(i = 0; i + n <= len; i++)
+  {
+    if(line[i] == word[0] && memcmp(line + i, word, n) == 0)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Is the line at line[0..len) (without its newline) the start of a record?
+char _parser_is_start(const CORTEX_PARSER *parser, const char *line, size_t len)
+{
+  if(parser->start_prefix == NULL)
+  {
+    return 0;
+  }
+
+  size_t n = strlen(parser->start_prefix);
+
+  if(len < n || strncasecmp(line, parser->start_prefix, n) != 0)
+  {
+    return 0;
+  }
+
+  return parser->start_word == NULL ||
+         _parser_line_has(line, len, parser->start_word) !=
+         parser->alignment_starts;
+}
+
+// Find complete lines (ending '\n') that start records in data[from..len),
+// where from is the start of a line.  Returns the offset of the first such
+// line, or of the last if last is set, or len if there are none
+size_t _parser_find_start(const CORTEX_PARSER *parser, const char *data,
+                          size_t from, size_t len, char last)
+{
+  size_t found = len;
+  const char *end;
+
+  while(from < len &&
+        (end = (const char*) memchr(data + from, '\n', len - from)) != NULL)
+  {
+    size_t line_end = end - data;
+
+    if(_parser_is_start(parser, data + from, line_end - from))
+    {
+      found = from;
+
+      if(!last)
+      {
+        break;
+      }
+    }
+
+    from = line_end + 1;
+  }
+
+  return found;
+}
+
+// Offset just after the first newline at or after from, or len
+size_t _parser_next_line(const char *data, size_t from, size_t len)
+{
+  const char *end = (const char*) memchr(data + from, '\n', len - from);
+  return end == NULL ? len : (size_t)(end - data) + 1;
+}
+
+// Parse all the records in data[0..len), which is at stream offset offset,
+// and pass them to the callback.  The data must end at a record boundary
+char _parser_parse(CORTEX_PARSER *parser, const char *data, size_t len,
+                   long offset)
+{
+  CORTEX_FILE *c_file = parser->c_file;
+
+  c_file->mem_start = c_file->mem = data;
+  c_file->mem_end = data + len;
+  c_file->mem_start_offset = offset;
+  strbuf_reset(c_file->buffer);
+
+  while(1)
+  {
+    // Skip blank lines to see if there is another record
+    while(strbuf_len(c_file->buffer) == 0 && _cortex_read_line(c_file) > 0);
+
+    if(strbuf_len(c_file->buffer) == 0)
+    {
+      return 1;
+    }
+
+    unsigned long skipped = c_file->records_skipped;
+    char success = (c_file->filetype == BUBBLE_FILE ?
+                    cortex_read_bubble(parser->bubble, c_file) :
+                    cortex_read_alignment(parser->alignment, c_file));
+
+    if(!success)
+    {
+      if(c_file->records_skipped > skipped && strbuf_len(c_file->buffer) == 0)
+      {
+        // Malformed record skipped up to the end of the data
+        return 1;
       }
 
-      printf("\n");
+      fprintf(stderr, "cortex.c: couldn't parse record (%s:%lu)\n",
+              c_file->path, c_file->line_number);
+      parser->failed = 1;
+      return 0;
+    }
+
+    parser->num_records++;
+
+    if(!parser->func(c_file, parser->bubble, parser->alignment, parser->arg))
+    {
+      parser->stopped = 1;
+      return 0;
+    }
+  }
+}
+
+// Parse the header once the first record is complete (or the input has
+// finished).  Returns 1 once the header has been parsed
+char _parser_sniff(CORTEX_PARSER *parser)
+{
+  const char *data = parser->pending;
+  size_t len = parser->pending_len, from = 0, line_end;
+
+  // Skip blank lines
+  while(from < len && (data[from] == '\n' || data[from] == '\r'))
+  {
+    from++;
+  }
+
+  line_end = _parser_next_line(data, from, len);
+
+  if(line_end == len && !parser->finished)
+  {
+    // First line not complete yet
+    return 0;
+  }
+
+  _parser_set_starts(parser, data + from, line_end - from);
+
+  if(!parser->finished && parser->start_prefix != NULL &&
+     _parser_find_start(parser, data, line_end, len, 0) == len)
+  {
+    // Haven't seen the start of the second record
+    return 0;
+  }
+
+  CORTEX_FILE *c_file = parser->c_file;
+  c_file->mem_start = c_file->mem = data;
+  c_file->mem_end = data + len;
+  c_file->mem_start_offset = parser->pending_offset;
+
+  if(_cortex_sniff(c_file) == NULL)
+  {
+    // _cortex_sniff() has closed the file
+    parser->c_file = NULL;
+    parser->failed = 1;
+    return 0;
+  }
+
+  c_file->line_number = 0;
+  parser->sniffed = 1;
+
+  // Now that the flags are known, use the same test as skipping bad records
+  if(c_file->filetype == BUBBLE_FILE)
+  {
+    parser->bubble = cortex_bubble_create(c_file);
+
+    if(c_file->fails_classifier_line)
+    {
+      _parser_starts_like(parser, fail_msg, NULL, 0);
+    }
+    else if(c_file->discovery_phase_line)
+    {
+      _parser_starts_like(parser, discovery_msg, NULL, 0);
+    }
+    else if(c_file->has_likelihoods)
+    {
+      _parser_starts_like(parser, "Colour", NULL, 0);
+    }
+    else
+    {
+      _parser_starts_like(parser, ">var_", "_5p_flank", 0);
+    }
+  }
+  else
+  {
+    parser->alignment = cortex_alignment_create(c_file);
+    _parser_starts_like(parser, ">", "_kmer_coverages", 1);
+  }
+
+  return 1;
+}
+
+// Parse the complete records in pending, keeping the rest
+char _parser_drain_pending(CORTEX_PARSER *parser)
+{
+  size_t end = parser->pending_len;
+
+  if(!parser->finished)
+  {
+    size_t second = _parser_next_line(parser->pending, 0, parser->pending_len);
+    end = _parser_find_start(parser, parser->pending, second,
+                             parser->pending_len, 1);
+
+    if(end == parser->pending_len)
+    {
+      // Nothing complete
+      return 1;
+    }
+  }
+
+  if(!_parser_parse(parser, parser->pending, end, parser->pending_offset))
+  {
+    return 0;
+  }
+
+  memmove(parser->pending, parser->pending + end, parser->pending_len - end);
+  parser->pending_len -= end;
+  parser->pending_offset += end;
+
+  return 1;
+}
+
+char cortex_parser_feed(CORTEX_PARSER *parser, const char *buf, size_t len)
+{
+  if(parser->failed || parser->stopped || parser->finished)
+  {
+    return 0;
+  }
+
+  long buf_offset = parser->stream_offset;
+  parser->stream_offset += len;
+
+  if(!parser->sniffed)
+  {
+    _parser_append(parser, buf, len);
+
+    if(!_parser_sniff(parser))
+    {
+      return !parser->failed;
+    }
+
+    return _parser_drain_pending(parser);
+  }
+
+  size_t start = 0;
+
+  if(parser->pending_len > 0)
+  {
+    // Complete the record carried over with bytes up to the next record
+    // start.  buf only starts with a line if pending ended with one
+    size_t from = (parser->pending[parser->pending_len-1] == '\n' ?
+                   0 : _parser_next_line(buf, 0, len));
+
+    start = _parser_find_start(parser, buf, from, len, 0);
+    _parser_append(parser, buf, start);
+
+    if(start == len)
+    {
+      return 1;
+    }
+
+    if(!_parser_parse(parser, parser->pending, parser->pending_len,
+                      parser->pending_offset))
+    {
+      return 0;
+    }
+
+    parser->pending_len = 0;
+  }
+
+  // buf[start] begins a record.  Everything up to the last record start is
+  // complete, so parse it where it is
+  size_t end = _parser_find_start(parser, buf, _parser_next_line(buf, start, len),
+                                  len, 1);
+
+  if(end == len)
+  {
+    end = start;
+  }
+
+  if(end > start &&
+     !_parser_parse(parser, buf + start, end - start, buf_offset + start))
+  {
+    return 0;
+  }
+
+  // Keep the last, unfinished record
+  _parser_append(parser, buf + end, len - end);
+  parser->pending_offset = buf_offset + end;
+
+  return 1;
+}
+
+char cortex_parser_finish(CORTEX_PARSER *parser)
+{
+  if(parser->failed || parser->stopped || parser->finished)
+  {
+    return !parser->failed && !parser->stopped;
+  }
+
+  parser->finished = 1;
+
+  if(!parser->sniffed)
+  {
+    if(parser->pending_len == 0)
+    {
+      fprintf(stderr, "cortex.c: no data (%s)\n", parser->c_file->path);
+      parser->failed = 1;
+      return 0;
+    }
+
+    if(!_parser_sniff(parser))
+    {
+      return 0;
     }
   }
 
-  printf("\n\n");
+  return _parser_drain_pending(parser);
 }
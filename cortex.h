@@ -25,7 +25,10 @@
 #ifndef CORTEX_H_SEEN
 #define CORTEX_H_SEEN
 
+#include <stdint.h>
+
 #include "string_buffer.h"
+#include "cortex_reader.h"
 
 enum CORTEX_FILE_TYPE {UNKNOWN_FILE,BUBBLE_FILE,ALIGNMENT_FILE};
 enum HETEROGENEITY {UNKNOWN_HET,HOM1,HOM2,HET};
@@ -36,14 +39,23 @@ typedef struct CORTEX_ALIGNMENT CORTEX_ALIGNMENT;
 typedef struct CORTEX_BUBBLE CORTEX_BUBBLE;
 typedef struct CORTEX_BUBBLE_PATH CORTEX_BUBBLE_PATH;
 typedef struct COLOUR_COVG COLOUR_COVG;
+typedef struct COLOUR_COVG_RUNS COLOUR_COVG_RUNS;
+typedef struct CORTEX_ALIGNMENT_RUNS CORTEX_ALIGNMENT_RUNS;
+typedef struct CORTEX_PARSER CORTEX_PARSER;
 
 struct CORTEX_FILE
 {
   // For reading the file
   char *path;
-  gzFile *file;
+  CORTEX_READER *file;
   StrBuf *buffer;
   unsigned long line_number; // line currently in buffer (starting at 1)
+  // Set if the last read found no more lines.  An empty buffer may just be a
+  // blank line
+  char line_eof;
+  // Uncompressed byte offsets of the line currently in buffer and of the
+  // start of the last record read
+  long line_offset, record_offset;
 
   // Syntax of the file
   enum CORTEX_FILE_TYPE filetype;
@@ -52,6 +64,27 @@ struct CORTEX_FILE
 
   unsigned long num_of_colours;
   unsigned long *colour_arr;
+
+  // Reads the lines before a bubble's paths (classifier, discovery and
+  // likelihood lines).  Picked for this file's variant on the first bubble;
+  // the likelihood header there also sets is_diploid
+  char (*read_bubble_head)(CORTEX_BUBBLE *bubble, CORTEX_FILE *c_file);
+  unsigned char bubble_head_lines;
+
+  // Follow mode (see cortex_follow()).  follow_waits counts the reads that
+  // had to wait for more data and follow_wait_ns is the total time waited
+  unsigned long follow_timeout_ms;
+  char follow_finished;
+  unsigned long follow_waits;
+  unsigned long long follow_wait_ns;
+
+  // Malformed records skipped so far (see cortex_set_error_budget())
+  unsigned long error_budget, records_skipped;
+
+  // In-memory input, read instead of file when file is NULL (see
+  // cortex_parser_feed()).  mem_start is at offset mem_start_offset
+  const char *mem_start, *mem, *mem_end;
+  long mem_start_offset;
 };
 
 struct COLOUR_COVG
@@ -100,6 +133,97 @@ char* cortex_colour_list_str(const CORTEX_FILE* c_file);
 long cortex_file_get_colour_index(unsigned long colour,
                                   const CORTEX_FILE* c_file);
 
+// Jump to a record start previously taken from c_file->record_offset.
+// Line numbers are not known after a seek and restart from 0.
+// Returns 1 on success, 0 on failure
+char cortex_seek(CORTEX_FILE* c_file, long offset);
+
+//
+// Following files that are still being written
+//
+
+// Turn on follow mode: at the end of the file, reads wait (backing off up to
+// 250ms between tries) for the rest of a line rather than returning a short
+// read, until nothing has arrived for timeout_ms or cortex_follow_finish() is
+// called.  Works for plain and gzip files; a gzip writer must flush.
+// timeout_ms == 0 turns follow mode off
+void cortex_follow(CORTEX_FILE* c_file, unsigned long timeout_ms);
+// Same as cortex_open() but in follow mode from the start, so the header can
+// still be being written.  Waits up to timeout_ms for the file to appear
+CORTEX_FILE* cortex_open_follow(const char *path, unsigned long timeout_ms);
+// Thread safe.  Call once the writer has finished: readers then stop waiting
+// at the end of the file
+void cortex_follow_finish(CORTEX_FILE* c_file);
+
+//
+// Malformed records
+//
+
+// By default reading stops at the first malformed record.  With max_skipped
+// > 0, cortex_read_bubble() and cortex_read_alignment() instead report it on
+// stderr, skip to the start of the next record and carry on, until more than
+// max_skipped records have been skipped.  The count is kept in
+// c_file->records_skipped
+void cortex_set_error_budget(CORTEX_FILE* c_file, unsigned long max_skipped);
+
+//
+// Opening many files at once
+//
+
+enum CORTEX_OPEN_STATUS {OPEN_OK, OPEN_FAILED, OPEN_FILETYPE_DIFFERS,
+                         OPEN_KMER_SIZE_DIFFERS, OPEN_COLOURS_DIFFER};
+
+typedef struct CORTEX_OPEN_SUMMARY CORTEX_OPEN_SUMMARY;
+
+struct CORTEX_OPEN_SUMMARY
+{
+  // status[i] is for paths[i].  Files are compared with the first file that
+  // opened successfully
+  enum CORTEX_OPEN_STATUS *status;
+  size_t num_ok, num_failed, num_filetype_differs,
+         num_kmer_size_differs, num_colours_differ;
+};
+
+// Open and sniff num_files files in parallel on num_threads threads
+// (0 means one per cpu).  Returns an array of num_files handles; entries are
+// NULL where the file couldn't be opened.  Files that open but don't match
+// the first file are still returned, and are reported on stderr and in
+// summary (if not NULL).  Free the array with free() after closing handles,
+// and the summary with cortex_open_summary_free().  Returns NULL if out of
+// memory, with no files opened
+CORTEX_FILE** cortex_open_many(const char **paths, size_t num_files,
+                               unsigned int num_threads,
+                               CORTEX_OPEN_SUMMARY *summary);
+void cortex_open_summary_free(CORTEX_OPEN_SUMMARY *summary);
+
+//
+// Header cache
+//
+
+// Same as cortex_open() but saves what was learnt about the file (type, kmer
+// size, header lines, likelihoods and colours) to a small sidecar file, and
+// uses it instead of re-reading the file next time.  The sidecar is ignored
+// if the file's size, modification time or first few KB have changed.
+// cache_path == NULL means use <path>.ctxhdr
+CORTEX_FILE* cortex_open_cached(const char *path, const char *cache_path);
+
+//
+// Checkpoints
+//
+
+// Save where c_file has got to, so that a restarted job can carry on from
+// there.  Call between records.  For gzip files the checkpoint holds the
+// nearest deflate block boundary before this point and the 32KB of output
+// before it, so resuming inflates at most about 1MB rather than the whole
+// file.  Written to a temporary file and renamed over path.  Returns 1 on
+// success, 0 on failure
+char cortex_checkpoint(const CORTEX_FILE *c_file, const char *path);
+// Continue a newly opened c_file from a checkpoint: the next record read is
+// the one that would have been read when it was saved, with the same line
+// numbers and count of skipped records.  Fails if the checkpoint is for a
+// different file.  Returns 1 on success, 0 on failure
+char cortex_resume(CORTEX_FILE *c_file, const char *path);
+
 //
 // Reading bubbles
 //
@@ -115,6 +239,9 @@ void cortex_bubble_free(CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file);
 char cortex_read_bubble(CORTEX_BUBBLE* bubble, CORTEX_FILE* file);
 // Print a bubble that came from a given file
 void cortex_print_bubble(const CORTEX_BUBBLE* bubble, const CORTEX_FILE *c_file);
+// Same as cortex_print_bubble() but to any stream
+void cortex_fprint_bubble(FILE *out, const CORTEX_BUBBLE* bubble,
+                          const CORTEX_FILE *c_file);
 
 //
 // Reading alignments
@@ -134,5 +261,93 @@ char cortex_read_alignment(CORTEX_ALIGNMENT* alignment, CORTEX_FILE* file);
 // Print an alignment that came from a given file
 void cortex_print_alignment(const CORTEX_ALIGNMENT* alignment,
                             const CORTEX_FILE* file);
+// Same as cortex_print_alignment() but to any stream
+void cortex_fprint_alignment(FILE *out, const CORTEX_ALIGNMENT* alignment,
+                             const CORTEX_FILE* file);
+
+//
+// Reading alignments with run-length encoded coverage
+//
+
+// Coverage along an alignment is usually flat for long stretches, so it can be
+// held as runs: kmers [ends[r-1], ends[r]) have coverage values[r] (with
+// ends[-1] = 0).  Coverage is 32 bit, as it is in cortex graphs
+struct COLOUR_COVG_RUNS
+{
+  unsigned long length; // number of kmers
+  unsigned long num_runs, capacity;
+  uint32_t *values, *ends;
+};
+
+struct CORTEX_ALIGNMENT_RUNS
+{
+  StrBuf *name, *seq;
+  COLOUR_COVG_RUNS **colour_runs;
+};
+
+CORTEX_ALIGNMENT_RUNS* cortex_alignment_runs_create(const CORTEX_FILE *c_file);
+void cortex_alignment_runs_reset(CORTEX_ALIGNMENT_RUNS* alignment,
+                                 const CORTEX_FILE *c_file);
+void cortex_alignment_runs_free(CORTEX_ALIGNMENT_RUNS* alignment,
+                                const CORTEX_FILE *c_file);
+// Release spare capacity, for alignments that are kept rather than reused
+void cortex_alignment_runs_shrink(CORTEX_ALIGNMENT_RUNS* alignment,
+                                  const CORTEX_FILE *c_file);
+
+// Same as cortex_read_alignment() but coverage is parsed straight into runs
+char cortex_read_alignment_runs(CORTEX_ALIGNMENT_RUNS* alignment,
+                                CORTEX_FILE* c_file);
+// Prints in the same format as cortex_print_alignment()
+void cortex_print_alignment_runs(const CORTEX_ALIGNMENT_RUNS* alignment,
+                                 const CORTEX_FILE* c_file);
+
+// Queries over kmers [start, end).  end is clipped to runs->length and an
+// empty range gives 0
+unsigned long cortex_covg_runs_get(const COLOUR_COVG_RUNS *runs,
+                                   unsigned long kmer);
+void cortex_covg_runs_decode(const COLOUR_COVG_RUNS *runs,
+                             unsigned long start, unsigned long end,
+                             unsigned long *covgs);
+unsigned long long cortex_covg_runs_sum(const COLOUR_COVG_RUNS *runs,
+                                        unsigned long start,
+                                        unsigned long end);
+unsigned long cortex_covg_runs_min(const COLOUR_COVG_RUNS *runs,
+                                   unsigned long start, unsigned long end);
+unsigned long cortex_covg_runs_max(const COLOUR_COVG_RUNS *runs,
+                                   unsigned long start, unsigned long end);
+
+//
+// Push parsing
+//
+
+// Parse data arriving in the caller's own buffers (already decompressed)
+// rather than from a file.  Chunks can split records and lines anywhere.
+// Records held entirely in a chunk are parsed straight from it; only the
+// start of a record that runs into the next chunk is copied.  A record is
+// passed on once the start of the next one has arrived (or at finish)
+
+// Called with each record, bubble or alignment depending on the file type
+// (the other is NULL).  The record and file are only valid during the call.
+// Return 0 to stop parsing
+typedef char (*cortex_parser_func)(const CORTEX_FILE *c_file,
+                                   const CORTEX_BUBBLE *bubble,
+                                   const CORTEX_ALIGNMENT *alignment,
+                                   void *arg);
+
+// name is used in place of a path in messages
+CORTEX_PARSER* cortex_parser_create(const char *name, cortex_parser_func func,
+                                    void *arg);
+void cortex_parser_free(CORTEX_PARSER *parser);
+
+// Returns 0 if the data couldn't be parsed or the callback stopped parsing
+char cortex_parser_feed(CORTEX_PARSER *parser, const char *buf, size_t len);
+// Call at the end of the input to parse the last record.
+// Returns 1 if all the input was parsed
+char cortex_parser_finish(CORTEX_PARSER *parser);
+
+// The file's header details are filled in once the first record is complete.
+// Can be used with cortex_set_error_budget() (NULL if the header was bad)
+CORTEX_FILE* cortex_parser_file(CORTEX_PARSER *parser);
+unsigned long cortex_parser_num_records(const CORTEX_PARSER *parser);
 
 #endif
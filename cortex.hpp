@@ -0,0 +1,498 @@
+/*
+ cortex.hpp
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_HPP_SEEN
+#define CORTEX_HPP_SEEN
+
+//
+// Header-only C++17 wrapper
+//
+// cortex::File closes its file when it goes out of scope.  Bubble and
+// Alignment own one C record each, which is reused by every read so reading
+// a file doesn't allocate per record.  Records are move-only and must not
+// outlive the File they were created from.
+//
+//   cortex::File file("calls.colour_covgs");
+//   for(const auto &bubble : cortex::bubbles<2, true>(file))
+//   {
+//     std::string_view flank = bubble.flank_5p();
+//     auto covgs = bubble.covg(0, 0);
+//     unsigned int genotype = bubble.best_genotype(0);
+//   }
+//
+// Errors opening a file or a file that doesn't match the record type are
+// thrown as cortex::Error.  Reading stops at the end of the file or at the
+// first record that can't be parsed (reported on stderr by the C library).
+//
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#  if __has_include(<span>)
+#    include <span>
+#    define CORTEX_HPP_STD_SPAN 1
+#  endif
+#endif
+
+extern "C" {
+#include "cortex.h"
+}
+
+namespace cortex
+{
+
+class Error : public std::runtime_error
+{
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+// Non-owning view of a coverage array.  std::span where the standard
+// library has it, otherwise a minimal stand-in with the same interface
+#ifdef CORTEX_HPP_STD_SPAN
+template<class T> using Span = std::span<T>;
+#else
+template<class T>
+class Span
+{
+ public:
+  constexpr Span() noexcept : data_(nullptr), size_(0) {}
+  constexpr Span(T *data, std::size_t size) noexcept
+    : data_(data), size_(size) {}
+
+  constexpr T* data() const noexcept { return data_; }
+  constexpr std::size_t size() const noexcept { return size_; }
+  constexpr bool empty() const noexcept { return size_ == 0; }
+  constexpr T* begin() const noexcept { return data_; }
+  constexpr T* end() const noexcept { return data_ + size_; }
+  constexpr T& operator[](std::size_t i) const { return data_[i]; }
+  constexpr T& front() const { return data_[0]; }
+  constexpr T& back() const { return data_[size_ - 1]; }
+
+ private:
+  T *data_;
+  std::size_t size_;
+};
+#endif
+
+inline std::string_view _view(const StrBuf *sbuf)
+{
+  return std::string_view(sbuf->buff, strbuf_len(sbuf));
+}
+
+inline Span<const unsigned long> _covgs(const COLOUR_COVG *covgs)
+{
+  return Span<const unsigned long>(covgs->colour_covgs, covgs->length);
+}
+
+class File
+{
+ public:
+  explicit File(const char *path) : file_(cortex_open(path))
+  {
+    if(file_ == nullptr)
+    {
+      throw Error(std::string("cortex.hpp: couldn't open file: ") + path);
+    }
+  }
+
+  explicit File(const std::string &path) : File(path.c_str()) {}
+
+  // Take ownership of a handle from cortex_open() and friends
+  explicit File(CORTEX_FILE *file) : file_(file)
+  {
+    if(file_ == nullptr)
+    {
+      throw Error("cortex.hpp: NULL file handle");
+    }
+  }
+
+  File(const File&) = delete;
+  File& operator=(const File&) = delete;
+
+  File(File &&other) noexcept : file_(std::exchange(other.file_, nullptr)) {}
+
+  File& operator=(File &&other) noexcept
+  {
+    if(this != &other)
+    {
+      close();
+      file_ = std::exchange(other.file_, nullptr);
+    }
+    return *this;
+  }
+
+  ~File() { close(); }
+
+  void close() noexcept
+  {
+    if(file_ != nullptr)
+    {
+      cortex_close(file_);
+      file_ = nullptr;
+    }
+  }
+
+  CORTEX_FILE* get() noexcept { return file_; }
+  const CORTEX_FILE* get() const noexcept { return file_; }
+
+  std::string_view path() const { return file_->path; }
+  enum CORTEX_FILE_TYPE filetype() const noexcept { return file_->filetype; }
+  unsigned int kmer_size() const noexcept { return file_->kmer_size; }
+  bool has_likelihoods() const noexcept { return file_->has_likelihoods; }
+  std::size_t num_colours() const noexcept { return file_->num_of_colours; }
+  unsigned long colour(std::size_t i) const { return file_->colour_arr[i]; }
+
+  // Index into the colour arrays of records, or -1
+  long colour_index(unsigned long colour) const
+  {
+    return cortex_file_get_colour_index(colour, file_);
+  }
+
+  bool seek(long offset) { return cortex_seek(file_, offset); }
+  long record_offset() const noexcept { return file_->record_offset; }
+
+ private:
+  CORTEX_FILE *file_;
+};
+
+// Ploidy is the number of copies of each branch a genotype can have (1 or 2).
+// Likelihood accessors only exist if HasLikelihoods is true, and are unrolled
+// for the ploidy at compile time.  Genotypes are numbered by the number of
+// copies of branch 2: 0 is hom branch 1, Ploidy is hom branch 2
+template<unsigned int Ploidy = 2, bool HasLikelihoods = true>
+class Bubble
+{
+  static_assert(Ploidy == 1 || Ploidy == 2, "cortex files are haploid or diploid");
+
+ public:
+  static constexpr unsigned int ploidy = Ploidy;
+  static constexpr unsigned int num_genotypes = Ploidy + 1;
+
+  explicit Bubble(const File &file) : file_(file.get()), bubble_(nullptr)
+  {
+    if(file.filetype() != BUBBLE_FILE)
+    {
+      throw Error(std::string("cortex.hpp: not a bubble file: ") +
+                  std::string(file.path()));
+    }
+
+    if(HasLikelihoods && !file.has_likelihoods())
+    {
+      throw Error(std::string("cortex.hpp: file has no likelihoods: ") +
+                  std::string(file.path()));
+    }
+
+    bubble_ = cortex_bubble_create(file_);
+  }
+
+  Bubble(const Bubble&) = delete;
+  Bubble& operator=(const Bubble&) = delete;
+
+  Bubble(Bubble &&other) noexcept
+    : file_(other.file_), bubble_(std::exchange(other.bubble_, nullptr)) {}
+
+  Bubble& operator=(Bubble &&other) noexcept
+  {
+    if(this != &other)
+    {
+      _free();
+      file_ = other.file_;
+      bubble_ = std::exchange(other.bubble_, nullptr);
+    }
+    return *this;
+  }
+
+  ~Bubble() { _free(); }
+
+  // Read the next bubble over this one.  Returns false at the end of the file
+  // or on a parse error
+  bool read(File &file)
+  {
+    if(!cortex_read_bubble(bubble_, file.get()))
+    {
+      return false;
+    }
+
+    // Ploidy is only known once a bubble has been read
+    if constexpr(HasLikelihoods)
+    {
+      if(file.get()->is_diploid != (Ploidy == 2))
+      {
+        throw Error(std::string("cortex.hpp: file ploidy doesn't match: ") +
+                    std::string(file.path()));
+      }
+    }
+
+    return true;
+  }
+
+  CORTEX_BUBBLE* get() noexcept { return bubble_; }
+  const CORTEX_BUBBLE* get() const noexcept { return bubble_; }
+
+  unsigned long var_num() const noexcept { return bubble_->var_num; }
+  std::size_t num_colours() const noexcept { return file_->num_of_colours; }
+
+  std::string_view flank_5p() const { return _view(bubble_->flank_5p.seq); }
+  std::string_view flank_3p() const { return _view(bubble_->flank_3p.seq); }
+  std::string_view branch(int b) const
+  {
+    return _view(bubble_->branches[b].seq);
+  }
+
+  const CORTEX_BUBBLE_PATH& flank_5p_path() const { return bubble_->flank_5p; }
+  const CORTEX_BUBBLE_PATH& flank_3p_path() const { return bubble_->flank_3p; }
+  const CORTEX_BUBBLE_PATH& branch_path(int b) const
+  {
+    return bubble_->branches[b];
+  }
+
+  // Per-kmer coverage of branch b (0 or 1) in colour index col
+  Span<const unsigned long> covg(int b, std::size_t col) const
+  {
+    return _covgs(bubble_->branches_colour_covgs[b][col]);
+  }
+
+  HETEROGENEITY call(std::size_t col) const
+  {
+    static_assert(HasLikelihoods, "bubble type has no likelihoods");
+    return bubble_->calls[col];
+  }
+
+  std::array<float, num_genotypes> likelihoods(std::size_t col) const
+  {
+    static_assert(HasLikelihoods, "bubble type has no likelihoods");
+
+    if constexpr(Ploidy == 1)
+    {
+      return {{bubble_->llk_hom_br1[col], bubble_->llk_hom_br2[col]}};
+    }
+    else
+    {
+      return {{bubble_->llk_hom_br1[col], bubble_->llk_het[col],
+               bubble_->llk_hom_br2[col]}};
+    }
+  }
+
+  // Genotype with the highest likelihood in colour index col
+  unsigned int best_genotype(std::size_t col) const
+  {
+    const std::array<float, num_genotypes> llks = likelihoods(col);
+    unsigned int best = 0, g;
+
+    for(g = 1; g < num_genotypes; g++)
+    {
+      if(llks[g] > llks[best])
+      {
+        best = g;
+      }
+    }
+
+    return best;
+  }
+
+  // Difference between the best and second best likelihoods
+  float likelihood_margin(std::size_t col) const
+  {
+    const std::array<float, num_genotypes> llks = likelihoods(col);
+    float best = llks[0], second = llks[1];
+    unsigned int g;
+
+    if(second > best)
+    {
+      std::swap(best, second);
+    }
+
+    for(g = 2; g < num_genotypes; g++)
+    {
+      if(llks[g] > best)
+      {
+        second = best;
+        best = llks[g];
+      }
+      else if(llks[g] > second)
+      {
+        second = llks[g];
+      }
+    }
+
+    return best - second;
+  }
+
+  void print(FILE *out = stdout) const
+  {
+    cortex_fprint_bubble(out, bubble_, file_);
+  }
+
+ private:
+  void _free() noexcept
+  {
+    if(bubble_ != nullptr)
+    {
+      cortex_bubble_free(bubble_, file_);
+      bubble_ = nullptr;
+    }
+  }
+
+  const CORTEX_FILE *file_;
+  CORTEX_BUBBLE *bubble_;
+};
+
+class Alignment
+{
+ public:
+  explicit Alignment(const File &file) : file_(file.get()), alignment_(nullptr)
+  {
+    if(file.filetype() != ALIGNMENT_FILE)
+    {
+      throw Error(std::string("cortex.hpp: not an alignment file: ") +
+                  std::string(file.path()));
+    }
+
+    alignment_ = cortex_alignment_create(file_);
+  }
+
+  Alignment(const Alignment&) = delete;
+  Alignment& operator=(const Alignment&) = delete;
+
+  Alignment(Alignment &&other) noexcept
+    : file_(other.file_), alignment_(std::exchange(other.alignment_, nullptr))
+  {}
+
+  Alignment& operator=(Alignment &&other) noexcept
+  {
+    if(this != &other)
+    {
+      _free();
+      file_ = other.file_;
+      alignment_ = std::exchange(other.alignment_, nullptr);
+    }
+    return *this;
+  }
+
+  ~Alignment() { _free(); }
+
+  // Read the next alignment over this one.  Returns false at the end of the
+  // file or on a parse error
+  bool read(File &file)
+  {
+    return cortex_read_alignment(alignment_, file.get());
+  }
+
+  CORTEX_ALIGNMENT* get() noexcept { return alignment_; }
+  const CORTEX_ALIGNMENT* get() const noexcept { return alignment_; }
+
+  std::size_t num_colours() const noexcept { return file_->num_of_colours; }
+  std::string_view name() const { return _view(alignment_->name); }
+  std::string_view seq() const { return _view(alignment_->seq); }
+
+  // Per-kmer coverage in colour index col
+  Span<const unsigned long> covg(std::size_t col) const
+  {
+    return _covgs(alignment_->colour_covgs[col]);
+  }
+
+  void print() const { cortex_print_alignment(alignment_, file_); }
+
+ private:
+  void _free() noexcept
+  {
+    if(alignment_ != nullptr)
+    {
+      cortex_alignment_free(alignment_, file_);
+      alignment_ = nullptr;
+    }
+  }
+
+  const CORTEX_FILE *file_;
+  CORTEX_ALIGNMENT *alignment_;
+};
+
+// Range over the records of a file for range-based for.  There is only one
+// record: each step of the iterator reads over it, so copy out anything you
+// want to keep
+struct RecordsEnd {};
+
+template<class Record>
+class Records
+{
+ public:
+  explicit Records(File &file) : file_(file), record_(file), ok_(false) {}
+
+  class iterator
+  {
+   public:
+    explicit iterator(Records *records) : records_(records) {}
+
+    const Record& operator*() const { return records_->record_; }
+    const Record* operator->() const { return &records_->record_; }
+
+    iterator& operator++()
+    {
+      records_->_next();
+      return *this;
+    }
+
+    bool operator==(RecordsEnd) const { return !records_->ok_; }
+    bool operator!=(RecordsEnd) const { return records_->ok_; }
+
+   private:
+    Records *records_;
+  };
+
+  iterator begin()
+  {
+    _next();
+    return iterator(this);
+  }
+
+  RecordsEnd end() const { return RecordsEnd(); }
+
+ private:
+  void _next() { ok_ = record_.read(file_); }
+
+  File &file_;
+  Record record_;
+  bool ok_;
+};
+
+template<unsigned int Ploidy = 2, bool HasLikelihoods = true>
+Records<Bubble<Ploidy, HasLikelihoods>> bubbles(File &file)
+{
+  return Records<Bubble<Ploidy, HasLikelihoods>>(file);
+}
+
+inline Records<Alignment> alignments(File &file)
+{
+  return Records<Alignment>(file);
+}
+
+} // namespace cortex
+
+#endif
@@ -0,0 +1,585 @@
+/*
+ cortex_arrow.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cortex_arrow.h"
+
+// Names of calls, indexed by HETEROGENEITY
+const char *arrow_call_names[] = {"UNKNOWN", "HOM1", "HOM2", "HET"};
+#define ARROW_NUM_CALL_NAMES 4
+
+void* _arrow_malloc(size_t size)
+{
+  // malloc(0) may return NULL - always ask for something
+  void *ptr = malloc(size > 0 ? size : 1);
+
+  if(ptr == NULL)
+  {
+    fprintf(stderr, "cortex_arrow.c: Couldn't allocate enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return ptr;
+}
+
+//
+// Schema and array nodes
+//
+// Everything hanging off a node (children, dictionary, buffers) is owned by
+// that node and freed by its release callback
+//
+
+void _arrow_schema_release(struct ArrowSchema *schema)
+{
+  int64_t i;
+
+  for(i = 0; i < schema->n_children; i++)
+  {
+    struct ArrowSchema *child = schema->children[i];
+
+    // Consumers may have moved a child out, leaving release NULL
+    if(child->release != NULL)
+    {
+      child->release(child);
+    }
+
+    free(child);
+  }
+
+  if(schema->dictionary != NULL)
+  {
+    if(schema->dictionary->release != NULL)
+    {
+      schema->dictionary->release(schema->dictionary);
+    }
+
+    free(schema->dictionary);
+  }
+
+  free(schema->children);
+  free((void*)schema->format);
+  free((void*)schema->name);
+
+  schema->release = NULL;
+}
+
+void _arrow_schema_init(struct ArrowSchema *schema, const char *format,
+                        const char *name, int64_t n_children)
+{
+  schema->format = strdup(format);
+  schema->name = strdup(name);
+  schema->metadata = NULL;
+  schema->flags = 0;
+  schema->n_children = n_children;
+  schema->children = NULL;
+  schema->dictionary = NULL;
+  schema->release = _arrow_schema_release;
+  schema->private_data = NULL;
+
+  if(n_children > 0)
+  {
+    schema->children = (struct ArrowSchema**)
+                       _arrow_malloc(n_children * sizeof(struct ArrowSchema*));
+
+    int64_t i;
+    for(i = 0; i < n_children; i++)
+    {
+      schema->children[i] = (struct ArrowSchema*)
+                            _arrow_malloc(sizeof(struct ArrowSchema));
+    }
+  }
+}
+
+void _arrow_array_release(struct ArrowArray *array)
+{
+  int64_t i;
+
+  for(i = 0; i < array->n_children; i++)
+  {
+    struct ArrowArray *child = array->children[i];
+
+    if(child->release != NULL)
+    {
+      child->release(child);
+    }
+
+    free(child);
+  }
+
+  if(array->dictionary != NULL)
+  {
+    if(array->dictionary->release != NULL)
+    {
+      array->dictionary->release(array->dictionary);
+    }
+
+    free(array->dictionary);
+  }
+
+  for(i = 0; i < array->n_buffers; i++)
+  {
+    free((void*)array->buffers[i]);
+  }
+
+  free(array->children);
+  free(array->buffers);
+
+  array->release = NULL;
+}
+
+// Buffers start as NULL (a NULL validity buffer means no nulls)
+void _arrow_array_init(struct ArrowArray *array, int64_t length,
+                       int64_t n_buffers, int64_t n_children)
+{
+  array->length = length;
+  array->null_count = 0;
+  array->offset = 0;
+  array->n_buffers = n_buffers;
+  array->n_children = n_children;
+  array->buffers = (const void**) calloc(n_buffers, sizeof(void*));
+  array->children = NULL;
+  array->dictionary = NULL;
+  array->release = _arrow_array_release;
+  array->private_data = NULL;
+
+  if(n_children > 0)
+  {
+    array->children = (struct ArrowArray**)
+                      _arrow_malloc(n_children * sizeof(struct ArrowArray*));
+
+    int64_t i;
+    for(i = 0; i < n_children; i++)
+    {
+      array->children[i] = (struct ArrowArray*)
+                           _arrow_malloc(sizeof(struct ArrowArray));
+    }
+  }
+}
+
+// fixed_size_list node with a single child of length * list_size items
+void _arrow_fixed_list_init(struct ArrowSchema *schema,
+                            struct ArrowArray *array, const char *name,
+                            size_t list_size, size_t length)
+{
+  char format[30];
+  sprintf(format, "+w:%lu", (unsigned long)list_size);
+
+  _arrow_schema_init(schema, format, name, 1);
+  _arrow_array_init(array, length, 1, 1);
+}
+
+//
+// Columns
+//
+
+void _arrow_export_utf8(struct ArrowSchema *schema, struct ArrowArray *array,
+                        const char *name, const char *const *strs,
+                        const size_t *lens, size_t num)
+{
+  size_t i, total = 0;
+
+  for(i = 0; i < num; i++)
+  {
+    total += lens[i];
+  }
+
+  int32_t *offsets = (int32_t*) _arrow_malloc((num+1) * sizeof(int32_t));
+  char *data = (char*) _arrow_malloc(total);
+
+  offsets[0] = 0;
+
+  for(i = 0; i < num; i++)
+  {
+    memcpy(data + offsets[i], strs[i], lens[i]);
+    offsets[i+1] = offsets[i] + (int32_t)lens[i];
+  }
+
+  _arrow_schema_init(schema, "u", name, 0);
+  _arrow_array_init(array, num, 3, 0);
+  array->buffers[1] = offsets;
+  array->buffers[2] = data;
+}
+
+// Column of sequences from StrBufs
+void _arrow_export_seqs(struct ArrowSchema *schema, struct ArrowArray *array,
+                        const char *name, StrBuf *const *seqs, size_t num)
+{
+  const char **strs = (const char**) _arrow_malloc(num * sizeof(char*));
+  size_t *lens = (size_t*) _arrow_malloc(num * sizeof(size_t));
+  size_t i;
+
+  for(i = 0; i < num; i++)
+  {
+    strs[i] = seqs[i]->buff;
+    lens[i] = strbuf_len(seqs[i]);
+  }
+
+  _arrow_export_utf8(schema, array, name, strs, lens, num);
+
+  free(strs);
+  free(lens);
+}
+
+// covgs[record][colour] -> fixed_size_list<list<uint64>>[num_of_colours]
+void _arrow_export_covgs(struct ArrowSchema *schema, struct ArrowArray *array,
+                         const char *name, COLOUR_COVG **const *covgs,
+                         size_t num, unsigned long num_of_colours)
+{
+  size_t num_lists = num * num_of_colours;
+  size_t i, total = 0;
+  unsigned long col;
+
+  for(i = 0; i < num; i++)
+  {
+    for(col = 0; col < num_of_colours; col++)
+    {
+      total += covgs[i][col]->length;
+    }
+  }
+
+  int32_t *offsets = (int32_t*) _arrow_malloc((num_lists+1) * sizeof(int32_t));
+  uint64_t *values = (uint64_t*) _arrow_malloc(total * sizeof(uint64_t));
+  size_t list = 0;
+
+  offsets[0] = 0;
+
+  for(i = 0; i < num; i++)
+  {
+    for(col = 0; col < num_of_colours; col++, list++)
+    {
+      const COLOUR_COVG *colour_covgs = covgs[i][col];
+      uint64_t *dst = values + offsets[list];
+      unsigned long j;
+
+      for(j = 0; j < colour_covgs->length; j++)
+      {
+        dst[j] = colour_covgs->colour_covgs[j];
+      }
+
+      offsets[list+1] = offsets[list] + (int32_t)colour_covgs->length;
+    }
+  }
+
+  _arrow_fixed_list_init(schema, array, name, num_of_colours, num);
+
+  struct ArrowSchema *list_schema = schema->children[0];
+  struct ArrowArray *list_array = array->children[0];
+
+  _arrow_schema_init(list_schema, "+l", "item", 1);
+  _arrow_array_init(list_array, num_lists, 2, 1);
+  list_array->buffers[1] = offsets;
+
+  _arrow_schema_init(list_schema->children[0], "L", "item", 0);
+  _arrow_array_init(list_array->children[0], total, 2, 0);
+  list_array->children[0]->buffers[1] = values;
+}
+
+// llks[record * num_of_colours + colour]
+void _arrow_export_llks(struct ArrowSchema *schema, struct ArrowArray *array,
+                        const char *name, CORTEX_BUBBLE *const *bubbles,
+                        size_t num, unsigned long num_of_colours, int which)
+{
+  float *values = (float*) _arrow_malloc(num * num_of_colours * sizeof(float));
+  size_t i;
+
+  for(i = 0; i < num; i++)
+  {
+    const float *src = which == 0 ? bubbles[i]->llk_hom_br1
+                     : which == 1 ? bubbles[i]->llk_het
+                                  : bubbles[i]->llk_hom_br2;
+
+    memcpy(values + i * num_of_colours, src, num_of_colours * sizeof(float));
+  }
+
+  _arrow_fixed_list_init(schema, array, name, num_of_colours, num);
+  _arrow_schema_init(schema->children[0], "f", "item", 0);
+  _arrow_array_init(array->children[0], num * num_of_colours, 2, 0);
+  array->children[0]->buffers[1] = values;
+}
+
+// Calls are int8 indices into a dictionary of call names
+void _arrow_export_calls(struct ArrowSchema *schema, struct ArrowArray *array,
+                         CORTEX_BUBBLE *const *bubbles, size_t num,
+                         unsigned long num_of_colours)
+{
+  int8_t *indices = (int8_t*) _arrow_malloc(num * num_of_colours);
+  size_t i;
+  unsigned long col;
+
+  for(i = 0; i < num; i++)
+  {
+    for(col = 0; col < num_of_colours; col++)
+    {
+      HETEROGENEITY call = bubbles[i]->calls[col];
+      indices[i * num_of_colours + col]
+        = (unsigned int)call < ARROW_NUM_CALL_NAMES ? (int8_t)call : 0;
+    }
+  }
+
+  _arrow_fixed_list_init(schema, array, "calls", num_of_colours, num);
+
+  struct ArrowSchema *index_schema = schema->children[0];
+  struct ArrowArray *index_array = array->children[0];
+
+  _arrow_schema_init(index_schema, "c", "item", 0);
+  _arrow_array_init(index_array, num * num_of_colours, 2, 0);
+  index_array->buffers[1] = indices;
+
+  // Dictionary
+  size_t lens[ARROW_NUM_CALL_NAMES];
+  for(i = 0; i < ARROW_NUM_CALL_NAMES; i++)
+  {
+    lens[i] = strlen(arrow_call_names[i]);
+  }
+
+  index_schema->dictionary = (struct ArrowSchema*)
+                             _arrow_malloc(sizeof(struct ArrowSchema));
+  index_array->dictionary = (struct ArrowArray*)
+                            _arrow_malloc(sizeof(struct ArrowArray));
+
+  _arrow_export_utf8(index_schema->dictionary, index_array->dictionary, "",
+                     arrow_call_names, lens, ARROW_NUM_CALL_NAMES);
+}
+
+//
+// Size checks - arrow offsets are 32 bit
+//
+
+char _arrow_check_size(size_t total, const char *what)
+{
+  if(total > INT32_MAX)
+  {
+    fprintf(stderr, "cortex_arrow.c: batch too large for 32 bit offsets "
+                    "[%s: %lu] - export fewer records at a time\n",
+            what, (unsigned long)total);
+    return 0;
+  }
+
+  return 1;
+}
+
+char _arrow_check_covgs(COLOUR_COVG **const *covgs, size_t num,
+                        unsigned long num_of_colours)
+{
+  size_t i, total = 0;
+  unsigned long col;
+
+  for(i = 0; i < num; i++)
+  {
+    for(col = 0; col < num_of_colours; col++)
+    {
+      total += covgs[i][col]->length;
+    }
+  }
+
+  return _arrow_check_size(total, "coverage values");
+}
+
+char _arrow_check_seqs(StrBuf *const *seqs, size_t num)
+{
+  size_t i, total = 0;
+
+  for(i = 0; i < num; i++)
+  {
+    total += strbuf_len(seqs[i]);
+  }
+
+  return _arrow_check_size(total, "sequence");
+}
+
+//
+// Public
+//
+
+char cortex_arrow_export_bubbles(CORTEX_BUBBLE *const *bubbles,
+                                 size_t num_bubbles, const CORTEX_FILE *c_file,
+                                 struct ArrowSchema *schema,
+                                 struct ArrowArray *array)
+{
+  unsigned long num_of_colours = c_file->num_of_colours;
+  size_t i;
+  int p, branch;
+
+  // Gather columns of pointers first so sizes can be checked before
+  // anything is built
+  StrBuf **seqs[4];
+  COLOUR_COVG ***covgs[2];
+  char ok = _arrow_check_size(num_bubbles * num_of_colours, "lists");
+
+  for(p = 0; p < 4; p++)
+  {
+    seqs[p] = (StrBuf**) _arrow_malloc(num_bubbles * sizeof(StrBuf*));
+  }
+
+  for(branch = 0; branch < 2; branch++)
+  {
+    covgs[branch] = (COLOUR_COVG***)
+                    _arrow_malloc(num_bubbles * sizeof(COLOUR_COVG**));
+  }
+
+  for(i = 0; i < num_bubbles; i++)
+  {
+    seqs[0][i] = bubbles[i]->flank_5p.seq;
+    seqs[1][i] = bubbles[i]->branches[0].seq;
+    seqs[2][i] = bubbles[i]->branches[1].seq;
+    seqs[3][i] = bubbles[i]->flank_3p.seq;
+    covgs[0][i] = bubbles[i]->branches_colour_covgs[0];
+    covgs[1][i] = bubbles[i]->branches_colour_covgs[1];
+  }
+
+  for(p = 0; p < 4 && ok; p++)
+  {
+    ok = _arrow_check_seqs(seqs[p], num_bubbles);
+  }
+
+  for(branch = 0; branch < 2 && ok; branch++)
+  {
+    ok = _arrow_check_covgs(covgs[branch], num_bubbles, num_of_colours);
+  }
+
+  if(ok)
+  {
+    int num_llks = c_file->has_likelihoods ? (c_file->is_diploid ? 3 : 2) : 0;
+    int num_fields = 1 + 4 + (c_file->has_likelihoods ? 1 + num_llks : 0) + 2;
+    int field = 0;
+
+    _arrow_schema_init(schema, "+s", "", num_fields);
+    _arrow_array_init(array, num_bubbles, 1, num_fields);
+
+    // var_num
+    uint64_t *var_nums = (uint64_t*) _arrow_malloc(num_bubbles * sizeof(uint64_t));
+
+    for(i = 0; i < num_bubbles; i++)
+    {
+      var_nums[i] = bubbles[i]->var_num;
+    }
+
+    _arrow_schema_init(schema->children[field], "L", "var_num", 0);
+    _arrow_array_init(array->children[field], num_bubbles, 2, 0);
+    array->children[field]->buffers[1] = var_nums;
+    field++;
+
+    // Sequences
+    const char *seq_names[4] = {"flank_5p", "branch1", "branch2", "flank_3p"};
+
+    for(p = 0; p < 4; p++, field++)
+    {
+      _arrow_export_seqs(schema->children[field], array->children[field],
+                         seq_names[p], seqs[p], num_bubbles);
+    }
+
+    // Calls and likelihoods
+    if(c_file->has_likelihoods)
+    {
+      _arrow_export_calls(schema->children[field], array->children[field],
+                          bubbles, num_bubbles, num_of_colours);
+      field++;
+
+      _arrow_export_llks(schema->children[field], array->children[field],
+                         "llk_hom_br1", bubbles, num_bubbles, num_of_colours, 0);
+      field++;
+
+      if(c_file->is_diploid)
+      {
+        _arrow_export_llks(schema->children[field], array->children[field],
+                           "llk_het", bubbles, num_bubbles, num_of_colours, 1);
+        field++;
+      }
+
+      _arrow_export_llks(schema->children[field], array->children[field],
+                         "llk_hom_br2", bubbles, num_bubbles, num_of_colours, 2);
+      field++;
+    }
+
+    // Coverage
+    const char *covg_names[2] = {"branch1_covgs", "branch2_covgs"};
+
+    for(branch = 0; branch < 2; branch++, field++)
+    {
+      _arrow_export_covgs(schema->children[field], array->children[field],
+                          covg_names[branch], covgs[branch], num_bubbles,
+                          num_of_colours);
+    }
+  }
+
+  for(p = 0; p < 4; p++)
+  {
+    free(seqs[p]);
+  }
+
+  free(covgs[0]);
+  free(covgs[1]);
+
+  return ok;
+}
+
+char cortex_arrow_export_alignments(CORTEX_ALIGNMENT *const *alignments,
+                                    size_t num_alignments,
+                                    const CORTEX_FILE *c_file,
+                                    struct ArrowSchema *schema,
+                                    struct ArrowArray *array)
+{
+  unsigned long num_of_colours = c_file->num_of_colours;
+  size_t i;
+
+  StrBuf **names = (StrBuf**) _arrow_malloc(num_alignments * sizeof(StrBuf*));
+  StrBuf **seqs = (StrBuf**) _arrow_malloc(num_alignments * sizeof(StrBuf*));
+  COLOUR_COVG ***covgs = (COLOUR_COVG***)
+                         _arrow_malloc(num_alignments * sizeof(COLOUR_COVG**));
+
+  for(i = 0; i < num_alignments; i++)
+  {
+    names[i] = alignments[i]->name;
+    seqs[i] = alignments[i]->seq;
+    covgs[i] = alignments[i]->colour_covgs;
+  }
+
+  char ok = _arrow_check_size(num_alignments * num_of_colours, "lists") &&
+            _arrow_check_seqs(names, num_alignments) &&
+            _arrow_check_seqs(seqs, num_alignments) &&
+            _arrow_check_covgs(covgs, num_alignments, num_of_colours);
+
+  if(ok)
+  {
+    _arrow_schema_init(schema, "+s", "", 3);
+    _arrow_array_init(array, num_alignments, 1, 3);
+
+    _arrow_export_seqs(schema->children[0], array->children[0], "name",
+                       names, num_alignments);
+    _arrow_export_seqs(schema->children[1], array->children[1], "seq",
+                       seqs, num_alignments);
+    _arrow_export_covgs(schema->children[2], array->children[2], "covgs",
+                        covgs, num_alignments, num_of_colours);
+  }
+
+  free(names);
+  free(seqs);
+  free(covgs);
+
+  return ok;
+}
@@ -0,0 +1,117 @@
+/*
+ cortex_arrow.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_ARROW_H_SEEN
+#define CORTEX_ARROW_H_SEEN
+
+#include <stdint.h>
+
+#include "cortex.h"
+
+//
+// Export of records through the Apache Arrow C data interface
+// (https://arrow.apache.org/docs/format/CDataInterface.html)
+//
+// A batch of records is copied once into columnar buffers owned by the
+// exported ArrowArray; consumers then use them without further copies and
+// call array->release() / schema->release() when done.
+//
+// Bubble batches are a struct array with fields:
+//   var_num                  uint64
+//   flank_5p, branch1,
+//   branch2, flank_3p        utf8
+//   calls                    fixed_size_list<dictionary<int8, utf8>>[colours]
+//                            (only if the file has likelihoods)
+//   llk_hom_br1, [llk_het,]
+//   llk_hom_br2              fixed_size_list<float>[colours]
+//                            (only if the file has likelihoods)
+//   branch1_covgs,
+//   branch2_covgs            fixed_size_list<list<uint64>>[colours]
+//
+// Alignment batches are a struct array with fields:
+//   name, seq                utf8
+//   covgs                    fixed_size_list<list<uint64>>[colours]
+//
+// Coverage values of all records and colours in a column share one buffer.
+//
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema
+{
+  // Array type description
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowSchema*);
+  // Opaque producer-specific data
+  void* private_data;
+};
+
+struct ArrowArray
+{
+  // Array data description
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowArray*);
+  // Opaque producer-specific data
+  void* private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+// Export bubbles[0..num_bubbles) (read from c_file) into schema and array.
+// Returns 1 on success, 0 on failure (in which case nothing needs releasing)
+char cortex_arrow_export_bubbles(CORTEX_BUBBLE *const *bubbles,
+                                 size_t num_bubbles, const CORTEX_FILE *c_file,
+                                 struct ArrowSchema *schema,
+                                 struct ArrowArray *array);
+
+// Export alignments[0..num_alignments) (read from c_file)
+char cortex_arrow_export_alignments(CORTEX_ALIGNMENT *const *alignments,
+                                    size_t num_alignments,
+                                    const CORTEX_FILE *c_file,
+                                    struct ArrowSchema *schema,
+                                    struct ArrowArray *array);
+
+#endif
@@ -0,0 +1,559 @@
+/*
+ cortex_bloom.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cortex_bloom.h"
+
+#define BLOOM_MAGIC "CTXBLOOM"
+#define BLOOM_VERSION 1
+
+// A block is one 64 byte cache line
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BLOCK_BITS 512
+
+// Each hash takes 9 bits of a 64 bit hash value
+#define BLOOM_MAX_HASHES 7
+
+#define BLOOM_SEED1 0x5bd1e995UL
+#define BLOOM_SEED2 0x27d4eb2f165667c5UL
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version, kmer_size, num_hashes, bits_per_kmer;
+  uint64_t bubbles_per_segment, num_segments;
+} BLOOM_HEADER;
+
+typedef struct
+{
+  int64_t offset;
+  uint64_t num_bubbles, num_blocks;
+} BLOOM_SEGMENT_HEADER;
+
+typedef struct
+{
+  BLOOM_SEGMENT_HEADER info;
+  uint64_t *blocks;
+} BLOOM_SEGMENT;
+
+struct CORTEX_BLOOM
+{
+  unsigned int kmer_size, bits_per_kmer, num_hashes;
+  unsigned long bubbles_per_segment;
+
+  BLOOM_SEGMENT *segments;
+  unsigned long num_segments, segments_capacity;
+
+  // Hash pairs of the segment currently being read
+  uint64_t *pending;
+  size_t num_pending, pending_capacity;
+  unsigned long pending_bubbles;
+  long pending_offset;
+};
+
+void _bloom_hashes(const CORTEX_KMER *kmer, unsigned int kmer_size,
+                   uint64_t *h1, uint64_t *h2)
+{
+  CORTEX_KMER canonical;
+  cortex_kmer_canonical(kmer, kmer_size, &canonical);
+  *h1 = cortex_kmer_hash(&canonical, BLOOM_SEED1);
+  *h2 = cortex_kmer_hash(&canonical, BLOOM_SEED2);
+}
+
+// h1 picks the block, h2 the bits within it
+uint64_t* _bloom_block(const BLOOM_SEGMENT *segment, uint64_t h1)
+{
+  uint64_t block = ((h1 >> 32) * segment->info.num_blocks) >> 32;
+  return segment->blocks + block * BLOOM_BLOCK_WORDS;
+}
+
+void _bloom_set(BLOOM_SEGMENT *segment, unsigned int num_hashes,
+                uint64_t h1, uint64_t h2)
+{
+  uint64_t *block = _bloom_block(segment, h1);
+  unsigned int i;
+
+  for(i = 0; i < num_hashes; i++, h2 >>= 9)
+  {
+    unsigned int bit = h2 & (BLOOM_BLOCK_BITS - 1);
+    block[bit >> 6] |= 1UL << (bit & 63);
+  }
+}
+
+char _bloom_test(const BLOOM_SEGMENT *segment, unsigned int num_hashes,
+                 uint64_t h1, uint64_t h2)
+{
+  const uint64_t *block = _bloom_block(segment, h1);
+  unsigned int i;
+
+  for(i = 0; i < num_hashes; i++, h2 >>= 9)
+  {
+    unsigned int bit = h2 & (BLOOM_BLOCK_BITS - 1);
+
+    if(!(block[bit >> 6] & (1UL << (bit & 63))))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Returns NULL if out of memory
+BLOOM_SEGMENT* _bloom_new_segment(CORTEX_BLOOM *bloom)
+{
+  if(bloom->num_segments == bloom->segments_capacity)
+  {
+    BLOOM_SEGMENT *segments
+      = realloc(bloom->segments,
+                2 * bloom->segments_capacity * sizeof(BLOOM_SEGMENT));
+
+    if(segments == NULL)
+    {
+      fprintf(stderr, "cortex_bloom.c: out of memory [%lu segments]\n",
+              bloom->num_segments);
+      return NULL;
+    }
+
+    bloom->segments = segments;
+    bloom->segments_capacity *= 2;
+  }
+
+  return &bloom->segments[bloom->num_segments++];
+}
+
+CORTEX_BLOOM* cortex_bloom_create(unsigned int kmer_size,
+                                  unsigned long bubbles_per_segment,
+                                  unsigned int bits_per_kmer)
+{
+  if(kmer_size == 0 || kmer_size > CORTEX_MAX_KMER_SIZE)
+  {
+    fprintf(stderr, "cortex_bloom.c: unsupported kmer size [%u]\n", kmer_size);
+    return NULL;
+  }
+
+  if(bits_per_kmer == 0)
+  {
+    bits_per_kmer = 1;
+  }
+
+  CORTEX_BLOOM *bloom = (CORTEX_BLOOM*) malloc(sizeof(CORTEX_BLOOM));
+
+  if(bloom == NULL)
+  {
+    fprintf(stderr, "cortex_bloom.c: out of memory\n");
+    return NULL;
+  }
+
+  bloom->kmer_size = kmer_size;
+  bloom->bits_per_kmer = bits_per_kmer;
+  bloom->bubbles_per_segment = bubbles_per_segment;
+
+  // Optimal number of hashes is bits_per_kmer * ln(2)
+  bloom->num_hashes = (unsigned int)(bits_per_kmer * 0.693 + 0.5);
+
+  if(bloom->num_hashes < 1)
+  {
+    bloom->num_hashes = 1;
+  }
+  else if(bloom->num_hashes > BLOOM_MAX_HASHES)
+  {
+    bloom->num_hashes = BLOOM_MAX_HASHES;
+  }
+
+  bloom->num_segments = 0;
+  bloom->segments_capacity = 16;
+  bloom->segments
+    = (BLOOM_SEGMENT*) malloc(bloom->segments_capacity * sizeof(BLOOM_SEGMENT));
+
+  bloom->num_pending = 0;
+  bloom->pending_capacity = 1<<12;
+  bloom->pending = (uint64_t*) malloc(bloom->pending_capacity * sizeof(uint64_t));
+  bloom->pending_bubbles = 0;
+  bloom->pending_offset = 0;
+
+  if(bloom->segments == NULL || bloom->pending == NULL)
+  {
+    fprintf(stderr, "cortex_bloom.c: out of memory\n");
+    cortex_bloom_free(bloom);
+    return NULL;
+  }
+
+  return bloom;
+}
+
+void cortex_bloom_free(CORTEX_BLOOM *bloom)
+{
+  unsigned long i;
+
+  for(i = 0; i < bloom->num_segments; i++)
+  {
+    free(bloom->segments[i].blocks);
+  }
+
+  free(bloom->segments);
+  free(bloom->pending);
+  free(bloom);
+}
+
+char cortex_bloom_finish(CORTEX_BLOOM *bloom)
+{
+  if(bloom->pending_bubbles == 0)
+  {
+    return 1;
+  }
+
+  size_t num_kmers = bloom->num_pending / 2;
+  uint64_t num_blocks = ((uint64_t)num_kmers * bloom->bits_per_kmer +
+                         BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+
+  if(num_blocks == 0)
+  {
+    num_blocks = 1;
+  }
+
+  uint64_t *blocks = (uint64_t*) calloc(num_blocks * BLOOM_BLOCK_WORDS,
+                                        sizeof(uint64_t));
+
+  if(blocks == NULL)
+  {
+    fprintf(stderr, "cortex_bloom.c: out of memory [%lu blocks]\n",
+            (unsigned long)num_blocks);
+    return 0;
+  }
+
+  BLOOM_SEGMENT *segment = _bloom_new_segment(bloom);
+
+  if(segment == NULL)
+  {
+    free(blocks);
+    return 0;
+  }
+
+  segment->info.offset = bloom->pending_offset;
+  segment->info.num_bubbles = bloom->pending_bubbles;
+  segment->info.num_blocks = num_blocks;
+  segment->blocks = blocks;
+
+  size_t i;
+  for(i = 0; i < bloom->num_pending; i += 2)
+  {
+    _bloom_set(segment, bloom->num_hashes,
+               bloom->pending[i], bloom->pending[i+1]);
+  }
+
+  bloom->num_pending = 0;
+  bloom->pending_bubbles = 0;
+  return 1;
+}
+
+char cortex_bloom_add_bubble(CORTEX_BLOOM *bloom, const CORTEX_BUBBLE *bubble,
+                             long offset)
+{
+  if(bloom->pending_bubbles == 0)
+  {
+    bloom->pending_offset = offset;
+  }
+
+  const StrBuf *paths[4] = {bubble->flank_5p.seq, bubble->branches[0].seq,
+                            bubble->branches[1].seq, bubble->flank_3p.seq};
+  int p;
+
+  for(p = 0; p < 4; p++)
+  {
+    CORTEX_KMER_ITER iter;
+    CORTEX_KMER kmer;
+    size_t start;
+
+    cortex_kmer_iter_init(&iter, paths[p]->buff, strbuf_len(paths[p]),
+                          bloom->kmer_size);
+
+    while(cortex_kmer_iter_next(&iter, &kmer, &start))
+    {
+      if(bloom->num_pending + 2 > bloom->pending_capacity)
+      {
+        uint64_t *pending
+          = realloc(bloom->pending,
+                    2 * bloom->pending_capacity * sizeof(uint64_t));
+
+        if(pending == NULL)
+        {
+          fprintf(stderr, "cortex_bloom.c: out of memory [%lu kmers]\n",
+                  (unsigned long)(bloom->num_pending / 2));
+          return 0;
+        }
+
+        bloom->pending = pending;
+        bloom->pending_capacity *= 2;
+      }
+
+      // Iterator kmers are already canonical
+      bloom->pending[bloom->num_pending++] = cortex_kmer_hash(&kmer, BLOOM_SEED1);
+      bloom->pending[bloom->num_pending++] = cortex_kmer_hash(&kmer, BLOOM_SEED2);
+    }
+  }
+
+  bloom->pending_bubbles++;
+
+  if(bloom->bubbles_per_segment > 0 &&
+     bloom->pending_bubbles == bloom->bubbles_per_segment)
+  {
+    return cortex_bloom_finish(bloom);
+  }
+
+  return 1;
+}
+
+CORTEX_BLOOM* cortex_bloom_build(CORTEX_FILE *c_file,
+                                 unsigned long bubbles_per_segment,
+                                 unsigned int bits_per_kmer)
+{
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_bloom.c: need a bubble file (%s)\n", c_file->path);
+    return NULL;
+  }
+
+  CORTEX_BLOOM *bloom = cortex_bloom_create(c_file->kmer_size,
+                                            bubbles_per_segment, bits_per_kmer);
+  if(bloom == NULL)
+  {
+    return NULL;
+  }
+
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  char success = 1;
+
+  while(success && cortex_read_bubble(bubble, c_file))
+  {
+    success = cortex_bloom_add_bubble(bloom, bubble, c_file->record_offset);
+  }
+
+  cortex_bubble_free(bubble, c_file);
+
+  if(!success || !cortex_bloom_finish(bloom))
+  {
+    cortex_bloom_free(bloom);
+    return NULL;
+  }
+
+  return bloom;
+}
+
+//
+// Save / load
+//
+
+char cortex_bloom_save(CORTEX_BLOOM *bloom, const char *path)
+{
+  if(!cortex_bloom_finish(bloom))
+  {
+    return 0;
+  }
+
+  FILE *out = fopen(path, "wb");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_bloom.c: couldn't open file (%s)\n", path);
+    return 0;
+  }
+
+  BLOOM_HEADER header;
+  memset(&header, 0, sizeof(BLOOM_HEADER));
+  memcpy(header.magic, BLOOM_MAGIC, 8);
+  header.version = BLOOM_VERSION;
+  header.kmer_size = bloom->kmer_size;
+  header.num_hashes = bloom->num_hashes;
+  header.bits_per_kmer = bloom->bits_per_kmer;
+  header.bubbles_per_segment = bloom->bubbles_per_segment;
+  header.num_segments = bloom->num_segments;
+
+  char success = (fwrite(&header, sizeof(BLOOM_HEADER), 1, out) == 1);
+  unsigned long i;
+
+  for(i = 0; i < bloom->num_segments && success; i++)
+  {
+    const BLOOM_SEGMENT *segment = &bloom->segments[i];
+    size_t num_words = segment->info.num_blocks * BLOOM_BLOCK_WORDS;
+
+    success = (fwrite(&segment->info, sizeof(BLOOM_SEGMENT_HEADER), 1, out) == 1 &&
+               fwrite(segment->blocks, sizeof(uint64_t), num_words, out)
+                 == num_words);
+  }
+
+  if(fclose(out) != 0)
+  {
+    success = 0;
+  }
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_bloom.c: couldn't write file (%s)\n", path);
+  }
+
+  return success;
+}
+
+CORTEX_BLOOM* cortex_bloom_load(const char *path)
+{
+  FILE *in = fopen(path, "rb");
+
+  if(in == NULL)
+  {
+    fprintf(stderr, "cortex_bloom.c: couldn't open file (%s)\n", path);
+    return NULL;
+  }
+
+  BLOOM_HEADER header;
+
+  if(fread(&header, sizeof(BLOOM_HEADER), 1, in) != 1 ||
+     memcmp(header.magic, BLOOM_MAGIC, 8) != 0 ||
+     header.version != BLOOM_VERSION)
+  {
+    fprintf(stderr, "cortex_bloom.c: not a bloom filter file (%s)\n", path);
+    fclose(in);
+    return NULL;
+  }
+
+  CORTEX_BLOOM *bloom = cortex_bloom_create(header.kmer_size,
+                                            header.bubbles_per_segment,
+                                            header.bits_per_kmer);
+  if(bloom == NULL)
+  {
+    fclose(in);
+    return NULL;
+  }
+
+  bloom->num_hashes = header.num_hashes;
+
+  uint64_t i;
+  char success = 1;
+
+  for(i = 0; i < header.num_segments && success; i++)
+  {
+    BLOOM_SEGMENT_HEADER info;
+
+    if(fread(&info, sizeof(BLOOM_SEGMENT_HEADER), 1, in) != 1 ||
+       info.num_blocks == 0)
+    {
+      success = 0;
+      break;
+    }
+
+    size_t num_words = info.num_blocks * BLOOM_BLOCK_WORDS;
+    uint64_t *blocks = (uint64_t*) malloc(num_words * sizeof(uint64_t));
+
+    if(blocks == NULL || fread(blocks, sizeof(uint64_t), num_words, in) != num_words)
+    {
+      free(blocks);
+      success = 0;
+      break;
+    }
+
+    BLOOM_SEGMENT *segment = _bloom_new_segment(bloom);
+
+    if(segment == NULL)
+    {
+      free(blocks);
+      success = 0;
+      break;
+    }
+
+    segment->info = info;
+    segment->blocks = blocks;
+  }
+
+  fclose(in);
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_bloom.c: bloom filter file truncated (%s)\n", path);
+    cortex_bloom_free(bloom);
+    return NULL;
+  }
+
+  return bloom;
+}
+
+//
+// Queries
+//
+
+unsigned int cortex_bloom_kmer_size(const CORTEX_BLOOM *bloom)
+{
+  return bloom->kmer_size;
+}
+
+unsigned long cortex_bloom_num_segments(const CORTEX_BLOOM *bloom)
+{
+  return bloom->num_segments;
+}
+
+void cortex_bloom_segment_info(const CORTEX_BLOOM *bloom, unsigned long segment,
+                               long *offset, unsigned long *num_bubbles)
+{
+  *offset = bloom->segments[segment].info.offset;
+  *num_bubbles = bloom->segments[segment].info.num_bubbles;
+}
+
+char cortex_bloom_may_contain(const CORTEX_BLOOM *bloom, unsigned long segment,
+                              const CORTEX_KMER *kmer)
+{
+  uint64_t h1, h2;
+  _bloom_hashes(kmer, bloom->kmer_size, &h1, &h2);
+  return _bloom_test(&bloom->segments[segment], bloom->num_hashes, h1, h2);
+}
+
+unsigned long cortex_bloom_query(const CORTEX_BLOOM *bloom,
+                                 const CORTEX_KMER *kmers, size_t num_kmers,
+                                 char *segment_hits)
+{
+  unsigned long s, num_hits = 0;
+  size_t i;
+
+  memset(segment_hits, 0, bloom->num_segments);
+
+  for(i = 0; i < num_kmers && num_hits < bloom->num_segments; i++)
+  {
+    uint64_t h1, h2;
+    _bloom_hashes(&kmers[i], bloom->kmer_size, &h1, &h2);
+
+    for(s = 0; s < bloom->num_segments; s++)
+    {
+      if(!segment_hits[s] &&
+         _bloom_test(&bloom->segments[s], bloom->num_hashes, h1, h2))
+      {
+        segment_hits[s] = 1;
+        num_hits++;
+      }
+    }
+  }
+
+  return num_hits;
+}
@@ -0,0 +1,88 @@
+/*
+ cortex_bloom.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_BLOOM_H_SEEN
+#define CORTEX_BLOOM_H_SEEN
+
+#include "cortex.h"
+#include "cortex_kmer.h"
+
+//
+// Blocked Bloom filters over the canonical kmers of bubbles
+//
+// A bubble file is split into segments of consecutive bubbles, each with its
+// own filter sized for the kmers it holds.  Each kmer sets bits within a
+// single 512-bit block, so a lookup touches one cache line.  Before scanning a
+// file for a set of kmers, check which segments (if any) may contain them and
+// cortex_seek() to those.  Kmers of all four paths are included, the same as
+// cortex_index.h.
+//
+
+typedef struct CORTEX_BLOOM CORTEX_BLOOM;
+
+// bubbles_per_segment == 0 means the whole file is one segment.
+// bits_per_kmer trades memory for false positive rate (10 gives ~1%).
+// Returns NULL on failure
+CORTEX_BLOOM* cortex_bloom_create(unsigned int kmer_size,
+                                  unsigned long bubbles_per_segment,
+                                  unsigned int bits_per_kmer);
+void cortex_bloom_free(CORTEX_BLOOM *bloom);
+
+// Add a bubble while reading a file; offset is c_file->record_offset.
+// Returns 0 if out of memory, after which the filters are incomplete
+char cortex_bloom_add_bubble(CORTEX_BLOOM *bloom, const CORTEX_BUBBLE *bubble,
+                             long offset);
+// Build filters for any bubbles added since the last segment was completed.
+// Called automatically by cortex_bloom_save().  Returns 0 if out of memory
+char cortex_bloom_finish(CORTEX_BLOOM *bloom);
+
+// Read all remaining bubbles of c_file into a new set of filters.
+// Returns NULL on failure
+CORTEX_BLOOM* cortex_bloom_build(CORTEX_FILE *c_file,
+                                 unsigned long bubbles_per_segment,
+                                 unsigned int bits_per_kmer);
+
+// Save/load filters, e.g. to <bubble file>.bloom.  Return 1/pointer on
+// success, 0/NULL on failure
+char cortex_bloom_save(CORTEX_BLOOM *bloom, const char *path);
+CORTEX_BLOOM* cortex_bloom_load(const char *path);
+
+unsigned int cortex_bloom_kmer_size(const CORTEX_BLOOM *bloom);
+unsigned long cortex_bloom_num_segments(const CORTEX_BLOOM *bloom);
+// Record offset of the first bubble in a segment and the number of bubbles
+void cortex_bloom_segment_info(const CORTEX_BLOOM *bloom, unsigned long segment,
+                               long *offset, unsigned long *num_bubbles);
+
+// Returns 0 if the segment definitely does not contain kmer (any orientation)
+char cortex_bloom_may_contain(const CORTEX_BLOOM *bloom, unsigned long segment,
+                              const CORTEX_KMER *kmer);
+
+// Set segment_hits[s] to 1 for each segment that may contain any of the kmers
+// and 0 otherwise.  Returns the number of segments that may contain them
+// (0 means the file can be skipped).
+unsigned long cortex_bloom_query(const CORTEX_BLOOM *bloom,
+                                 const CORTEX_KMER *kmers, size_t num_kmers,
+                                 char *segment_hits);
+
+#endif
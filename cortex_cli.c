@@ -0,0 +1,1910 @@
+/*
+ cortex_cli.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cortex.h"
+#include "cortex_parallel.h"
+#include "cortex_pack.h"
+#include "cortex_index.h"
+#include "cortex_multi.h"
+#include "cortex_prof.h"
+
+//
+// cortex: command line tool over libcortex.a
+//
+// Records are read in batches on the main thread.  Each batch is split into
+// chunks that are filtered, formatted (or counted) on the thread pool, then
+// written out in order, while the main thread reads the next batch.
+//
+
+// Records per batch and per chunk of work
+#define CLI_BATCH_SIZE 4096
+#define CLI_CHUNK_SIZE 64
+#define CLI_NUM_CHUNKS (CLI_BATCH_SIZE / CLI_CHUNK_SIZE)
+
+// stdio buffer for output
+#define CLI_OUT_BUFFER (1<<20)
+
+// Binary bubble files (see convert): _CLI_BINARY_HEADER, num_of_colours x
+// uint64_t colours, then for each bubble a uint64_t length and the bubble
+// from cortex_bubble_pack().  Native byte order, like packed bubbles
+#define CLI_BINARY_MAGIC "CTXBIN01"
+
+typedef struct
+{
+  char magic[8];
+  uint8_t filetype, kmer_size, has_likelihoods, fails_classifier_line,
+          discovery_phase_line, is_diploid, padding[2];
+  uint64_t num_of_colours;
+} _CLI_BINARY_HEADER;
+
+//
+// Fields and predicates
+//
+
+enum _CLI_FIELD_ID {FIELD_VAR, FIELD_LEN5P, FIELD_LEN1, FIELD_LEN2,
+                    FIELD_LEN3P, FIELD_SEQ5P, FIELD_SEQ1, FIELD_SEQ2,
+                    FIELD_SEQ3P, FIELD_CALL, FIELD_LLK_HOM1, FIELD_LLK_HET,
+                    FIELD_LLK_HOM2, FIELD_COVG1, FIELD_COVG2,
+                    FIELD_NAME, FIELD_SEQ, FIELD_LEN, FIELD_COVG, FIELD_MIN,
+                    FIELD_MAX, NUM_FIELDS};
+
+typedef struct
+{
+  const char *name;
+  enum CORTEX_FILE_TYPE filetype;
+  // Per-colour fields have a value for each colour; strings can only be
+  // compared with = and !=.  Numbers are printed with precision decimals
+  char per_colour, is_string;
+  int precision;
+} _CLI_FIELD;
+
+// In the order of _CLI_FIELD_ID
+const _CLI_FIELD cli_fields[NUM_FIELDS] = {
+  {"var",      BUBBLE_FILE,    0, 0, 0},
+  {"len5p",    BUBBLE_FILE,    0, 0, 0},
+  {"len1",     BUBBLE_FILE,    0, 0, 0},
+  {"len2",     BUBBLE_FILE,    0, 0, 0},
+  {"len3p",    BUBBLE_FILE,    0, 0, 0},
+  {"seq5p",    BUBBLE_FILE,    0, 1, 0},
+  {"seq1",     BUBBLE_FILE,    0, 1, 0},
+  {"seq2",     BUBBLE_FILE,    0, 1, 0},
+  {"seq3p",    BUBBLE_FILE,    0, 1, 0},
+  {"call",     BUBBLE_FILE,    1, 1, 0},
+  {"llk_hom1", BUBBLE_FILE,    1, 0, 2},
+  {"llk_het",  BUBBLE_FILE,    1, 0, 2},
+  {"llk_hom2", BUBBLE_FILE,    1, 0, 2},
+  {"covg1",    BUBBLE_FILE,    1, 0, 2},
+  {"covg2",    BUBBLE_FILE,    1, 0, 2},
+  {"name",     ALIGNMENT_FILE, 0, 1, 0},
+  {"seq",      ALIGNMENT_FILE, 0, 1, 0},
+  {"len",      ALIGNMENT_FILE, 0, 0, 0},
+  {"covg",     ALIGNMENT_FILE, 1, 0, 2},
+  {"min",      ALIGNMENT_FILE, 1, 0, 0},
+  {"max",      ALIGNMENT_FILE, 1, 0, 0}
+};
+
+enum _CLI_OP {OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE};
+
+typedef struct
+{
+  enum _CLI_FIELD_ID field;
+  // Colour index, or -1 to pass if any selected colour passes
+  long col;
+  enum _CLI_OP op;
+  double number;
+  const char *str;
+} _CLI_PRED;
+
+//
+// Batches
+//
+
+typedef struct
+{
+  unsigned long calls[4], uncovered, max;
+  // Kmers and total coverage: of each branch for bubbles, [0] for alignments
+  unsigned long long kmers[2], covg[2], covered;
+} _CLI_COLOUR_STATS;
+
+typedef struct
+{
+  unsigned long records;
+  unsigned long long lengths[2];
+  _CLI_COLOUR_STATS *colours;
+} _CLI_STATS;
+
+typedef struct
+{
+  // Records [start, end) of the batch
+  size_t start, end;
+  // Output, from open_memstream()
+  FILE *out;
+  char *data;
+  size_t len;
+  char failed;
+
+  // Scratch space: a bubble to unpack into, packing output, a bubble or
+  // alignment restricted to the selected colours and the chunk's statistics
+  CORTEX_BUBBLE *bubble;
+  CORTEX_PACKED packed;
+  CORTEX_BUBBLE view_bubble;
+  CORTEX_ALIGNMENT view_alignment;
+  HETEROGENEITY *calls;
+  float *llks;
+  COLOUR_COVG **covgs;
+  _CLI_STATS stats;
+} _CLI_CHUNK;
+
+typedef struct _CLI _CLI;
+
+typedef struct
+{
+  _CLI *cli;
+  // Parsed records (CORTEX_BUBBLE* or CORTEX_ALIGNMENT*), created as needed
+  void **records;
+  size_t num_created;
+  // Or packed bubbles: record r is packed.data[offsets[r], offsets[r+1])
+  CORTEX_PACKED packed;
+  size_t *offsets;
+  size_t num_records, num_chunks;
+  _CLI_CHUNK chunks[CLI_NUM_CHUNKS];
+  char failed;
+} _CLI_BATCH;
+
+struct _CLI
+{
+  // Input: a text file, binary bubbles or several bubble files.  c_file
+  // describes the records in any case
+  CORTEX_FILE *in;
+  FILE *bin_in;
+  CORTEX_MULTI_FILE *multi;
+  const CORTEX_FILE *c_file;
+  FILE *out;
+
+  // Selected colours (indices into c_file), and whether they are a subset,
+  // in which case view is c_file with only those colours
+  unsigned long *cols, *view_colours;
+  size_t num_cols;
+  char subset;
+  CORTEX_FILE view;
+
+  enum _CLI_FIELD_ID *fields;
+  size_t num_fields;
+  _CLI_PRED *preds;
+  size_t num_preds;
+  char invert;
+
+  // Reads the next batch (main thread), and handles a chunk of it (workers)
+  size_t (*fill)(_CLI *cli, _CLI_BATCH *batch);
+  void (*chunk_func)(const _CLI *cli, const _CLI_BATCH *batch,
+                     _CLI_CHUNK *chunk);
+
+  char keep_stats;
+  _CLI_STATS totals;
+
+  unsigned int num_threads;
+  _CLI_BATCH batches[2];
+  char header_written, failed;
+  // Handle batches on the main thread, so that they are profiled
+  char profile;
+};
+
+typedef struct
+{
+  unsigned int num_threads;
+  const char *colours, *fields;
+  const char **exprs;
+  size_t num_exprs;
+  char invert, profile;
+  char **args;
+  int num_args;
+} _CLI_OPTS;
+
+// Uncompressed bytes read from inputs, for profiling
+unsigned long long cli_input_bytes = 0;
+
+void _cli_oom()
+{
+  fprintf(stderr, "cortex_cli.c: out of memory\n");
+  exit(EXIT_FAILURE);
+}
+
+//
+// Record values
+//
+
+double _cli_mean_covg(const COLOUR_COVG *covgs)
+{
+  unsigned long long sum = 0;
+  unsigned long i;
+
+  for(i = 0; i < covgs->length; i++)
+  {
+    sum += covgs->colour_covgs[i];
+  }
+
+  return covgs->length > 0 ? (double)sum / covgs->length : 0;
+}
+
+unsigned long _cli_covg_limit(const COLOUR_COVG *covgs, char want_max)
+{
+  unsigned long result = covgs->length > 0 ? covgs->colour_covgs[0] : 0, i;
+
+  for(i = 1; i < covgs->length; i++)
+  {
+    unsigned long covg = covgs->colour_covgs[i];
+    result = (want_max ? covg > result : covg < result) ? covg : result;
+  }
+
+  return result;
+}
+
+double _cli_number(const _CLI *cli, const void *record,
+                   enum _CLI_FIELD_ID field, unsigned long col)
+{
+  const CORTEX_BUBBLE *bubble = (const CORTEX_BUBBLE*)record;
+  const CORTEX_ALIGNMENT *alignment = (const CORTEX_ALIGNMENT*)record;
+
+  switch(field)
+  {
+    case FIELD_VAR:
+      return bubble->var_num;
+    case FIELD_LEN5P:
+      return bubble->flank_5p.seq_length;
+    case FIELD_LEN1:
+      return bubble->branches[0].seq_length;
+    case FIELD_LEN2:
+      return bubble->branches[1].seq_length;
+    case FIELD_LEN3P:
+      return bubble->flank_3p.seq_length;
+    case FIELD_LLK_HOM1:
+      return cli->c_file->has_likelihoods ? bubble->llk_hom_br1[col] : NAN;
+    case FIELD_LLK_HET:
+      return cli->c_file->has_likelihoods && cli->c_file->is_diploid ?
+             bubble->llk_het[col] : NAN;
+    case FIELD_LLK_HOM2:
+      return cli->c_file->has_likelihoods ? bubble->llk_hom_br2[col] : NAN;
+    case FIELD_COVG1:
+      return _cli_mean_covg(bubble->branches_colour_covgs[0][col]);
+    case FIELD_COVG2:
+      return _cli_mean_covg(bubble->branches_colour_covgs[1][col]);
+    case FIELD_LEN:
+      return strbuf_len(alignment->seq);
+    case FIELD_COVG:
+      return _cli_mean_covg(alignment->colour_covgs[col]);
+    case FIELD_MIN:
+      return _cli_covg_limit(alignment->colour_covgs[col], 0);
+    case FIELD_MAX:
+      return _cli_covg_limit(alignment->colour_covgs[col], 1);
+    default:
+      return NAN;
+  }
+}
+
+const char* _cli_call_str(HETEROGENEITY call)
+{
+  switch(call)
+  {
+    case HOM1:
+      return "HOM1";
+    case HET:
+      return "HET";
+    case HOM2:
+      return "HOM2";
+    default:
+      return ".";
+  }
+}
+
+const char* _cli_string(const _CLI *cli, const void *record,
+                        enum _CLI_FIELD_ID field, unsigned long col)
+{
+  const CORTEX_BUBBLE *bubble = (const CORTEX_BUBBLE*)record;
+  const CORTEX_ALIGNMENT *alignment = (const CORTEX_ALIGNMENT*)record;
+
+  switch(field)
+  {
+    case FIELD_SEQ5P:
+      return bubble->flank_5p.seq->buff;
+    case FIELD_SEQ1:
+      return bubble->branches[0].seq->buff;
+    case FIELD_SEQ2:
+      return bubble->branches[1].seq->buff;
+    case FIELD_SEQ3P:
+      return bubble->flank_3p.seq->buff;
+    case FIELD_CALL:
+      return cli->c_file->has_likelihoods ? _cli_call_str(bubble->calls[col])
+                                          : ".";
+    case FIELD_NAME:
+      return alignment->name->buff;
+    case FIELD_SEQ:
+      return alignment->seq->buff;
+    default:
+      return "";
+  }
+}
+
+void _cli_print_value(FILE *out, const _CLI *cli, const void *record,
+                      enum _CLI_FIELD_ID field, unsigned long col)
+{
+  if(cli_fields[field].is_string)
+  {
+    fputs(_cli_string(cli, record, field, col), out);
+  }
+  else
+  {
+    fprintf(out, "%.*f", cli_fields[field].precision,
+            _cli_number(cli, record, field, col));
+  }
+}
+
+void _cli_print_fields(FILE *out, const _CLI *cli, const void *record)
+{
+  size_t f, c;
+
+  for(f = 0; f < cli->num_fields; f++)
+  {
+    enum _CLI_FIELD_ID field = cli->fields[f];
+
+    if(f > 0)
+    {
+      fputc('\t', out);
+    }
+
+    if(!cli_fields[field].per_colour)
+    {
+      _cli_print_value(out, cli, record, field, 0);
+      continue;
+    }
+
+    for(c = 0; c < cli->num_cols; c++)
+    {
+      if(c > 0)
+      {
+        fputc(',', out);
+      }
+
+      _cli_print_value(out, cli, record, field, cli->cols[c]);
+    }
+  }
+
+  fputc('\n', out);
+}
+
+char _cli_test(const _CLI *cli, const _CLI_PRED *pred, const void *record,
+               unsigned long col)
+{
+  int cmp;
+
+  if(cli_fields[pred->field].is_string)
+  {
+    cmp = strcmp(_cli_string(cli, record, pred->field, col), pred->str);
+  }
+  else
+  {
+    // nan compares as neither less nor greater, but isn't equal either
+    double value = _cli_number(cli, record, pred->field, col);
+
+    if(isnan(value))
+    {
+      return pred->op == OP_NE;
+    }
+
+    cmp = (value > pred->number) - (value < pred->number);
+  }
+
+  switch(pred->op)
+  {
+    case OP_EQ:
+      return cmp == 0;
+    case OP_NE:
+      return cmp != 0;
+    case OP_LT:
+      return cmp < 0;
+    case OP_LE:
+      return cmp <= 0;
+    case OP_GT:
+      return cmp > 0;
+    default:
+      return cmp >= 0;
+  }
+}
+
+// Does a record pass every predicate (or fail one, with -v)?
+char _cli_keep(const _CLI *cli, const void *record)
+{
+  size_t p, c;
+
+  for(p = 0; p < cli->num_preds; p++)
+  {
+    const _CLI_PRED *pred = &cli->preds[p];
+    char pass = 0;
+
+    if(pred->col >= 0)
+    {
+      pass = _cli_test(cli, pred, record, (unsigned long)pred->col);
+    }
+    else
+    {
+      for(c = 0; c < cli->num_cols && !pass; c++)
+      {
+        pass = _cli_test(cli, pred, record, cli->cols[c]);
+      }
+    }
+
+    if(!pass)
+    {
+      return cli->invert;
+    }
+  }
+
+  return !cli->invert;
+}
+
+//
+// Chunk functions
+//
+
+// The bubble with only the selected colours, to print with cli->view
+const CORTEX_BUBBLE* _cli_view_bubble(const _CLI *cli, _CLI_CHUNK *chunk,
+                                      const CORTEX_BUBBLE *bubble)
+{
+  CORTEX_BUBBLE *view = &chunk->view_bubble;
+  size_t m = cli->num_cols, c;
+
+  *view = *bubble;
+  view->calls = chunk->calls;
+  view->llk_hom_br1 = chunk->llks;
+  view->llk_het = chunk->llks + m;
+  view->llk_hom_br2 = chunk->llks + 2 * m;
+  view->branches_colour_covgs[0] = chunk->covgs;
+  view->branches_colour_covgs[1] = chunk->covgs + m;
+
+  for(c = 0; c < m; c++)
+  {
+    unsigned long col = cli->cols[c];
+    view->calls[c] = bubble->calls[col];
+    view->llk_hom_br1[c] = bubble->llk_hom_br1[col];
+    view->llk_het[c] = bubble->llk_het[col];
+    view->llk_hom_br2[c] = bubble->llk_hom_br2[col];
+    view->branches_colour_covgs[0][c] = bubble->branches_colour_covgs[0][col];
+    view->branches_colour_covgs[1][c] = bubble->branches_colour_covgs[1][col];
+  }
+
+  return view;
+}
+
+const CORTEX_ALIGNMENT* _cli_view_alignment(const _CLI *cli,
+                                            _CLI_CHUNK *chunk,
+                                            const CORTEX_ALIGNMENT *alignment)
+{
+  CORTEX_ALIGNMENT *view = &chunk->view_alignment;
+  size_t c;
+
+  *view = *alignment;
+  view->colour_covgs = chunk->covgs;
+
+  for(c = 0; c < cli->num_cols; c++)
+  {
+    view->colour_covgs[c] = alignment->colour_covgs[cli->cols[c]];
+  }
+
+  return view;
+}
+
+void _cli_print_record(const _CLI *cli, _CLI_CHUNK *chunk, const void *record)
+{
+  if(cli->c_file->filetype == BUBBLE_FILE)
+  {
+    const CORTEX_BUBBLE *bubble = (const CORTEX_BUBBLE*)record;
+
+    if(cli->subset)
+    {
+      cortex_fprint_bubble(chunk->out, _cli_view_bubble(cli, chunk, bubble),
+                           &cli->view);
+    }
+    else
+    {
+      cortex_fprint_bubble(chunk->out, bubble, cli->c_file);
+    }
+  }
+  else
+  {
+    const CORTEX_ALIGNMENT *alignment = (const CORTEX_ALIGNMENT*)record;
+
+    if(cli->subset)
+    {
+      cortex_fprint_alignment(chunk->out,
+                              _cli_view_alignment(cli, chunk, alignment),
+                              &cli->view);
+    }
+    else
+    {
+      cortex_fprint_alignment(chunk->out, alignment, cli->c_file);
+    }
+  }
+}
+
+// view and filter
+void _cli_view_chunk(const _CLI *cli, const _CLI_BATCH *batch,
+                     _CLI_CHUNK *chunk)
+{
+  size_t r;
+
+  for(r = chunk->start; r < chunk->end; r++)
+  {
+    const void *record = batch->records[r];
+
+    if(cli->num_preds > 0 && !_cli_keep(cli, record))
+    {
+      continue;
+    }
+
+    if(cli->num_fields > 0)
+    {
+      _cli_print_fields(chunk->out, cli, record);
+    }
+    else
+    {
+      _cli_print_record(cli, chunk, record);
+    }
+  }
+}
+
+void _cli_covg_stats(_CLI_COLOUR_STATS *stats, const COLOUR_COVG *covgs,
+                     int branch)
+{
+  unsigned long i;
+
+  for(i = 0; i < covgs->length; i++)
+  {
+    unsigned long covg = covgs->colour_covgs[i];
+    stats->covg[branch] += covg;
+    stats->covered += (covg > 0);
+    stats->max = covg > stats->max ? covg : stats->max;
+  }
+
+  stats->kmers[branch] += covgs->length;
+}
+
+void _cli_stats_chunk(const _CLI *cli, const _CLI_BATCH *batch,
+                      _CLI_CHUNK *chunk)
+{
+  _CLI_STATS *stats = &chunk->stats;
+  size_t r, c;
+
+  for(r = chunk->start; r < chunk->end; r++)
+  {
+    stats->records++;
+
+    if(cli->c_file->filetype == BUBBLE_FILE)
+    {
+      const CORTEX_BUBBLE *bubble = (const CORTEX_BUBBLE*)batch->records[r];
+
+      stats->lengths[0] += bubble->branches[0].seq_length;
+      stats->lengths[1] += bubble->branches[1].seq_length;
+
+      for(c = 0; c < cli->num_cols; c++)
+      {
+        _CLI_COLOUR_STATS *colour = &stats->colours[c];
+        unsigned long col = cli->cols[c];
+        unsigned long long covered = colour->covered;
+
+        colour->calls[cli->c_file->has_likelihoods ? bubble->calls[col]
+                                                   : UNKNOWN_HET]++;
+        _cli_covg_stats(colour, bubble->branches_colour_covgs[0][col], 0);
+        _cli_covg_stats(colour, bubble->branches_colour_covgs[1][col], 1);
+        colour->uncovered += (colour->covered == covered);
+      }
+    }
+    else
+    {
+      const CORTEX_ALIGNMENT *alignment
+        = (const CORTEX_ALIGNMENT*)batch->records[r];
+
+      stats->lengths[0] += strbuf_len(alignment->seq);
+
+      for(c = 0; c < cli->num_cols; c++)
+      {
+        _cli_covg_stats(&stats->colours[c],
+                        alignment->colour_covgs[cli->cols[c]], 0);
+      }
+    }
+  }
+}
+
+void _cli_stats_add(_CLI_STATS *totals, const _CLI_STATS *stats,
+                    size_t num_cols)
+{
+  size_t c, i;
+
+  totals->records += stats->records;
+  totals->lengths[0] += stats->lengths[0];
+  totals->lengths[1] += stats->lengths[1];
+
+  for(c = 0; c < num_cols; c++)
+  {
+    _CLI_COLOUR_STATS *total = &totals->colours[c];
+    const _CLI_COLOUR_STATS *colour = &stats->colours[c];
+
+    for(i = 0; i < 4; i++)
+    {
+      total->calls[i] += colour->calls[i];
+    }
+
+    for(i = 0; i < 2; i++)
+    {
+      total->kmers[i] += colour->kmers[i];
+      total->covg[i] += colour->covg[i];
+    }
+
+    total->uncovered += colour->uncovered;
+    total->covered += colour->covered;
+    total->max = colour->max > total->max ? colour->max : total->max;
+  }
+}
+
+// Text to binary
+void _cli_pack_chunk(const _CLI *cli, const _CLI_BATCH *batch,
+                     _CLI_CHUNK *chunk)
+{
+  size_t r;
+
+  for(r = chunk->start; r < chunk->end; r++)
+  {
+    cortex_packed_reset(&chunk->packed);
+    cortex_bubble_pack(&chunk->packed, (const CORTEX_BUBBLE*)batch->records[r],
+                       cli->c_file);
+
+    uint64_t len = (uint64_t)chunk->packed.len;
+    fwrite(&len, sizeof(uint64_t), 1, chunk->out);
+    fwrite(chunk->packed.data, 1, chunk->packed.len, chunk->out);
+  }
+}
+
+// Packed bubbles (from binary files or cat) to text
+void _cli_unpack_chunk(const _CLI *cli, const _CLI_BATCH *batch,
+                       _CLI_CHUNK *chunk)
+{
+  size_t r;
+
+  for(r = chunk->start; r < chunk->end; r++)
+  {
+    if(cortex_bubble_unpack(chunk->bubble, cli->c_file,
+                            batch->packed.data + batch->offsets[r],
+                            batch->offsets[r+1] - batch->offsets[r]) == 0)
+    {
+      chunk->failed = 1;
+      return;
+    }
+
+    cortex_fprint_bubble(chunk->out, chunk->bubble, cli->c_file);
+  }
+}
+
+//
+// Filling batches
+//
+
+size_t _cli_fill_text(_CLI *cli, _CLI_BATCH *batch)
+{
+  char is_bubble = (cli->c_file->filetype == BUBBLE_FILE);
+  size_t n = 0;
+
+  while(n < CLI_BATCH_SIZE)
+  {
+    if(n == batch->num_created)
+    {
+      batch->records[n] = is_bubble ?
+        (void*)cortex_bubble_create(cli->c_file) :
+        (void*)cortex_alignment_create(cli->c_file);
+      batch->num_created++;
+    }
+
+    if(is_bubble ?
+       !cortex_read_bubble((CORTEX_BUBBLE*)batch->records[n], cli->in) :
+       !cortex_read_alignment((CORTEX_ALIGNMENT*)batch->records[n], cli->in))
+    {
+      break;
+    }
+
+    n++;
+  }
+
+  return n;
+}
+
+char _cli_write_binary_header(_CLI *cli)
+{
+  const CORTEX_FILE *c_file = cli->c_file;
+  _CLI_BINARY_HEADER header;
+  unsigned long i;
+
+  memset(&header, 0, sizeof(_CLI_BINARY_HEADER));
+  memcpy(header.magic, CLI_BINARY_MAGIC, 8);
+  header.filetype = (uint8_t)c_file->filetype;
+  header.kmer_size = c_file->kmer_size;
+  header.has_likelihoods = c_file->has_likelihoods;
+  header.fails_classifier_line = c_file->fails_classifier_line;
+  header.discovery_phase_line = c_file->discovery_phase_line;
+  header.is_diploid = c_file->is_diploid;
+  header.num_of_colours = (uint64_t)c_file->num_of_colours;
+
+  if(fwrite(&header, sizeof(_CLI_BINARY_HEADER), 1, cli->out) != 1)
+  {
+    return 0;
+  }
+
+  for(i = 0; i < c_file->num_of_colours; i++)
+  {
+    uint64_t colour = (uint64_t)c_file->colour_arr[i];
+
+    if(fwrite(&colour, sizeof(uint64_t), 1, cli->out) != 1)
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// The header's is_diploid is only known once the first bubble has been read
+size_t _cli_fill_convert(_CLI *cli, _CLI_BATCH *batch)
+{
+  size_t n = _cli_fill_text(cli, batch);
+
+  if(!cli->header_written)
+  {
+    cli->header_written = 1;
+
+    if(!_cli_write_binary_header(cli))
+    {
+      cli->failed = 1;
+      return 0;
+    }
+  }
+
+  return n;
+}
+
+size_t _cli_fill_binary(_CLI *cli, _CLI_BATCH *batch)
+{
+  size_t n = 0;
+  uint64_t len;
+
+  cortex_packed_reset(&batch->packed);
+  batch->offsets[0] = 0;
+
+  while(n < CLI_BATCH_SIZE &&
+        fread(&len, sizeof(uint64_t), 1, cli->bin_in) == 1)
+  {
+    cortex_packed_ensure(&batch->packed, (size_t)len);
+
+    if(fread(batch->packed.data + batch->packed.len, 1, (size_t)len,
+             cli->bin_in) != len)
+    {
+      fprintf(stderr, "cortex_cli.c: binary file is truncated\n");
+      cli->failed = 1;
+      break;
+    }
+
+    batch->packed.len += (size_t)len;
+    batch->offsets[++n] = batch->packed.len;
+  }
+
+  return n;
+}
+
+size_t _cli_fill_multi(_CLI *cli, _CLI_BATCH *batch)
+{
+  const CORTEX_BUBBLE *bubble;
+  size_t n = 0;
+
+  cortex_packed_reset(&batch->packed);
+  batch->offsets[0] = 0;
+
+  while(n < CLI_BATCH_SIZE &&
+        (bubble = cortex_multi_read_bubble(cli->multi, NULL)) != NULL)
+  {
+    cortex_bubble_pack(&batch->packed, bubble, cli->c_file);
+    batch->offsets[++n] = batch->packed.len;
+  }
+
+  return n;
+}
+
+//
+// Running
+//
+
+void _cli_run_chunk(size_t i, void *ptr)
+{
+  _CLI_BATCH *batch = (_CLI_BATCH*)ptr;
+  _CLI_CHUNK *chunk = &batch->chunks[i];
+
+  // Reuse the chunk's stream from batch to batch: write over it from the
+  // start, and flushing sets len to the end of what was written
+  if(chunk->out == NULL &&
+     (chunk->out = open_memstream(&chunk->data, &chunk->len)) == NULL)
+  {
+    _cli_oom();
+  }
+
+  rewind(chunk->out);
+  batch->cli->chunk_func(batch->cli, batch, chunk);
+
+  if(fflush(chunk->out) != 0)
+  {
+    chunk->failed = 1;
+  }
+}
+
+// Handle a batch on the thread pool then write it out in order
+void* _cli_run_batch(void *ptr)
+{
+  _CLI_BATCH *batch = (_CLI_BATCH*)ptr;
+  FILE *out = batch->cli->out;
+  size_t i;
+
+  cortex_parallel_for(batch->num_chunks, batch->cli->num_threads,
+                      _cli_run_chunk, batch);
+
+  for(i = 0; i < batch->num_chunks; i++)
+  {
+    _CLI_CHUNK *chunk = &batch->chunks[i];
+
+    if(chunk->failed ||
+       (chunk->len > 0 && fwrite(chunk->data, 1, chunk->len, out) != chunk->len))
+    {
+      batch->failed = 1;
+    }
+  }
+
+  return NULL;
+}
+
+// Call after a batch has been written
+void _cli_finish_batch(_CLI *cli, _CLI_BATCH *batch)
+{
+  size_t i;
+
+  cli->failed |= batch->failed;
+
+  if(cli->keep_stats)
+  {
+    for(i = 0; i < batch->num_chunks; i++)
+    {
+      _CLI_STATS *stats = &batch->chunks[i].stats;
+      _cli_stats_add(&cli->totals, stats, cli->num_cols);
+
+      stats->records = 0;
+      stats->lengths[0] = stats->lengths[1] = 0;
+      memset(stats->colours, 0, cli->num_cols * sizeof(_CLI_COLOUR_STATS));
+    }
+  }
+}
+
+// c_file with only the selected colours.  Taken once the first batch has been
+// read, as that can set details such as is_diploid
+void _cli_set_view(_CLI *cli)
+{
+  cli->view = *cli->c_file;
+  cli->view.num_of_colours = cli->num_cols;
+  cli->view.colour_arr = cli->view_colours;
+}
+
+// Read batches, alternating between two so that the next is read while the
+// last is handled.  Returns 1 on success, 0 on failure
+char _cli_run(_CLI *cli)
+{
+  pthread_t thread;
+  char running = 0, threaded = 0;
+  size_t num_batches = 0, b = 0, i;
+
+  while(!cli->failed)
+  {
+    _CLI_BATCH *batch = &cli->batches[b];
+    size_t n = cli->fill(cli, batch);
+
+    if(running)
+    {
+      if(threaded)
+      {
+        pthread_join(thread, NULL);
+      }
+
+      _cli_finish_batch(cli, &cli->batches[b ^ 1]);
+      running = 0;
+    }
+
+    if(n == 0)
+    {
+      break;
+    }
+
+    if(num_batches++ == 0 && cli->subset)
+    {
+      _cli_set_view(cli);
+    }
+
+    batch->num_records = n;
+    batch->num_chunks = (n + CLI_CHUNK_SIZE - 1) / CLI_CHUNK_SIZE;
+    batch->failed = 0;
+
+    for(i = 0; i < batch->num_chunks; i++)
+    {
+      batch->chunks[i].start = i * CLI_CHUNK_SIZE;
+      batch->chunks[i].end = (i + 1) * CLI_CHUNK_SIZE < n ?
+                             (i + 1) * CLI_CHUNK_SIZE : n;
+      batch->chunks[i].failed = 0;
+    }
+
+    threaded = !cli->profile &&
+               pthread_create(&thread, NULL, _cli_run_batch, batch) == 0;
+
+    if(!threaded)
+    {
+      CORTEX_PROF_ENTER(PROF_OUTPUT);
+      _cli_run_batch(batch);
+      CORTEX_PROF_LEAVE();
+    }
+
+    running = 1;
+    b ^= 1;
+  }
+
+  if(running)
+  {
+    if(threaded)
+    {
+      pthread_join(thread, NULL);
+    }
+
+    _cli_finish_batch(cli, &cli->batches[b ^ 1]);
+  }
+
+  return !cli->failed;
+}
+
+//
+// Setting up
+//
+
+// Resolve colours (a comma separated list of colour numbers, or NULL for
+// all) to indices.  Returns 0 if one isn't in the file
+char _cli_set_colours(_CLI *cli, const char *colours)
+{
+  const CORTEX_FILE *c_file = cli->c_file;
+  unsigned long i;
+
+  cli->cols = (unsigned long*) malloc(c_file->num_of_colours *
+                                      sizeof(unsigned long));
+  cli->view_colours = (unsigned long*) malloc(c_file->num_of_colours *
+                                              sizeof(unsigned long));
+
+  if(cli->cols == NULL || cli->view_colours == NULL)
+  {
+    _cli_oom();
+  }
+
+  cli->num_cols = 0;
+  cli->subset = (colours != NULL);
+
+  if(colours == NULL)
+  {
+    for(i = 0; i < c_file->num_of_colours; i++)
+    {
+      cli->cols[i] = i;
+      cli->view_colours[i] = c_file->colour_arr[i];
+    }
+
+    cli->num_cols = c_file->num_of_colours;
+    return 1;
+  }
+
+  const char *str = colours;
+
+  while(*str != '\0')
+  {
+    char *end;
+    unsigned long colour = strtoul(str, &end, 10);
+    long col_index;
+
+    if(end == str || (*end != ',' && *end != '\0') ||
+       (col_index = cortex_file_get_colour_index(colour, c_file)) < 0)
+    {
+      fprintf(stderr, "cortex_cli.c: colour '%s' is not in file (%s)\n",
+              str, c_file->path);
+      return 0;
+    }
+
+    if(cli->num_cols == c_file->num_of_colours)
+    {
+      fprintf(stderr, "cortex_cli.c: too many colours (%s)\n", colours);
+      return 0;
+    }
+
+    cli->cols[cli->num_cols] = (unsigned long)col_index;
+    cli->view_colours[cli->num_cols] = colour;
+    cli->num_cols++;
+    str = (*end == ',' ? end + 1 : end);
+  }
+
+  if(cli->num_cols == 0)
+  {
+    fprintf(stderr, "cortex_cli.c: no colours given\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+// Returns NUM_FIELDS if name isn't a field of this file type
+enum _CLI_FIELD_ID _cli_find_field(const char *name, size_t len,
+                                   enum CORTEX_FILE_TYPE filetype)
+{
+  int i;
+
+  for(i = 0; i < NUM_FIELDS; i++)
+  {
+    if(cli_fields[i].filetype == filetype &&
+       strlen(cli_fields[i].name) == len &&
+       strncmp(cli_fields[i].name, name, len) == 0)
+    {
+      break;
+    }
+  }
+
+  return (enum _CLI_FIELD_ID)i;
+}
+
+char _cli_set_fields(_CLI *cli, const char *fields)
+{
+  size_t max_fields = strlen(fields) / 2 + 1;
+  const char *str = fields;
+
+  if((cli->fields = (enum _CLI_FIELD_ID*)
+                    malloc(max_fields * sizeof(enum _CLI_FIELD_ID))) == NULL)
+  {
+    _cli_oom();
+  }
+
+  while(*str != '\0')
+  {
+    size_t len = strcspn(str, ",");
+    enum _CLI_FIELD_ID field
+      = _cli_find_field(str, len, cli->c_file->filetype);
+
+    if(field == NUM_FIELDS)
+    {
+      fprintf(stderr, "cortex_cli.c: unknown field '%.*s' for this file type "
+                      "(%s)\n", (int)len, str, cli->c_file->path);
+      return 0;
+    }
+
+    cli->fields[cli->num_fields++] = field;
+    str += len + (str[len] == ',');
+  }
+
+  return cli->num_fields > 0;
+}
+
+// Parse <field>[:<colour>]<op><value>
+char _cli_parse_pred(_CLI *cli, const char *expr, _CLI_PRED *pred)
+{
+  size_t name_len = strcspn(expr, ":!<>=");
+  const char *str = expr + name_len;
+
+  pred->field = _cli_find_field(expr, name_len, cli->c_file->filetype);
+  pred->col = -1;
+
+  if(pred->field == NUM_FIELDS)
+  {
+    fprintf(stderr, "cortex_cli.c: unknown field in '%s'\n", expr);
+    return 0;
+  }
+
+  if(*str == ':')
+  {
+    char *end;
+    unsigned long colour = strtoul(str + 1, &end, 10);
+
+    if(end == str + 1 || !cli_fields[pred->field].per_colour ||
+       (pred->col = cortex_file_get_colour_index(colour, cli->c_file)) < 0)
+    {
+      fprintf(stderr, "cortex_cli.c: bad colour in '%s'\n", expr);
+      return 0;
+    }
+
+    str = end;
+  }
+
+  if(strncmp(str, "!=", 2) == 0)
+  {
+    pred->op = OP_NE;
+    str += 2;
+  }
+  else if(strncmp(str, "<=", 2) == 0)
+  {
+    pred->op = OP_LE;
+    str += 2;
+  }
+  else if(strncmp(str, ">=", 2) == 0)
+  {
+    pred->op = OP_GE;
+    str += 2;
+  }
+  else if(*str == '<' || *str == '>' || *str == '=')
+  {
+    pred->op = (*str == '<' ? OP_LT : (*str == '>' ? OP_GT : OP_EQ));
+    str += 1 + (strncmp(str, "==", 2) == 0);
+  }
+  else
+  {
+    fprintf(stderr, "cortex_cli.c: no comparison in '%s'\n", expr);
+    return 0;
+  }
+
+  pred->str = str;
+
+  if(cli_fields[pred->field].is_string)
+  {
+    if(pred->op != OP_EQ && pred->op != OP_NE)
+    {
+      fprintf(stderr, "cortex_cli.c: '%s' can only be compared with = or "
+                      "!=\n", cli_fields[pred->field].name);
+      return 0;
+    }
+  }
+  else
+  {
+    char *end;
+    pred->number = strtod(str, &end);
+
+    if(end == str || *end != '\0')
+    {
+      fprintf(stderr, "cortex_cli.c: not a number in '%s'\n", expr);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Allocate batches and chunk scratch space once c_file and the colours are
+// known
+void _cli_init_batches(_CLI *cli, char packed)
+{
+  size_t m = cli->num_cols, b, i;
+
+  for(b = 0; b < 2; b++)
+  {
+    _CLI_BATCH *batch = &cli->batches[b];
+    batch->cli = cli;
+    batch->records = (void**) calloc(CLI_BATCH_SIZE, sizeof(void*));
+    batch->offsets = (size_t*) malloc((CLI_BATCH_SIZE + 1) * sizeof(size_t));
+    cortex_packed_init(&batch->packed);
+
+    if(batch->records == NULL || batch->offsets == NULL)
+    {
+      _cli_oom();
+    }
+
+    for(i = 0; i < CLI_NUM_CHUNKS; i++)
+    {
+      _CLI_CHUNK *chunk = &batch->chunks[i];
+      memset(chunk, 0, sizeof(_CLI_CHUNK));
+      cortex_packed_init(&chunk->packed);
+
+      chunk->calls = (HETEROGENEITY*) malloc(m * sizeof(HETEROGENEITY));
+      chunk->llks = (float*) malloc(3 * m * sizeof(float));
+      chunk->covgs = (COLOUR_COVG**) malloc(2 * m * sizeof(COLOUR_COVG*));
+      chunk->stats.colours
+        = (_CLI_COLOUR_STATS*) calloc(m, sizeof(_CLI_COLOUR_STATS));
+
+      if(m > 0 && (chunk->calls == NULL || chunk->llks == NULL ||
+                   chunk->covgs == NULL || chunk->stats.colours == NULL))
+      {
+        _cli_oom();
+      }
+
+      if(packed)
+      {
+        chunk->bubble = cortex_bubble_create(cli->c_file);
+      }
+    }
+  }
+
+  cli->totals.colours
+    = (_CLI_COLOUR_STATS*) calloc(m, sizeof(_CLI_COLOUR_STATS));
+
+  if(m > 0 && cli->totals.colours == NULL)
+  {
+    _cli_oom();
+  }
+}
+
+void _cli_free(_CLI *cli)
+{
+  size_t b, i;
+
+  for(b = 0; b < 2; b++)
+  {
+    _CLI_BATCH *batch = &cli->batches[b];
+
+    if(batch->records == NULL)
+    {
+      continue;
+    }
+
+    for(i = 0; i < batch->num_created; i++)
+    {
+      if(cli->c_file->filetype == BUBBLE_FILE)
+      {
+        cortex_bubble_free((CORTEX_BUBBLE*)batch->records[i], cli->c_file);
+      }
+      else
+      {
+        cortex_alignment_free((CORTEX_ALIGNMENT*)batch->records[i],
+                              cli->c_file);
+      }
+    }
+
+    for(i = 0; i < CLI_NUM_CHUNKS; i++)
+    {
+      _CLI_CHUNK *chunk = &batch->chunks[i];
+
+      if(chunk->bubble != NULL)
+      {
+        cortex_bubble_free(chunk->bubble, cli->c_file);
+      }
+
+      if(chunk->out != NULL)
+      {
+        fclose(chunk->out);
+        free(chunk->data);
+      }
+
+      cortex_packed_free(&chunk->packed);
+      free(chunk->calls);
+      free(chunk->llks);
+      free(chunk->covgs);
+      free(chunk->stats.colours);
+    }
+
+    cortex_packed_free(&batch->packed);
+    free(batch->records);
+    free(batch->offsets);
+  }
+
+  free(cli->totals.colours);
+  free(cli->cols);
+  free(cli->view_colours);
+  free(cli->fields);
+  free(cli->preds);
+}
+
+// Open a text input and set up cli to read it
+char _cli_open(_CLI *cli, const _CLI_OPTS *opts, const char *path)
+{
+  memset(cli, 0, sizeof(_CLI));
+  cli->num_threads = opts->num_threads;
+  cli->profile = opts->profile;
+  cli->out = stdout;
+  cli->fill = _cli_fill_text;
+
+  if((cli->in = cortex_open(path)) == NULL)
+  {
+    return 0;
+  }
+
+  cli->c_file = cli->in;
+
+  return _cli_set_colours(cli, opts->colours);
+}
+
+void _cli_close(_CLI *cli)
+{
+  if(cli->c_file != NULL)
+  {
+    _cli_free(cli);
+  }
+
+  if(cli->in != NULL)
+  {
+    if(cli->in->file != NULL)
+    {
+      cli_input_bytes += cortex_reader_tell(cli->in->file);
+    }
+
+    cortex_close(cli->in);
+  }
+}
+
+//
+// Commands
+//
+
+int _cli_view(const _CLI_OPTS *opts, char filter)
+{
+  _CLI cli;
+  size_t i;
+
+  if(opts->num_args != 1 || (filter && opts->num_exprs == 0))
+  {
+    fprintf(stderr, "cortex_cli.c: %s takes one input file%s\n",
+            filter ? "filter" : "view",
+            filter ? " and at least one -e <pred>" : "");
+    return EXIT_FAILURE;
+  }
+
+  char success = _cli_open(&cli, opts, opts->args[0]);
+
+  if(success && opts->fields != NULL)
+  {
+    success = _cli_set_fields(&cli, opts->fields);
+  }
+
+  if(success && opts->num_exprs > 0)
+  {
+    cli.preds = (_CLI_PRED*) malloc(opts->num_exprs * sizeof(_CLI_PRED));
+
+    if(cli.preds == NULL)
+    {
+      _cli_oom();
+    }
+
+    for(i = 0; i < opts->num_exprs && success; i++)
+    {
+      success = _cli_parse_pred(&cli, opts->exprs[i], &cli.preds[i]);
+      cli.num_preds++;
+    }
+
+    cli.invert = opts->invert;
+  }
+
+  if(success)
+  {
+    cli.chunk_func = _cli_view_chunk;
+    _cli_init_batches(&cli, 0);
+
+    if(cli.num_fields > 0)
+    {
+      for(i = 0; i < cli.num_fields; i++)
+      {
+        fprintf(cli.out, "%s%s", i == 0 ? "#" : "\t",
+                cli_fields[cli.fields[i]].name);
+      }
+
+      fputc('\n', cli.out);
+    }
+
+    success = _cli_run(&cli);
+  }
+
+  _cli_close(&cli);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void _cli_print_stats(const _CLI *cli)
+{
+  const CORTEX_FILE *c_file = cli->c_file;
+  const _CLI_STATS *totals = &cli->totals;
+  unsigned long records = totals->records > 0 ? totals->records : 1;
+  size_t c;
+
+  fprintf(cli->out, "file\t%s\n", c_file->path);
+  fprintf(cli->out, "kmer_size\t%u\n", (unsigned int)c_file->kmer_size);
+
+  if(c_file->filetype == BUBBLE_FILE)
+  {
+    fprintf(cli->out, "bubbles\t%lu\n", totals->records);
+    fprintf(cli->out, "mean_branch1_length\t%.2f\n",
+            (double)totals->lengths[0] / records);
+    fprintf(cli->out, "mean_branch2_length\t%.2f\n",
+            (double)totals->lengths[1] / records);
+    fprintf(cli->out, "#colour\tHOM1\tHET\tHOM2\tno_call\tmean_covg_br1\t"
+                      "mean_covg_br2\tuncovered\n");
+
+    for(c = 0; c < cli->num_cols; c++)
+    {
+      const _CLI_COLOUR_STATS *colour = &totals->colours[c];
+
+      fprintf(cli->out, "%lu\t%lu\t%lu\t%lu\t%lu\t%.2f\t%.2f\t%lu\n",
+              c_file->colour_arr[cli->cols[c]], colour->calls[HOM1],
+              colour->calls[HET], colour->calls[HOM2],
+              colour->calls[UNKNOWN_HET],
+              colour->kmers[0] > 0 ? (double)colour->covg[0] / colour->kmers[0]
+                                   : 0,
+              colour->kmers[1] > 0 ? (double)colour->covg[1] / colour->kmers[1]
+                                   : 0,
+              colour->uncovered);
+    }
+  }
+  else
+  {
+    fprintf(cli->out, "alignments\t%lu\n", totals->records);
+    fprintf(cli->out, "mean_length\t%.2f\n",
+            (double)totals->lengths[0] / records);
+    fprintf(cli->out, "#colour\tkmers\tcovered\tmean_covg\tmax_covg\n");
+
+    for(c = 0; c < cli->num_cols; c++)
+    {
+      const _CLI_COLOUR_STATS *colour = &totals->colours[c];
+
+      fprintf(cli->out, "%lu\t%llu\t%llu\t%.2f\t%lu\n",
+              c_file->colour_arr[cli->cols[c]], colour->kmers[0],
+              colour->covered,
+              colour->kmers[0] > 0 ? (double)colour->covg[0] / colour->kmers[0]
+                                   : 0,
+              colour->max);
+    }
+  }
+}
+
+int _cli_stats(const _CLI_OPTS *opts)
+{
+  char success = (opts->num_args > 0);
+  int i;
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_cli.c: stats needs at least one input file\n");
+  }
+
+  for(i = 0; i < opts->num_args && success; i++)
+  {
+    _CLI cli;
+
+    if((success = _cli_open(&cli, opts, opts->args[i])))
+    {
+      cli.chunk_func = _cli_stats_chunk;
+      cli.keep_stats = 1;
+      _cli_init_batches(&cli, 0);
+
+      if((success = _cli_run(&cli)))
+      {
+        if(i > 0)
+        {
+          fputc('\n', cli.out);
+        }
+
+        _cli_print_stats(&cli);
+      }
+    }
+
+    _cli_close(&cli);
+  }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int _cli_index(const _CLI_OPTS *opts)
+{
+  if(opts->num_args != 2)
+  {
+    fprintf(stderr, "cortex_cli.c: index takes <in> <out.idx>\n");
+    return EXIT_FAILURE;
+  }
+
+  CORTEX_FILE *c_file = cortex_open(opts->args[0]);
+
+  if(c_file == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+
+  char success = cortex_index_build(c_file, opts->args[1]);
+
+  cli_input_bytes += cortex_reader_tell(c_file->file);
+  cortex_close(c_file);
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Returns a file describing the bubbles of a binary file, or NULL if it isn't
+// one
+CORTEX_FILE* _cli_read_binary_header(FILE *in, const char *path)
+{
+  _CLI_BINARY_HEADER header;
+  unsigned long i;
+
+  if(fread(&header, sizeof(_CLI_BINARY_HEADER), 1, in) != 1 ||
+     memcmp(header.magic, CLI_BINARY_MAGIC, 8) != 0 ||
+     header.filetype != BUBBLE_FILE || header.num_of_colours == 0)
+  {
+    return NULL;
+  }
+
+  // Enough of a CORTEX_FILE to unpack and print bubbles, and to be freed by
+  // cortex_close()
+  CORTEX_FILE *c_file = (CORTEX_FILE*) calloc(1, sizeof(CORTEX_FILE));
+
+  if(c_file == NULL || (c_file->path = strdup(path)) == NULL ||
+     (c_file->colour_arr = (unsigned long*)
+        malloc(header.num_of_colours * sizeof(unsigned long))) == NULL)
+  {
+    _cli_oom();
+  }
+
+  c_file->filetype = BUBBLE_FILE;
+  c_file->kmer_size = header.kmer_size;
+  c_file->has_likelihoods = header.has_likelihoods;
+  c_file->fails_classifier_line = header.fails_classifier_line;
+  c_file->discovery_phase_line = header.discovery_phase_line;
+  c_file->is_diploid = header.is_diploid;
+  c_file->num_of_colours = (unsigned long)header.num_of_colours;
+
+  for(i = 0; i < c_file->num_of_colours; i++)
+  {
+    uint64_t colour;
+
+    if(fread(&colour, sizeof(uint64_t), 1, in) != 1)
+    {
+      cortex_close(c_file);
+      return NULL;
+    }
+
+    c_file->colour_arr[i] = (unsigned long)colour;
+  }
+
+  return c_file;
+}
+
+int _cli_convert(const _CLI_OPTS *opts)
+{
+  if(opts->num_args != 2)
+  {
+    fprintf(stderr, "cortex_cli.c: convert takes <in> <out>\n");
+    return EXIT_FAILURE;
+  }
+
+  const char *in_path = opts->args[0], *out_path = opts->args[1];
+  char magic[8], success = 1;
+  FILE *bin_in = fopen(in_path, "r");
+
+  if(bin_in == NULL)
+  {
+    fprintf(stderr, "cortex_cli.c: couldn't open file (%s)\n", in_path);
+    return EXIT_FAILURE;
+  }
+
+  char is_binary = (fread(magic, 1, 8, bin_in) == 8 &&
+                    memcmp(magic, CLI_BINARY_MAGIC, 8) == 0);
+  _CLI cli;
+
+  if(is_binary)
+  {
+    rewind(bin_in);
+    memset(&cli, 0, sizeof(_CLI));
+    cli.num_threads = opts->num_threads;
+    cli.profile = opts->profile;
+    cli.bin_in = bin_in;
+    cli.in = _cli_read_binary_header(bin_in, in_path);
+    cli.c_file = cli.in;
+    cli.fill = _cli_fill_binary;
+    cli.chunk_func = _cli_unpack_chunk;
+
+    if(cli.in == NULL)
+    {
+      fprintf(stderr, "cortex_cli.c: bad binary file header (%s)\n", in_path);
+      success = 0;
+    }
+  }
+  else
+  {
+    fclose(bin_in);
+    bin_in = NULL;
+
+    if((success = _cli_open(&cli, opts, in_path)) &&
+       cli.c_file->filetype != BUBBLE_FILE)
+    {
+      fprintf(stderr, "cortex_cli.c: only bubble files can be converted to "
+                      "binary (%s)\n", in_path);
+      success = 0;
+    }
+
+    cli.fill = _cli_fill_convert;
+    cli.chunk_func = _cli_pack_chunk;
+  }
+
+  if(success && (cli.out = fopen(out_path, "w")) == NULL)
+  {
+    fprintf(stderr, "cortex_cli.c: couldn't open output file (%s)\n",
+            out_path);
+    success = 0;
+  }
+
+  if(success)
+  {
+    setvbuf(cli.out, NULL, _IOFBF, CLI_OUT_BUFFER);
+
+    if(is_binary)
+    {
+      success = _cli_set_colours(&cli, NULL);
+    }
+
+    _cli_init_batches(&cli, is_binary);
+    success = success && _cli_run(&cli);
+    success = (fclose(cli.out) == 0) && success;
+
+    if(!success)
+    {
+      fprintf(stderr, "cortex_cli.c: failed to convert (%s)\n", in_path);
+    }
+  }
+
+  _cli_close(&cli);
+
+  if(bin_in != NULL)
+  {
+    cli_input_bytes += ftell(bin_in);
+    fclose(bin_in);
+  }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int _cli_cat(const _CLI_OPTS *opts)
+{
+  CORTEX_OPEN_SUMMARY summary;
+  size_t num_files = (size_t)opts->num_args, i;
+  char success = (num_files > 0);
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_cli.c: cat needs at least one input file\n");
+    return EXIT_FAILURE;
+  }
+
+  // Check the files go together before writing anything
+  CORTEX_FILE **files = cortex_open_many((const char**)opts->args, num_files,
+                                         opts->num_threads, &summary);
+  enum CORTEX_FILE_TYPE filetype = UNKNOWN_FILE;
+
+  success = (summary.num_ok == num_files);
+
+  for(i = 0; i < num_files; i++)
+  {
+    if(files[i] != NULL)
+    {
+      filetype = files[i]->filetype;
+      cortex_close(files[i]);
+    }
+  }
+
+  free(files);
+  cortex_open_summary_free(&summary);
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_cli.c: can't cat files that differ\n");
+    return EXIT_FAILURE;
+  }
+
+  if(filetype == BUBBLE_FILE)
+  {
+    // Each file is parsed on its own thread by cortex_multi; bubbles are
+    // packed to be printed on the thread pool
+    _CLI cli;
+    memset(&cli, 0, sizeof(_CLI));
+    cli.num_threads = opts->num_threads;
+    cli.profile = opts->profile;
+    cli.out = stdout;
+
+    if((cli.multi = cortex_multi_open((const char**)opts->args, num_files))
+         == NULL)
+    {
+      return EXIT_FAILURE;
+    }
+
+    cli.c_file = cortex_multi_get_file(cli.multi, 0);
+    cli.fill = _cli_fill_multi;
+    cli.chunk_func = _cli_unpack_chunk;
+
+    success = _cli_set_colours(&cli, NULL);
+    _cli_init_batches(&cli, 1);
+    success = success && _cli_run(&cli);
+
+    for(i = 0; i < num_files; i++)
+    {
+      cli_input_bytes
+        += cortex_reader_tell(cortex_multi_get_file(cli.multi, i)->file);
+    }
+
+    _cli_free(&cli);
+    cortex_multi_close(cli.multi);
+  }
+  else
+  {
+    _CLI_OPTS all_colours = *opts;
+    all_colours.colours = NULL;
+
+    for(i = 0; i < num_files && success; i++)
+    {
+      _CLI cli;
+
+      if((success = _cli_open(&cli, &all_colours, opts->args[i])))
+      {
+        cli.chunk_func = _cli_view_chunk;
+        _cli_init_batches(&cli, 0);
+        success = _cli_run(&cli);
+      }
+
+      _cli_close(&cli);
+    }
+  }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void _cli_usage(const char *cmd)
+{
+  fprintf(stderr,
+"usage: %s <command> [options] <in> [...]\n"
+"\n"
+"Commands:\n"
+"  view <in>               print records\n"
+"  filter <in>             print records matching every -e predicate\n"
+"  stats <in> [...]        per-colour call and coverage summaries\n"
+"  index <in> <out.idx>    build a kmer -> bubble index\n"
+"  convert <in> <out>      bubble text to binary, or binary back to text\n"
+"  cat <in> [...]          merge bubble files in var_num order, or join\n"
+"                          alignment files one after another\n"
+"\n"
+"Options:\n"
+"  -t <n>          threads (default 0: one per cpu)\n"
+"  -c <c1,c2,..>   only these colours (view, filter, stats)\n"
+"  -f <f1,f2,..>   print these fields, tab separated (view, filter)\n"
+"  -e <pred>       <field>[:<colour>]<op><value>, op is one of\n"
+"                  = != < <= > >=  e.g. covg1:0>=5  call=HET  len1<10\n"
+"  -v              print records that don't match (filter)\n"
+"  -p              profile parsing stages with hardware counters, report on\n"
+"                  stderr (runs on one thread)\n"
+"\n"
+"Fields:\n"
+"  bubbles:     var len5p len1 len2 len3p seq5p seq1 seq2 seq3p call\n"
+"               llk_hom1 llk_het llk_hom2 covg1 covg2\n"
+"  alignments:  name seq len covg min max\n"
+"Per-colour fields (call, llk_*, covg*, min and max) have a value for each\n"
+"colour, comma separated.  covg* is mean kmer coverage.  A predicate without\n"
+"a colour holds if it holds for any selected colour.\n", cmd);
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    _cli_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char *cmd = argv[1];
+  _CLI_OPTS opts;
+  int c;
+
+  memset(&opts, 0, sizeof(_CLI_OPTS));
+
+  if((opts.exprs = (const char**) malloc(argc * sizeof(char*))) == NULL)
+  {
+    _cli_oom();
+  }
+
+  while((c = getopt(argc - 1, argv + 1, "t:c:f:e:vp")) != -1)
+  {
+    switch(c)
+    {
+      case 't':
+        opts.num_threads = (unsigned int)strtoul(optarg, NULL, 10);
+        break;
+      case 'c':
+        opts.colours = optarg;
+        break;
+      case 'f':
+        opts.fields = optarg;
+        break;
+      case 'e':
+        opts.exprs[opts.num_exprs++] = optarg;
+        break;
+      case 'v':
+        opts.invert = 1;
+        break;
+      case 'p':
+        opts.profile = 1;
+        break;
+      default:
+        _cli_usage(argv[0]);
+        free(opts.exprs);
+        return EXIT_FAILURE;
+    }
+  }
+
+  opts.args = argv + 1 + optind;
+  opts.num_args = argc - 1 - optind;
+
+  setvbuf(stdout, NULL, _IOFBF, CLI_OUT_BUFFER);
+
+  if(opts.profile)
+  {
+    // Stages are only profiled on this thread
+    opts.num_threads = 1;
+    cortex_prof_start();
+  }
+
+  int result;
+
+  if(strcmp(cmd, "view") == 0)
+  {
+    result = _cli_view(&opts, 0);
+  }
+  else if(strcmp(cmd, "filter") == 0)
+  {
+    result = _cli_view(&opts, 1);
+  }
+  else if(strcmp(cmd, "stats") == 0)
+  {
+    result = _cli_stats(&opts);
+  }
+  else if(strcmp(cmd, "index") == 0)
+  {
+    result = _cli_index(&opts);
+  }
+  else if(strcmp(cmd, "convert") == 0)
+  {
+    result = _cli_convert(&opts);
+  }
+  else if(strcmp(cmd, "cat") == 0)
+  {
+    result = _cli_cat(&opts);
+  }
+  else
+  {
+    _cli_usage(argv[0]);
+    result = EXIT_FAILURE;
+  }
+
+  free(opts.exprs);
+
+  if(fflush(stdout) != 0)
+  {
+    fprintf(stderr, "cortex_cli.c: couldn't write output\n");
+    result = EXIT_FAILURE;
+  }
+
+  if(opts.profile)
+  {
+    cortex_prof_stop();
+    cortex_prof_report(stderr, cli_input_bytes);
+  }
+
+  return result;
+}
@@ -0,0 +1,599 @@
+/*
+ cortex_covg_matrix.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cortex_covg_matrix.h"
+
+// Aim to keep a tile under this many bytes
+#define MATRIX_TILE_BYTES (1UL<<25)
+#define MATRIX_MAX_TILE_BUBBLES 4096
+#define MATRIX_MIN_TILE_BUBBLES 64
+
+// Transpose works on square blocks of this many elements
+#define MATRIX_BLOCK 8
+
+struct CORTEX_COVG_MATRIX
+{
+  FILE *out, *spill;
+  char *path;
+
+  enum CORTEX_MATRIX_STAT stat;
+  enum CORTEX_MATRIX_TYPE type;
+  enum CORTEX_MATRIX_FORMAT format;
+
+  unsigned long num_of_colours, num_bubbles, num_tiles_spilled;
+
+  // An element holds both branches: two uint16 or two floats
+  size_t elem_size;
+
+  // tile_in[bubble][colour] is filled as bubbles are added,
+  // tile_out[colour][bubble] is its transpose
+  void *tile_in, *tile_out;
+  unsigned long tile_bubbles, tile_fill;
+
+  // Set if spilling a tile failed; later adds are ignored
+  char failed;
+
+  // Working space for median calculation
+  unsigned long *scratch;
+  size_t scratch_capacity;
+};
+
+//
+// Transpose
+//
+
+// in is rows x cols, out is cols x rows
+// Only the SSE2 kernels need blocks to be full; edges are done one at a time
+void _matrix_transpose32(const uint32_t *in, uint32_t *out,
+                         size_t rows, size_t cols)
+{
+  size_t r, c, i, j;
+
+  for(r = 0; r < rows; r += MATRIX_BLOCK)
+  {
+    size_t r_end = r + MATRIX_BLOCK < rows ? r + MATRIX_BLOCK : rows;
+
+    for(c = 0; c < cols; c += MATRIX_BLOCK)
+    {
+      size_t c_end = c + MATRIX_BLOCK < cols ? c + MATRIX_BLOCK : cols;
+
+      #ifdef __SSE2__
+      if(r_end - r == MATRIX_BLOCK && c_end - c == MATRIX_BLOCK)
+      {
+        // 4x4 kernels
+        for(i = r; i < r_end; i += 4)
+        {
+          for(j = c; j < c_end; j += 4)
+          {
+            const uint32_t *src = in + i * cols + j;
+            uint32_t *dst = out + j * rows + i;
+
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(src));
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(src + cols));
+            __m128i r2 = _mm_loadu_si128((const __m128i*)(src + 2*cols));
+            __m128i r3 = _mm_loadu_si128((const __m128i*)(src + 3*cols));
+
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+            _mm_storeu_si128((__m128i*)(dst), _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(dst + rows), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(dst + 2*rows), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i*)(dst + 3*rows), _mm_unpackhi_epi64(t2, t3));
+          }
+        }
+        continue;
+      }
+      #endif
+
+      for(i = r; i < r_end; i++)
+      {
+        for(j = c; j < c_end; j++)
+        {
+          out[j * rows + i] = in[i * cols + j];
+        }
+      }
+    }
+  }
+}
+
+void _matrix_transpose64(const uint64_t *in, uint64_t *out,
+                         size_t rows, size_t cols)
+{
+  size_t r, c, i, j;
+
+  for(r = 0; r < rows; r += MATRIX_BLOCK)
+  {
+    size_t r_end = r + MATRIX_BLOCK < rows ? r + MATRIX_BLOCK : rows;
+
+    for(c = 0; c < cols; c += MATRIX_BLOCK)
+    {
+      size_t c_end = c + MATRIX_BLOCK < cols ? c + MATRIX_BLOCK : cols;
+
+      #ifdef __SSE2__
+      if(r_end - r == MATRIX_BLOCK && c_end - c == MATRIX_BLOCK)
+      {
+        // 2x2 kernels
+        for(i = r; i < r_end; i += 2)
+        {
+          for(j = c; j < c_end; j += 2)
+          {
+            const uint64_t *src = in + i * cols + j;
+            uint64_t *dst = out + j * rows + i;
+
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(src));
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(src + cols));
+
+            _mm_storeu_si128((__m128i*)(dst), _mm_unpacklo_epi64(r0, r1));
+            _mm_storeu_si128((__m128i*)(dst + rows), _mm_unpackhi_epi64(r0, r1));
+          }
+        }
+        continue;
+      }
+      #endif
+
+      for(i = r; i < r_end; i++)
+      {
+        for(j = c; j < c_end; j++)
+        {
+          out[j * rows + i] = in[i * cols + j];
+        }
+      }
+    }
+  }
+}
+
+//
+// Coverage summaries
+//
+
+double _matrix_mean(const COLOUR_COVG *covgs)
+{
+  if(covgs->length == 0)
+  {
+    return 0;
+  }
+
+  unsigned long i, sum = 0;
+
+  for(i = 0; i < covgs->length; i++)
+  {
+    sum += covgs->colour_covgs[i];
+  }
+
+  return (double)sum / covgs->length;
+}
+
+// Partially sorts arr so that arr[k] is the k-th smallest value and
+// everything before it is no larger
+void _matrix_select(unsigned long *arr, size_t len, size_t k)
+{
+  size_t left = 0, right = len - 1;
+
+  while(left < right)
+  {
+    unsigned long pivot = arr[left + (right - left) / 2];
+    size_t i = left, j = right;
+
+    while(i <= j)
+    {
+      while(arr[i] < pivot) i++;
+      while(arr[j] > pivot) j--;
+
+      if(i <= j)
+      {
+        unsigned long tmp = arr[i];
+        arr[i] = arr[j];
+        arr[j] = tmp;
+        i++;
+        if(j == 0) break;
+        j--;
+      }
+    }
+
+    if(k <= j)
+    {
+      right = j;
+    }
+    else if(k >= i)
+    {
+      left = i;
+    }
+    else
+    {
+      return;
+    }
+  }
+}
+
+double _matrix_median(CORTEX_COVG_MATRIX *matrix, const COLOUR_COVG *covgs)
+{
+  size_t len = covgs->length;
+
+  if(len == 0)
+  {
+    return 0;
+  }
+
+  if(matrix->scratch_capacity < len)
+  {
+    matrix->scratch_capacity = len;
+    matrix->scratch = realloc(matrix->scratch, len * sizeof(unsigned long));
+  }
+
+  unsigned long *arr = matrix->scratch;
+  memcpy(arr, covgs->colour_covgs, len * sizeof(unsigned long));
+
+  size_t mid = len / 2;
+  _matrix_select(arr, len, mid);
+
+  if(len % 2 == 1)
+  {
+    return arr[mid];
+  }
+
+  // Even length: average with largest value of the lower half
+  unsigned long lower = arr[0];
+  size_t i;
+
+  for(i = 1; i < mid; i++)
+  {
+    if(arr[i] > lower)
+    {
+      lower = arr[i];
+    }
+  }
+
+  return ((double)lower + arr[mid]) / 2;
+}
+
+//
+// Tiles
+//
+
+// Transpose the current tile and append it to the spill file
+char _matrix_spill_tile(CORTEX_COVG_MATRIX *matrix)
+{
+  size_t rows = matrix->tile_fill, cols = matrix->num_of_colours;
+
+  if(matrix->elem_size == sizeof(uint32_t))
+  {
+    _matrix_transpose32(matrix->tile_in, matrix->tile_out, rows, cols);
+  }
+  else
+  {
+    _matrix_transpose64(matrix->tile_in, matrix->tile_out, rows, cols);
+  }
+
+  if(matrix->spill == NULL && (matrix->spill = tmpfile()) == NULL)
+  {
+    fprintf(stderr, "cortex_covg_matrix.c: couldn't create temporary file\n");
+    return 0;
+  }
+
+  if(fwrite(matrix->tile_out, matrix->elem_size, rows * cols, matrix->spill)
+       != rows * cols)
+  {
+    fprintf(stderr, "cortex_covg_matrix.c: couldn't write temporary file\n");
+    return 0;
+  }
+
+  matrix->num_tiles_spilled++;
+  matrix->tile_fill = 0;
+  return 1;
+}
+
+void _matrix_write_npy_header(CORTEX_COVG_MATRIX *matrix)
+{
+  // numpy wants the endianness of the data
+  const uint16_t one = 1;
+  char endian = (*(const char*)&one == 1) ? '<' : '>';
+
+  char dict[200];
+  int dict_len = sprintf(dict, "{'descr': '%c%s', 'fortran_order': False, "
+                               "'shape': (%lu, %lu, 2), }",
+                         endian, matrix->type == MATRIX_UINT16 ? "u2" : "f4",
+                         matrix->num_of_colours, matrix->num_bubbles);
+
+  // magic(6) + version(2) + header length(2) + dict + padding + '\n'
+  // must be a multiple of 64 bytes
+  size_t total = 10 + dict_len + 1;
+  total = (total + 63) / 64 * 64;
+  uint16_t header_len = (uint16_t)(total - 10);
+
+  fwrite("\x93NUMPY\x01\x00", 1, 8, matrix->out);
+  fputc(header_len & 0xff, matrix->out);
+  fputc(header_len >> 8, matrix->out);
+  fwrite(dict, 1, dict_len, matrix->out);
+
+  size_t i;
+  for(i = 10 + dict_len; i < total - 1; i++)
+  {
+    fputc(' ', matrix->out);
+  }
+
+  fputc('\n', matrix->out);
+}
+
+//
+// Public functions
+//
+
+CORTEX_COVG_MATRIX* cortex_covg_matrix_open(const char *path,
+                                            const CORTEX_FILE *c_file,
+                                            enum CORTEX_MATRIX_STAT stat,
+                                            enum CORTEX_MATRIX_TYPE type,
+                                            enum CORTEX_MATRIX_FORMAT format)
+{
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_covg_matrix.c: need a bubble file (%s)\n",
+            c_file->path);
+    return NULL;
+  }
+
+  FILE *out = fopen(path, "wb");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_covg_matrix.c: couldn't open file (%s)\n", path);
+    return NULL;
+  }
+
+  setvbuf(out, NULL, _IOFBF, 1<<20);
+
+  CORTEX_COVG_MATRIX *matrix
+    = (CORTEX_COVG_MATRIX*) malloc(sizeof(CORTEX_COVG_MATRIX));
+
+  matrix->out = out;
+  matrix->spill = NULL;
+  matrix->path = strdup(path);
+  matrix->stat = stat;
+  matrix->type = type;
+  matrix->format = format;
+  matrix->num_of_colours = c_file->num_of_colours;
+  matrix->num_bubbles = 0;
+  matrix->num_tiles_spilled = 0;
+  matrix->elem_size = (type == MATRIX_UINT16) ? 2 * sizeof(uint16_t)
+                                              : 2 * sizeof(float);
+
+  unsigned long tile_bubbles
+    = MATRIX_TILE_BYTES / (matrix->elem_size * c_file->num_of_colours);
+
+  if(tile_bubbles > MATRIX_MAX_TILE_BUBBLES)
+  {
+    tile_bubbles = MATRIX_MAX_TILE_BUBBLES;
+  }
+  else if(tile_bubbles < MATRIX_MIN_TILE_BUBBLES)
+  {
+    tile_bubbles = MATRIX_MIN_TILE_BUBBLES;
+  }
+
+  size_t tile_bytes = tile_bubbles * c_file->num_of_colours * matrix->elem_size;
+
+  matrix->tile_bubbles = tile_bubbles;
+  matrix->tile_fill = 0;
+  matrix->failed = 0;
+  matrix->tile_in = malloc(tile_bytes);
+  matrix->tile_out = malloc(tile_bytes);
+
+  matrix->scratch_capacity = 256;
+  matrix->scratch
+    = (unsigned long*) malloc(matrix->scratch_capacity * sizeof(unsigned long));
+
+  if(matrix->tile_in == NULL || matrix->tile_out == NULL)
+  {
+    fprintf(stderr, "cortex_covg_matrix.c: Couldn't allocate enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return matrix;
+}
+
+void cortex_covg_matrix_add(CORTEX_COVG_MATRIX *matrix,
+                            const CORTEX_BUBBLE *bubble)
+{
+  if(matrix->failed)
+  {
+    return;
+  }
+
+  size_t row_start = matrix->tile_fill * matrix->num_of_colours * 2;
+  unsigned long col;
+  int branch;
+
+  for(col = 0; col < matrix->num_of_colours; col++)
+  {
+    for(branch = 0; branch < 2; branch++)
+    {
+      const COLOUR_COVG *covgs = bubble->branches_colour_covgs[branch][col];
+      double value = matrix->stat == MATRIX_MEAN ? _matrix_mean(covgs)
+                                                 : _matrix_median(matrix, covgs);
+
+      size_t index = row_start + col * 2 + branch;
+
+      if(matrix->type == MATRIX_UINT16)
+      {
+        ((uint16_t*)matrix->tile_in)[index]
+          = value >= 65535 ? 65535 : (uint16_t)(value + 0.5);
+      }
+      else
+      {
+        ((float*)matrix->tile_in)[index] = (float)value;
+      }
+    }
+  }
+
+  matrix->num_bubbles++;
+
+  if(++matrix->tile_fill == matrix->tile_bubbles &&
+     !_matrix_spill_tile(matrix))
+  {
+    matrix->failed = 1;
+    matrix->tile_fill = 0;
+  }
+}
+
+unsigned long cortex_covg_matrix_num_bubbles(const CORTEX_COVG_MATRIX *matrix)
+{
+  return matrix->num_bubbles;
+}
+
+// Copy each colour's row out of the spilled tiles
+char _matrix_assemble(CORTEX_COVG_MATRIX *matrix)
+{
+  size_t elem_size = matrix->elem_size;
+  unsigned long cols = matrix->num_of_colours;
+  unsigned long full_rows = matrix->tile_bubbles;
+  unsigned long last_rows = matrix->num_bubbles -
+                            (matrix->num_tiles_spilled - 1) * full_rows;
+
+  off_t full_tile_bytes = (off_t)full_rows * cols * elem_size;
+  unsigned long col, tile;
+
+  for(col = 0; col < cols; col++)
+  {
+    for(tile = 0; tile < matrix->num_tiles_spilled; tile++)
+    {
+      unsigned long rows = (tile + 1 == matrix->num_tiles_spilled) ? last_rows
+                                                                   : full_rows;
+
+      off_t offset = full_tile_bytes * tile + (off_t)col * rows * elem_size;
+
+      if(fseeko(matrix->spill, offset, SEEK_SET) != 0 ||
+         fread(matrix->tile_out, elem_size, rows, matrix->spill) != rows ||
+         fwrite(matrix->tile_out, elem_size, rows, matrix->out) != rows)
+      {
+        fprintf(stderr, "cortex_covg_matrix.c: failed assembling matrix "
+                        "(%s)\n", matrix->path);
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+// Write the header and every bubble added to the output file
+char _matrix_write(CORTEX_COVG_MATRIX *matrix)
+{
+  if(matrix->format == MATRIX_NPY)
+  {
+    _matrix_write_npy_header(matrix);
+  }
+
+  if(matrix->num_tiles_spilled == 0)
+  {
+    // Everything fits in one tile - no need for the temporary file
+    size_t rows = matrix->tile_fill, cols = matrix->num_of_colours;
+
+    if(matrix->elem_size == sizeof(uint32_t))
+    {
+      _matrix_transpose32(matrix->tile_in, matrix->tile_out, rows, cols);
+    }
+    else
+    {
+      _matrix_transpose64(matrix->tile_in, matrix->tile_out, rows, cols);
+    }
+
+    return fwrite(matrix->tile_out, matrix->elem_size, rows*cols, matrix->out)
+             == rows*cols;
+  }
+
+  if(matrix->tile_fill > 0 && !_matrix_spill_tile(matrix))
+  {
+    return 0;
+  }
+
+  fflush(matrix->spill);
+  return _matrix_assemble(matrix);
+}
+
+char cortex_covg_matrix_close(CORTEX_COVG_MATRIX *matrix)
+{
+  // Nothing is written if bubbles were lost to a failed spill
+  char success = !matrix->failed && _matrix_write(matrix);
+
+  if(fclose(matrix->out) != 0)
+  {
+    success = 0;
+  }
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_covg_matrix.c: couldn't write matrix (%s)\n",
+            matrix->path);
+  }
+
+  if(matrix->spill != NULL)
+  {
+    fclose(matrix->spill);
+  }
+
+  free(matrix->tile_in);
+  free(matrix->tile_out);
+  free(matrix->scratch);
+  free(matrix->path);
+  free(matrix);
+
+  return success;
+}
+
+long cortex_covg_matrix_convert(CORTEX_FILE *c_file, const char *path,
+                                enum CORTEX_MATRIX_STAT stat,
+                                enum CORTEX_MATRIX_TYPE type,
+                                enum CORTEX_MATRIX_FORMAT format)
+{
+  CORTEX_COVG_MATRIX *matrix = cortex_covg_matrix_open(path, c_file, stat,
+                                                       type, format);
+  if(matrix == NULL)
+  {
+    return -1;
+  }
+
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+
+  while(!matrix->failed && cortex_read_bubble(bubble, c_file))
+  {
+    cortex_covg_matrix_add(matrix, bubble);
+  }
+
+  cortex_bubble_free(bubble, c_file);
+
+  unsigned long num_bubbles = matrix->num_bubbles;
+
+  return cortex_covg_matrix_close(matrix) ? (long)num_bubbles : -1;
+}
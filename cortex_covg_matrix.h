@@ -0,0 +1,74 @@
+/*
+ cortex_covg_matrix.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_COVG_MATRIX_H_SEEN
+#define CORTEX_COVG_MATRIX_H_SEEN
+
+#include "cortex.h"
+
+//
+// Colour x bubble coverage matrix
+//
+// Output is a C-order array of shape (num_of_colours, num_bubbles, 2): for
+// each colour, for each bubble, the mean or median coverage of branch 1 then
+// branch 2.  uint16 values saturate at 65535.
+//
+// Bubbles are gathered a tile at a time (row per bubble), transposed to
+// column per colour and spilled to a temporary file.  The output is assembled
+// from the tiles once the number of bubbles is known, so memory use depends on
+// the number of colours, not the number of bubbles.
+//
+
+enum CORTEX_MATRIX_STAT {MATRIX_MEAN, MATRIX_MEDIAN};
+enum CORTEX_MATRIX_TYPE {MATRIX_UINT16, MATRIX_FLOAT32};
+// MATRIX_RAW is just the values; MATRIX_NPY adds a numpy .npy header
+enum CORTEX_MATRIX_FORMAT {MATRIX_RAW, MATRIX_NPY};
+
+typedef struct CORTEX_COVG_MATRIX CORTEX_COVG_MATRIX;
+
+// Returns NULL on failure
+CORTEX_COVG_MATRIX* cortex_covg_matrix_open(const char *path,
+                                            const CORTEX_FILE *c_file,
+                                            enum CORTEX_MATRIX_STAT stat,
+                                            enum CORTEX_MATRIX_TYPE type,
+                                            enum CORTEX_MATRIX_FORMAT format);
+
+// Add the next bubble (column) to the matrix.  If writing to the temporary
+// file fails, this and later adds do nothing and closing returns failure
+void cortex_covg_matrix_add(CORTEX_COVG_MATRIX *matrix,
+                            const CORTEX_BUBBLE *bubble);
+
+unsigned long cortex_covg_matrix_num_bubbles(const CORTEX_COVG_MATRIX *matrix);
+
+// Write the matrix and free memory.  Returns 1 on success, 0 on failure
+char cortex_covg_matrix_close(CORTEX_COVG_MATRIX *matrix);
+
+// Write the matrix for all remaining bubbles in c_file.
+// Returns the number of bubbles written or -1 on failure
+long cortex_covg_matrix_convert(CORTEX_FILE *c_file, const char *path,
+                                enum CORTEX_MATRIX_STAT stat,
+                                enum CORTEX_MATRIX_TYPE type,
+                                enum CORTEX_MATRIX_FORMAT format);
+
+#endif
@@ -0,0 +1,751 @@
+/*
+ cortex_dedup.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "cortex_dedup.h"
+#include "cortex_hash.h"
+#include "cortex_parallel.h"
+
+// Bubbles between checks for a pending hash table grow
+#define DEDUP_BATCH_SIZE 4096
+#define DEDUP_DEFAULT_CAPACITY (1<<20)
+
+// Position of a bubble in the input: file index and record number
+#define DEDUP_RECORD_BITS 40
+#define DEDUP_MAX_FILES ((size_t)1 << (64 - DEDUP_RECORD_BITS))
+
+//
+// Fingerprints: MurmurHash3 x64 128, fed a byte at a time so that the
+// reverse complement can be hashed without building it
+//
+
+typedef struct
+{
+  uint64_t h1, h2;
+  unsigned char tail[16];
+  size_t tail_len, total_len;
+} _FP_STATE;
+
+#define ROTL64(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define FP_C1 0x87c37b91114253d5ULL
+#define FP_C2 0x4cf5ad432745937fULL
+
+uint64_t _fp_fmix(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+uint64_t _fp_load64(const unsigned char *bytes)
+{
+  uint64_t word = 0;
+  int i;
+
+  for(i = 7; i >= 0; i--)
+  {
+    word = (word << 8) | bytes[i];
+  }
+
+  return word;
+}
+
+void _fp_block(_FP_STATE *st)
+{
+  uint64_t k1 = _fp_load64(st->tail), k2 = _fp_load64(st->tail + 8);
+
+  k1 *= FP_C1; k1 = ROTL64(k1, 31); k1 *= FP_C2; st->h1 ^= k1;
+  st->h1 = ROTL64(st->h1, 27); st->h1 += st->h2;
+  st->h1 = st->h1 * 5 + 0x52dce729;
+
+  k2 *= FP_C2; k2 = ROTL64(k2, 33); k2 *= FP_C1; st->h2 ^= k2;
+  st->h2 = ROTL64(st->h2, 31); st->h2 += st->h1;
+  st->h2 = st->h2 * 5 + 0x38495ab5;
+
+  st->tail_len = 0;
+}
+
+void _fp_init(_FP_STATE *st)
+{
+  st->h1 = st->h2 = 0x5eed;
+  st->tail_len = st->total_len = 0;
+}
+
+void _fp_byte(_FP_STATE *st, unsigned char c)
+{
+  st->tail[st->tail_len++] = c;
+  st->total_len++;
+
+  if(st->tail_len == 16)
+  {
+    _fp_block(st);
+  }
+}
+
+void _fp_final(_FP_STATE *st, uint64_t *hi, uint64_t *lo)
+{
+  uint64_t k1 = 0, k2 = 0;
+  size_t i;
+
+  for(i = st->tail_len; i-- > 8; )
+  {
+    k2 = (k2 << 8) | st->tail[i];
+  }
+
+  for(i = (st->tail_len < 8 ? st->tail_len : 8); i-- > 0; )
+  {
+    k1 = (k1 << 8) | st->tail[i];
+  }
+
+  if(st->tail_len > 8)
+  {
+    k2 *= FP_C2; k2 = ROTL64(k2, 33); k2 *= FP_C1; st->h2 ^= k2;
+  }
+
+  if(st->tail_len > 0)
+  {
+    k1 *= FP_C1; k1 = ROTL64(k1, 31); k1 *= FP_C2; st->h1 ^= k1;
+  }
+
+  st->h1 ^= st->total_len;
+  st->h2 ^= st->total_len;
+  st->h1 += st->h2;
+  st->h2 += st->h1;
+  st->h1 = _fp_fmix(st->h1);
+  st->h2 = _fp_fmix(st->h2);
+  st->h1 += st->h2;
+  st->h2 += st->h1;
+
+  *hi = st->h1 & CORTEX_HASH_KEY_MASK;
+  *lo = st->h2;
+}
+
+char _fp_complement(char c)
+{
+  switch(c)
+  {
+    case 'A': return 'T';
+    case 'C': return 'G';
+    case 'G': return 'C';
+    case 'T': return 'A';
+    default: return c;
+  }
+}
+
+void _fp_seq(_FP_STATE *st, const StrBuf *seq, char reverse)
+{
+  t_buf_pos len = strbuf_len(seq), i;
+
+  if(reverse)
+  {
+    for(i = len; i-- > 0; )
+    {
+      _fp_byte(st, _fp_complement(toupper(seq->buff[i])));
+    }
+  }
+  else
+  {
+    for(i = 0; i < len; i++)
+    {
+      _fp_byte(st, toupper(seq->buff[i]));
+    }
+  }
+
+  // Separator, so sequences can't run into each other
+  _fp_byte(st, '|');
+}
+
+void cortex_bubble_fingerprint(const CORTEX_BUBBLE *bubble,
+                               CORTEX_FINGERPRINT *fingerprint)
+{
+  _FP_STATE fw, rv;
+  uint64_t fw_hi, fw_lo, rv_hi, rv_lo;
+
+  _fp_init(&fw);
+  _fp_seq(&fw, bubble->flank_5p.seq, 0);
+  _fp_seq(&fw, bubble->branches[0].seq, 0);
+  _fp_seq(&fw, bubble->branches[1].seq, 0);
+  _fp_seq(&fw, bubble->flank_3p.seq, 0);
+  _fp_final(&fw, &fw_hi, &fw_lo);
+
+  // On the other strand the 3' flank comes first
+  _fp_init(&rv);
+  _fp_seq(&rv, bubble->flank_3p.seq, 1);
+  _fp_seq(&rv, bubble->branches[0].seq, 1);
+  _fp_seq(&rv, bubble->branches[1].seq, 1);
+  _fp_seq(&rv, bubble->flank_5p.seq, 1);
+  _fp_final(&rv, &rv_hi, &rv_lo);
+
+  if(rv_hi < fw_hi || (rv_hi == fw_hi && rv_lo < fw_lo))
+  {
+    fingerprint->hi = rv_hi;
+    fingerprint->lo = rv_lo;
+    fingerprint->reversed = 1;
+  }
+  else
+  {
+    fingerprint->hi = fw_hi;
+    fingerprint->lo = fw_lo;
+    fingerprint->reversed = 0;
+  }
+
+  fingerprint->swapped = 0;
+}
+
+void _fp_word(_FP_STATE *st, uint64_t word)
+{
+  int i;
+
+  for(i = 0; i < 8; i++)
+  {
+    _fp_byte(st, (unsigned char)(word >> (8 * i)));
+  }
+}
+
+// Hash each branch on one strand, then the two hashes smallest first
+void _fp_branch_pair(const CORTEX_BUBBLE *bubble, char reverse,
+                     uint64_t *hi, uint64_t *lo, char *swapped)
+{
+  _FP_STATE st;
+  uint64_t branch_hi[2], branch_lo[2];
+  int b, first;
+
+  for(b = 0; b < 2; b++)
+  {
+    _fp_init(&st);
+    _fp_seq(&st, bubble->branches[b].seq, reverse);
+    _fp_final(&st, &branch_hi[b], &branch_lo[b]);
+  }
+
+  first = (branch_hi[1] < branch_hi[0] ||
+           (branch_hi[1] == branch_hi[0] && branch_lo[1] < branch_lo[0]));
+
+  _fp_init(&st);
+
+  for(b = 0; b < 2; b++)
+  {
+    _fp_word(&st, branch_hi[b ^ first]);
+    _fp_word(&st, branch_lo[b ^ first]);
+  }
+
+  _fp_final(&st, hi, lo);
+  *swapped = (char)first;
+}
+
+void cortex_bubble_branch_fingerprint(const CORTEX_BUBBLE *bubble,
+                                      CORTEX_FINGERPRINT *fingerprint)
+{
+  uint64_t fw_hi, fw_lo, rv_hi, rv_lo;
+  char fw_swapped, rv_swapped;
+
+  _fp_branch_pair(bubble, 0, &fw_hi, &fw_lo, &fw_swapped);
+  _fp_branch_pair(bubble, 1, &rv_hi, &rv_lo, &rv_swapped);
+
+  if(rv_hi < fw_hi || (rv_hi == fw_hi && rv_lo < fw_lo))
+  {
+    fingerprint->hi = rv_hi;
+    fingerprint->lo = rv_lo;
+    fingerprint->reversed = 1;
+    fingerprint->swapped = rv_swapped;
+  }
+  else
+  {
+    fingerprint->hi = fw_hi;
+    fingerprint->lo = fw_lo;
+    fingerprint->reversed = 0;
+    fingerprint->swapped = fw_swapped;
+  }
+}
+
+//
+// Dedup
+//
+// Pass 1 records the first position of each fingerprint.  With merge_covg,
+// pass 2 adds the coverage of every later copy into a buffer for the copy
+// that is kept.  The last pass writes kept bubbles, one temporary file per
+// input, which are concatenated in input order at the end.
+//
+
+typedef struct
+{
+  CORTEX_FILE **c_files;
+  CORTEX_HASH *hash;
+
+  // Coordinate growing the table: no batch may run while it grows
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned int active;
+  char growing;
+
+  // Merged coverage per hash slot: [total length, then values for each
+  // branch and colour in fingerprint orientation]
+  unsigned long **merged;
+
+  FILE **outs;
+  unsigned long *num_kept;
+  unsigned long num_bubbles;
+  char failed;
+} _DEDUP_ARGS;
+
+uint64_t _dedup_position(size_t file, unsigned long record)
+{
+  return ((uint64_t)file << DEDUP_RECORD_BITS) | record;
+}
+
+void _dedup_enter_batch(_DEDUP_ARGS *args)
+{
+  pthread_mutex_lock(&args->lock);
+
+  while(args->growing)
+  {
+    pthread_cond_wait(&args->cond, &args->lock);
+  }
+
+  args->active++;
+  pthread_mutex_unlock(&args->lock);
+}
+
+void _dedup_leave_batch(_DEDUP_ARGS *args)
+{
+  pthread_mutex_lock(&args->lock);
+  args->active--;
+  pthread_cond_broadcast(&args->cond);
+  pthread_mutex_unlock(&args->lock);
+}
+
+// Called outside a batch when the table was found full at old_capacity
+void _dedup_grow(_DEDUP_ARGS *args, size_t old_capacity)
+{
+  pthread_mutex_lock(&args->lock);
+
+  while(args->growing)
+  {
+    pthread_cond_wait(&args->cond, &args->lock);
+  }
+
+  if(cortex_hash_capacity(args->hash) == old_capacity)
+  {
+    args->growing = 1;
+
+    while(args->active > 0)
+    {
+      pthread_cond_wait(&args->cond, &args->lock);
+    }
+
+    cortex_hash_grow(args->hash, old_capacity * 2);
+    args->growing = 0;
+    pthread_cond_broadcast(&args->cond);
+  }
+
+  pthread_mutex_unlock(&args->lock);
+}
+
+void _dedup_find_firsts(size_t file, void *ptr)
+{
+  _DEDUP_ARGS *args = (_DEDUP_ARGS*)ptr;
+  CORTEX_FILE *c_file = args->c_files[file];
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  CORTEX_FINGERPRINT fp;
+  unsigned long record = 0;
+  char more = 1;
+
+  while(more)
+  {
+    unsigned long batch_end = record + DEDUP_BATCH_SIZE;
+    size_t full_capacity = 0;
+
+    _dedup_enter_batch(args);
+
+    while(record < batch_end && (more = cortex_read_bubble(bubble, c_file)))
+    {
+      uint64_t pos = _dedup_position(file, record), *value, old;
+
+      cortex_bubble_fingerprint(bubble, &fp);
+
+      enum CORTEX_HASH_RESULT result
+        = cortex_hash_insert(args->hash, fp.hi, fp.lo, pos, &value);
+
+      if(result == CORTEX_HASH_FULL)
+      {
+        // Leave this bubble for after the grow
+        full_capacity = cortex_hash_capacity(args->hash);
+        break;
+      }
+
+      if(result == CORTEX_HASH_FOUND)
+      {
+        // Keep the earliest position
+        while(pos < (old = __atomic_load_n(value, __ATOMIC_RELAXED)) &&
+              !__sync_bool_compare_and_swap(value, old, pos));
+      }
+
+      record++;
+    }
+
+    _dedup_leave_batch(args);
+
+    if(full_capacity > 0)
+    {
+      // Grow, then insert the bubble we couldn't (other threads may fill the
+      // new table first)
+      uint64_t pos = _dedup_position(file, record), *value, old;
+      enum CORTEX_HASH_RESULT result = CORTEX_HASH_FULL;
+
+      while(result == CORTEX_HASH_FULL)
+      {
+        _dedup_grow(args, full_capacity);
+        _dedup_enter_batch(args);
+
+        result = cortex_hash_insert(args->hash, fp.hi, fp.lo, pos, &value);
+        full_capacity = cortex_hash_capacity(args->hash);
+
+        while(result == CORTEX_HASH_FOUND &&
+              pos < (old = __atomic_load_n(value, __ATOMIC_RELAXED)) &&
+              !__sync_bool_compare_and_swap(value, old, pos));
+
+        _dedup_leave_batch(args);
+      }
+
+      record++;
+    }
+  }
+
+  __sync_fetch_and_add(&args->num_bubbles, record);
+  cortex_bubble_free(bubble, c_file);
+}
+
+unsigned long _dedup_covg_length(const CORTEX_BUBBLE *bubble,
+                                 const CORTEX_FILE *c_file)
+{
+  unsigned long length = 0, col;
+  int branch;
+
+  for(branch = 0; branch < 2; branch++)
+  {
+    for(col = 0; col < c_file->num_of_colours; col++)
+    {
+      length += bubble->branches_colour_covgs[branch][col]->length;
+    }
+  }
+
+  return length;
+}
+
+// Add (add == 1) bubble's coverage into merged, or merged into the bubble
+// (add == 0), flipping each array if the bubble is the other way round
+void _dedup_covg_transfer(unsigned long *merged, CORTEX_BUBBLE *bubble,
+                          const CORTEX_FILE *c_file, char reversed, char add)
+{
+  unsigned long col, i, pos = 1;
+  int branch;
+
+  for(branch = 0; branch < 2; branch++)
+  {
+    for(col = 0; col < c_file->num_of_colours; col++)
+    {
+      COLOUR_COVG *covgs = bubble->branches_colour_covgs[branch][col];
+
+      for(i = 0; i < covgs->length; i++)
+      {
+        unsigned long j = reversed ? covgs->length - 1 - i : i;
+
+        if(add)
+        {
+          __sync_fetch_and_add(&merged[pos + i], covgs->colour_covgs[j]);
+        }
+        else
+        {
+          covgs->colour_covgs[j] += merged[pos + i];
+        }
+      }
+
+      pos += covgs->length;
+    }
+  }
+}
+
+void _dedup_merge_covgs(size_t file, void *ptr)
+{
+  _DEDUP_ARGS *args = (_DEDUP_ARGS*)ptr;
+  CORTEX_FILE *c_file = args->c_files[file];
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  CORTEX_FINGERPRINT fp;
+  unsigned long record;
+
+  cortex_seek(c_file, 0);
+
+  for(record = 0; cortex_read_bubble(bubble, c_file); record++)
+  {
+    cortex_bubble_fingerprint(bubble, &fp);
+
+    long slot = cortex_hash_slot(args->hash, fp.hi, fp.lo);
+    uint64_t first = *cortex_hash_find(args->hash, fp.hi, fp.lo);
+
+    if(first == _dedup_position(file, record))
+    {
+      continue;
+    }
+
+    unsigned long length = _dedup_covg_length(bubble, c_file);
+    unsigned long *merged = __atomic_load_n(&args->merged[slot],
+                                            __ATOMIC_ACQUIRE);
+
+    if(merged == NULL)
+    {
+      merged = (unsigned long*) calloc(length + 1, sizeof(unsigned long));
+      merged[0] = length;
+
+      unsigned long *existing = NULL;
+
+      if(!__atomic_compare_exchange_n(&args->merged[slot], &existing, merged,
+                                      0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+        free(merged);
+        merged = existing;
+      }
+    }
+
+    if(merged[0] != length)
+    {
+      fprintf(stderr, "cortex_dedup.c: duplicate bubble has different "
+                      "coverage lengths, not merged (%s:%lu)\n",
+              c_file->path, c_file->line_number);
+      continue;
+    }
+
+    _dedup_covg_transfer(merged, bubble, c_file, fp.reversed, 1);
+  }
+
+  cortex_bubble_free(bubble, c_file);
+}
+
+void _dedup_write_kept(size_t file, void *ptr)
+{
+  _DEDUP_ARGS *args = (_DEDUP_ARGS*)ptr;
+  CORTEX_FILE *c_file = args->c_files[file];
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  CORTEX_FINGERPRINT fp;
+  unsigned long record;
+  FILE *out = tmpfile();
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_dedup.c: couldn't create temporary file\n");
+    args->failed = 1;
+    cortex_bubble_free(bubble, c_file);
+    return;
+  }
+
+  cortex_seek(c_file, 0);
+
+  for(record = 0; cortex_read_bubble(bubble, c_file); record++)
+  {
+    cortex_bubble_fingerprint(bubble, &fp);
+
+    long slot = cortex_hash_slot(args->hash, fp.hi, fp.lo);
+    uint64_t first = *cortex_hash_find(args->hash, fp.hi, fp.lo);
+
+    if(first != _dedup_position(file, record))
+    {
+      continue;
+    }
+
+    if(args->merged != NULL && args->merged[slot] != NULL &&
+       args->merged[slot][0] == _dedup_covg_length(bubble, c_file))
+    {
+      _dedup_covg_transfer(args->merged[slot], bubble, c_file,
+                           fp.reversed, 0);
+    }
+
+    cortex_fprint_bubble(out, bubble, c_file);
+    args->num_kept[file]++;
+  }
+
+  if(fflush(out) != 0)
+  {
+    fprintf(stderr, "cortex_dedup.c: couldn't write temporary file\n");
+    args->failed = 1;
+  }
+
+  rewind(out);
+  args->outs[file] = out;
+  cortex_bubble_free(bubble, c_file);
+}
+
+long cortex_dedup(const char **paths, size_t num_files, const char *out_path,
+                  char merge_covg, size_t expected_bubbles,
+                  unsigned int num_threads, unsigned long *num_duplicates)
+{
+  if(num_files == 0 || num_files >= DEDUP_MAX_FILES)
+  {
+    fprintf(stderr, "cortex_dedup.c: can't dedup %lu files\n",
+            (unsigned long)num_files);
+    return -1;
+  }
+
+  CORTEX_OPEN_SUMMARY summary;
+  CORTEX_FILE **c_files = cortex_open_many(paths, num_files, num_threads,
+                                           &summary);
+
+  if(c_files == NULL)
+  {
+    return -1;
+  }
+
+  char success = (summary.num_ok == num_files);
+  size_t i;
+
+  cortex_open_summary_free(&summary);
+
+  for(i = 0; i < num_files && success; i++)
+  {
+    if(c_files[i]->filetype != BUBBLE_FILE ||
+       c_files[i]->has_likelihoods != c_files[0]->has_likelihoods)
+    {
+      fprintf(stderr, "cortex_dedup.c: not a bubble file or likelihoods "
+                      "differ from %s (%s)\n", paths[0], paths[i]);
+      success = 0;
+    }
+  }
+
+  FILE *out = NULL;
+
+  if(success && (out = fopen(out_path, "w")) == NULL)
+  {
+    fprintf(stderr, "cortex_dedup.c: couldn't open output file (%s)\n",
+            out_path);
+    success = 0;
+  }
+
+  if(!success)
+  {
+    for(i = 0; i < num_files; i++)
+    {
+      if(c_files[i] != NULL)
+      {
+        cortex_close(c_files[i]);
+      }
+    }
+
+    free(c_files);
+    return -1;
+  }
+
+  _DEDUP_ARGS args;
+  args.c_files = c_files;
+  args.hash = cortex_hash_create(expected_bubbles > 0 ?
+                                 expected_bubbles / 3 * 4 + 1 :
+                                 DEDUP_DEFAULT_CAPACITY);
+  args.active = 0;
+  args.growing = 0;
+  args.merged = NULL;
+  args.outs = (FILE**) calloc(num_files, sizeof(FILE*));
+  args.num_kept = (unsigned long*) calloc(num_files, sizeof(unsigned long));
+  args.num_bubbles = 0;
+  args.failed = 0;
+  pthread_mutex_init(&args.lock, NULL);
+  pthread_cond_init(&args.cond, NULL);
+
+  cortex_parallel_for(num_files, num_threads, _dedup_find_firsts, &args);
+
+  if(merge_covg && args.num_bubbles > cortex_hash_size(args.hash))
+  {
+    args.merged = (unsigned long**)
+                  calloc(cortex_hash_capacity(args.hash), sizeof(unsigned long*));
+    cortex_parallel_for(num_files, num_threads, _dedup_merge_covgs, &args);
+  }
+
+  cortex_parallel_for(num_files, num_threads, _dedup_write_kept, &args);
+
+  // Concatenate outputs in input order
+  long num_written = 0;
+  char *copy_buf = (char*) malloc(1<<16);
+  size_t bytes;
+
+  for(i = 0; i < num_files; i++)
+  {
+    if(args.outs[i] == NULL)
+    {
+      continue;
+    }
+
+    while((bytes = fread(copy_buf, 1, 1<<16, args.outs[i])) > 0)
+    {
+      if(fwrite(copy_buf, 1, bytes, out) != bytes)
+      {
+        args.failed = 1;
+        break;
+      }
+    }
+
+    fclose(args.outs[i]);
+    num_written += args.num_kept[i];
+  }
+
+  if(fclose(out) != 0 || args.failed)
+  {
+    fprintf(stderr, "cortex_dedup.c: couldn't write output file (%s)\n",
+            out_path);
+    num_written = -1;
+  }
+
+  if(num_duplicates != NULL)
+  {
+    *num_duplicates = args.num_bubbles - cortex_hash_size(args.hash);
+  }
+
+  // Clean up
+  if(args.merged != NULL)
+  {
+    for(i = 0; i < cortex_hash_capacity(args.hash); i++)
+    {
+      free(args.merged[i]);
+    }
+
+    free(args.merged);
+  }
+
+  for(i = 0; i < num_files; i++)
+  {
+    cortex_close(c_files[i]);
+  }
+
+  free(copy_buf);
+  free(c_files);
+  free(args.outs);
+  free(args.num_kept);
+  cortex_hash_free(args.hash);
+  pthread_mutex_destroy(&args.lock);
+  pthread_cond_destroy(&args.cond);
+
+  return num_written;
+}
@@ -0,0 +1,72 @@
+/*
+ cortex_dedup.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_DEDUP_H_SEEN
+#define CORTEX_DEDUP_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cortex.h"
+
+//
+// Remove duplicate bubbles across files
+//
+// Bubbles are identified by a 128-bit fingerprint of their flanks and
+// branches that is the same for a bubble and its reverse complement, so the
+// same bubble called in different runs (with different var_nums) matches.
+//
+
+typedef struct CORTEX_FINGERPRINT CORTEX_FINGERPRINT;
+
+struct CORTEX_FINGERPRINT
+{
+  uint64_t hi, lo;
+  // 1 if the fingerprint came from the reverse complement of the bubble
+  char reversed;
+  // 1 if branch 2 was hashed before branch 1 (branch fingerprints only)
+  char swapped;
+};
+
+void cortex_bubble_fingerprint(const CORTEX_BUBBLE *bubble,
+                               CORTEX_FINGERPRINT *fingerprint);
+
+// Fingerprint of the two branches alone, which is also the same whichever
+// order the branches are in.  Matches a bubble between runs that extended
+// its flanks differently or reported the branches the other way round
+void cortex_bubble_branch_fingerprint(const CORTEX_BUBBLE *bubble,
+                                      CORTEX_FINGERPRINT *fingerprint);
+
+// Write each distinct bubble in the files to out_path once, keeping the
+// first copy in file order.  Files must have the same colours and kmer size.
+// With merge_covg, per-kmer coverage of later copies is added to the copy
+// that is kept.  expected_bubbles sizes the hash table (0 for a default; it
+// grows as needed).  Files are processed in parallel on num_threads threads
+// (0 means one per cpu).  Returns the number of bubbles written or -1 on
+// error.  If num_duplicates is not NULL it is set to the number dropped
+long cortex_dedup(const char **paths, size_t num_files, const char *out_path,
+                  char merge_covg, size_t expected_bubbles,
+                  unsigned int num_threads, unsigned long *num_duplicates);
+
+#endif
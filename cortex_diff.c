@@ -0,0 +1,492 @@
+/*
+ cortex_diff.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "string_buffer.h"
+#include "cortex_diff.h"
+#include "cortex_dedup.h"
+#include "cortex_hash.h"
+#include "cortex_parallel.h"
+
+// Records per unit of parallel work, and chunks formatted before writing
+#define DIFF_CHUNK_SIZE 4096
+#define DIFF_WINDOW_CHUNKS 64
+
+#define DIFF_UNMATCHED UINT64_MAX
+
+const char *diff_call_names[] = {"UNKNOWN", "HOM1", "HOM2", "HET"};
+
+typedef struct
+{
+  uint64_t hi, lo;
+  unsigned long var_num;
+  char swapped;
+} _DIFF_RECORD;
+
+typedef struct
+{
+  CORTEX_FILE *c_file;
+  _DIFF_RECORD *records;
+  size_t num_records, capacity;
+  // With likelihoods: calls[record * colours + col] and three llks per call
+  // (hom_br1, het, hom_br2)
+  unsigned char *calls;
+  float *llks;
+  // For file a: the first record in b with the same fingerprint
+  // For file b: the record in a with the same fingerprint
+  uint64_t *matches;
+} _DIFF_SIDE;
+
+typedef struct
+{
+  _DIFF_SIDE sides[2];
+  CORTEX_HASH *hash;
+  // Index in file b of each of file a's colours, or -1
+  long *colour_map;
+  float llk_tolerance;
+  char compare_calls;
+  // Output of the window being formatted: chunks of b's records, then
+  // chunks of a's
+  size_t first_chunk, num_b_chunks, num_chunks;
+  StrBuf **chunks;
+  CORTEX_DIFF_STATS *chunk_stats;
+} _DIFF_ARGS;
+
+size_t _diff_num_chunks(size_t num_records)
+{
+  return (num_records + DIFF_CHUNK_SIZE - 1) / DIFF_CHUNK_SIZE;
+}
+
+void _diff_side_grow(_DIFF_SIDE *side)
+{
+  const CORTEX_FILE *c_file = side->c_file;
+  size_t num_calls;
+
+  side->capacity = side->capacity == 0 ? DIFF_CHUNK_SIZE : side->capacity * 2;
+  num_calls = side->capacity * c_file->num_of_colours;
+
+  side->records = (_DIFF_RECORD*)
+                  realloc(side->records, side->capacity * sizeof(_DIFF_RECORD));
+
+  if(c_file->has_likelihoods && num_calls > 0)
+  {
+    side->calls = (unsigned char*) realloc(side->calls, num_calls);
+    side->llks = (float*) realloc(side->llks, 3 * num_calls * sizeof(float));
+
+    if(side->calls == NULL || side->llks == NULL)
+    {
+      side->records = NULL;
+    }
+  }
+
+  if(side->records == NULL)
+  {
+    fprintf(stderr, "cortex_diff.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void _diff_read_side(size_t s, void *ptr)
+{
+  _DIFF_ARGS *args = (_DIFF_ARGS*)ptr;
+  _DIFF_SIDE *side = &args->sides[s];
+  CORTEX_FILE *c_file = side->c_file;
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  CORTEX_FINGERPRINT fp;
+  unsigned long num_colours = c_file->num_of_colours, col;
+
+  while(cortex_read_bubble(bubble, c_file))
+  {
+    if(side->num_records == side->capacity)
+    {
+      _diff_side_grow(side);
+    }
+
+    _DIFF_RECORD *record = &side->records[side->num_records];
+
+    cortex_bubble_branch_fingerprint(bubble, &fp);
+    record->hi = fp.hi;
+    record->lo = fp.lo;
+    record->var_num = bubble->var_num;
+    record->swapped = fp.swapped;
+
+    if(c_file->has_likelihoods)
+    {
+      unsigned char *calls = side->calls + side->num_records * num_colours;
+      float *llks = side->llks + side->num_records * num_colours * 3;
+
+      for(col = 0; col < num_colours; col++)
+      {
+        calls[col] = (unsigned char)bubble->calls[col];
+        llks[3*col] = bubble->llk_hom_br1[col];
+        llks[3*col+1] = c_file->is_diploid ? bubble->llk_het[col] : 0;
+        llks[3*col+2] = bubble->llk_hom_br2[col];
+      }
+    }
+
+    side->num_records++;
+  }
+
+  cortex_bubble_free(bubble, c_file);
+}
+
+// Keep the smallest index in *value
+void _diff_atomic_min(uint64_t *value, uint64_t index)
+{
+  uint64_t old;
+
+  while(index < (old = __atomic_load_n(value, __ATOMIC_RELAXED)) &&
+        !__sync_bool_compare_and_swap(value, old, index));
+}
+
+void _diff_build(size_t chunk, void *ptr)
+{
+  _DIFF_ARGS *args = (_DIFF_ARGS*)ptr;
+  const _DIFF_SIDE *side = &args->sides[0];
+  size_t i = chunk * DIFF_CHUNK_SIZE, end = i + DIFF_CHUNK_SIZE;
+  uint64_t *value;
+
+  end = end < side->num_records ? end : side->num_records;
+
+  for(; i < end; i++)
+  {
+    const _DIFF_RECORD *record = &side->records[i];
+
+    // The table was sized for every record so it can't fill up
+    if(cortex_hash_insert(args->hash, record->hi, record->lo, i, &value)
+       == CORTEX_HASH_FOUND)
+    {
+      _diff_atomic_min(value, i);
+    }
+  }
+}
+
+void _diff_probe(size_t chunk, void *ptr)
+{
+  _DIFF_ARGS *args = (_DIFF_ARGS*)ptr;
+  _DIFF_SIDE *side_a = &args->sides[0], *side_b = &args->sides[1];
+  size_t i = chunk * DIFF_CHUNK_SIZE, end = i + DIFF_CHUNK_SIZE;
+
+  end = end < side_b->num_records ? end : side_b->num_records;
+
+  for(; i < end; i++)
+  {
+    const _DIFF_RECORD *record = &side_b->records[i];
+    const uint64_t *value = cortex_hash_find(args->hash, record->hi,
+                                             record->lo);
+
+    side_b->matches[i] = (value == NULL ? DIFF_UNMATCHED : *value);
+
+    if(value != NULL)
+    {
+      _diff_atomic_min(&side_a->matches[*value], i);
+    }
+  }
+}
+
+char _diff_llk_moved(float llk_a, float llk_b, float tolerance)
+{
+  // Equal infinities give nan, which is not a change
+  return fabsf(llk_a - llk_b) > tolerance;
+}
+
+void _diff_print_llks(StrBuf *sbuf, const float *llks, char diploid)
+{
+  if(diploid)
+  {
+    strbuf_sprintf(sbuf, "%.2f,%.2f,%.2f", llks[0], llks[1], llks[2]);
+  }
+  else
+  {
+    strbuf_sprintf(sbuf, "%.2f,.,%.2f", llks[0], llks[2]);
+  }
+}
+
+// Write a 'changed' line for each colour that differs, returning how many
+unsigned long _diff_compare(StrBuf *sbuf, const _DIFF_ARGS *args,
+                            size_t a, size_t b)
+{
+  const _DIFF_SIDE *side_a = &args->sides[0], *side_b = &args->sides[1];
+  const _DIFF_RECORD *record_a = &side_a->records[a];
+  const _DIFF_RECORD *record_b = &side_b->records[b];
+  unsigned long colours_a = side_a->c_file->num_of_colours;
+  unsigned long colours_b = side_b->c_file->num_of_colours;
+  char diploid_a = side_a->c_file->is_diploid;
+  char diploid_b = side_b->c_file->is_diploid;
+  char flip = (record_a->swapped != record_b->swapped);
+  unsigned long col, num_changed = 0;
+
+  for(col = 0; col < colours_a; col++)
+  {
+    if(args->colour_map[col] < 0)
+    {
+      continue;
+    }
+
+    size_t col_b = (size_t)args->colour_map[col];
+    unsigned char call_a = side_a->calls[a * colours_a + col];
+    unsigned char call_b = side_b->calls[b * colours_b + col_b];
+    const float *llks_a = side_a->llks + 3 * (a * colours_a + col);
+    const float *llks = side_b->llks + 3 * (b * colours_b + col_b);
+    float llks_b[3];
+
+    // Put b's branches in a's order
+    if(flip)
+    {
+      call_b = (call_b == HOM1 ? HOM2 : (call_b == HOM2 ? HOM1 : call_b));
+      llks_b[0] = llks[2];
+      llks_b[2] = llks[0];
+    }
+    else
+    {
+      llks_b[0] = llks[0];
+      llks_b[2] = llks[2];
+    }
+
+    llks_b[1] = llks[1];
+
+    if(call_a == call_b &&
+       !_diff_llk_moved(llks_a[0], llks_b[0], args->llk_tolerance) &&
+       !_diff_llk_moved(llks_a[2], llks_b[2], args->llk_tolerance) &&
+       !(diploid_a && diploid_b &&
+         _diff_llk_moved(llks_a[1], llks_b[1], args->llk_tolerance)))
+    {
+      continue;
+    }
+
+    strbuf_sprintf(sbuf, "changed\t%lu\t%lu\t%lu\t%s\t%s\t", record_a->var_num,
+                   record_b->var_num, side_a->c_file->colour_arr[col],
+                   diff_call_names[call_a & 3], diff_call_names[call_b & 3]);
+    _diff_print_llks(sbuf, llks_a, diploid_a);
+    strbuf_append_char(sbuf, '\t');
+    _diff_print_llks(sbuf, llks_b, diploid_b);
+    strbuf_append_char(sbuf, '\n');
+    num_changed++;
+  }
+
+  return num_changed;
+}
+
+// Chunks of b report matched and added bubbles, chunks of a removed ones
+void _diff_format_chunk(size_t i, void *ptr)
+{
+  _DIFF_ARGS *args = (_DIFF_ARGS*)ptr;
+  size_t chunk = args->first_chunk + i;
+  char is_b = (chunk < args->num_b_chunks);
+  const _DIFF_SIDE *side = &args->sides[is_b ? 1 : 0];
+  const _DIFF_SIDE *side_a = &args->sides[0];
+  StrBuf *sbuf = args->chunks[i];
+  CORTEX_DIFF_STATS *stats = &args->chunk_stats[i];
+  size_t r, end;
+
+  strbuf_reset(sbuf);
+  memset(stats, 0, sizeof(CORTEX_DIFF_STATS));
+
+  r = (is_b ? chunk : chunk - args->num_b_chunks) * DIFF_CHUNK_SIZE;
+  end = r + DIFF_CHUNK_SIZE < side->num_records ? r + DIFF_CHUNK_SIZE
+                                                 : side->num_records;
+
+  for(; r < end; r++)
+  {
+    uint64_t match = side->matches[r];
+
+    if(!is_b)
+    {
+      if(match == DIFF_UNMATCHED)
+      {
+        strbuf_sprintf(sbuf, "removed\t%lu\t.\t.\t.\t.\t.\t.\n",
+                       side->records[r].var_num);
+        stats->removed++;
+      }
+    }
+    else if(match == DIFF_UNMATCHED || side_a->matches[match] != r)
+    {
+      // Not in a, or a later copy of a bubble that is
+      strbuf_sprintf(sbuf, "added\t.\t%lu\t.\t.\t.\t.\t.\n",
+                     side->records[r].var_num);
+      stats->added++;
+    }
+    else
+    {
+      unsigned long num_changed = 0;
+
+      if(args->compare_calls)
+      {
+        num_changed = _diff_compare(sbuf, args, match, r);
+      }
+
+      stats->matched++;
+      stats->changed_bubbles += (num_changed > 0);
+      stats->changed_colours += num_changed;
+    }
+  }
+}
+
+char cortex_diff(CORTEX_FILE *file_a, CORTEX_FILE *file_b,
+                 const char *out_path, float llk_tolerance,
+                 unsigned int num_threads, CORTEX_DIFF_STATS *stats)
+{
+  if(file_a->filetype != BUBBLE_FILE || file_b->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_diff.c: not a bubble file (%s)\n",
+            file_a->filetype != BUBBLE_FILE ? file_a->path : file_b->path);
+    return 0;
+  }
+
+  FILE *out = fopen(out_path, "w");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_diff.c: couldn't open output file (%s)\n",
+            out_path);
+    return 0;
+  }
+
+  fprintf(out, "#change\tvar_a\tvar_b\tcolour\tcall_a\tcall_b\t"
+               "llks_a\tllks_b\n");
+
+  if(num_threads == 0)
+  {
+    num_threads = cortex_num_cpus();
+  }
+
+  _DIFF_ARGS args;
+  CORTEX_DIFF_STATS totals;
+  size_t i, num_a, num_b;
+
+  memset(&args, 0, sizeof(_DIFF_ARGS));
+  memset(&totals, 0, sizeof(CORTEX_DIFF_STATS));
+  args.sides[0].c_file = file_a;
+  args.sides[1].c_file = file_b;
+  args.llk_tolerance = llk_tolerance;
+  args.compare_calls = file_a->has_likelihoods && file_b->has_likelihoods;
+
+  // Stream both files at once
+  cortex_parallel_for(2, num_threads, _diff_read_side, &args);
+
+  num_a = args.sides[0].num_records;
+  num_b = args.sides[1].num_records;
+
+  args.colour_map = (long*) malloc(file_a->num_of_colours * sizeof(long) + 1);
+  args.sides[0].matches = (uint64_t*) malloc(num_a * sizeof(uint64_t) + 1);
+  args.sides[1].matches = (uint64_t*) malloc(num_b * sizeof(uint64_t) + 1);
+  args.hash = cortex_hash_create(num_a / 3 * 4 + 64);
+  args.chunks = (StrBuf**) malloc(DIFF_WINDOW_CHUNKS * sizeof(StrBuf*));
+  args.chunk_stats = (CORTEX_DIFF_STATS*)
+                     malloc(DIFF_WINDOW_CHUNKS * sizeof(CORTEX_DIFF_STATS));
+
+  if(args.colour_map == NULL || args.sides[0].matches == NULL ||
+     args.sides[1].matches == NULL || args.chunks == NULL ||
+     args.chunk_stats == NULL)
+  {
+    fprintf(stderr, "cortex_diff.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < file_a->num_of_colours; i++)
+  {
+    args.colour_map[i] = cortex_file_get_colour_index(file_a->colour_arr[i],
+                                                      file_b);
+  }
+
+  for(i = 0; i < num_a; i++)
+  {
+    args.sides[0].matches[i] = DIFF_UNMATCHED;
+  }
+
+  for(i = 0; i < DIFF_WINDOW_CHUNKS; i++)
+  {
+    args.chunks[i] = strbuf_init(DIFF_CHUNK_SIZE * 32);
+  }
+
+  // Hash join: build on a, probe with b
+  cortex_parallel_for(_diff_num_chunks(num_a), num_threads, _diff_build,
+                      &args);
+  cortex_parallel_for(_diff_num_chunks(num_b), num_threads, _diff_probe,
+                      &args);
+
+  // Format a window of chunks in parallel, then write them in order
+  args.num_b_chunks = _diff_num_chunks(num_b);
+  args.num_chunks = args.num_b_chunks + _diff_num_chunks(num_a);
+
+  size_t window, c;
+
+  for(args.first_chunk = 0; args.first_chunk < args.num_chunks;
+      args.first_chunk += window)
+  {
+    window = args.num_chunks - args.first_chunk;
+    window = window < DIFF_WINDOW_CHUNKS ? window : DIFF_WINDOW_CHUNKS;
+
+    cortex_parallel_for(window, num_threads, _diff_format_chunk, &args);
+
+    for(c = 0; c < window; c++)
+    {
+      fwrite(args.chunks[c]->buff, 1, strbuf_len(args.chunks[c]), out);
+      totals.matched += args.chunk_stats[c].matched;
+      totals.added += args.chunk_stats[c].added;
+      totals.removed += args.chunk_stats[c].removed;
+      totals.changed_bubbles += args.chunk_stats[c].changed_bubbles;
+      totals.changed_colours += args.chunk_stats[c].changed_colours;
+    }
+  }
+
+  char success = !ferror(out);
+  success = (fclose(out) == 0) && success;
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_diff.c: couldn't write output file (%s)\n",
+            out_path);
+  }
+
+  if(stats != NULL)
+  {
+    *stats = totals;
+  }
+
+  // Clean up
+  for(i = 0; i < 2; i++)
+  {
+    free(args.sides[i].records);
+    free(args.sides[i].calls);
+    free(args.sides[i].llks);
+    free(args.sides[i].matches);
+  }
+
+  for(i = 0; i < DIFF_WINDOW_CHUNKS; i++)
+  {
+    strbuf_free(args.chunks[i]);
+  }
+
+  free(args.chunks);
+  free(args.chunk_stats);
+  free(args.colour_map);
+  cortex_hash_free(args.hash);
+
+  return success;
+}
@@ -0,0 +1,65 @@
+/*
+ cortex_diff.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_DIFF_H_SEEN
+#define CORTEX_DIFF_H_SEEN
+
+#include "cortex.h"
+
+//
+// Differences between the calls in two bubble files
+//
+// Bubbles are matched on cortex_bubble_branch_fingerprint(), so the files
+// may list them in any order, with different var_nums, on either strand or
+// with the branches the other way round.  Calls and likelihoods from file b
+// are put in file a's branch order before comparing, for the colour numbers
+// both files have.
+//
+// The output is tab separated:
+//   #change var_a var_b colour call_a call_b llks_a llks_b
+// 'added' and 'removed' lines are bubbles only in b or only in a.  A
+// 'changed' line is a colour of a matched bubble whose call differs or whose
+// likelihoods moved by more than llk_tolerance.  llks are
+// hom_br1,het,hom_br2 and missing fields are '.'.  Matched and added bubbles
+// are written in b's order, followed by removed bubbles in a's order.
+// Only the first copy of a bubble repeated within a file is matched; later
+// copies are reported as added or removed.
+//
+
+typedef struct
+{
+  unsigned long matched, added, removed;
+  // Matched bubbles with a change, and the number of 'changed' lines
+  unsigned long changed_bubbles, changed_colours;
+} CORTEX_DIFF_STATS;
+
+// Read the rest of both files in parallel, then join them using up to
+// num_threads threads (0 means one per cpu).  Calls and likelihoods of both
+// files are held in memory: 13 bytes per bubble per colour.  stats may be
+// NULL.  Returns 1 on success, 0 on failure
+char cortex_diff(CORTEX_FILE *file_a, CORTEX_FILE *file_b,
+                 const char *out_path, float llk_tolerance,
+                 unsigned int num_threads, CORTEX_DIFF_STATS *stats);
+
+#endif
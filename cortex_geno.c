@@ -0,0 +1,576 @@
+/*
+ cortex_geno.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cortex_geno.h"
+#include "cortex_parallel.h"
+
+#define GENO_MAGIC "CTXGENO1"
+#define GENO_VERSION 1
+
+// Two bit codes.  0 is missing so that the unused end of a row counts for
+// nothing
+#define GENO_MISSING 0
+#define GENO_HOM1 1
+#define GENO_HET 2
+#define GENO_HOM2 3
+
+// Low bit of every code in a word
+#define GENO_LO 0x5555555555555555ULL
+
+// Words of each row handled by one task in cortex_geno_sample_counts()
+#define GENO_SAMPLE_CHUNK 16
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version, padding;
+  uint64_t num_samples, num_bubbles;
+} GENO_HEADER;
+
+struct CORTEX_GENO
+{
+  unsigned long num_samples, num_bubbles, capacity;
+  // Each row is the bubble's var_num followed by its packed calls
+  size_t row_words;
+  uint64_t *rows;
+  // Set if bubbles added have calls (their file has likelihoods)
+  char has_calls;
+  // Set if loaded from a file
+  void *map;
+  size_t map_size;
+};
+
+typedef struct
+{
+  const CORTEX_GENO *geno;
+  unsigned long *het, *called;
+} _GENO_SAMPLE_ARGS;
+
+size_t _geno_row_words(unsigned long num_samples)
+{
+  return 1 + (num_samples + 31) / 32;
+}
+
+uint64_t _geno_code(HETEROGENEITY call)
+{
+  switch(call)
+  {
+    case HOM1: return GENO_HOM1;
+    case HET: return GENO_HET;
+    case HOM2: return GENO_HOM2;
+    default: return GENO_MISSING;
+  }
+}
+
+// Without likelihoods bubble->calls isn't set, so every call is left missing
+void _geno_pack(uint64_t *row, unsigned long num_samples, char has_calls,
+                const CORTEX_BUBBLE *bubble)
+{
+  uint64_t *calls = row + 1;
+  unsigned long s;
+
+  row[0] = bubble->var_num;
+  memset(calls, 0, (num_samples + 31) / 32 * sizeof(uint64_t));
+
+  for(s = 0; has_calls && s < num_samples; s++)
+  {
+    calls[s / 32] |= _geno_code(bubble->calls[s]) << (2 * (s % 32));
+  }
+}
+
+const uint64_t* _geno_row(const CORTEX_GENO *geno, unsigned long bubble)
+{
+  return geno->rows + bubble * geno->row_words;
+}
+
+CORTEX_GENO* _geno_alloc(unsigned long num_samples)
+{
+  CORTEX_GENO *geno = (CORTEX_GENO*) malloc(sizeof(CORTEX_GENO));
+
+  if(geno == NULL)
+  {
+    fprintf(stderr, "cortex_geno.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  geno->num_samples = num_samples;
+  geno->num_bubbles = 0;
+  geno->capacity = 0;
+  geno->row_words = _geno_row_words(num_samples);
+  geno->rows = NULL;
+  geno->has_calls = 0;
+  geno->map = NULL;
+  geno->map_size = 0;
+
+  return geno;
+}
+
+CORTEX_GENO* cortex_geno_create(const CORTEX_FILE *c_file)
+{
+  CORTEX_GENO *geno = _geno_alloc(c_file->num_of_colours);
+  geno->has_calls = c_file->has_likelihoods;
+  return geno;
+}
+
+void cortex_geno_free(CORTEX_GENO *geno)
+{
+  if(geno->map != NULL)
+  {
+    munmap(geno->map, geno->map_size);
+  }
+  else
+  {
+    free(geno->rows);
+  }
+
+  free(geno);
+}
+
+char cortex_geno_add(CORTEX_GENO *geno, const CORTEX_BUBBLE *bubble)
+{
+  if(geno->map != NULL)
+  {
+    fprintf(stderr, "cortex_geno.c: can't add to a loaded matrix\n");
+    return 0;
+  }
+
+  if(geno->num_bubbles == geno->capacity)
+  {
+    geno->capacity = geno->capacity == 0 ? 1024 : geno->capacity * 2;
+
+    size_t mem = geno->capacity * geno->row_words * sizeof(uint64_t);
+    geno->rows = (uint64_t*) realloc(geno->rows, mem);
+
+    if(geno->rows == NULL)
+    {
+      fprintf(stderr, "cortex_geno.c: out of memory [%lu bubbles]\n",
+              geno->capacity);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  _geno_pack(geno->rows + geno->num_bubbles * geno->row_words,
+             geno->num_samples, geno->has_calls, bubble);
+
+  geno->num_bubbles++;
+  return 1;
+}
+
+char _geno_check_file(unsigned long num_samples, const CORTEX_FILE *c_file)
+{
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_geno.c: not a bubble file (%s)\n", c_file->path);
+    return 0;
+  }
+
+  if(num_samples != c_file->num_of_colours)
+  {
+    fprintf(stderr, "cortex_geno.c: matrix has %lu samples, file has %lu "
+                    "colours (%s)\n",
+            num_samples, c_file->num_of_colours, c_file->path);
+    return 0;
+  }
+
+  return 1;
+}
+
+long cortex_geno_read(CORTEX_GENO *geno, CORTEX_FILE *c_file)
+{
+  if(!_geno_check_file(geno->num_samples, c_file))
+  {
+    return -1;
+  }
+
+  if(c_file->has_likelihoods != geno->has_calls)
+  {
+    fprintf(stderr, "cortex_geno.c: file %s likelihoods, matrix was created "
+                    "from a file that %s (%s)\n",
+            c_file->has_likelihoods ? "has" : "has no",
+            geno->has_calls ? "does" : "doesn't", c_file->path);
+    return -1;
+  }
+
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  long num_bubbles = 0;
+
+  while(cortex_read_bubble(bubble, c_file))
+  {
+    if(!cortex_geno_add(geno, bubble))
+    {
+      num_bubbles = -1;
+      break;
+    }
+
+    num_bubbles++;
+  }
+
+  cortex_bubble_free(bubble, c_file);
+
+  return num_bubbles;
+}
+
+void _geno_header(GENO_HEADER *header, unsigned long num_samples,
+                  unsigned long num_bubbles)
+{
+  memset(header, 0, sizeof(GENO_HEADER));
+  memcpy(header->magic, GENO_MAGIC, 8);
+  header->version = GENO_VERSION;
+  header->num_samples = num_samples;
+  header->num_bubbles = num_bubbles;
+}
+
+char cortex_geno_save(const CORTEX_GENO *geno, const char *path)
+{
+  FILE *out = fopen(path, "wb");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_geno.c: couldn't open output file (%s)\n", path);
+    return 0;
+  }
+
+  GENO_HEADER header;
+  _geno_header(&header, geno->num_samples, geno->num_bubbles);
+
+  size_t num_words = geno->num_bubbles * geno->row_words;
+  char success = (fwrite(&header, sizeof(GENO_HEADER), 1, out) == 1 &&
+                  (num_words == 0 ||
+                   fwrite(geno->rows, sizeof(uint64_t), num_words, out)
+                     == num_words));
+
+  success = (fclose(out) == 0) && success;
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_geno.c: couldn't write matrix (%s)\n", path);
+  }
+
+  return success;
+}
+
+long cortex_geno_convert(CORTEX_FILE *c_file, const char *path)
+{
+  if(!_geno_check_file(c_file->num_of_colours, c_file))
+  {
+    return -1;
+  }
+
+  FILE *out = fopen(path, "wb");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_geno.c: couldn't open output file (%s)\n", path);
+    return -1;
+  }
+
+  unsigned long num_samples = c_file->num_of_colours;
+  size_t row_words = _geno_row_words(num_samples);
+  uint64_t *row = (uint64_t*) malloc(row_words * sizeof(uint64_t));
+
+  if(row == NULL)
+  {
+    fprintf(stderr, "cortex_geno.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Header is written again once the number of bubbles is known
+  GENO_HEADER header;
+  _geno_header(&header, num_samples, 0);
+
+  char success = (fwrite(&header, sizeof(GENO_HEADER), 1, out) == 1);
+
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  unsigned long num_bubbles = 0;
+
+  while(success && cortex_read_bubble(bubble, c_file))
+  {
+    _geno_pack(row, num_samples, c_file->has_likelihoods, bubble);
+    success = (fwrite(row, sizeof(uint64_t), row_words, out) == row_words);
+    num_bubbles++;
+  }
+
+  cortex_bubble_free(bubble, c_file);
+  free(row);
+
+  _geno_header(&header, num_samples, num_bubbles);
+
+  success = success && fseek(out, 0, SEEK_SET) == 0 &&
+            fwrite(&header, sizeof(GENO_HEADER), 1, out) == 1;
+
+  success = (fclose(out) == 0) && success;
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_geno.c: couldn't write matrix (%s)\n", path);
+    return -1;
+  }
+
+  return (long)num_bubbles;
+}
+
+CORTEX_GENO* cortex_geno_load(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+
+  if(fd == -1)
+  {
+    fprintf(stderr, "cortex_geno.c: couldn't open file (%s)\n", path);
+    return NULL;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(GENO_HEADER))
+  {
+    fprintf(stderr, "cortex_geno.c: not a genotype matrix (%s)\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+  {
+    fprintf(stderr, "cortex_geno.c: couldn't map file (%s)\n", path);
+    return NULL;
+  }
+
+  const GENO_HEADER *header = (const GENO_HEADER*)map;
+  size_t expected_size = 0;
+
+  if(memcmp(header->magic, GENO_MAGIC, 8) == 0 &&
+     header->version == GENO_VERSION)
+  {
+    expected_size = sizeof(GENO_HEADER) +
+                    header->num_bubbles *
+                    _geno_row_words(header->num_samples) * sizeof(uint64_t);
+  }
+
+  if(expected_size != (size_t)st.st_size)
+  {
+    fprintf(stderr, "cortex_geno.c: corrupt or incompatible matrix (%s)\n",
+            path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  CORTEX_GENO *geno = _geno_alloc(header->num_samples);
+  geno->num_bubbles = header->num_bubbles;
+  geno->capacity = header->num_bubbles;
+  geno->rows = (uint64_t*)(header + 1);
+  geno->map = map;
+  geno->map_size = st.st_size;
+
+  return geno;
+}
+
+unsigned long cortex_geno_num_bubbles(const CORTEX_GENO *geno)
+{
+  return geno->num_bubbles;
+}
+
+unsigned long cortex_geno_num_samples(const CORTEX_GENO *geno)
+{
+  return geno->num_samples;
+}
+
+unsigned long cortex_geno_var_num(const CORTEX_GENO *geno,
+                                  unsigned long bubble)
+{
+  return _geno_row(geno, bubble)[0];
+}
+
+HETEROGENEITY cortex_geno_get(const CORTEX_GENO *geno, unsigned long bubble,
+                              unsigned long sample)
+{
+  const uint64_t *calls = _geno_row(geno, bubble) + 1;
+
+  switch((calls[sample / 32] >> (2 * (sample % 32))) & 3)
+  {
+    case GENO_HOM1: return HOM1;
+    case GENO_HET: return HET;
+    case GENO_HOM2: return HOM2;
+    default: return UNKNOWN_HET;
+  }
+}
+
+//
+// Statistics
+//
+
+void cortex_geno_counts(const CORTEX_GENO *geno, unsigned long bubble,
+                        CORTEX_GENO_COUNTS *counts)
+{
+  const uint64_t *calls = _geno_row(geno, bubble) + 1;
+  size_t w, num_words = geno->row_words - 1;
+  unsigned long hom1 = 0, het = 0, hom2 = 0;
+
+  for(w = 0; w < num_words; w++)
+  {
+    uint64_t lo = calls[w] & GENO_LO, hi = (calls[w] >> 1) & GENO_LO;
+
+    hom1 += __builtin_popcountll(lo & ~hi);
+    het += __builtin_popcountll(hi & ~lo);
+    hom2 += __builtin_popcountll(lo & hi);
+  }
+
+  counts->hom1 = hom1;
+  counts->het = het;
+  counts->hom2 = hom2;
+  counts->missing = geno->num_samples - hom1 - het - hom2;
+}
+
+// Count a chunk of samples over all bubbles.  Hets and missing calls are
+// visited bit by bit; everything else is skipped a word at a time
+void _geno_sample_chunk(size_t i, void *ptr)
+{
+  const _GENO_SAMPLE_ARGS *args = (const _GENO_SAMPLE_ARGS*)ptr;
+  const CORTEX_GENO *geno = args->geno;
+  size_t num_words = geno->row_words - 1, w;
+  size_t start = i * GENO_SAMPLE_CHUNK;
+  size_t end = start + GENO_SAMPLE_CHUNK < num_words ? start + GENO_SAMPLE_CHUNK
+                                                     : num_words;
+  unsigned long first = start * 32, s, b;
+  unsigned long last = end * 32 < geno->num_samples ? end * 32
+                                                    : geno->num_samples;
+  unsigned long *missing = args->called;
+
+  for(s = first; s < last; s++)
+  {
+    args->het[s] = 0;
+    missing[s] = 0;
+  }
+
+  for(b = 0; b < geno->num_bubbles; b++)
+  {
+    const uint64_t *calls = _geno_row(geno, b) + 1;
+
+    for(w = start; w < end; w++)
+    {
+      uint64_t lo = calls[w] & GENO_LO, hi = (calls[w] >> 1) & GENO_LO;
+      uint64_t bits = hi & ~lo;
+
+      while(bits)
+      {
+        args->het[w * 32 + __builtin_ctzll(bits) / 2]++;
+        bits &= bits - 1;
+      }
+
+      bits = ~(lo | hi) & GENO_LO;
+
+      while(bits)
+      {
+        // Past the last sample is always missing
+        unsigned long sample = w * 32 + __builtin_ctzll(bits) / 2;
+
+        if(sample >= last)
+        {
+          break;
+        }
+
+        missing[sample]++;
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  for(s = first; s < last; s++)
+  {
+    args->called[s] = geno->num_bubbles - missing[s];
+  }
+}
+
+void cortex_geno_sample_counts(const CORTEX_GENO *geno, unsigned long *het,
+                               unsigned long *called,
+                               unsigned int num_threads)
+{
+  _GENO_SAMPLE_ARGS args;
+  args.geno = geno;
+  args.het = het;
+  args.called = called;
+
+  size_t num_words = geno->row_words - 1;
+  size_t num_chunks = (num_words + GENO_SAMPLE_CHUNK - 1) / GENO_SAMPLE_CHUNK;
+
+  cortex_parallel_for(num_chunks, num_threads, _geno_sample_chunk, &args);
+}
+
+double cortex_geno_r2(const CORTEX_GENO *geno, unsigned long bubble1,
+                      unsigned long bubble2)
+{
+  const uint64_t *x = _geno_row(geno, bubble1) + 1;
+  const uint64_t *y = _geno_row(geno, bubble2) + 1;
+  size_t w, num_words = geno->row_words - 1;
+
+  // x = x1 + 2*x2 where x1 marks hets and x2 marks hom2s
+  long long n = 0, x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+  long long x1y1 = 0, x1y2 = 0, x2y1 = 0, x2y2 = 0;
+
+  for(w = 0; w < num_words; w++)
+  {
+    uint64_t xlo = x[w] & GENO_LO, xhi = (x[w] >> 1) & GENO_LO;
+    uint64_t ylo = y[w] & GENO_LO, yhi = (y[w] >> 1) & GENO_LO;
+    uint64_t both = (xlo | xhi) & (ylo | yhi);
+
+    uint64_t xhet = xhi & ~xlo & both, xhom2 = xhi & xlo & both;
+    uint64_t yhet = yhi & ~ylo & both, yhom2 = yhi & ylo & both;
+
+    n += __builtin_popcountll(both);
+    x1 += __builtin_popcountll(xhet);
+    x2 += __builtin_popcountll(xhom2);
+    y1 += __builtin_popcountll(yhet);
+    y2 += __builtin_popcountll(yhom2);
+    x1y1 += __builtin_popcountll(xhet & yhet);
+    x1y2 += __builtin_popcountll(xhet & yhom2);
+    x2y1 += __builtin_popcountll(xhom2 & yhet);
+    x2y2 += __builtin_popcountll(xhom2 & yhom2);
+  }
+
+  long long sum_x = x1 + 2 * x2, sum_y = y1 + 2 * y2;
+  long long sum_xx = x1 + 4 * x2, sum_yy = y1 + 4 * y2;
+  long long sum_xy = x1y1 + 2 * (x1y2 + x2y1) + 4 * x2y2;
+
+  double cov = (double)(n * sum_xy - sum_x * sum_y);
+  double var_x = (double)(n * sum_xx - sum_x * sum_x);
+  double var_y = (double)(n * sum_yy - sum_y * sum_y);
+
+  if(var_x <= 0 || var_y <= 0)
+  {
+    return NAN;
+  }
+
+  return (cov * cov) / (var_x * var_y);
+}
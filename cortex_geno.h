@@ -0,0 +1,107 @@
+/*
+ cortex_geno.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_GENO_H_SEEN
+#define CORTEX_GENO_H_SEEN
+
+#include "cortex.h"
+
+//
+// Packed genotype matrix
+//
+// Bubble x sample matrix of calls (samples are the file's colours) packed
+// two bits per call, 32 calls to a 64-bit word, one row of words per bubble.
+// Statistics are computed with popcounts over whole words.  10^4 samples take
+// 2.5KB per bubble.  Files without likelihoods have no calls, so all of
+// their calls are missing.
+//
+// Matrices can be saved and loaded.  Loading maps the file into memory, so a
+// matrix larger than memory can still be queried, and cortex_geno_convert()
+// writes one straight from a bubble file without holding it in memory.  Files
+// use the host's byte order.
+//
+
+typedef struct CORTEX_GENO CORTEX_GENO;
+
+typedef struct
+{
+  unsigned long hom1, het, hom2, missing;
+} CORTEX_GENO_COUNTS;
+
+// Create an empty matrix with a sample for each colour in c_file
+CORTEX_GENO* cortex_geno_create(const CORTEX_FILE *c_file);
+void cortex_geno_free(CORTEX_GENO *geno);
+
+// Add a bubble's calls as the next row.  bubble must come from the file geno
+// was created from.  Returns 1 on success, 0 if geno was loaded from a file
+// (loaded matrices are read-only)
+char cortex_geno_add(CORTEX_GENO *geno, const CORTEX_BUBBLE *bubble);
+
+// Add all remaining bubbles in c_file.
+// Returns the number of bubbles added or -1 on failure
+long cortex_geno_read(CORTEX_GENO *geno, CORTEX_FILE *c_file);
+
+// Returns 1 on success, 0 on failure
+char cortex_geno_save(const CORTEX_GENO *geno, const char *path);
+
+// Write the matrix for all remaining bubbles in c_file to path, one row at a
+// time.  Returns the number of bubbles written or -1 on failure
+long cortex_geno_convert(CORTEX_FILE *c_file, const char *path);
+
+// Returns NULL on failure
+CORTEX_GENO* cortex_geno_load(const char *path);
+
+unsigned long cortex_geno_num_bubbles(const CORTEX_GENO *geno);
+unsigned long cortex_geno_num_samples(const CORTEX_GENO *geno);
+
+unsigned long cortex_geno_var_num(const CORTEX_GENO *geno,
+                                  unsigned long bubble);
+
+HETEROGENEITY cortex_geno_get(const CORTEX_GENO *geno, unsigned long bubble,
+                              unsigned long sample);
+
+//
+// Statistics
+//
+
+// Count a bubble's calls.  Branch 1 has 2*hom1+het alleles and branch 2 has
+// 2*hom2+het
+void cortex_geno_counts(const CORTEX_GENO *geno, unsigned long bubble,
+                        CORTEX_GENO_COUNTS *counts);
+
+// For each sample count the bubbles called het and the bubbles called at all
+// (het[s] / called[s] is the sample's heterozygosity).  het and called must
+// hold num_samples values.  Uses up to num_threads threads (0 means one per
+// cpu)
+void cortex_geno_sample_counts(const CORTEX_GENO *geno, unsigned long *het,
+                               unsigned long *called,
+                               unsigned int num_threads);
+
+// r^2 between two bubbles: squared correlation of branch 2 allele counts
+// (0, 1 or 2) over the samples called in both.  Returns NaN if either bubble
+// doesn't vary over those samples
+double cortex_geno_r2(const CORTEX_GENO *geno, unsigned long bubble1,
+                      unsigned long bubble2);
+
+#endif
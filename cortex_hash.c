@@ -0,0 +1,268 @@
+/*
+ cortex_hash.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cortex_hash.h"
+
+// Slot states, in the top two bits of hi.  0 means empty
+#define HASH_BUSY  ((uint64_t)1 << 62)
+#define HASH_READY ((uint64_t)1 << 63)
+
+// hi is read and written with atomics: a slot's lo and value are written
+// before hi is set to READY, and only read after seeing READY
+typedef struct
+{
+  uint64_t hi, lo, value;
+} _HASH_SLOT;
+
+struct CORTEX_HASH
+{
+  _HASH_SLOT *slots;
+  size_t capacity, mask, limit;
+  size_t size;
+};
+
+_HASH_SLOT* _hash_alloc(size_t capacity)
+{
+  _HASH_SLOT *slots = (_HASH_SLOT*) calloc(capacity, sizeof(_HASH_SLOT));
+
+  if(slots == NULL)
+  {
+    fprintf(stderr, "cortex_hash.c: out of memory [%lu slots]\n",
+            (unsigned long)capacity);
+    exit(EXIT_FAILURE);
+  }
+
+  return slots;
+}
+
+void _hash_set_capacity(CORTEX_HASH *hash, size_t capacity)
+{
+  size_t rounded = 64;
+
+  while(rounded < capacity)
+  {
+    rounded *= 2;
+  }
+
+  hash->capacity = rounded;
+  hash->mask = rounded - 1;
+  hash->limit = rounded / 4 * 3;
+}
+
+CORTEX_HASH* cortex_hash_create(size_t capacity)
+{
+  CORTEX_HASH *hash = (CORTEX_HASH*) malloc(sizeof(CORTEX_HASH));
+
+  if(hash == NULL)
+  {
+    fprintf(stderr, "cortex_hash.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  _hash_set_capacity(hash, capacity);
+  hash->slots = _hash_alloc(hash->capacity);
+  hash->size = 0;
+
+  return hash;
+}
+
+void cortex_hash_free(CORTEX_HASH *hash)
+{
+  free(hash->slots);
+  free(hash);
+}
+
+size_t cortex_hash_size(const CORTEX_HASH *hash)
+{
+  return hash->size;
+}
+
+size_t cortex_hash_capacity(const CORTEX_HASH *hash)
+{
+  return hash->capacity;
+}
+
+// Wait for another thread to finish writing a slot it has claimed
+uint64_t _hash_wait_ready(const _HASH_SLOT *slot, uint64_t cur)
+{
+  while(!(cur & HASH_READY))
+  {
+    cur = __atomic_load_n(&slot->hi, __ATOMIC_ACQUIRE);
+  }
+
+  return cur;
+}
+
+enum CORTEX_HASH_RESULT cortex_hash_insert(CORTEX_HASH *hash,
+                                           uint64_t hi, uint64_t lo,
+                                           uint64_t value,
+                                           uint64_t **value_ptr)
+{
+  uint64_t key = hi & CORTEX_HASH_KEY_MASK;
+  size_t i = (size_t)lo & hash->mask, probes;
+
+  for(probes = 0; probes < hash->capacity; probes++)
+  {
+    _HASH_SLOT *slot = &hash->slots[i];
+    uint64_t cur = __atomic_load_n(&slot->hi, __ATOMIC_ACQUIRE);
+
+    if(cur == 0)
+    {
+      if(__atomic_load_n(&hash->size, __ATOMIC_RELAXED) >= hash->limit)
+      {
+        return CORTEX_HASH_FULL;
+      }
+
+      uint64_t empty = 0;
+
+      if(__atomic_compare_exchange_n(&slot->hi, &empty, HASH_BUSY | key, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      {
+        slot->lo = lo;
+        __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->hi, HASH_READY | key, __ATOMIC_RELEASE);
+
+        __atomic_fetch_add(&hash->size, 1, __ATOMIC_RELAXED);
+
+        if(value_ptr != NULL)
+        {
+          *value_ptr = &slot->value;
+        }
+
+        return CORTEX_HASH_INSERTED;
+      }
+
+      // Lost the race - empty now holds what was written
+      cur = empty;
+    }
+
+    if((cur & CORTEX_HASH_KEY_MASK) == key)
+    {
+      _hash_wait_ready(slot, cur);
+
+      if(slot->lo == lo)
+      {
+        if(value_ptr != NULL)
+        {
+          *value_ptr = &slot->value;
+        }
+
+        return CORTEX_HASH_FOUND;
+      }
+    }
+
+    i = (i + 1) & hash->mask;
+  }
+
+  return CORTEX_HASH_FULL;
+}
+
+long cortex_hash_slot(const CORTEX_HASH *hash, uint64_t hi, uint64_t lo)
+{
+  uint64_t key = hi & CORTEX_HASH_KEY_MASK;
+  size_t i = (size_t)lo & hash->mask, probes;
+
+  for(probes = 0; probes < hash->capacity; probes++)
+  {
+    const _HASH_SLOT *slot = &hash->slots[i];
+    uint64_t cur = __atomic_load_n(&slot->hi, __ATOMIC_ACQUIRE);
+
+    if(cur == 0)
+    {
+      return -1;
+    }
+
+    if((cur & CORTEX_HASH_KEY_MASK) == key)
+    {
+      _hash_wait_ready(slot, cur);
+
+      if(slot->lo == lo)
+      {
+        return (long)i;
+      }
+    }
+
+    i = (i + 1) & hash->mask;
+  }
+
+  return -1;
+}
+
+uint64_t* cortex_hash_find(const CORTEX_HASH *hash, uint64_t hi, uint64_t lo)
+{
+  long slot = cortex_hash_slot(hash, hi, lo);
+  return slot < 0 ? NULL : &hash->slots[slot].value;
+}
+
+void cortex_hash_grow(CORTEX_HASH *hash, size_t new_capacity)
+{
+  _HASH_SLOT *old_slots = hash->slots;
+  size_t old_capacity = hash->capacity, i;
+
+  if(new_capacity <= old_capacity)
+  {
+    return;
+  }
+
+  _hash_set_capacity(hash, new_capacity);
+  hash->slots = _hash_alloc(hash->capacity);
+
+  for(i = 0; i < old_capacity; i++)
+  {
+    const _HASH_SLOT *old = &old_slots[i];
+
+    if(old->hi & HASH_READY)
+    {
+      size_t j = (size_t)old->lo & hash->mask;
+
+      while(hash->slots[j].hi != 0)
+      {
+        j = (j + 1) & hash->mask;
+      }
+
+      hash->slots[j] = *old;
+    }
+  }
+
+  free(old_slots);
+}
+
+void cortex_hash_iterate(const CORTEX_HASH *hash, cortex_hash_func func,
+                         void *arg)
+{
+  size_t i;
+
+  for(i = 0; i < hash->capacity; i++)
+  {
+    const _HASH_SLOT *slot = &hash->slots[i];
+
+    if(slot->hi & HASH_READY)
+    {
+      func(slot->hi & CORTEX_HASH_KEY_MASK, slot->lo, slot->value, arg);
+    }
+  }
+}
@@ -0,0 +1,80 @@
+/*
+ cortex_hash.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_HASH_H_SEEN
+#define CORTEX_HASH_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Concurrent hash table of 128-bit keys to 64-bit values
+//
+// Open addressing with linear probing.  Threads claim empty slots with a
+// compare-and-swap on the key's high word, so inserts and finds don't lock.
+// The top two bits of hi are used for slot state and are ignored, so keys
+// are really 126 bits - use well mixed hashes.  The table does not grow by
+// itself: insert returns CORTEX_HASH_FULL once it is 3/4 full, and the caller
+// must stop all other threads using the table before cortex_hash_grow().
+//
+
+#define CORTEX_HASH_KEY_MASK (((uint64_t)1 << 62) - 1)
+
+enum CORTEX_HASH_RESULT {CORTEX_HASH_INSERTED, CORTEX_HASH_FOUND,
+                         CORTEX_HASH_FULL};
+
+typedef struct CORTEX_HASH CORTEX_HASH;
+
+// capacity is rounded up to a power of two
+CORTEX_HASH* cortex_hash_create(size_t capacity);
+void cortex_hash_free(CORTEX_HASH *hash);
+
+size_t cortex_hash_size(const CORTEX_HASH *hash);
+size_t cortex_hash_capacity(const CORTEX_HASH *hash);
+
+// Thread safe.  Adds (hi,lo) -> value unless the key is already there.  If
+// value_ptr is not NULL it is set to the stored value (the existing one if
+// found), which may be updated with atomic operations until the next grow
+enum CORTEX_HASH_RESULT cortex_hash_insert(CORTEX_HASH *hash,
+                                           uint64_t hi, uint64_t lo,
+                                           uint64_t value,
+                                           uint64_t **value_ptr);
+
+// Thread safe.  Returns a pointer to the value or NULL if not found
+uint64_t* cortex_hash_find(const CORTEX_HASH *hash, uint64_t hi, uint64_t lo);
+
+// Slot index of the key, in [0, capacity), or -1 if not found.  Can be used
+// to index side arrays of capacity elements (invalidated by grow)
+long cortex_hash_slot(const CORTEX_HASH *hash, uint64_t hi, uint64_t lo);
+
+// Not thread safe.  Rehash into at least new_capacity slots
+void cortex_hash_grow(CORTEX_HASH *hash, size_t new_capacity);
+
+// Not thread safe.  Call func for each key in slot order
+typedef void (*cortex_hash_func)(uint64_t hi, uint64_t lo, uint64_t value,
+                                 void *arg);
+void cortex_hash_iterate(const CORTEX_HASH *hash, cortex_hash_func func,
+                         void *arg);
+
+#endif
@@ -0,0 +1,476 @@
+/*
+ cortex_index.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cortex_index.h"
+
+#define INDEX_MAGIC "CTXKIDX1"
+#define INDEX_VERSION 1
+
+// Aim for this many entries per directory bucket
+#define INDEX_BUCKET_ENTRIES 4
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version, kmer_size, dir_bits, padding;
+  uint64_t num_entries, num_records;
+} INDEX_HEADER;
+
+typedef struct
+{
+  uint64_t kmer[2];
+  uint64_t record;
+} INDEX_ENTRY;
+
+typedef struct
+{
+  uint64_t var_num;
+  int64_t offset;
+} INDEX_RECORD;
+
+// Entry plus its directory bucket, used while building
+typedef struct
+{
+  uint64_t bucket;
+  INDEX_ENTRY entry;
+} INDEX_BUILD_ENTRY;
+
+struct CORTEX_KMER_INDEX
+{
+  void *map;
+  size_t map_size;
+  const INDEX_HEADER *header;
+  const uint64_t *directory;
+  const INDEX_ENTRY *entries;
+  const INDEX_RECORD *records;
+};
+
+int _index_entry_cmp(const INDEX_ENTRY *a, const INDEX_ENTRY *b)
+{
+  if(a->kmer[0] != b->kmer[0])
+  {
+    return a->kmer[0] < b->kmer[0] ? -1 : 1;
+  }
+
+  if(a->kmer[1] != b->kmer[1])
+  {
+    return a->kmer[1] < b->kmer[1] ? -1 : 1;
+  }
+
+  return 0;
+}
+
+int _index_build_cmp(const void *ptr1, const void *ptr2)
+{
+  const INDEX_BUILD_ENTRY *a = (const INDEX_BUILD_ENTRY*)ptr1;
+  const INDEX_BUILD_ENTRY *b = (const INDEX_BUILD_ENTRY*)ptr2;
+
+  if(a->bucket != b->bucket)
+  {
+    return a->bucket < b->bucket ? -1 : 1;
+  }
+
+  int cmp = _index_entry_cmp(&a->entry, &b->entry);
+
+  if(cmp != 0)
+  {
+    return cmp;
+  }
+
+  if(a->entry.record != b->entry.record)
+  {
+    return a->entry.record < b->entry.record ? -1 : 1;
+  }
+
+  return 0;
+}
+
+uint64_t _index_hash(const CORTEX_KMER *kmer)
+{
+  return cortex_kmer_hash(kmer, 0);
+}
+
+//
+// Building
+//
+
+char cortex_index_build(CORTEX_FILE *c_file, const char *index_path)
+{
+  unsigned int kmer_size = c_file->kmer_size;
+
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_index.c: can only index bubble files (%s)\n",
+            c_file->path);
+    return 0;
+  }
+
+  if(kmer_size == 0 || kmer_size > CORTEX_MAX_KMER_SIZE)
+  {
+    fprintf(stderr, "cortex_index.c: unsupported kmer size [%u] (%s)\n",
+            kmer_size, c_file->path);
+    return 0;
+  }
+
+  size_t entries_capacity = 1<<16, num_entries = 0;
+  size_t records_capacity = 1<<12, num_records = 0;
+
+  INDEX_BUILD_ENTRY *entries
+    = (INDEX_BUILD_ENTRY*) malloc(entries_capacity * sizeof(INDEX_BUILD_ENTRY));
+  INDEX_RECORD *records
+    = (INDEX_RECORD*) malloc(records_capacity * sizeof(INDEX_RECORD));
+
+  char have_memory = (entries != NULL && records != NULL);
+
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+
+  while(have_memory && cortex_read_bubble(bubble, c_file))
+  {
+    if(num_records == records_capacity)
+    {
+      INDEX_RECORD *new_records
+        = realloc(records, 2 * records_capacity * sizeof(INDEX_RECORD));
+
+      if(new_records == NULL)
+      {
+        have_memory = 0;
+        break;
+      }
+
+      records = new_records;
+      records_capacity *= 2;
+    }
+
+    records[num_records].var_num = bubble->var_num;
+    records[num_records].offset = c_file->record_offset;
+
+    const StrBuf *paths[4] = {bubble->flank_5p.seq, bubble->branches[0].seq,
+                              bubble->branches[1].seq, bubble->flank_3p.seq};
+    int p;
+
+    for(p = 0; p < 4 && have_memory; p++)
+    {
+      CORTEX_KMER_ITER iter;
+      CORTEX_KMER kmer;
+      size_t start;
+
+      cortex_kmer_iter_init(&iter, paths[p]->buff, strbuf_len(paths[p]),
+                            kmer_size);
+
+      while(cortex_kmer_iter_next(&iter, &kmer, &start))
+      {
+        if(num_entries == entries_capacity)
+        {
+          INDEX_BUILD_ENTRY *new_entries
+            = realloc(entries,
+                      2 * entries_capacity * sizeof(INDEX_BUILD_ENTRY));
+
+          if(new_entries == NULL)
+          {
+            have_memory = 0;
+            break;
+          }
+
+          entries = new_entries;
+          entries_capacity *= 2;
+        }
+
+        // Bucket is set once we know how many bits the directory has
+        entries[num_entries].bucket = _index_hash(&kmer);
+        entries[num_entries].entry.kmer[0] = kmer.b[0];
+        entries[num_entries].entry.kmer[1] = kmer.b[1];
+        entries[num_entries].entry.record = num_records;
+        num_entries++;
+      }
+    }
+
+    num_records++;
+  }
+
+  cortex_bubble_free(bubble, c_file);
+
+  if(!have_memory)
+  {
+    fprintf(stderr, "cortex_index.c: out of memory indexing %lu bubbles (%s)\n",
+            (unsigned long)num_records, c_file->path);
+    free(entries);
+    free(records);
+    return 0;
+  }
+
+  // Choose directory size
+  uint32_t dir_bits = 1;
+
+  while(dir_bits < 30 &&
+        ((size_t)1 << dir_bits) * INDEX_BUCKET_ENTRIES < num_entries)
+  {
+    dir_bits++;
+  }
+
+  size_t i, j;
+
+  for(i = 0; i < num_entries; i++)
+  {
+    entries[i].bucket >>= (64 - dir_bits);
+  }
+
+  qsort(entries, num_entries, sizeof(INDEX_BUILD_ENTRY), _index_build_cmp);
+
+  // Remove repeats of a kmer within a bubble
+  for(i = 0, j = 0; i < num_entries; i++)
+  {
+    if(j == 0 || _index_build_cmp(&entries[i], &entries[j-1]) != 0)
+    {
+      entries[j++] = entries[i];
+    }
+  }
+
+  num_entries = j;
+
+  // Directory: start of each bucket plus the end
+  size_t num_buckets = (size_t)1 << dir_bits;
+  uint64_t *directory = (uint64_t*) malloc((num_buckets+1) * sizeof(uint64_t));
+
+  if(directory == NULL)
+  {
+    fprintf(stderr, "cortex_index.c: out of memory (%s)\n", index_path);
+    free(entries);
+    free(records);
+    return 0;
+  }
+
+  for(i = 0, j = 0; i <= num_buckets; i++)
+  {
+    while(j < num_entries && entries[j].bucket < i)
+    {
+      j++;
+    }
+
+    directory[i] = j;
+  }
+
+  // Write
+  char success = 1;
+  FILE *out = fopen(index_path, "wb");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_index.c: couldn't open file (%s)\n", index_path);
+    success = 0;
+  }
+  else
+  {
+    INDEX_HEADER header;
+    memset(&header, 0, sizeof(INDEX_HEADER));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.version = INDEX_VERSION;
+    header.kmer_size = kmer_size;
+    header.dir_bits = dir_bits;
+    header.num_entries = num_entries;
+    header.num_records = num_records;
+
+    setvbuf(out, NULL, _IOFBF, 1<<20);
+
+    success = (fwrite(&header, sizeof(INDEX_HEADER), 1, out) == 1 &&
+               fwrite(directory, sizeof(uint64_t), num_buckets+1, out)
+                 == num_buckets+1);
+
+    for(i = 0; i < num_entries && success; i++)
+    {
+      success = (fwrite(&entries[i].entry, sizeof(INDEX_ENTRY), 1, out) == 1);
+    }
+
+    if(success &&
+       fwrite(records, sizeof(INDEX_RECORD), num_records, out) != num_records)
+    {
+      success = 0;
+    }
+
+    if(fclose(out) != 0)
+    {
+      success = 0;
+    }
+
+    if(!success)
+    {
+      fprintf(stderr, "cortex_index.c: couldn't write index (%s)\n",
+              index_path);
+    }
+  }
+
+  free(directory);
+  free(entries);
+  free(records);
+
+  return success;
+}
+
+//
+// Querying
+//
+
+CORTEX_KMER_INDEX* cortex_index_load(const char *index_path)
+{
+  int fd = open(index_path, O_RDONLY);
+
+  if(fd == -1)
+  {
+    fprintf(stderr, "cortex_index.c: couldn't open file (%s)\n", index_path);
+    return NULL;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(INDEX_HEADER))
+  {
+    fprintf(stderr, "cortex_index.c: not an index file (%s)\n", index_path);
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+  {
+    fprintf(stderr, "cortex_index.c: couldn't map file (%s)\n", index_path);
+    return NULL;
+  }
+
+  const INDEX_HEADER *header = (const INDEX_HEADER*)map;
+
+  size_t expected_size = 0;
+
+  if(memcmp(header->magic, INDEX_MAGIC, 8) == 0 &&
+     header->version == INDEX_VERSION && header->dir_bits < 64)
+  {
+    expected_size = sizeof(INDEX_HEADER) +
+                    (((size_t)1 << header->dir_bits) + 1) * sizeof(uint64_t) +
+                    header->num_entries * sizeof(INDEX_ENTRY) +
+                    header->num_records * sizeof(INDEX_RECORD);
+  }
+
+  if(expected_size != (size_t)st.st_size)
+  {
+    fprintf(stderr, "cortex_index.c: corrupt or incompatible index (%s)\n",
+            index_path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  CORTEX_KMER_INDEX *index
+    = (CORTEX_KMER_INDEX*) malloc(sizeof(CORTEX_KMER_INDEX));
+
+  index->map = map;
+  index->map_size = st.st_size;
+  index->header = header;
+  index->directory = (const uint64_t*)(header + 1);
+  index->entries = (const INDEX_ENTRY*)
+                   (index->directory + ((size_t)1 << header->dir_bits) + 1);
+  index->records = (const INDEX_RECORD*)
+                   (index->entries + header->num_entries);
+
+  return index;
+}
+
+void cortex_index_close(CORTEX_KMER_INDEX *index)
+{
+  munmap(index->map, index->map_size);
+  free(index);
+}
+
+unsigned int cortex_index_kmer_size(const CORTEX_KMER_INDEX *index)
+{
+  return index->header->kmer_size;
+}
+
+size_t cortex_index_query(const CORTEX_KMER_INDEX *index,
+                          const CORTEX_KMER *kmer,
+                          CORTEX_INDEX_HIT *hits, size_t max_hits)
+{
+  INDEX_ENTRY key;
+  CORTEX_KMER canonical;
+
+  cortex_kmer_canonical(kmer, index->header->kmer_size, &canonical);
+  key.kmer[0] = canonical.b[0];
+  key.kmer[1] = canonical.b[1];
+
+  uint64_t bucket = _index_hash(&canonical) >> (64 - index->header->dir_bits);
+
+  // Find first match in bucket
+  size_t lo = index->directory[bucket], hi = index->directory[bucket+1];
+
+  while(lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if(_index_entry_cmp(&index->entries[mid], &key) < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  size_t end = index->directory[bucket+1], num_hits = 0;
+
+  for(; lo < end && _index_entry_cmp(&index->entries[lo], &key) == 0; lo++)
+  {
+    if(num_hits < max_hits)
+    {
+      const INDEX_RECORD *record = &index->records[index->entries[lo].record];
+      hits[num_hits].var_num = record->var_num;
+      hits[num_hits].offset = record->offset;
+    }
+
+    num_hits++;
+  }
+
+  return num_hits;
+}
+
+size_t cortex_index_query_str(const CORTEX_KMER_INDEX *index, const char *kmer,
+                              CORTEX_INDEX_HIT *hits, size_t max_hits)
+{
+  CORTEX_KMER bkmer;
+
+  if(strlen(kmer) != index->header->kmer_size ||
+     !cortex_kmer_from_str(kmer, index->header->kmer_size, &bkmer))
+  {
+    return 0;
+  }
+
+  return cortex_index_query(index, &bkmer, hits, max_hits);
+}
@@ -0,0 +1,75 @@
+/*
+ cortex_index.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_INDEX_H_SEEN
+#define CORTEX_INDEX_H_SEEN
+
+#include "cortex.h"
+#include "cortex_kmer.h"
+
+//
+// Kmer -> bubble index
+//
+// Maps every canonical kmer (k = c_file->kmer_size) of the four paths of each
+// bubble to the bubble's var_num and record offset (use with cortex_seek()).
+//
+// On disk the index is a table of (kmer, bubble) entries sorted by kmer hash,
+// with a directory on the top bits of the hash giving each bucket's range.
+// Loading maps the file into memory; a query hashes the kmer, jumps to its
+// bucket and binary searches it.  Files use the host's byte order.
+//
+// Building holds all entries in memory before sorting them (32 bytes per
+// kmer of every path), so it is limited by memory.  Only queries work on
+// indexes larger than memory.
+//
+
+typedef struct CORTEX_KMER_INDEX CORTEX_KMER_INDEX;
+
+typedef struct
+{
+  unsigned long var_num;
+  long offset;
+} CORTEX_INDEX_HIT;
+
+// Index all remaining bubbles of c_file and write the index to index_path.
+// Returns 1 on success, 0 on failure
+char cortex_index_build(CORTEX_FILE *c_file, const char *index_path);
+
+// Returns NULL on failure
+CORTEX_KMER_INDEX* cortex_index_load(const char *index_path);
+void cortex_index_close(CORTEX_KMER_INDEX *index);
+
+unsigned int cortex_index_kmer_size(const CORTEX_KMER_INDEX *index);
+
+// Look up a kmer (either orientation).  Up to max_hits bubbles containing it
+// are stored in hits.  Returns the total number of bubbles containing it.
+size_t cortex_index_query(const CORTEX_KMER_INDEX *index,
+                          const CORTEX_KMER *kmer,
+                          CORTEX_INDEX_HIT *hits, size_t max_hits);
+
+// As above but kmer is a string of kmer_size bases
+size_t cortex_index_query_str(const CORTEX_KMER_INDEX *index, const char *kmer,
+                              CORTEX_INDEX_HIT *hits, size_t max_hits);
+
+#endif
@@ -0,0 +1,1302 @@
+/*
+ cortex_join.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cortex_join.h"
+#include "cortex_hash.h"
+#include "cortex_kmer.h"
+#include "cortex_parallel.h"
+
+// Bubbles per batch and per unit of parallel work
+#define JOIN_BATCH_SIZE 4096
+#define JOIN_CHUNK_SIZE 64
+
+// Alignments read before indexing or looking up a batch: up to this many,
+// or until they hold JOIN_BATCH_KMERS kmers
+#define JOIN_ALIGNMENT_BATCH 256
+#define JOIN_BATCH_KMERS (1<<20)
+
+#define JOIN_END UINT64_MAX
+
+// Records and kmer offsets have to fit in an occurrence
+#define JOIN_MAX_RECORDS UINT32_MAX
+#define JOIN_MAX_KMERS (((size_t)1 << 31) - 1)
+
+// A bubble's best alignment when indexing bubbles: flank kmers found, then
+// the alignment (inverted so that earlier alignments win ties), then 1 for
+// '+', so the best has the largest value.  0 means none
+#define JOIN_BEST_ALIGNMENT_BITS 40
+#define JOIN_BEST_ALIGNMENT_MASK (((uint64_t)1 << JOIN_BEST_ALIGNMENT_BITS) - 1)
+#define JOIN_BEST_MAX_KMERS (((uint64_t)1 << 22) - 1)
+
+// An occurrence of a kmer in the indexed input: its record, its kmer offset
+// there (the 3' flank's kmers follow on from the 5' flank's) << 1, and 1 if
+// the record has the reverse complement of the canonical kmer
+typedef struct
+{
+  uint32_t record, pos_rev;
+  uint64_t next;
+} _JOIN_OCC;
+
+// Canonical kmer -> its most recent occurrence, which links to the others
+typedef struct
+{
+  CORTEX_HASH *hash;
+  _JOIN_OCC *occs;
+  size_t num_occs, capacity;
+  unsigned int kmer_size;
+} _JOIN_INDEX;
+
+// A flank kmer found in an alignment.  record is the other input's record
+typedef struct
+{
+  uint32_t record, flank_pos, aln_pos;
+  char minus;
+} _JOIN_HIT;
+
+typedef struct
+{
+  _JOIN_HIT *hits;
+  size_t num_hits, capacity;
+} _JOIN_HITS;
+
+//
+// Kmer index
+//
+
+// A bijection, so the key is still the kmer itself
+uint64_t _join_mix(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+size_t _join_num_kmers(size_t seq_len, unsigned int kmer_size)
+{
+  return seq_len >= kmer_size ? seq_len - kmer_size + 1 : 0;
+}
+
+void _join_index_init(_JOIN_INDEX *index, unsigned int kmer_size)
+{
+  index->hash = cortex_hash_create(JOIN_BATCH_KMERS);
+  index->occs = NULL;
+  index->num_occs = 0;
+  index->capacity = 0;
+  index->kmer_size = kmer_size;
+}
+
+void _join_index_dealloc(_JOIN_INDEX *index)
+{
+  cortex_hash_free(index->hash);
+  free(index->occs);
+}
+
+// Not thread safe.  Make room for num_kmers more occurrences
+void _join_index_reserve(_JOIN_INDEX *index, size_t num_kmers)
+{
+  size_t capacity = cortex_hash_capacity(index->hash);
+
+  while(cortex_hash_size(index->hash) + num_kmers > capacity / 4 * 3)
+  {
+    capacity *= 2;
+  }
+
+  if(capacity > cortex_hash_capacity(index->hash))
+  {
+    cortex_hash_grow(index->hash, capacity);
+  }
+
+  if(index->num_occs + num_kmers > index->capacity)
+  {
+    index->capacity = index->num_occs + num_kmers;
+    index->capacity += index->capacity / 2;
+    index->occs = (_JOIN_OCC*)
+                  realloc(index->occs, index->capacity * sizeof(_JOIN_OCC));
+
+    if(index->occs == NULL)
+    {
+      fprintf(stderr, "cortex_join.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Thread safe after _join_index_reserve().  Add the kmers of seq, whose
+// occurrences were reserved from first_occ, with offsets from pos_offset
+void _join_index_add(_JOIN_INDEX *index, const StrBuf *seq, uint32_t record,
+                     uint32_t pos_offset, size_t first_occ)
+{
+  CORTEX_KMER_ITER iter;
+  CORTEX_KMER kmer;
+  size_t start;
+  uint64_t *head;
+
+  cortex_kmer_iter_init(&iter, seq->buff, strbuf_len(seq), index->kmer_size);
+
+  while(cortex_kmer_iter_next(&iter, &kmer, &start))
+  {
+    uint64_t o = first_occ + start;
+    _JOIN_OCC *occ = &index->occs[o];
+
+    occ->record = record;
+    occ->pos_rev = ((pos_offset + (uint32_t)start) << 1) |
+                   (cortex_kmer_cmp(&kmer, &iter.fw) != 0);
+    occ->next = JOIN_END;
+
+    if(cortex_hash_insert(index->hash, kmer.b[0], _join_mix(kmer.b[1]), o,
+                          &head) == CORTEX_HASH_FOUND)
+    {
+      occ->next = __atomic_exchange_n(head, o, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void _join_hits_push(_JOIN_HITS *hits, uint32_t record, uint32_t flank_pos,
+                     uint32_t aln_pos, char minus)
+{
+  if(hits->num_hits == hits->capacity)
+  {
+    hits->capacity = hits->capacity == 0 ? 256 : hits->capacity * 2;
+    hits->hits = (_JOIN_HIT*)
+                 realloc(hits->hits, hits->capacity * sizeof(_JOIN_HIT));
+
+    if(hits->hits == NULL)
+    {
+      fprintf(stderr, "cortex_join.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  _JOIN_HIT *hit = &hits->hits[hits->num_hits++];
+  hit->record = record;
+  hit->flank_pos = flank_pos;
+  hit->aln_pos = aln_pos;
+  hit->minus = minus;
+}
+
+// Thread safe.  Add a hit for each occurrence of each kmer in seq.  With
+// is_flank, seq is part of a bubble (its kmer offsets from pos_offset) and
+// the index holds alignments; otherwise seq is an alignment and the index
+// holds bubbles
+void _join_hits_add(_JOIN_HITS *hits, const _JOIN_INDEX *index,
+                    const StrBuf *seq, uint32_t pos_offset, char is_flank)
+{
+  CORTEX_KMER_ITER iter;
+  CORTEX_KMER kmer;
+  size_t start;
+  const uint64_t *head;
+  uint64_t o;
+
+  cortex_kmer_iter_init(&iter, seq->buff, strbuf_len(seq), index->kmer_size);
+
+  while(cortex_kmer_iter_next(&iter, &kmer, &start))
+  {
+    char rev = (cortex_kmer_cmp(&kmer, &iter.fw) != 0);
+
+    head = cortex_hash_find(index->hash, kmer.b[0], _join_mix(kmer.b[1]));
+
+    for(o = (head == NULL ? JOIN_END : *head); o != JOIN_END;
+        o = index->occs[o].next)
+    {
+      const _JOIN_OCC *occ = &index->occs[o];
+      uint32_t occ_pos = occ->pos_rev >> 1;
+      char minus = ((char)(occ->pos_rev & 1) != rev);
+
+      if(is_flank)
+      {
+        _join_hits_push(hits, occ->record, pos_offset + (uint32_t)start,
+                        occ_pos, minus);
+      }
+      else
+      {
+        _join_hits_push(hits, occ->record, occ_pos, (uint32_t)start, minus);
+      }
+    }
+  }
+}
+
+// Groups hits by record and strand, then flank kmer, earliest in the
+// alignment first
+int _join_hit_cmp(const void *ptr1, const void *ptr2)
+{
+  const _JOIN_HIT *a = (const _JOIN_HIT*)ptr1, *b = (const _JOIN_HIT*)ptr2;
+
+  if(a->record != b->record)
+  {
+    return a->record < b->record ? -1 : 1;
+  }
+
+  if(a->minus != b->minus)
+  {
+    return a->minus < b->minus ? -1 : 1;
+  }
+
+  if(a->flank_pos != b->flank_pos)
+  {
+    return a->flank_pos < b->flank_pos ? -1 : 1;
+  }
+
+  return a->aln_pos < b->aln_pos ? -1 : (a->aln_pos > b->aln_pos);
+}
+
+char _join_same_group(const _JOIN_HIT *a, const _JOIN_HIT *b)
+{
+  return a->record == b->record && a->minus == b->minus;
+}
+
+// Number of distinct flank kmers in the group of sorted hits starting at
+// first, and the hit after the group in *end
+size_t _join_group_kmers(const _JOIN_HIT *hits, size_t num_hits, size_t first,
+                         size_t *end)
+{
+  size_t i, num_kmers = 1;
+
+  for(i = first + 1; i < num_hits && _join_same_group(&hits[first], &hits[i]);
+      i++)
+  {
+    num_kmers += (hits[i].flank_pos != hits[i-1].flank_pos);
+  }
+
+  *end = i;
+  return num_kmers;
+}
+
+//
+// Matches
+//
+
+CORTEX_JOIN_MATCH* _join_match_create(unsigned long num_colours)
+{
+  CORTEX_JOIN_MATCH *match
+    = (CORTEX_JOIN_MATCH*) malloc(sizeof(CORTEX_JOIN_MATCH));
+  unsigned long col;
+  int f;
+
+  if(match == NULL)
+  {
+    fprintf(stderr, "cortex_join.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(f = 0; f < 2; f++)
+  {
+    match->flank_colour_covgs[f]
+      = (COLOUR_COVG**) malloc(num_colours * sizeof(COLOUR_COVG*) + 1);
+
+    if(match->flank_colour_covgs[f] == NULL)
+    {
+      fprintf(stderr, "cortex_join.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for(col = 0; col < num_colours; col++)
+    {
+      match->flank_colour_covgs[f][col]
+        = (COLOUR_COVG*) calloc(1, sizeof(COLOUR_COVG));
+
+      if(match->flank_colour_covgs[f][col] == NULL)
+      {
+        fprintf(stderr, "cortex_join.c: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  return match;
+}
+
+void _join_match_free(CORTEX_JOIN_MATCH *match, unsigned long num_colours)
+{
+  unsigned long col;
+  int f;
+
+  for(f = 0; f < 2; f++)
+  {
+    for(col = 0; col < num_colours; col++)
+    {
+      free(match->flank_colour_covgs[f][col]->colour_covgs);
+      free(match->flank_colour_covgs[f][col]);
+    }
+
+    free(match->flank_colour_covgs[f]);
+  }
+
+  free(match);
+}
+
+// No alignment, with zero coverage for flanks of num_kmers kmers
+void _join_match_reset(CORTEX_JOIN_MATCH *match, const size_t num_kmers[2],
+                       unsigned long num_colours)
+{
+  unsigned long col;
+  int f;
+
+  match->alignment = -1;
+  match->name = NULL;
+  match->strand = '+';
+  match->kmers_5p = match->kmers_3p = 0;
+  match->start = match->end = 0;
+
+  for(f = 0; f < 2; f++)
+  {
+    for(col = 0; col < num_colours; col++)
+    {
+      COLOUR_COVG *covg = match->flank_colour_covgs[f][col];
+
+      if(num_kmers[f] > covg->capacity)
+      {
+        covg->capacity = num_kmers[f];
+        covg->colour_covgs = (unsigned long*)
+          realloc(covg->colour_covgs, covg->capacity * sizeof(unsigned long));
+
+        if(covg->colour_covgs == NULL)
+        {
+          fprintf(stderr, "cortex_join.c: out of memory\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      covg->length = num_kmers[f];
+
+      if(covg->length > 0)
+      {
+        memset(covg->colour_covgs, 0, covg->length * sizeof(unsigned long));
+      }
+    }
+  }
+}
+
+// Record that flank kmer flank_pos is at aln_pos in the alignment.  Returns
+// a pointer to where its coverage goes, indexed by colour
+void _join_match_found(CORTEX_JOIN_MATCH *match, size_t kmers_5p,
+                       uint32_t flank_pos, uint32_t aln_pos,
+                       int *flank, size_t *pos)
+{
+  if(match->kmers_5p + match->kmers_3p == 0)
+  {
+    match->start = aln_pos;
+    match->end = aln_pos + 1;
+  }
+  else
+  {
+    match->start = aln_pos < match->start ? aln_pos : match->start;
+    match->end = aln_pos + 1 > match->end ? aln_pos + 1 : match->end;
+  }
+
+  if(flank_pos < kmers_5p)
+  {
+    *flank = 0;
+    *pos = flank_pos;
+    match->kmers_5p++;
+  }
+  else
+  {
+    *flank = 1;
+    *pos = flank_pos - kmers_5p;
+    match->kmers_3p++;
+  }
+}
+
+void _join_flank_kmers(const CORTEX_BUBBLE *bubble, unsigned int kmer_size,
+                       size_t num_kmers[2])
+{
+  num_kmers[0] = _join_num_kmers(strbuf_len(bubble->flank_5p.seq), kmer_size);
+  num_kmers[1] = _join_num_kmers(strbuf_len(bubble->flank_3p.seq), kmer_size);
+}
+
+char _join_check_alignment(const CORTEX_FILE *alignments, size_t alignment,
+                            size_t num_kmers)
+{
+  if(alignment >= JOIN_MAX_RECORDS || num_kmers > JOIN_MAX_KMERS)
+  {
+    fprintf(stderr, "cortex_join.c: too many alignments or alignment too "
+                    "long (%s:%lu)\n", alignments->path,
+            alignments->line_number);
+    return 0;
+  }
+
+  return 1;
+}
+
+//
+// Indexing alignments, streaming bubbles
+//
+
+typedef struct
+{
+  size_t name_offset, covg_offset;
+  uint32_t num_kmers;
+} _JOIN_ALIGNMENT;
+
+typedef struct
+{
+  _JOIN_INDEX index;
+  unsigned long num_colours;
+
+  // Alignments indexed so far, their names and their coverage
+  // ([alignment][colour][kmer])
+  _JOIN_ALIGNMENT *alignments;
+  size_t num_alignments, capacity;
+  char *names;
+  size_t names_len, names_capacity;
+  uint32_t *covgs;
+  size_t covgs_len, covgs_capacity;
+
+  // Batch of alignments being indexed, and the first occurrence of each
+  CORTEX_ALIGNMENT **batch;
+  size_t batch_size, batch_first, *batch_occs;
+
+  // Batch of bubbles being matched
+  CORTEX_BUBBLE **bubbles;
+  CORTEX_JOIN_MATCH **matches;
+  size_t num_bubbles;
+} _JOIN_BY_ALIGNMENTS;
+
+void _join_index_alignment(size_t i, void *ptr)
+{
+  _JOIN_BY_ALIGNMENTS *join = (_JOIN_BY_ALIGNMENTS*)ptr;
+  const CORTEX_ALIGNMENT *alignment = join->batch[i];
+  size_t record = join->batch_first + i;
+  const _JOIN_ALIGNMENT *stored = &join->alignments[record];
+  uint32_t *covgs = join->covgs + stored->covg_offset;
+  unsigned long col, j;
+
+  _join_index_add(&join->index, alignment->seq, (uint32_t)record, 0,
+                  join->batch_occs[i]);
+
+  for(col = 0; col < join->num_colours; col++)
+  {
+    const COLOUR_COVG *covg = alignment->colour_covgs[col];
+
+    for(j = 0; j < stored->num_kmers; j++)
+    {
+      unsigned long value = j < covg->length ? covg->colour_covgs[j] : 0;
+      covgs[j] = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+    }
+
+    covgs += stored->num_kmers;
+  }
+}
+
+// Add an alignment to the batch (already read into join->batch)
+void _join_store_alignment(_JOIN_BY_ALIGNMENTS *join, size_t num_kmers)
+{
+  const CORTEX_ALIGNMENT *alignment = join->batch[join->batch_size];
+  size_t name_len = strbuf_len(alignment->name);
+
+  if(join->num_alignments == join->capacity)
+  {
+    join->capacity = join->capacity == 0 ? 1024 : join->capacity * 2;
+    join->alignments = (_JOIN_ALIGNMENT*)
+      realloc(join->alignments, join->capacity * sizeof(_JOIN_ALIGNMENT));
+  }
+
+  if(join->names_len + name_len + 1 > join->names_capacity)
+  {
+    join->names_capacity = 2 * (join->names_len + name_len + 1);
+    join->names = (char*) realloc(join->names, join->names_capacity);
+  }
+
+  if(join->alignments == NULL || join->names == NULL)
+  {
+    fprintf(stderr, "cortex_join.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  _JOIN_ALIGNMENT *stored = &join->alignments[join->num_alignments++];
+  stored->name_offset = join->names_len;
+  stored->covg_offset = join->covgs_len;
+  stored->num_kmers = (uint32_t)num_kmers;
+
+  memcpy(join->names + join->names_len, alignment->name->buff, name_len + 1);
+  join->names_len += name_len + 1;
+  join->covgs_len += num_kmers * join->num_colours;
+}
+
+char _join_read_alignments(_JOIN_BY_ALIGNMENTS *join, CORTEX_FILE *c_file,
+                           unsigned int num_threads)
+{
+  unsigned int kmer_size = join->index.kmer_size;
+  size_t i, kmers;
+  char success = 1;
+
+  join->batch = (CORTEX_ALIGNMENT**)
+                malloc(JOIN_ALIGNMENT_BATCH * sizeof(CORTEX_ALIGNMENT*));
+  join->batch_occs = (size_t*) malloc(JOIN_ALIGNMENT_BATCH * sizeof(size_t));
+
+  if(join->batch == NULL || join->batch_occs == NULL)
+  {
+    fprintf(stderr, "cortex_join.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < JOIN_ALIGNMENT_BATCH; i++)
+  {
+    join->batch[i] = cortex_alignment_create(c_file);
+  }
+
+  do
+  {
+    join->batch_first = join->num_alignments;
+    kmers = 0;
+
+    for(join->batch_size = 0; join->batch_size < JOIN_ALIGNMENT_BATCH &&
+        kmers < JOIN_BATCH_KMERS &&
+        cortex_read_alignment(join->batch[join->batch_size], c_file);
+        join->batch_size++)
+    {
+      size_t num_kmers
+        = _join_num_kmers(strbuf_len(join->batch[join->batch_size]->seq),
+                          kmer_size);
+
+      if(!_join_check_alignment(c_file, join->num_alignments, num_kmers))
+      {
+        success = 0;
+        break;
+      }
+
+      _join_store_alignment(join, num_kmers);
+      join->batch_occs[join->batch_size] = join->index.num_occs + kmers;
+      kmers += num_kmers;
+    }
+
+    if(join->covgs_len > join->covgs_capacity)
+    {
+      join->covgs_capacity = join->covgs_len + join->covgs_len / 2;
+      join->covgs = (uint32_t*)
+        realloc(join->covgs, join->covgs_capacity * sizeof(uint32_t));
+
+      if(join->covgs == NULL)
+      {
+        fprintf(stderr, "cortex_join.c: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    _join_index_reserve(&join->index, kmers);
+    cortex_parallel_for(join->batch_size, num_threads, _join_index_alignment,
+                        join);
+    join->index.num_occs += kmers;
+  }
+  while(success && join->batch_size > 0);
+
+  for(i = 0; i < JOIN_ALIGNMENT_BATCH; i++)
+  {
+    cortex_alignment_free(join->batch[i], c_file);
+  }
+
+  free(join->batch);
+  free(join->batch_occs);
+
+  return success;
+}
+
+void _join_match_bubble(const _JOIN_BY_ALIGNMENTS *join,
+                        const CORTEX_BUBBLE *bubble, CORTEX_JOIN_MATCH *match,
+                        _JOIN_HITS *hits)
+{
+  size_t num_kmers[2], i, first, end, best = 0, best_kmers = 0, pos;
+  unsigned long col;
+  int flank;
+
+  _join_flank_kmers(bubble, join->index.kmer_size, num_kmers);
+  _join_match_reset(match, num_kmers, join->num_colours);
+
+  hits->num_hits = 0;
+  _join_hits_add(hits, &join->index, bubble->flank_5p.seq, 0, 1);
+  _join_hits_add(hits, &join->index, bubble->flank_3p.seq,
+                 (uint32_t)num_kmers[0], 1);
+
+  if(hits->num_hits == 0)
+  {
+    return;
+  }
+
+  qsort(hits->hits, hits->num_hits, sizeof(_JOIN_HIT), _join_hit_cmp);
+
+  // Groups are in alignment then strand order, so the first best wins ties
+  for(first = 0; first < hits->num_hits; first = end)
+  {
+    size_t group_kmers = _join_group_kmers(hits->hits, hits->num_hits, first,
+                                           &end);
+
+    if(group_kmers > best_kmers)
+    {
+      best = first;
+      best_kmers = group_kmers;
+    }
+  }
+
+  const _JOIN_HIT *best_hit = &hits->hits[best];
+  const _JOIN_ALIGNMENT *alignment = &join->alignments[best_hit->record];
+
+  match->alignment = (long)best_hit->record;
+  match->name = join->names + alignment->name_offset;
+  match->strand = best_hit->minus ? '-' : '+';
+
+  for(i = best; i < hits->num_hits &&
+      _join_same_group(best_hit, &hits->hits[i]); i++)
+  {
+    const _JOIN_HIT *hit = &hits->hits[i];
+
+    // Where the kmer is first in the alignment
+    if(i > best && hit->flank_pos == hits->hits[i-1].flank_pos)
+    {
+      continue;
+    }
+
+    _join_match_found(match, num_kmers[0], hit->flank_pos, hit->aln_pos,
+                      &flank, &pos);
+
+    for(col = 0; col < join->num_colours; col++)
+    {
+      match->flank_colour_covgs[flank][col]->colour_covgs[pos]
+        = join->covgs[alignment->covg_offset +
+                      col * alignment->num_kmers + hit->aln_pos];
+    }
+  }
+}
+
+void _join_match_chunk(size_t chunk, void *ptr)
+{
+  _JOIN_BY_ALIGNMENTS *join = (_JOIN_BY_ALIGNMENTS*)ptr;
+  size_t i = chunk * JOIN_CHUNK_SIZE, end = i + JOIN_CHUNK_SIZE;
+  _JOIN_HITS hits = {NULL, 0, 0};
+
+  if(end > join->num_bubbles)
+  {
+    end = join->num_bubbles;
+  }
+
+  for(; i < end; i++)
+  {
+    _join_match_bubble(join, join->bubbles[i], join->matches[i], &hits);
+  }
+
+  free(hits.hits);
+}
+
+long _join_by_alignments(CORTEX_FILE *bubbles, CORTEX_FILE *alignments,
+                         cortex_join_func func, void *arg,
+                         unsigned int num_threads)
+{
+  _JOIN_BY_ALIGNMENTS join;
+  memset(&join, 0, sizeof(_JOIN_BY_ALIGNMENTS));
+  _join_index_init(&join.index, alignments->kmer_size);
+  join.num_colours = alignments->num_of_colours;
+
+  long num_bubbles = -1;
+  size_t i;
+
+  if(_join_read_alignments(&join, alignments, num_threads))
+  {
+    join.bubbles
+      = (CORTEX_BUBBLE**) malloc(JOIN_BATCH_SIZE * sizeof(CORTEX_BUBBLE*));
+    join.matches = (CORTEX_JOIN_MATCH**)
+                   malloc(JOIN_BATCH_SIZE * sizeof(CORTEX_JOIN_MATCH*));
+
+    if(join.bubbles == NULL || join.matches == NULL)
+    {
+      fprintf(stderr, "cortex_join.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < JOIN_BATCH_SIZE; i++)
+    {
+      join.bubbles[i] = cortex_bubble_create(bubbles);
+      join.matches[i] = _join_match_create(join.num_colours);
+    }
+
+    num_bubbles = 0;
+
+    do
+    {
+      for(join.num_bubbles = 0; join.num_bubbles < JOIN_BATCH_SIZE &&
+          cortex_read_bubble(join.bubbles[join.num_bubbles], bubbles);
+          join.num_bubbles++);
+
+      size_t num_chunks = (join.num_bubbles + JOIN_CHUNK_SIZE - 1) /
+                          JOIN_CHUNK_SIZE;
+
+      cortex_parallel_for(num_chunks, num_threads, _join_match_chunk, &join);
+
+      for(i = 0; i < join.num_bubbles; i++)
+      {
+        func(join.bubbles[i], join.matches[i], arg);
+      }
+
+      num_bubbles += join.num_bubbles;
+    }
+    while(join.num_bubbles == JOIN_BATCH_SIZE);
+
+    for(i = 0; i < JOIN_BATCH_SIZE; i++)
+    {
+      cortex_bubble_free(join.bubbles[i], bubbles);
+      _join_match_free(join.matches[i], join.num_colours);
+    }
+
+    free(join.bubbles);
+    free(join.matches);
+  }
+
+  _join_index_dealloc(&join.index);
+  free(join.alignments);
+  free(join.names);
+  free(join.covgs);
+
+  return num_bubbles;
+}
+
+//
+// Indexing bubbles, streaming alignments
+//
+// Pass 1 over the alignments finds each bubble's best alignment, and pass 2
+// copies the coverage from it.  The bubbles are then read again in order.
+//
+
+typedef struct
+{
+  uint64_t best;
+  // First flank kmer in positions, and in covgs (times the colours)
+  size_t offset;
+  uint32_t kmers_5p, kmers_3p;
+} _JOIN_BUBBLE;
+
+typedef struct
+{
+  _JOIN_INDEX index;
+  unsigned long num_colours;
+
+  _JOIN_BUBBLE *bubbles;
+  size_t num_bubbles, capacity;
+
+  // For each flank kmer: 1 + where it is in the best alignment (0 if it
+  // isn't), and its coverage there ([bubble][colour][kmer])
+  uint32_t *positions, *covgs;
+  size_t num_flank_kmers;
+
+  // Names of alignments that are best for some bubble
+  char **names;
+  size_t num_alignments;
+
+  // Batches being indexed or streamed, and the first occurrence of each
+  // bubble
+  CORTEX_BUBBLE **bubble_batch;
+  CORTEX_ALIGNMENT **alignment_batch;
+  size_t batch_size, batch_first, *batch_occs;
+} _JOIN_BY_BUBBLES;
+
+uint64_t _join_best_pack(size_t num_kmers, size_t alignment, char minus)
+{
+  uint64_t kmers = num_kmers < JOIN_BEST_MAX_KMERS ? num_kmers
+                                                   : JOIN_BEST_MAX_KMERS;
+
+  return (kmers << (JOIN_BEST_ALIGNMENT_BITS + 1)) |
+         ((JOIN_BEST_ALIGNMENT_MASK - alignment) << 1) | !minus;
+}
+
+size_t _join_best_alignment(uint64_t best)
+{
+  return JOIN_BEST_ALIGNMENT_MASK - ((best >> 1) & JOIN_BEST_ALIGNMENT_MASK);
+}
+
+void _join_index_bubble_chunk(size_t chunk, void *ptr)
+{
+  _JOIN_BY_BUBBLES *join = (_JOIN_BY_BUBBLES*)ptr;
+  size_t i = chunk * JOIN_CHUNK_SIZE, end = i + JOIN_CHUNK_SIZE;
+
+  if(end > join->batch_size)
+  {
+    end = join->batch_size;
+  }
+
+  for(; i < end; i++)
+  {
+    const CORTEX_BUBBLE *bubble = join->bubble_batch[i];
+    size_t record = join->batch_first + i;
+    uint32_t kmers_5p = join->bubbles[record].kmers_5p;
+
+    _join_index_add(&join->index, bubble->flank_5p.seq, (uint32_t)record, 0,
+                    join->batch_occs[i]);
+    _join_index_add(&join->index, bubble->flank_3p.seq, (uint32_t)record,
+                    kmers_5p, join->batch_occs[i] + kmers_5p);
+  }
+}
+
+// Returns the offset of the first bubble, or -1 if there are none or they
+// couldn't be indexed
+long _join_read_bubbles(_JOIN_BY_BUBBLES *join, CORTEX_FILE *c_file,
+                        unsigned int num_threads)
+{
+  unsigned int kmer_size = join->index.kmer_size;
+  size_t i, kmers, num_kmers[2];
+  long first_offset = -1;
+  char success = 1;
+
+  join->bubble_batch
+    = (CORTEX_BUBBLE**) malloc(JOIN_BATCH_SIZE * sizeof(CORTEX_BUBBLE*));
+  join->batch_occs = (size_t*) malloc(JOIN_BATCH_SIZE * sizeof(size_t));
+
+  if(join->bubble_batch == NULL || join->batch_occs == NULL)
+  {
+    fprintf(stderr, "cortex_join.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < JOIN_BATCH_SIZE; i++)
+  {
+    join->bubble_batch[i] = cortex_bubble_create(c_file);
+  }
+
+  do
+  {
+    join->batch_first = join->num_bubbles;
+    kmers = 0;
+
+    for(join->batch_size = 0; join->batch_size < JOIN_BATCH_SIZE &&
+        cortex_read_bubble(join->bubble_batch[join->batch_size], c_file);
+        join->batch_size++)
+    {
+      _join_flank_kmers(join->bubble_batch[join->batch_size], kmer_size,
+                        num_kmers);
+
+      if(join->num_bubbles >= JOIN_MAX_RECORDS ||
+         num_kmers[0] + num_kmers[1] > JOIN_MAX_KMERS)
+      {
+        fprintf(stderr, "cortex_join.c: too many bubbles or flanks too long "
+                        "(%s:%lu)\n", c_file->path, c_file->line_number);
+        success = 0;
+        break;
+      }
+
+      if(first_offset < 0)
+      {
+        first_offset = c_file->record_offset;
+      }
+
+      if(join->num_bubbles == join->capacity)
+      {
+        join->capacity = join->capacity == 0 ? JOIN_BATCH_SIZE
+                                             : join->capacity * 2;
+        join->bubbles = (_JOIN_BUBBLE*)
+          realloc(join->bubbles, join->capacity * sizeof(_JOIN_BUBBLE));
+
+        if(join->bubbles == NULL)
+        {
+          fprintf(stderr, "cortex_join.c: out of memory\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      _JOIN_BUBBLE *stored = &join->bubbles[join->num_bubbles++];
+      stored->best = 0;
+      stored->offset = join->num_flank_kmers;
+      stored->kmers_5p = (uint32_t)num_kmers[0];
+      stored->kmers_3p = (uint32_t)num_kmers[1];
+
+      join->num_flank_kmers += num_kmers[0] + num_kmers[1];
+      join->batch_occs[join->batch_size] = join->index.num_occs + kmers;
+      kmers += num_kmers[0] + num_kmers[1];
+    }
+
+    size_t num_chunks = (join->batch_size + JOIN_CHUNK_SIZE - 1) /
+                        JOIN_CHUNK_SIZE;
+
+    _join_index_reserve(&join->index, kmers);
+    cortex_parallel_for(num_chunks, num_threads, _join_index_bubble_chunk,
+                        join);
+    join->index.num_occs += kmers;
+  }
+  while(success && join->batch_size == JOIN_BATCH_SIZE);
+
+  for(i = 0; i < JOIN_BATCH_SIZE; i++)
+  {
+    cortex_bubble_free(join->bubble_batch[i], c_file);
+  }
+
+  free(join->bubble_batch);
+  free(join->batch_occs);
+
+  return success ? first_offset : -1;
+}
+
+// Pass 1: offer each bubble this alignment
+void _join_vote_alignment(size_t i, void *ptr)
+{
+  _JOIN_BY_BUBBLES *join = (_JOIN_BY_BUBBLES*)ptr;
+  size_t alignment = join->batch_first + i, first, end;
+  _JOIN_HITS hits = {NULL, 0, 0};
+
+  _join_hits_add(&hits, &join->index, join->alignment_batch[i]->seq, 0, 0);
+
+  if(hits.num_hits == 0)
+  {
+    return;
+  }
+
+  qsort(hits.hits, hits.num_hits, sizeof(_JOIN_HIT), _join_hit_cmp);
+
+  for(first = 0; first < hits.num_hits; first = end)
+  {
+    const _JOIN_HIT *hit = &hits.hits[first];
+    size_t num_kmers = _join_group_kmers(hits.hits, hits.num_hits, first,
+                                         &end);
+    uint64_t vote = _join_best_pack(num_kmers, alignment, hit->minus), old;
+    uint64_t *best = &join->bubbles[hit->record].best;
+
+    while(vote > (old = __atomic_load_n(best, __ATOMIC_RELAXED)) &&
+          !__sync_bool_compare_and_swap(best, old, vote));
+  }
+
+  free(hits.hits);
+}
+
+// Pass 2: copy coverage to the bubbles this alignment is best for.  Only
+// this thread writes to those bubbles
+void _join_covg_alignment(size_t i, void *ptr)
+{
+  _JOIN_BY_BUBBLES *join = (_JOIN_BY_BUBBLES*)ptr;
+  const CORTEX_ALIGNMENT *alignment = join->alignment_batch[i];
+  size_t record = join->batch_first + i;
+  CORTEX_KMER_ITER iter;
+  CORTEX_KMER kmer;
+  size_t start;
+  const uint64_t *head;
+  uint64_t o;
+  unsigned long col;
+  char is_best = 0;
+
+  cortex_kmer_iter_init(&iter, alignment->seq->buff,
+                        strbuf_len(alignment->seq), join->index.kmer_size);
+
+  while(cortex_kmer_iter_next(&iter, &kmer, &start))
+  {
+    char rev = (cortex_kmer_cmp(&kmer, &iter.fw) != 0);
+
+    head = cortex_hash_find(join->index.hash, kmer.b[0], _join_mix(kmer.b[1]));
+
+    for(o = (head == NULL ? JOIN_END : *head); o != JOIN_END;
+        o = join->index.occs[o].next)
+    {
+      const _JOIN_OCC *occ = &join->index.occs[o];
+      const _JOIN_BUBBLE *bubble = &join->bubbles[occ->record];
+      char minus = ((char)(occ->pos_rev & 1) != rev);
+      size_t pos = occ->pos_rev >> 1;
+
+      if(bubble->best == 0 || (char)(bubble->best & 1) == minus ||
+         _join_best_alignment(bubble->best) != record ||
+         join->positions[bubble->offset + pos] != 0)
+      {
+        continue;
+      }
+
+      // Kmers come in alignment order, so this is the first place it's found
+      size_t flank_kmers = bubble->kmers_5p + bubble->kmers_3p;
+      uint32_t *covgs = join->covgs + bubble->offset * join->num_colours;
+
+      join->positions[bubble->offset + pos] = (uint32_t)start + 1;
+
+      for(col = 0; col < join->num_colours; col++)
+      {
+        const COLOUR_COVG *covg = alignment->colour_covgs[col];
+        unsigned long value = start < covg->length ? covg->colour_covgs[start]
+                                                   : 0;
+
+        covgs[col * flank_kmers + pos]
+          = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+      }
+
+      is_best = 1;
+    }
+  }
+
+  if(is_best)
+  {
+    join->names[record] = strdup(alignment->name->buff);
+  }
+}
+
+// Stream the alignments, calling func for each batch.  Returns 1 on success
+char _join_stream_alignments(_JOIN_BY_BUBBLES *join, CORTEX_FILE *c_file,
+                             cortex_parallel_func func,
+                             unsigned int num_threads)
+{
+  size_t i, kmers, num_alignments = 0;
+  char success = 1;
+
+  join->alignment_batch = (CORTEX_ALIGNMENT**)
+                          malloc(JOIN_ALIGNMENT_BATCH * sizeof(CORTEX_ALIGNMENT*));
+
+  if(join->alignment_batch == NULL)
+  {
+    fprintf(stderr, "cortex_join.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < JOIN_ALIGNMENT_BATCH; i++)
+  {
+    join->alignment_batch[i] = cortex_alignment_create(c_file);
+  }
+
+  do
+  {
+    join->batch_first = num_alignments;
+    kmers = 0;
+
+    for(join->batch_size = 0; join->batch_size < JOIN_ALIGNMENT_BATCH &&
+        kmers < JOIN_BATCH_KMERS &&
+        cortex_read_alignment(join->alignment_batch[join->batch_size], c_file);
+        join->batch_size++)
+    {
+      CORTEX_ALIGNMENT *alignment = join->alignment_batch[join->batch_size];
+      size_t num_kmers = _join_num_kmers(strbuf_len(alignment->seq),
+                                         join->index.kmer_size);
+
+      if(!_join_check_alignment(c_file, num_alignments, num_kmers))
+      {
+        success = 0;
+        break;
+      }
+
+      num_alignments++;
+      kmers += num_kmers;
+    }
+
+    cortex_parallel_for(join->batch_size, num_threads, func, join);
+  }
+  while(success && join->batch_size > 0);
+
+  for(i = 0; i < JOIN_ALIGNMENT_BATCH; i++)
+  {
+    cortex_alignment_free(join->alignment_batch[i], c_file);
+  }
+
+  free(join->alignment_batch);
+  join->num_alignments = num_alignments;
+
+  return success;
+}
+
+void _join_bubble_match(const _JOIN_BY_BUBBLES *join, size_t record,
+                        CORTEX_JOIN_MATCH *match)
+{
+  const _JOIN_BUBBLE *bubble = &join->bubbles[record];
+  size_t num_kmers[2] = {bubble->kmers_5p, bubble->kmers_3p};
+  size_t flank_kmers = num_kmers[0] + num_kmers[1], i, pos;
+  const uint32_t *positions = join->positions + bubble->offset;
+  const uint32_t *covgs = join->covgs + bubble->offset * join->num_colours;
+  unsigned long col;
+  int flank;
+
+  _join_match_reset(match, num_kmers, join->num_colours);
+
+  if(bubble->best == 0)
+  {
+    return;
+  }
+
+  match->alignment = (long)_join_best_alignment(bubble->best);
+  match->name = join->names[match->alignment];
+  match->strand = (bubble->best & 1) ? '+' : '-';
+
+  for(i = 0; i < flank_kmers; i++)
+  {
+    if(positions[i] == 0)
+    {
+      continue;
+    }
+
+    _join_match_found(match, num_kmers[0], (uint32_t)i, positions[i] - 1,
+                      &flank, &pos);
+
+    for(col = 0; col < join->num_colours; col++)
+    {
+      match->flank_colour_covgs[flank][col]->colour_covgs[pos]
+        = covgs[col * flank_kmers + i];
+    }
+  }
+}
+
+long _join_by_bubbles(CORTEX_FILE *bubbles, CORTEX_FILE *alignments,
+                      cortex_join_func func, void *arg,
+                      unsigned int num_threads)
+{
+  _JOIN_BY_BUBBLES join;
+  memset(&join, 0, sizeof(_JOIN_BY_BUBBLES));
+  _join_index_init(&join.index, bubbles->kmer_size);
+  join.num_colours = alignments->num_of_colours;
+
+  long bubbles_offset = _join_read_bubbles(&join, bubbles, num_threads);
+  long num_bubbles = -1;
+  size_t i;
+
+  if(bubbles_offset < 0 && join.num_bubbles > 0)
+  {
+    _join_index_dealloc(&join.index);
+    free(join.bubbles);
+    return -1;
+  }
+
+  join.positions = (uint32_t*) calloc(join.num_flank_kmers + 1,
+                                      sizeof(uint32_t));
+  join.covgs = (uint32_t*) calloc(join.num_flank_kmers * join.num_colours + 1,
+                                  sizeof(uint32_t));
+
+  if(join.positions == NULL || join.covgs == NULL)
+  {
+    fprintf(stderr, "cortex_join.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Both passes start from the first alignment
+  CORTEX_ALIGNMENT *first = cortex_alignment_create(alignments);
+  long alignments_offset = -1;
+  char success = 1;
+
+  if(cortex_read_alignment(first, alignments))
+  {
+    alignments_offset = alignments->record_offset;
+    success = cortex_seek(alignments, alignments_offset);
+  }
+
+  cortex_alignment_free(first, alignments);
+
+  if(success && alignments_offset >= 0)
+  {
+    success = _join_stream_alignments(&join, alignments, _join_vote_alignment,
+                                      num_threads);
+
+    join.names = (char**) calloc(join.num_alignments + 1, sizeof(char*));
+
+    if(join.names == NULL)
+    {
+      fprintf(stderr, "cortex_join.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    success = success && cortex_seek(alignments, alignments_offset) &&
+              _join_stream_alignments(&join, alignments, _join_covg_alignment,
+                                      num_threads);
+  }
+
+  // Read the bubbles again, in order
+  if(success && join.num_bubbles > 0)
+  {
+    success = cortex_seek(bubbles, bubbles_offset);
+  }
+
+  if(success)
+  {
+    CORTEX_BUBBLE *bubble = cortex_bubble_create(bubbles);
+    CORTEX_JOIN_MATCH *match = _join_match_create(join.num_colours);
+
+    for(num_bubbles = 0; (size_t)num_bubbles < join.num_bubbles &&
+        cortex_read_bubble(bubble, bubbles); num_bubbles++)
+    {
+      _join_bubble_match(&join, (size_t)num_bubbles, match);
+      func(bubble, match, arg);
+    }
+
+    if((size_t)num_bubbles != join.num_bubbles)
+    {
+      fprintf(stderr, "cortex_join.c: bubbles changed while joining (%s)\n",
+              bubbles->path);
+      num_bubbles = -1;
+    }
+
+    cortex_bubble_free(bubble, bubbles);
+    _join_match_free(match, join.num_colours);
+  }
+
+  // Clean up
+  if(join.names != NULL)
+  {
+    for(i = 0; i < join.num_alignments; i++)
+    {
+      free(join.names[i]);
+    }
+  }
+
+  _join_index_dealloc(&join.index);
+  free(join.names);
+  free(join.bubbles);
+  free(join.positions);
+  free(join.covgs);
+
+  return num_bubbles;
+}
+
+long cortex_join(CORTEX_FILE *bubbles, CORTEX_FILE *alignments,
+                 enum CORTEX_JOIN_INDEX index_side,
+                 cortex_join_func func, void *arg, unsigned int num_threads)
+{
+  if(bubbles->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_join.c: not a bubble file (%s)\n", bubbles->path);
+    return -1;
+  }
+
+  if(alignments->filetype != ALIGNMENT_FILE)
+  {
+    fprintf(stderr, "cortex_join.c: not an alignment file (%s)\n",
+            alignments->path);
+    return -1;
+  }
+
+  if(bubbles->kmer_size != alignments->kmer_size ||
+     bubbles->kmer_size == 0 || bubbles->kmer_size > CORTEX_MAX_KMER_SIZE)
+  {
+    fprintf(stderr, "cortex_join.c: kmer sizes differ or aren't supported "
+                    "[%u vs %u] (%s, %s)\n", bubbles->kmer_size,
+            alignments->kmer_size, bubbles->path, alignments->path);
+    return -1;
+  }
+
+  if(index_side == CORTEX_JOIN_SMALLER)
+  {
+    struct stat bubbles_stat, alignments_stat;
+
+    index_side = (stat(bubbles->path, &bubbles_stat) == 0 &&
+                  stat(alignments->path, &alignments_stat) == 0 &&
+                  bubbles_stat.st_size < alignments_stat.st_size)
+                 ? CORTEX_JOIN_BUBBLES : CORTEX_JOIN_ALIGNMENTS;
+  }
+
+  if(index_side == CORTEX_JOIN_BUBBLES)
+  {
+    return _join_by_bubbles(bubbles, alignments, func, arg, num_threads);
+  }
+  else
+  {
+    return _join_by_alignments(bubbles, alignments, func, arg, num_threads);
+  }
+}
@@ -0,0 +1,83 @@
+/*
+ cortex_join.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_JOIN_H_SEEN
+#define CORTEX_JOIN_H_SEEN
+
+#include "cortex.h"
+
+//
+// Joining bubbles to alignments
+//
+// Bubbles and alignments are matched on the canonical kmers of the bubble's
+// flanks.  A bubble's best alignment is the one sharing the most flank kmers
+// on one strand (ties go to the alignment nearest the start of the file, then
+// to '+'), and the coverage of each flank kmer is taken from where it first
+// occurs in that alignment.
+//
+// One input is indexed (a hash of each kmer's occurrences) and the other is
+// streamed against it, so memory grows with the indexed input only:
+//  - indexing alignments takes about 16 bytes plus 4 per colour per kmer
+//  - indexing bubbles takes about 20 bytes plus 4 per colour per flank kmer,
+//    but both files are read twice (they must be seekable)
+// The index is built in parallel as each batch is read.  Results are the
+// same either way round.
+//
+
+enum CORTEX_JOIN_INDEX {CORTEX_JOIN_SMALLER, CORTEX_JOIN_ALIGNMENTS,
+                        CORTEX_JOIN_BUBBLES};
+
+typedef struct
+{
+  // Best alignment, counting from 0 in file order, or -1 if no alignment
+  // shares a flank kmer with the bubble
+  long alignment;
+  // Name of the best alignment (NULL if none)
+  const char *name;
+  // '+' if the bubble (5' flank to 3' flank) reads along the alignment,
+  // '-' if it is on the other strand
+  char strand;
+  // Flank kmers found in the alignment, and the alignment kmers they span
+  // (half open)
+  unsigned long kmers_5p, kmers_3p;
+  unsigned long start, end;
+  // Coverage in each colour of the alignment file of each kmer of the 5'
+  // (flank_colour_covgs[0]) and 3' (flank_colour_covgs[1]) flanks.  Kmers
+  // not in the alignment have coverage 0
+  COLOUR_COVG **flank_colour_covgs[2];
+} CORTEX_JOIN_MATCH;
+
+// Called in bubble file order from cortex_join()
+typedef void (*cortex_join_func)(const CORTEX_BUBBLE *bubble,
+                                 const CORTEX_JOIN_MATCH *match, void *arg);
+
+// Join the remaining bubbles to the remaining alignments, indexing the input
+// given by index_side (CORTEX_JOIN_SMALLER compares file sizes).  Uses up to
+// num_threads threads (0 means one per cpu).  Returns the number of bubbles
+// passed to func or -1 on failure
+long cortex_join(CORTEX_FILE *bubbles, CORTEX_FILE *alignments,
+                 enum CORTEX_JOIN_INDEX index_side,
+                 cortex_join_func func, void *arg, unsigned int num_threads);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ cortex_kmer.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cortex_kmer.h"
+
+// Base to 2-bit code, 4 for anything that isn't ACGT
+const unsigned char kmer_base_codes[256] = {
+  4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+  4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+  4,0,4,1,4,4,4,2,4,4,4,4,4,4,4,4, 4,4,4,4,3,4,4,4,4,4,4,4,4,4,4,4,
+  4,0,4,1,4,4,4,2,4,4,4,4,4,4,4,4, 4,4,4,4,3,4,4,4,4,4,4,4,4,4,4,4,
+  4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+  4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+  4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+  4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4};
+
+const char kmer_code_bases[4] = {'A','C','G','T'};
+
+// Clear bits above the top base
+void _kmer_mask(CORTEX_KMER *kmer, unsigned int kmer_size)
+{
+  unsigned int bits = 2 * kmer_size;
+
+  if(bits <= 64)
+  {
+    kmer->b[0] = 0;
+
+    if(bits < 64)
+    {
+      kmer->b[1] &= (1UL << bits) - 1;
+    }
+  }
+  else
+  {
+    kmer->b[0] &= (1UL << (bits - 64)) - 1;
+  }
+}
+
+// Append a base to the right hand end
+void _kmer_shift_left(CORTEX_KMER *kmer, unsigned int kmer_size,
+                      uint64_t code)
+{
+  kmer->b[0] = (kmer->b[0] << 2) | (kmer->b[1] >> 62);
+  kmer->b[1] = (kmer->b[1] << 2) | code;
+  _kmer_mask(kmer, kmer_size);
+}
+
+// Prepend a base to the left hand end
+void _kmer_shift_right(CORTEX_KMER *kmer, unsigned int kmer_size,
+                       uint64_t code)
+{
+  unsigned int top = 2 * (kmer_size - 1);
+
+  kmer->b[1] = (kmer->b[1] >> 2) | (kmer->b[0] << 62);
+  kmer->b[0] >>= 2;
+
+  if(top >= 64)
+  {
+    kmer->b[0] |= code << (top - 64);
+  }
+  else
+  {
+    kmer->b[1] |= code << top;
+  }
+}
+
+char cortex_kmer_from_str(const char *str, unsigned int kmer_size,
+                          CORTEX_KMER *kmer)
+{
+  unsigned int i;
+
+  kmer->b[0] = kmer->b[1] = 0;
+
+  for(i = 0; i < kmer_size; i++)
+  {
+    unsigned char code = kmer_base_codes[(unsigned char)str[i]];
+
+    if(code > 3)
+    {
+      return 0;
+    }
+
+    _kmer_shift_left(kmer, kmer_size, code);
+  }
+
+  return 1;
+}
+
+void cortex_kmer_to_str(const CORTEX_KMER *kmer, unsigned int kmer_size,
+                        char *str)
+{
+  unsigned int i;
+
+  for(i = 0; i < kmer_size; i++)
+  {
+    unsigned int shift = 2 * (kmer_size - 1 - i);
+    uint64_t code = shift >= 64 ? kmer->b[0] >> (shift - 64)
+                                : kmer->b[1] >> shift;
+
+    str[i] = kmer_code_bases[code & 3];
+  }
+
+  str[kmer_size] = '\0';
+}
+
+void cortex_kmer_revcomp(const CORTEX_KMER *kmer, unsigned int kmer_size,
+                         CORTEX_KMER *result)
+{
+  CORTEX_KMER fw = *kmer, rv = {{0,0}};
+  unsigned int i;
+
+  for(i = 0; i < kmer_size; i++)
+  {
+    _kmer_shift_left(&rv, kmer_size, 3 - (fw.b[1] & 3));
+    fw.b[1] = (fw.b[1] >> 2) | (fw.b[0] << 62);
+    fw.b[0] >>= 2;
+  }
+
+  *result = rv;
+}
+
+int cortex_kmer_cmp(const CORTEX_KMER *a, const CORTEX_KMER *b)
+{
+  if(a->b[0] != b->b[0])
+  {
+    return a->b[0] < b->b[0] ? -1 : 1;
+  }
+
+  if(a->b[1] != b->b[1])
+  {
+    return a->b[1] < b->b[1] ? -1 : 1;
+  }
+
+  return 0;
+}
+
+void cortex_kmer_canonical(const CORTEX_KMER *kmer, unsigned int kmer_size,
+                           CORTEX_KMER *result)
+{
+  CORTEX_KMER rv;
+  cortex_kmer_revcomp(kmer, kmer_size, &rv);
+  *result = cortex_kmer_cmp(kmer, &rv) <= 0 ? *kmer : rv;
+}
+
+// 64 bit finaliser from MurmurHash3
+uint64_t _kmer_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t cortex_kmer_hash(const CORTEX_KMER *kmer, uint64_t seed)
+{
+  uint64_t h = _kmer_mix(kmer->b[0] ^ seed ^ 0x9e3779b97f4a7c15UL);
+  return _kmer_mix(h ^ kmer->b[1]);
+}
+
+void cortex_kmer_iter_init(CORTEX_KMER_ITER *iter, const char *seq, size_t len,
+                           unsigned int kmer_size)
+{
+  iter->seq = seq;
+  iter->len = len;
+  iter->pos = 0;
+  iter->kmer_size = kmer_size;
+  iter->num_valid = 0;
+  iter->fw.b[0] = iter->fw.b[1] = 0;
+  iter->rv.b[0] = iter->rv.b[1] = 0;
+}
+
+char cortex_kmer_iter_next(CORTEX_KMER_ITER *iter, CORTEX_KMER *kmer,
+                           size_t *start)
+{
+  unsigned int kmer_size = iter->kmer_size;
+
+  while(iter->pos < iter->len)
+  {
+    unsigned char code = kmer_base_codes[(unsigned char)iter->seq[iter->pos++]];
+
+    if(code > 3)
+    {
+      iter->num_valid = 0;
+      continue;
+    }
+
+    _kmer_shift_left(&iter->fw, kmer_size, code);
+    _kmer_shift_right(&iter->rv, kmer_size, 3 - code);
+
+    if(iter->num_valid < kmer_size)
+    {
+      iter->num_valid++;
+    }
+
+    if(iter->num_valid == kmer_size)
+    {
+      *kmer = cortex_kmer_cmp(&iter->fw, &iter->rv) <= 0 ? iter->fw : iter->rv;
+      *start = iter->pos - kmer_size;
+      return 1;
+    }
+  }
+
+  return 0;
+}
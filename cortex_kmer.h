@@ -0,0 +1,82 @@
+/*
+ cortex_kmer.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_KMER_H_SEEN
+#define CORTEX_KMER_H_SEEN
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// 2-bit encoded kmers (A=0, C=1, G=2, T=3) of up to 63 bases
+//
+// Like cortex's own binary kmers, words are most significant first: the last
+// base of the kmer is in the lowest two bits of b[1].  The top two bits of
+// b[0] are never used.
+//
+
+#define CORTEX_MAX_KMER_SIZE 63
+
+typedef struct
+{
+  uint64_t b[2];
+} CORTEX_KMER;
+
+// Returns 1 on success, 0 if str has a base other than ACGT (any case)
+char cortex_kmer_from_str(const char *str, unsigned int kmer_size,
+                          CORTEX_KMER *kmer);
+// str must have space for kmer_size+1 chars
+void cortex_kmer_to_str(const CORTEX_KMER *kmer, unsigned int kmer_size,
+                        char *str);
+
+void cortex_kmer_revcomp(const CORTEX_KMER *kmer, unsigned int kmer_size,
+                         CORTEX_KMER *result);
+// Lesser of kmer and its reverse complement
+void cortex_kmer_canonical(const CORTEX_KMER *kmer, unsigned int kmer_size,
+                           CORTEX_KMER *result);
+
+int cortex_kmer_cmp(const CORTEX_KMER *a, const CORTEX_KMER *b);
+uint64_t cortex_kmer_hash(const CORTEX_KMER *kmer, uint64_t seed);
+
+//
+// Iterate over the canonical kmers of a sequence with a rolling encoding.
+// Kmers containing bases other than ACGT are skipped.
+//
+typedef struct
+{
+  const char *seq;
+  size_t len, pos;
+  unsigned int kmer_size, num_valid;
+  CORTEX_KMER fw, rv;
+} CORTEX_KMER_ITER;
+
+void cortex_kmer_iter_init(CORTEX_KMER_ITER *iter, const char *seq, size_t len,
+                           unsigned int kmer_size);
+
+// Sets kmer to the next canonical kmer and start to its offset in seq.
+// Returns 1 on success, 0 once there are no more kmers
+char cortex_kmer_iter_next(CORTEX_KMER_ITER *iter, CORTEX_KMER *kmer,
+                           size_t *start);
+
+#endif
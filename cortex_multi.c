@@ -0,0 +1,444 @@
+/*
+ cortex_multi.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cortex_multi.h"
+
+// Bubbles read ahead per file
+#define MULTI_QUEUE_SIZE 16
+
+typedef struct
+{
+  CORTEX_FILE *c_file;
+
+  // Ring of read-ahead bubbles: slots [head, tail) are ready to be used
+  CORTEX_BUBBLE *slots[MULTI_QUEUE_SIZE];
+  unsigned long head, tail;
+  char done, stop, thread_running;
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+  pthread_t thread;
+
+  // For checking the file is sorted
+  unsigned long prev_var_num;
+  char warned_unsorted;
+} MULTI_INPUT;
+
+struct CORTEX_MULTI_FILE
+{
+  MULTI_INPUT *inputs;
+  size_t num_files;
+
+  // Min-heap of indices of inputs that have a bubble ready
+  size_t *heap;
+  size_t heap_size;
+
+  // Input whose bubble was returned last (needs to be released), or -1
+  long last_input;
+};
+
+//
+// Read-ahead threads
+//
+
+void* _multi_prefetch(void *ptr)
+{
+  MULTI_INPUT *input = (MULTI_INPUT*)ptr;
+
+  while(1)
+  {
+    pthread_mutex_lock(&input->lock);
+
+    while(input->tail - input->head == MULTI_QUEUE_SIZE && !input->stop)
+    {
+      pthread_cond_wait(&input->not_full, &input->lock);
+    }
+
+    if(input->stop)
+    {
+      pthread_mutex_unlock(&input->lock);
+      break;
+    }
+
+    CORTEX_BUBBLE *slot = input->slots[input->tail % MULTI_QUEUE_SIZE];
+    pthread_mutex_unlock(&input->lock);
+
+    // Consumer never touches slots outside [head, tail)
+    char success = cortex_read_bubble(slot, input->c_file);
+
+    pthread_mutex_lock(&input->lock);
+
+    if(success)
+    {
+      input->tail++;
+    }
+    else
+    {
+      input->done = 1;
+    }
+
+    pthread_cond_signal(&input->not_empty);
+    pthread_mutex_unlock(&input->lock);
+
+    if(!success)
+    {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+// Wait for the input's next bubble.  Returns NULL if there are no more
+CORTEX_BUBBLE* _multi_peek(MULTI_INPUT *input)
+{
+  CORTEX_BUBBLE *bubble = NULL;
+
+  if(!input->thread_running && input->head == input->tail && !input->done)
+  {
+    // No read-ahead thread: read on demand
+    CORTEX_BUBBLE *slot = input->slots[input->tail % MULTI_QUEUE_SIZE];
+
+    if(cortex_read_bubble(slot, input->c_file))
+    {
+      input->tail++;
+    }
+    else
+    {
+      input->done = 1;
+    }
+  }
+
+  pthread_mutex_lock(&input->lock);
+
+  while(input->head == input->tail && !input->done)
+  {
+    pthread_cond_wait(&input->not_empty, &input->lock);
+  }
+
+  if(input->head != input->tail)
+  {
+    bubble = input->slots[input->head % MULTI_QUEUE_SIZE];
+  }
+
+  pthread_mutex_unlock(&input->lock);
+
+  return bubble;
+}
+
+// Hand the input's current bubble slot back to its thread
+void _multi_release(MULTI_INPUT *input)
+{
+  pthread_mutex_lock(&input->lock);
+  input->head++;
+  pthread_cond_signal(&input->not_full);
+  pthread_mutex_unlock(&input->lock);
+}
+
+//
+// Heap of inputs ordered by var_num of their next bubble
+//
+
+char _multi_less(CORTEX_MULTI_FILE *multi, size_t a, size_t b)
+{
+  MULTI_INPUT *in_a = &multi->inputs[a], *in_b = &multi->inputs[b];
+  unsigned long var_a = in_a->slots[in_a->head % MULTI_QUEUE_SIZE]->var_num;
+  unsigned long var_b = in_b->slots[in_b->head % MULTI_QUEUE_SIZE]->var_num;
+
+  // Ties go to the earlier file
+  return var_a < var_b || (var_a == var_b && a < b);
+}
+
+void _multi_heap_push(CORTEX_MULTI_FILE *multi, size_t input)
+{
+  size_t pos = multi->heap_size++;
+
+  while(pos > 0)
+  {
+    size_t parent = (pos - 1) / 2;
+
+    if(!_multi_less(multi, input, multi->heap[parent]))
+    {
+      break;
+    }
+
+    multi->heap[pos] = multi->heap[parent];
+    pos = parent;
+  }
+
+  multi->heap[pos] = input;
+}
+
+size_t _multi_heap_pop(CORTEX_MULTI_FILE *multi)
+{
+  size_t top = multi->heap[0];
+  size_t last = multi->heap[--multi->heap_size];
+  size_t pos = 0;
+
+  while(1)
+  {
+    size_t child = 2 * pos + 1;
+
+    if(child >= multi->heap_size)
+    {
+      break;
+    }
+
+    if(child + 1 < multi->heap_size &&
+       _multi_less(multi, multi->heap[child+1], multi->heap[child]))
+    {
+      child++;
+    }
+
+    if(!_multi_less(multi, multi->heap[child], last))
+    {
+      break;
+    }
+
+    multi->heap[pos] = multi->heap[child];
+    pos = child;
+  }
+
+  if(multi->heap_size > 0)
+  {
+    multi->heap[pos] = last;
+  }
+
+  return top;
+}
+
+// Queue the input's next bubble, if it has one
+void _multi_fetch(CORTEX_MULTI_FILE *multi, size_t i)
+{
+  MULTI_INPUT *input = &multi->inputs[i];
+  CORTEX_BUBBLE *bubble = _multi_peek(input);
+
+  if(bubble == NULL)
+  {
+    return;
+  }
+
+  if(bubble->var_num < input->prev_var_num && !input->warned_unsorted)
+  {
+    fprintf(stderr, "cortex_multi.c: file is not sorted by var_num - merged "
+                    "output will not be either (%s)\n", input->c_file->path);
+    input->warned_unsorted = 1;
+  }
+
+  input->prev_var_num = bubble->var_num;
+  _multi_heap_push(multi, i);
+}
+
+//
+// Open / close
+//
+
+// Kmer size and colours are checked by cortex_open_many()
+char _multi_compatible(const CORTEX_FILE *a, const CORTEX_FILE *b)
+{
+  if(b->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_multi.c: not a bubble file (%s)\n", b->path);
+    return 0;
+  }
+
+  if(a->has_likelihoods != b->has_likelihoods)
+  {
+    fprintf(stderr, "cortex_multi.c: only one file has likelihoods (%s, %s)\n",
+            a->path, b->path);
+    return 0;
+  }
+
+  return 1;
+}
+
+CORTEX_MULTI_FILE* cortex_multi_open(const char **paths, size_t num_files)
+{
+  if(num_files == 0)
+  {
+    fprintf(stderr, "cortex_multi.c: no files given\n");
+    return NULL;
+  }
+
+  CORTEX_OPEN_SUMMARY summary;
+  CORTEX_FILE **c_files = cortex_open_many(paths, num_files, 0, &summary);
+
+  if(c_files == NULL)
+  {
+    return NULL;
+  }
+
+  char success = (summary.num_ok == num_files);
+  size_t i;
+
+  cortex_open_summary_free(&summary);
+
+  for(i = 0; i < num_files && success; i++)
+  {
+    success = _multi_compatible(c_files[0], c_files[i]);
+  }
+
+  if(!success)
+  {
+    for(i = 0; i < num_files; i++)
+    {
+      if(c_files[i] != NULL)
+      {
+        cortex_close(c_files[i]);
+      }
+    }
+
+    free(c_files);
+    return NULL;
+  }
+
+  CORTEX_MULTI_FILE *multi = (CORTEX_MULTI_FILE*) malloc(sizeof(CORTEX_MULTI_FILE));
+  multi->num_files = num_files;
+  multi->inputs = (MULTI_INPUT*) malloc(num_files * sizeof(MULTI_INPUT));
+  multi->heap = (size_t*) malloc(num_files * sizeof(size_t));
+  multi->heap_size = 0;
+  multi->last_input = -1;
+
+  for(i = 0; i < num_files; i++)
+  {
+    MULTI_INPUT *input = &multi->inputs[i];
+    int s;
+
+    input->c_file = c_files[i];
+
+    for(s = 0; s < MULTI_QUEUE_SIZE; s++)
+    {
+      input->slots[s] = cortex_bubble_create(c_files[i]);
+    }
+
+    input->head = input->tail = 0;
+    input->done = input->stop = 0;
+    input->prev_var_num = 0;
+    input->warned_unsorted = 0;
+
+    pthread_mutex_init(&input->lock, NULL);
+    pthread_cond_init(&input->not_empty, NULL);
+    pthread_cond_init(&input->not_full, NULL);
+
+    input->thread_running
+      = (pthread_create(&input->thread, NULL, _multi_prefetch, input) == 0);
+
+    if(!input->thread_running)
+    {
+      fprintf(stderr, "cortex_multi.c: couldn't start thread - reading "
+                      "without read-ahead (%s)\n", paths[i]);
+    }
+  }
+
+  free(c_files);
+
+  for(i = 0; i < num_files; i++)
+  {
+    _multi_fetch(multi, i);
+  }
+
+  return multi;
+}
+
+void cortex_multi_close(CORTEX_MULTI_FILE *multi)
+{
+  size_t i;
+
+  for(i = 0; i < multi->num_files; i++)
+  {
+    MULTI_INPUT *input = &multi->inputs[i];
+
+    pthread_mutex_lock(&input->lock);
+    input->stop = 1;
+    pthread_cond_signal(&input->not_full);
+    pthread_mutex_unlock(&input->lock);
+
+    if(input->thread_running)
+    {
+      pthread_join(input->thread, NULL);
+    }
+
+    int s;
+    for(s = 0; s < MULTI_QUEUE_SIZE; s++)
+    {
+      cortex_bubble_free(input->slots[s], input->c_file);
+    }
+
+    pthread_mutex_destroy(&input->lock);
+    pthread_cond_destroy(&input->not_empty);
+    pthread_cond_destroy(&input->not_full);
+
+    cortex_close(input->c_file);
+  }
+
+  free(multi->inputs);
+  free(multi->heap);
+  free(multi);
+}
+
+size_t cortex_multi_num_files(const CORTEX_MULTI_FILE *multi)
+{
+  return multi->num_files;
+}
+
+const CORTEX_FILE* cortex_multi_get_file(const CORTEX_MULTI_FILE *multi,
+                                         size_t file_index)
+{
+  return multi->inputs[file_index].c_file;
+}
+
+const CORTEX_BUBBLE* cortex_multi_read_bubble(CORTEX_MULTI_FILE *multi,
+                                              size_t *file_index)
+{
+  if(multi->last_input >= 0)
+  {
+    // Done with the last bubble returned: free its slot and queue the next
+    size_t last = (size_t)multi->last_input;
+    _multi_release(&multi->inputs[last]);
+    _multi_fetch(multi, last);
+    multi->last_input = -1;
+  }
+
+  if(multi->heap_size == 0)
+  {
+    return NULL;
+  }
+
+  size_t i = _multi_heap_pop(multi);
+  MULTI_INPUT *input = &multi->inputs[i];
+
+  multi->last_input = (long)i;
+
+  if(file_index != NULL)
+  {
+    *file_index = i;
+  }
+
+  return input->slots[input->head % MULTI_QUEUE_SIZE];
+}
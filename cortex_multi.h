@@ -0,0 +1,59 @@
+/*
+ cortex_multi.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_MULTI_H_SEEN
+#define CORTEX_MULTI_H_SEEN
+
+#include <stddef.h>
+
+#include "cortex.h"
+
+//
+// Read bubbles from several sharded bubble files in global var_num order
+//
+// Every file must have the same kmer size and colour list.  Each file is read
+// ahead on its own thread into a small queue; a heap on var_num picks the next
+// bubble.  Files are each expected to be in var_num order already (as cortex
+// writes them); a warning is printed if one is not.
+//
+
+typedef struct CORTEX_MULTI_FILE CORTEX_MULTI_FILE;
+
+// Returns NULL if any file cannot be opened or files are incompatible
+CORTEX_MULTI_FILE* cortex_multi_open(const char **paths, size_t num_files);
+void cortex_multi_close(CORTEX_MULTI_FILE *multi);
+
+size_t cortex_multi_num_files(const CORTEX_MULTI_FILE *multi);
+// Use to interpret bubbles (all files share the same colours and kmer size)
+const CORTEX_FILE* cortex_multi_get_file(const CORTEX_MULTI_FILE *multi,
+                                         size_t file_index);
+
+// Returns the bubble with the next smallest var_num, or NULL once all files
+// are finished.  If file_index is not NULL it is set to the index of the file
+// the bubble came from.  The bubble belongs to multi and is only valid until
+// the next call.
+const CORTEX_BUBBLE* cortex_multi_read_bubble(CORTEX_MULTI_FILE *multi,
+                                              size_t *file_index);
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ cortex_norm.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "cortex_norm.h"
+
+// Branches are compared eight bytes at a time.  The first differing byte is
+// found from the xor of two words, which depends on byte order
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define NORM_WORDS 1
+#endif
+
+// Number of bytes that match at the start of a and b, up to len
+size_t _norm_prefix(const char *a, const char *b, size_t len)
+{
+  size_t i = 0;
+
+#ifdef NORM_WORDS
+  uint64_t x, y;
+
+  for(; i + 8 <= len; i += 8)
+  {
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+
+    if(x != y)
+    {
+      return i + __builtin_ctzll(x ^ y) / 8;
+    }
+  }
+#endif
+
+  while(i < len && a[i] == b[i])
+  {
+    i++;
+  }
+
+  return i;
+}
+
+// Number of bytes that match at the end of a and b, up to len.  a_end and
+// b_end point just past the last bytes
+size_t _norm_suffix(const char *a_end, const char *b_end, size_t len)
+{
+  size_t i = 0;
+
+#ifdef NORM_WORDS
+  uint64_t x, y;
+
+  for(; i + 8 <= len; i += 8)
+  {
+    memcpy(&x, a_end - i - 8, 8);
+    memcpy(&y, b_end - i - 8, 8);
+
+    if(x != y)
+    {
+      return i + __builtin_clzll(x ^ y) / 8;
+    }
+  }
+#endif
+
+  while(i < len && *(a_end - i - 1) == *(b_end - i - 1))
+  {
+    i++;
+  }
+
+  return i;
+}
+
+char cortex_norm_base(const CORTEX_BUBBLE *bubble, int branch, size_t pos)
+{
+  const StrBuf *flank = bubble->flank_5p.seq;
+  size_t flank_len = strbuf_len(flank);
+
+  return pos < flank_len ? flank->buff[pos]
+                         : bubble->branches[branch].seq->buff[pos - flank_len];
+}
+
+void cortex_norm_bubble(const CORTEX_BUBBLE *bubble, CORTEX_NORM *norm)
+{
+  const StrBuf *br0 = bubble->branches[0].seq, *br1 = bubble->branches[1].seq;
+  size_t flank_len = strbuf_len(bubble->flank_5p.seq);
+  size_t len0 = strbuf_len(br0), len1 = strbuf_len(br1);
+  size_t min_len = len0 < len1 ? len0 : len1;
+
+  // Trim the end first, then the start of what's left
+  size_t suffix = _norm_suffix(br0->buff + len0, br1->buff + len1, min_len);
+  size_t prefix = _norm_prefix(br0->buff, br1->buff, min_len - suffix);
+
+  norm->pos = flank_len + prefix;
+  norm->lengths[0] = len0 - suffix - prefix;
+  norm->lengths[1] = len1 - suffix - prefix;
+
+  // Shift an indel left while the base before it matches its last base
+  if((norm->lengths[0] == 0) != (norm->lengths[1] == 0))
+  {
+    int b = norm->lengths[0] == 0 ? 1 : 0;
+    size_t len = norm->lengths[b];
+
+    while(norm->pos > 0 &&
+          cortex_norm_base(bubble, b, norm->pos - 1) ==
+          cortex_norm_base(bubble, b, norm->pos + len - 1))
+    {
+      norm->pos--;
+    }
+  }
+
+  norm->shared_3p = flank_len + len0 - norm->pos - norm->lengths[0];
+}
+
+size_t cortex_norm_allele(const CORTEX_BUBBLE *bubble, const CORTEX_NORM *norm,
+                          int branch, char *out)
+{
+  size_t flank_len = strbuf_len(bubble->flank_5p.seq);
+  size_t len = norm->lengths[branch], pos = norm->pos, i = 0;
+
+  // Part in the 5' flank, then part in the branch
+  for(; i < len && pos + i < flank_len; i++)
+  {
+    out[i] = bubble->flank_5p.seq->buff[pos + i];
+  }
+
+  if(i < len)
+  {
+    memcpy(out + i, bubble->branches[branch].seq->buff + (pos + i - flank_len),
+           len - i);
+  }
+
+  out[len] = '\0';
+  return len;
+}
@@ -0,0 +1,63 @@
+/*
+ cortex_norm.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_NORM_H_SEEN
+#define CORTEX_NORM_H_SEEN
+
+#include <stddef.h>
+
+#include "cortex.h"
+
+//
+// Variant normalisation
+//
+// Reduces a bubble's branches to their minimal alleles: bases shared at the
+// end of both branches go to the 3' flank, bases shared at the start go to
+// the 5' flank, and an indel is then shifted as far left (into the 5' flank)
+// as its sequence allows.
+//
+// Positions are in the haplotype flank_5p + branches[b].  Bases before pos
+// are the same in both haplotypes, so pos is the new length of the 5' flank
+// and the alleles are bases [pos, pos+lengths[b]).  Nothing is allocated.
+//
+
+typedef struct
+{
+  size_t pos, lengths[2];
+  // Bases after the alleles up to the end of the branches (the same for both
+  // branches), now part of the 3' flank
+  size_t shared_3p;
+} CORTEX_NORM;
+
+void cortex_norm_bubble(const CORTEX_BUBBLE *bubble, CORTEX_NORM *norm);
+
+// Base at pos in flank_5p + branches[branch]
+char cortex_norm_base(const CORTEX_BUBBLE *bubble, int branch, size_t pos);
+
+// Copy an allele into out, which must have space for lengths[branch]+1 chars.
+// Returns the allele length
+size_t cortex_norm_allele(const CORTEX_BUBBLE *bubble, const CORTEX_NORM *norm,
+                          int branch, char *out);
+
+#endif
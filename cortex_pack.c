@@ -0,0 +1,321 @@
+/*
+ cortex_pack.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cortex_pack.h"
+
+//
+// Buffer
+//
+
+void cortex_packed_init(CORTEX_PACKED *packed)
+{
+  packed->data = NULL;
+  packed->len = packed->capacity = 0;
+}
+
+void cortex_packed_reset(CORTEX_PACKED *packed)
+{
+  packed->len = 0;
+}
+
+void cortex_packed_free(CORTEX_PACKED *packed)
+{
+  free(packed->data);
+  cortex_packed_init(packed);
+}
+
+void cortex_packed_ensure(CORTEX_PACKED *packed, size_t len)
+{
+  if(packed->len + len <= packed->capacity)
+  {
+    return;
+  }
+
+  size_t capacity = packed->capacity < 1024 ? 1024 : packed->capacity;
+
+  while(capacity < packed->len + len)
+  {
+    capacity *= 2;
+  }
+
+  packed->data = (unsigned char*) realloc(packed->data, capacity);
+
+  if(packed->data == NULL)
+  {
+    fprintf(stderr, "cortex_pack.c: out of memory [%lu bytes]\n",
+            (unsigned long)capacity);
+    exit(EXIT_FAILURE);
+  }
+
+  packed->capacity = capacity;
+}
+
+void cortex_packed_append(CORTEX_PACKED *packed, const void *data, size_t len)
+{
+  cortex_packed_ensure(packed, len);
+  memcpy(packed->data + packed->len, data, len);
+  packed->len += len;
+}
+
+//
+// Packing
+//
+
+void _pack_varint(CORTEX_PACKED *packed, uint64_t value)
+{
+  cortex_packed_ensure(packed, 10);
+
+  while(value >= 0x80)
+  {
+    packed->data[packed->len++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+
+  packed->data[packed->len++] = (unsigned char)value;
+}
+
+void _pack_str(CORTEX_PACKED *packed, const char *str, size_t len)
+{
+  _pack_varint(packed, len);
+  cortex_packed_append(packed, str, len);
+}
+
+void _pack_path(CORTEX_PACKED *packed, const CORTEX_BUBBLE_PATH *path)
+{
+  _pack_varint(packed, path->seq_length);
+  cortex_packed_append(packed, &path->mean_covg, sizeof(float));
+  _pack_varint(packed, path->min_covg);
+  _pack_varint(packed, path->max_covg);
+  _pack_varint(packed, path->fst_covg);
+  _pack_varint(packed, path->lst_covg);
+
+  _pack_str(packed, path->fst_kmer, strlen(path->fst_kmer));
+  _pack_str(packed, path->fst_r, strlen(path->fst_r));
+  _pack_str(packed, path->fst_f, strlen(path->fst_f));
+  _pack_str(packed, path->lst_kmer, strlen(path->lst_kmer));
+  _pack_str(packed, path->lst_r, strlen(path->lst_r));
+  _pack_str(packed, path->lst_f, strlen(path->lst_f));
+
+  _pack_str(packed, path->seq->buff, strbuf_len(path->seq));
+}
+
+void cortex_bubble_pack(CORTEX_PACKED *packed, const CORTEX_BUBBLE *bubble,
+                        const CORTEX_FILE *c_file)
+{
+  unsigned long col, i;
+  int branch;
+
+  _pack_varint(packed, bubble->var_num);
+
+  _pack_path(packed, &bubble->flank_5p);
+  _pack_path(packed, &bubble->branches[0]);
+  _pack_path(packed, &bubble->branches[1]);
+  _pack_path(packed, &bubble->flank_3p);
+
+  if(c_file->has_likelihoods)
+  {
+    for(col = 0; col < c_file->num_of_colours; col++)
+    {
+      unsigned char call = (unsigned char)bubble->calls[col];
+      // Haploid files have no het likelihood; llk_het isn't set when reading
+      float llk_het = c_file->is_diploid ? bubble->llk_het[col] : 0;
+      cortex_packed_append(packed, &call, 1);
+      cortex_packed_append(packed, &bubble->llk_hom_br1[col], sizeof(float));
+      cortex_packed_append(packed, &llk_het, sizeof(float));
+      cortex_packed_append(packed, &bubble->llk_hom_br2[col], sizeof(float));
+    }
+  }
+
+  for(branch = 0; branch < 2; branch++)
+  {
+    for(col = 0; col < c_file->num_of_colours; col++)
+    {
+      const COLOUR_COVG *covgs = bubble->branches_colour_covgs[branch][col];
+
+      _pack_varint(packed, covgs->length);
+
+      for(i = 0; i < covgs->length; i++)
+      {
+        _pack_varint(packed, covgs->colour_covgs[i]);
+      }
+    }
+  }
+}
+
+//
+// Unpacking
+//
+
+typedef struct
+{
+  const unsigned char *data;
+  size_t len, pos;
+  char ok;
+} _UNPACKER;
+
+uint64_t _unpack_varint(_UNPACKER *in)
+{
+  uint64_t value = 0;
+  int shift = 0;
+
+  while(in->pos < in->len && shift < 64)
+  {
+    unsigned char byte = in->data[in->pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+
+    if(!(byte & 0x80))
+    {
+      return value;
+    }
+
+    shift += 7;
+  }
+
+  in->ok = 0;
+  return 0;
+}
+
+void _unpack_bytes(_UNPACKER *in, void *dst, size_t len)
+{
+  if(in->pos + len > in->len)
+  {
+    in->ok = 0;
+    return;
+  }
+
+  memcpy(dst, in->data + in->pos, len);
+  in->pos += len;
+}
+
+// dst holds up to 64 chars plus '\0'
+void _unpack_kmer_str(_UNPACKER *in, char *dst)
+{
+  uint64_t len = _unpack_varint(in);
+
+  if(len > 64)
+  {
+    in->ok = 0;
+    len = 0;
+  }
+
+  _unpack_bytes(in, dst, len);
+  dst[in->ok ? len : 0] = '\0';
+}
+
+void _unpack_path(_UNPACKER *in, CORTEX_BUBBLE_PATH *path)
+{
+  path->seq_length = _unpack_varint(in);
+  _unpack_bytes(in, &path->mean_covg, sizeof(float));
+  path->min_covg = _unpack_varint(in);
+  path->max_covg = _unpack_varint(in);
+  path->fst_covg = _unpack_varint(in);
+  path->lst_covg = _unpack_varint(in);
+
+  _unpack_kmer_str(in, path->fst_kmer);
+  _unpack_kmer_str(in, path->fst_r);
+  _unpack_kmer_str(in, path->fst_f);
+  _unpack_kmer_str(in, path->lst_kmer);
+  _unpack_kmer_str(in, path->lst_r);
+  _unpack_kmer_str(in, path->lst_f);
+
+  uint64_t seq_len = _unpack_varint(in);
+
+  strbuf_reset(path->seq);
+
+  if(!in->ok || in->pos + seq_len > in->len)
+  {
+    in->ok = 0;
+    return;
+  }
+
+  strbuf_append_strn(path->seq, (const char*)in->data + in->pos, seq_len);
+  in->pos += seq_len;
+}
+
+size_t cortex_bubble_unpack(CORTEX_BUBBLE *bubble, const CORTEX_FILE *c_file,
+                            const unsigned char *data, size_t len)
+{
+  _UNPACKER in = {data, len, 0, 1};
+  unsigned long col, i;
+  int branch;
+
+  cortex_bubble_reset(bubble, c_file);
+
+  bubble->var_num = _unpack_varint(&in);
+
+  _unpack_path(&in, &bubble->flank_5p);
+  _unpack_path(&in, &bubble->branches[0]);
+  _unpack_path(&in, &bubble->branches[1]);
+  _unpack_path(&in, &bubble->flank_3p);
+
+  if(c_file->has_likelihoods)
+  {
+    for(col = 0; col < c_file->num_of_colours && in.ok; col++)
+    {
+      unsigned char call = 0;
+      _unpack_bytes(&in, &call, 1);
+      bubble->calls[col] = (HETEROGENEITY)call;
+      _unpack_bytes(&in, &bubble->llk_hom_br1[col], sizeof(float));
+      _unpack_bytes(&in, &bubble->llk_het[col], sizeof(float));
+      _unpack_bytes(&in, &bubble->llk_hom_br2[col], sizeof(float));
+    }
+  }
+
+  for(branch = 0; branch < 2 && in.ok; branch++)
+  {
+    for(col = 0; col < c_file->num_of_colours && in.ok; col++)
+    {
+      COLOUR_COVG *covgs = bubble->branches_colour_covgs[branch][col];
+      uint64_t num_covgs = _unpack_varint(&in);
+
+      // Each value takes at least one byte
+      if(num_covgs > len - in.pos)
+      {
+        in.ok = 0;
+        break;
+      }
+
+      if(covgs->capacity < num_covgs)
+      {
+        covgs->colour_covgs = realloc(covgs->colour_covgs,
+                                      num_covgs * sizeof(unsigned long));
+        covgs->capacity = num_covgs;
+      }
+
+      for(i = 0; i < num_covgs; i++)
+      {
+        covgs->colour_covgs[i] = _unpack_varint(&in);
+      }
+
+      covgs->length = num_covgs;
+    }
+  }
+
+  return in.ok ? in.pos : 0;
+}
@@ -0,0 +1,68 @@
+/*
+ cortex_pack.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_PACK_H_SEEN
+#define CORTEX_PACK_H_SEEN
+
+#include <stddef.h>
+
+#include "cortex.h"
+
+//
+// Compact binary form of bubbles
+//
+// Integers are stored as varints and likelihoods as raw floats, so a packed
+// bubble is a fraction of the size of its text.  Everything in a bubble is
+// kept, so unpacking then printing gives back the original text.  The number
+// of colours and whether there are likelihoods are not stored - unpack with
+// the CORTEX_FILE the bubble was read from.  Packed data is for temporary
+// files on the same machine (floats are in native byte order).
+//
+
+typedef struct CORTEX_PACKED CORTEX_PACKED;
+
+struct CORTEX_PACKED
+{
+  unsigned char *data;
+  size_t len, capacity;
+};
+
+void cortex_packed_init(CORTEX_PACKED *packed);
+void cortex_packed_reset(CORTEX_PACKED *packed);
+void cortex_packed_free(CORTEX_PACKED *packed);
+// Make room for at least len more bytes
+void cortex_packed_ensure(CORTEX_PACKED *packed, size_t len);
+void cortex_packed_append(CORTEX_PACKED *packed, const void *data, size_t len);
+
+// Append a bubble to packed
+void cortex_bubble_pack(CORTEX_PACKED *packed, const CORTEX_BUBBLE *bubble,
+                        const CORTEX_FILE *c_file);
+
+// Decode a bubble from len bytes of data (bubble should come from
+// cortex_bubble_create(c_file)).  Returns the number of bytes used, or 0 if
+// data is truncated or corrupt
+size_t cortex_bubble_unpack(CORTEX_BUBBLE *bubble, const CORTEX_FILE *c_file,
+                            const unsigned char *data, size_t len);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ cortex_parallel.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cortex_parallel.h"
+
+typedef struct
+{
+  size_t n, next;
+  cortex_parallel_func func;
+  void *arg;
+} PARALLEL_JOB;
+
+unsigned int cortex_num_cpus()
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus < 1 ? 1 : (unsigned int)cpus;
+}
+
+void* _parallel_worker(void *ptr)
+{
+  PARALLEL_JOB *job = (PARALLEL_JOB*)ptr;
+  size_t i;
+
+  while((i = __sync_fetch_and_add(&job->next, 1)) < job->n)
+  {
+    job->func(i, job->arg);
+  }
+
+  return NULL;
+}
+
+void cortex_parallel_for(size_t n, unsigned int num_threads,
+                         cortex_parallel_func func, void *arg)
+{
+  if(num_threads == 0)
+  {
+    num_threads = cortex_num_cpus();
+  }
+
+  if(num_threads > n)
+  {
+    num_threads = (unsigned int)n;
+  }
+
+  PARALLEL_JOB job = {.n = n, .next = 0, .func = func, .arg = arg};
+
+  if(num_threads <= 1)
+  {
+    _parallel_worker(&job);
+    return;
+  }
+
+  // The calling thread does its share of the work too
+  pthread_t *threads = (pthread_t*) malloc((num_threads-1) * sizeof(pthread_t));
+  unsigned int t, started = 0;
+
+  for(t = 0; t < num_threads-1; t++)
+  {
+    if(pthread_create(&threads[t], NULL, _parallel_worker, &job) != 0)
+    {
+      fprintf(stderr, "cortex_parallel.c: couldn't start thread\n");
+      break;
+    }
+    started++;
+  }
+
+  _parallel_worker(&job);
+
+  for(t = 0; t < started; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+
+  free(threads);
+}
@@ -0,0 +1,43 @@
+/*
+ cortex_parallel.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_PARALLEL_H_SEEN
+#define CORTEX_PARALLEL_H_SEEN
+
+#include <stddef.h>
+
+// Called once for each index 0 <= i < n, from any of the worker threads
+typedef void (*cortex_parallel_func)(size_t i, void *arg);
+
+// Number of online processors (at least 1)
+unsigned int cortex_num_cpus();
+
+// Run func(i, arg) for every i in [0,n) using up to num_threads threads.
+// Indices are handed out dynamically so uneven work balances itself.
+// num_threads == 0 means use one thread per cpu.  Returns once all calls have
+// finished.  With a single thread no threads are created.
+void cortex_parallel_for(size_t n, unsigned int num_threads,
+                         cortex_parallel_func func, void *arg);
+
+#endif
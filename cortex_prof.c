@@ -0,0 +1,379 @@
+/*
+ cortex_prof.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "cortex_prof.h"
+
+// Deepest nesting of stages that is tracked
+#define PROF_MAX_DEPTH 16
+
+enum _PROF_COUNTER {PROF_CYCLES, PROF_INSTRUCTIONS, PROF_BRANCH_MISSES,
+                    PROF_CACHE_MISSES, PROF_NUM_COUNTERS};
+
+const char *prof_stage_names[PROF_NUM_STAGES]
+  = {"other", "decompress", "line_split", "header", "likelihoods",
+     "coverage", "output"};
+
+const char *prof_counter_names[PROF_NUM_COUNTERS]
+  = {"cycles", "instructions", "branch_misses", "cache_misses"};
+
+typedef struct
+{
+  // Counter file descriptors (-1 if unavailable), the first open one leads
+  // the group.  ids match values read from the group to counters
+  int fds[PROF_NUM_COUNTERS], group_fd;
+  uint64_t ids[PROF_NUM_COUNTERS];
+  int open_errno;
+
+  // Counts at the last change of stage
+  uint64_t last[PROF_NUM_COUNTERS];
+  unsigned long long last_ns;
+
+  uint64_t counts[PROF_NUM_STAGES][PROF_NUM_COUNTERS];
+  unsigned long long ns[PROF_NUM_STAGES];
+  unsigned long entries[PROF_NUM_STAGES];
+
+  enum CORTEX_PROF_STAGE stack[PROF_MAX_DEPTH];
+  // Can exceed PROF_MAX_DEPTH; deeper stages are charged to the deepest
+  // tracked one
+  size_t depth;
+} _PROF_STATE;
+
+__thread char cortex_prof_active = 0;
+__thread _PROF_STATE prof_state;
+
+unsigned long long _prof_now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#if defined(__linux__)
+
+int _prof_open(uint64_t config, int group_fd)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = (group_fd == -1);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// Returns 1 if any counter opened
+char _prof_open_counters(_PROF_STATE *state)
+{
+  const uint64_t configs[PROF_NUM_COUNTERS]
+    = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+       PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+  int i;
+
+  for(i = 0; i < PROF_NUM_COUNTERS; i++)
+  {
+    state->fds[i] = _prof_open(configs[i], state->group_fd);
+
+    if(state->fds[i] == -1)
+    {
+      state->open_errno = errno;
+      continue;
+    }
+
+    if(ioctl(state->fds[i], PERF_EVENT_IOC_ID, &state->ids[i]) == -1)
+    {
+      close(state->fds[i]);
+      state->fds[i] = -1;
+      continue;
+    }
+
+    if(state->group_fd == -1)
+    {
+      state->group_fd = state->fds[i];
+    }
+  }
+
+  if(state->group_fd == -1)
+  {
+    return 0;
+  }
+
+  ioctl(state->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(state->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+  return 1;
+}
+
+// Read the group into values
+void _prof_read_counters(const _PROF_STATE *state, uint64_t *values)
+{
+  // nr, then nr x (value, id)
+  uint64_t data[1 + 2 * PROF_NUM_COUNTERS];
+  uint64_t v;
+  int i;
+
+  if(state->group_fd == -1 ||
+     read(state->group_fd, data, sizeof(data)) < (ssize_t)sizeof(uint64_t))
+  {
+    return;
+  }
+
+  for(v = 0; v < data[0] && v < PROF_NUM_COUNTERS; v++)
+  {
+    for(i = 0; i < PROF_NUM_COUNTERS; i++)
+    {
+      if(state->fds[i] != -1 && state->ids[i] == data[2 + 2 * v])
+      {
+        values[i] = data[1 + 2 * v];
+      }
+    }
+  }
+}
+
+#else
+
+char _prof_open_counters(_PROF_STATE *state)
+{
+  state->open_errno = ENOSYS;
+  return 0;
+}
+
+void _prof_read_counters(const _PROF_STATE *state, uint64_t *values)
+{
+  (void)state;
+  (void)values;
+}
+
+#endif
+
+// Charge everything since the last change of stage to the current stage
+void _prof_sample(_PROF_STATE *state)
+{
+  uint64_t values[PROF_NUM_COUNTERS];
+  unsigned long long now = _prof_now_ns();
+  size_t top = state->depth < PROF_MAX_DEPTH ? state->depth : PROF_MAX_DEPTH;
+  enum CORTEX_PROF_STAGE stage = top == 0 ? PROF_OTHER : state->stack[top-1];
+  int i;
+
+  memcpy(values, state->last, sizeof(values));
+  _prof_read_counters(state, values);
+
+  for(i = 0; i < PROF_NUM_COUNTERS; i++)
+  {
+    state->counts[stage][i] += values[i] - state->last[i];
+  }
+
+  state->ns[stage] += now - state->last_ns;
+
+  memcpy(state->last, values, sizeof(values));
+  state->last_ns = now;
+}
+
+char cortex_prof_start()
+{
+  _PROF_STATE *state = &prof_state;
+  int i;
+
+  if(cortex_prof_active)
+  {
+    cortex_prof_stop();
+  }
+
+  memset(state, 0, sizeof(_PROF_STATE));
+  state->group_fd = -1;
+
+  for(i = 0; i < PROF_NUM_COUNTERS; i++)
+  {
+    state->fds[i] = -1;
+  }
+
+  char have_counters = _prof_open_counters(state);
+
+  _prof_read_counters(state, state->last);
+  state->last_ns = _prof_now_ns();
+  cortex_prof_active = 1;
+
+  return have_counters;
+}
+
+void cortex_prof_stop()
+{
+  _PROF_STATE *state = &prof_state;
+  int i;
+
+  if(!cortex_prof_active)
+  {
+    return;
+  }
+
+  _prof_sample(state);
+  cortex_prof_active = 0;
+
+  // Keep the fds' slots as a record of which counters were open
+  for(i = 0; i < PROF_NUM_COUNTERS; i++)
+  {
+    if(state->fds[i] != -1)
+    {
+      close(state->fds[i]);
+    }
+  }
+
+  state->group_fd = -1;
+}
+
+void cortex_prof_enter(enum CORTEX_PROF_STAGE stage)
+{
+  _PROF_STATE *state = &prof_state;
+
+  _prof_sample(state);
+
+  if(state->depth < PROF_MAX_DEPTH)
+  {
+    state->stack[state->depth] = stage;
+  }
+
+  state->depth++;
+  state->entries[stage]++;
+}
+
+void cortex_prof_leave()
+{
+  _PROF_STATE *state = &prof_state;
+
+  // Profiling may have started inside a stage
+  if(state->depth > 0)
+  {
+    _prof_sample(state);
+    state->depth--;
+  }
+}
+
+void _prof_print_count(FILE *out, const _PROF_STATE *state, int counter,
+                       double value)
+{
+  if(state->fds[counter] == -1)
+  {
+    fprintf(out, "\t-");
+  }
+  else
+  {
+    fprintf(out, "\t%.0f", value);
+  }
+}
+
+void cortex_prof_report(FILE *out, unsigned long long input_bytes)
+{
+  const _PROF_STATE *state = &prof_state;
+  double mb = input_bytes / (1024.0 * 1024.0);
+  char have_ipc = (state->fds[PROF_CYCLES] != -1 &&
+                   state->fds[PROF_INSTRUCTIONS] != -1);
+  int s, i;
+
+  if(state->fds[PROF_CYCLES] == -1 && state->fds[PROF_INSTRUCTIONS] == -1 &&
+     state->fds[PROF_BRANCH_MISSES] == -1 &&
+     state->fds[PROF_CACHE_MISSES] == -1)
+  {
+    fprintf(out, "# hardware counters unavailable (perf_event_open: %s)\n",
+            strerror(state->open_errno));
+  }
+
+  if(input_bytes > 0)
+  {
+    fprintf(out, "# input %.2f MB\n", mb);
+  }
+
+  fprintf(out, "#stage\tentries\tms");
+
+  for(i = 0; i < PROF_NUM_COUNTERS; i++)
+  {
+    fprintf(out, "\t%s", prof_counter_names[i]);
+  }
+
+  fprintf(out, "\tIPC");
+
+  if(input_bytes > 0)
+  {
+    fprintf(out, "\tms/MB");
+
+    for(i = 0; i < PROF_NUM_COUNTERS; i++)
+    {
+      fprintf(out, "\t%s/MB", prof_counter_names[i]);
+    }
+  }
+
+  fprintf(out, "\n");
+
+  for(s = 0; s < PROF_NUM_STAGES; s++)
+  {
+    const uint64_t *counts = state->counts[s];
+    double ms = state->ns[s] / 1e6;
+
+    fprintf(out, "%s\t%lu\t%.3f", prof_stage_names[s], state->entries[s], ms);
+
+    for(i = 0; i < PROF_NUM_COUNTERS; i++)
+    {
+      _prof_print_count(out, state, i, (double)counts[i]);
+    }
+
+    if(have_ipc && counts[PROF_CYCLES] > 0)
+    {
+      fprintf(out, "\t%.2f",
+              (double)counts[PROF_INSTRUCTIONS] / counts[PROF_CYCLES]);
+    }
+    else
+    {
+      fprintf(out, "\t-");
+    }
+
+    if(input_bytes > 0)
+    {
+      fprintf(out, "\t%.3f", ms / mb);
+
+      for(i = 0; i < PROF_NUM_COUNTERS; i++)
+      {
+        _prof_print_count(out, state, i, counts[i] / mb);
+      }
+    }
+
+    fprintf(out, "\n");
+  }
+}
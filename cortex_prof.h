@@ -0,0 +1,68 @@
+/*
+ cortex_prof.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_PROF_H_SEEN
+#define CORTEX_PROF_H_SEEN
+
+#include <stdio.h>
+
+//
+// Stage profiling with hardware performance counters
+//
+// While profiling, the parser marks the stage it is in and each stage is
+// charged the time, instructions, cycles, branch misses and cache misses
+// (from Linux perf_event_open, user space only) spent in it, not counting
+// stages nested inside it.  Counters are read with a system call at every
+// change of stage, so profiled runs are slower than normal ones; the counts
+// per stage are still representative.  Only the thread that called
+// cortex_prof_start() is profiled.  Where the counters aren't available (not
+// Linux, no PMU in a VM, perf_event_paranoid) stages are still timed.
+//
+
+enum CORTEX_PROF_STAGE {PROF_OTHER, PROF_DECOMPRESS, PROF_LINE_SPLIT,
+                        PROF_HEADER, PROF_LIKELIHOODS, PROF_COVERAGE,
+                        PROF_OUTPUT, PROF_NUM_STAGES};
+
+// Set on the thread being profiled.  Use the macros below, which cost a
+// thread-local test when not profiling
+extern __thread char cortex_prof_active;
+
+#define CORTEX_PROF_ENTER(stage) \
+  do { if(cortex_prof_active) cortex_prof_enter(stage); } while(0)
+#define CORTEX_PROF_LEAVE() \
+  do { if(cortex_prof_active) cortex_prof_leave(); } while(0)
+
+// Start profiling this thread, clearing earlier counts.  Returns 1 if the
+// hardware counters could be opened, 0 if only timing is available
+char cortex_prof_start();
+void cortex_prof_stop();
+
+void cortex_prof_enter(enum CORTEX_PROF_STAGE stage);
+void cortex_prof_leave();
+
+// Print a table of the counts for each stage, and per MB of input_bytes
+// (0 to leave those out).  Call after cortex_prof_stop()
+void cortex_prof_report(FILE *out, unsigned long long input_bytes);
+
+#endif
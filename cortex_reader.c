@@ -0,0 +1,559 @@
+/*
+ cortex_reader.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "cortex_reader.h"
+#include "cortex_prof.h"
+
+#define READER_IN_SIZE (1<<15)
+#define READER_OUT_SIZE (1<<16)
+
+// zlib's largest window, kept before new output in the out buffer
+#define READER_WINDOW 32768
+
+// Output between restart points, and how many are kept
+#define READER_POINT_SPACING (1<<20)
+#define READER_NUM_POINTS 4
+
+// Bytes after a gzip member's deflate data (crc and length)
+#define READER_TRAILER 8
+
+// gzip, auto-detected header, or raw deflate when resuming mid-member
+#define READER_GZIP_BITS (15 + 32)
+#define READER_RAW_BITS (-15)
+
+typedef struct
+{
+  long out_offset, in_offset;
+  int bits;
+  unsigned char *window;
+  size_t window_len;
+} _READER_POINT;
+
+struct CORTEX_READER
+{
+  int fd;
+  // 1 for gzip, 0 for plain, -1 until the first bytes have been written
+  int is_gzip;
+
+  z_stream strm;
+  char strm_ready;
+  // Resumed in raw deflate: the member's trailer has to be skipped
+  char raw;
+  // Finished a member and no output yet from the next one: anything but a
+  // gzip header now is trailing garbage, read as the end of the file
+  char between_members, at_end;
+  size_t skip_in;
+  unsigned char *in;
+  // File offset just after the bytes read into in
+  long in_end_offset;
+
+  // Output in out[0, out_len): out_pos is the next char to be read, at
+  // uncompressed offset offset.  Up to READER_WINDOW chars before new output
+  // are kept from the last fill
+  unsigned char *out;
+  size_t out_pos, out_len;
+  long offset;
+
+  // Ring of restart points, most recent at points[last_point]
+  _READER_POINT points[READER_NUM_POINTS];
+  size_t num_points, last_point;
+};
+
+CORTEX_READER* cortex_reader_open(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+
+  if(fd == -1)
+  {
+    return NULL;
+  }
+
+  CORTEX_READER *reader = (CORTEX_READER*) calloc(1, sizeof(CORTEX_READER));
+
+  if(reader == NULL ||
+     (reader->out = (unsigned char*) malloc(READER_WINDOW + READER_OUT_SIZE))
+       == NULL)
+  {
+    fprintf(stderr, "cortex_reader.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  reader->fd = fd;
+  reader->is_gzip = -1;
+
+  return reader;
+}
+
+void cortex_reader_close(CORTEX_READER *reader)
+{
+  size_t i;
+
+  if(reader->strm_ready)
+  {
+    inflateEnd(&reader->strm);
+  }
+
+  for(i = 0; i < READER_NUM_POINTS; i++)
+  {
+    free(reader->points[i].window);
+  }
+
+  close(reader->fd);
+  free(reader->in);
+  free(reader->out);
+  free(reader);
+}
+
+// Decide whether the file is gzip once it has two bytes.  Returns 0 if it
+// doesn't yet
+char _reader_detect(CORTEX_READER *reader)
+{
+  unsigned char magic[2];
+  ssize_t num_bytes = pread(reader->fd, magic, 2, 0);
+
+  if(num_bytes < 2)
+  {
+    return 0;
+  }
+
+  reader->is_gzip = (magic[0] == 0x1f && magic[1] == 0x8b);
+
+  if(reader->is_gzip)
+  {
+    reader->in = (unsigned char*) malloc(READER_IN_SIZE);
+
+    if(reader->in == NULL ||
+       inflateInit2(&reader->strm, READER_GZIP_BITS) != Z_OK)
+    {
+      fprintf(stderr, "cortex_reader.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    reader->strm_ready = 1;
+  }
+
+  return 1;
+}
+
+void _reader_add_point(CORTEX_READER *reader)
+{
+  // Offset of the end of the output
+  long out_offset = reader->offset + (long)(reader->out_len - reader->out_pos);
+
+  if(reader->num_points > 0 &&
+     out_offset - reader->points[reader->last_point].out_offset
+       < READER_POINT_SPACING)
+  {
+    return;
+  }
+
+  reader->last_point = (reader->last_point + 1) % READER_NUM_POINTS;
+  reader->num_points += (reader->num_points < READER_NUM_POINTS);
+
+  _READER_POINT *point = &reader->points[reader->last_point];
+
+  if(point->window == NULL &&
+     (point->window = (unsigned char*) malloc(READER_WINDOW)) == NULL)
+  {
+    fprintf(stderr, "cortex_reader.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  point->out_offset = out_offset;
+  point->in_offset = reader->in_end_offset - (long)reader->strm.avail_in;
+  point->bits = reader->strm.data_type & 7;
+  point->window_len = reader->out_len < READER_WINDOW ? reader->out_len
+                                                      : READER_WINDOW;
+  memcpy(point->window, reader->out + reader->out_len - point->window_len,
+         point->window_len);
+}
+
+// Inflate more output after out_len.  Returns the number of chars added, 0
+// if there is no more input yet
+size_t _reader_inflate(CORTEX_READER *reader)
+{
+  z_stream *strm = &reader->strm;
+  size_t start = reader->out_len;
+  int ret;
+
+  while(reader->out_len == start && !reader->at_end)
+  {
+    if(strm->avail_in == 0)
+    {
+      ssize_t num_bytes = read(reader->fd, reader->in, READER_IN_SIZE);
+
+      if(num_bytes <= 0)
+      {
+        break;
+      }
+
+      strm->next_in = reader->in;
+      strm->avail_in = (uInt)num_bytes;
+      reader->in_end_offset += num_bytes;
+    }
+
+    if(reader->skip_in > 0)
+    {
+      size_t skip = reader->skip_in < strm->avail_in ? reader->skip_in
+                                                     : strm->avail_in;
+      strm->next_in += skip;
+      strm->avail_in -= (uInt)skip;
+      reader->skip_in -= skip;
+      continue;
+    }
+
+    strm->next_out = reader->out + reader->out_len;
+    strm->avail_out = (uInt)(READER_WINDOW + READER_OUT_SIZE - reader->out_len);
+
+    // Stop at block boundaries, to take restart points
+    ret = inflate(strm, Z_BLOCK);
+    reader->out_len = (size_t)(strm->next_out - reader->out);
+
+    if(reader->out_len > start)
+    {
+      reader->between_members = 0;
+    }
+
+    if(ret == Z_STREAM_END)
+    {
+      // Another member may follow
+      reader->skip_in = reader->raw ? READER_TRAILER : 0;
+      reader->raw = 0;
+      reader->between_members = 1;
+      inflateReset2(strm, READER_GZIP_BITS);
+    }
+    else if(ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+      if(!reader->between_members)
+      {
+        fprintf(stderr, "cortex_reader.c: corrupt gzip data at offset %li\n",
+                reader->in_end_offset - (long)strm->avail_in);
+      }
+
+      reader->at_end = 1;
+    }
+    else if((strm->data_type & 128) && !(strm->data_type & 64))
+    {
+      reader->between_members = 0;
+      _reader_add_point(reader);
+    }
+  }
+
+  return reader->out_len - start;
+}
+
+size_t _reader_read_more(CORTEX_READER *reader)
+{
+  if(reader->is_gzip < 0 && !_reader_detect(reader))
+  {
+    return 0;
+  }
+
+  if(!reader->is_gzip)
+  {
+    ssize_t num_bytes = read(reader->fd, reader->out, READER_OUT_SIZE);
+    reader->out_pos = 0;
+    reader->out_len = num_bytes > 0 ? (size_t)num_bytes : 0;
+    return reader->out_len;
+  }
+
+  // Keep the window zlib would need to restart here
+  size_t keep = reader->out_len < READER_WINDOW ? reader->out_len
+                                                : READER_WINDOW;
+
+  memmove(reader->out, reader->out + reader->out_len - keep, keep);
+  reader->out_pos = reader->out_len = keep;
+
+  return _reader_inflate(reader);
+}
+
+// Read more into out once everything in it has been read.  Returns the
+// number of chars added, 0 at the end of the file
+size_t _reader_fill(CORTEX_READER *reader)
+{
+  CORTEX_PROF_ENTER(PROF_DECOMPRESS);
+  size_t num_chars = _reader_read_more(reader);
+  CORTEX_PROF_LEAVE();
+
+  return num_chars;
+}
+
+t_buf_pos cortex_reader_readline(CORTEX_READER *reader, StrBuf *sbuf)
+{
+  t_buf_pos num_read = 0;
+
+  while(reader->out_pos < reader->out_len || _reader_fill(reader) > 0)
+  {
+    const unsigned char *start = reader->out + reader->out_pos;
+    size_t avail = reader->out_len - reader->out_pos;
+    const unsigned char *end = (const unsigned char*) memchr(start, '\n', avail);
+    size_t len = (end == NULL ? avail : (size_t)(end - start) + 1);
+
+    strbuf_append_strn(sbuf, (const char*)start, (t_buf_pos)len);
+    reader->out_pos += len;
+    reader->offset += (long)len;
+    num_read += (t_buf_pos)len;
+
+    if(end != NULL)
+    {
+      break;
+    }
+  }
+
+  return num_read;
+}
+
+long cortex_reader_tell(const CORTEX_READER *reader)
+{
+  return reader->offset;
+}
+
+// Read and drop num_chars.  Returns 0 if the file ends first
+char _reader_skip(CORTEX_READER *reader, long num_chars)
+{
+  while(num_chars > 0)
+  {
+    if(reader->out_pos == reader->out_len && _reader_fill(reader) == 0)
+    {
+      return 0;
+    }
+
+    size_t avail = reader->out_len - reader->out_pos;
+    size_t skip = (size_t)num_chars < avail ? (size_t)num_chars : avail;
+
+    reader->out_pos += skip;
+    reader->offset += (long)skip;
+    num_chars -= (long)skip;
+  }
+
+  return 1;
+}
+
+// Restart a gzip file from a restart point, or its start if point is NULL
+char _reader_restart(CORTEX_READER *reader, const _READER_POINT *point)
+{
+  z_stream *strm = &reader->strm;
+  long in_offset = point == NULL ? 0 : point->in_offset;
+  unsigned char byte;
+
+  if(point != NULL && point->bits > 0)
+  {
+    in_offset--;
+  }
+
+  strm->avail_in = 0;
+  reader->in_end_offset = in_offset;
+  reader->skip_in = 0;
+  reader->between_members = 0;
+  reader->at_end = 0;
+  reader->out_pos = reader->out_len = 0;
+
+  if(lseek(reader->fd, in_offset, SEEK_SET) != in_offset)
+  {
+    return 0;
+  }
+
+  if(point == NULL)
+  {
+    reader->raw = 0;
+    reader->offset = 0;
+    return inflateReset2(strm, READER_GZIP_BITS) == Z_OK;
+  }
+
+  reader->raw = 1;
+  reader->offset = point->out_offset;
+
+  if(inflateReset2(strm, READER_RAW_BITS) != Z_OK)
+  {
+    return 0;
+  }
+
+  if(point->bits > 0)
+  {
+    if(read(reader->fd, &byte, 1) != 1)
+    {
+      return 0;
+    }
+
+    reader->in_end_offset++;
+    inflatePrime(strm, point->bits, byte >> (8 - point->bits));
+  }
+
+  if(point->window_len > 0 &&
+     inflateSetDictionary(strm, point->window, (uInt)point->window_len)
+       != Z_OK)
+  {
+    return 0;
+  }
+
+  // The window is also the history for the next restart point
+  memcpy(reader->out, point->window, point->window_len);
+  reader->out_pos = reader->out_len = point->window_len;
+
+  return 1;
+}
+
+char cortex_reader_seek(CORTEX_READER *reader, long offset)
+{
+  long out_start = reader->offset - (long)reader->out_pos;
+  size_t i;
+
+  // Still in the buffer
+  if(offset >= out_start && offset <= out_start + (long)reader->out_len)
+  {
+    reader->out_pos = (size_t)(offset - out_start);
+    reader->offset = offset;
+    return 1;
+  }
+
+  if(reader->is_gzip < 0 && !_reader_detect(reader))
+  {
+    return offset == 0;
+  }
+
+  if(!reader->is_gzip)
+  {
+    if(lseek(reader->fd, offset, SEEK_SET) != offset)
+    {
+      return 0;
+    }
+
+    reader->out_pos = reader->out_len = 0;
+    reader->offset = offset;
+    return 1;
+  }
+
+  if(offset < reader->offset)
+  {
+    const _READER_POINT *best = NULL;
+
+    for(i = 0; i < reader->num_points; i++)
+    {
+      const _READER_POINT *point = &reader->points[i];
+
+      if(point->out_offset <= offset &&
+         (best == NULL || point->out_offset > best->out_offset))
+      {
+        best = point;
+      }
+    }
+
+    if(!_reader_restart(reader, best))
+    {
+      return 0;
+    }
+  }
+
+  return _reader_skip(reader, offset - reader->offset);
+}
+
+void cortex_reader_point(const CORTEX_READER *reader, long offset,
+                         CORTEX_READER_POINT *point)
+{
+  const _READER_POINT *best = NULL;
+  size_t i;
+
+  memset(point, 0, sizeof(CORTEX_READER_POINT));
+
+  if(reader->is_gzip != 1)
+  {
+    // Plain files restart anywhere
+    point->out_offset = point->in_offset = offset;
+    return;
+  }
+
+  for(i = 0; i < reader->num_points; i++)
+  {
+    const _READER_POINT *candidate = &reader->points[i];
+
+    if(candidate->out_offset <= offset &&
+       (best == NULL || candidate->out_offset > best->out_offset))
+    {
+      best = candidate;
+    }
+  }
+
+  if(best != NULL)
+  {
+    point->out_offset = best->out_offset;
+    point->in_offset = best->in_offset;
+    point->bits = best->bits;
+    point->window = best->window;
+    point->window_len = best->window_len;
+  }
+}
+
+char cortex_reader_resume(CORTEX_READER *reader,
+                          const CORTEX_READER_POINT *point, long offset)
+{
+  if(point->out_offset > offset || point->window_len > READER_WINDOW ||
+     point->bits < 0 || point->bits > 7)
+  {
+    return 0;
+  }
+
+  if(reader->is_gzip < 0 && !_reader_detect(reader))
+  {
+    return offset == 0;
+  }
+
+  if(!reader->is_gzip)
+  {
+    return cortex_reader_seek(reader, offset);
+  }
+
+  if(point->in_offset == 0)
+  {
+    return _reader_restart(reader, NULL) && _reader_skip(reader, offset);
+  }
+
+  // Keep the point, so it can be saved again
+  reader->last_point = (reader->last_point + 1) % READER_NUM_POINTS;
+  reader->num_points += (reader->num_points < READER_NUM_POINTS);
+
+  _READER_POINT *kept = &reader->points[reader->last_point];
+
+  if(kept->window == NULL &&
+     (kept->window = (unsigned char*) malloc(READER_WINDOW)) == NULL)
+  {
+    fprintf(stderr, "cortex_reader.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  kept->out_offset = point->out_offset;
+  kept->in_offset = point->in_offset;
+  kept->bits = point->bits;
+  kept->window_len = point->window_len;
+  memcpy(kept->window, point->window, point->window_len);
+
+  return _reader_restart(reader, kept) &&
+         _reader_skip(reader, offset - kept->out_offset);
+}
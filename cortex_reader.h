@@ -0,0 +1,82 @@
+/*
+ cortex_reader.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_READER_H_SEEN
+#define CORTEX_READER_H_SEEN
+
+#include <stddef.h>
+
+#include "string_buffer.h"
+
+//
+// Line reader for plain and gzip files
+//
+// Used by CORTEX_FILE in place of zlib's gzFile so that a position in a gzip
+// file can be saved and returned to without inflating everything before it.
+// While inflating, the reader keeps a few restart points: deflate block
+// boundaries about 1MB apart, each with its compressed offset (and bit) and
+// the 32KB of output before it, which zlib needs as a dictionary to carry on
+// from there.  Offsets are in uncompressed bytes.  gzip files with several
+// members (e.g. from cat or bgzip) are read through.
+//
+
+typedef struct CORTEX_READER CORTEX_READER;
+
+typedef struct
+{
+  // Uncompressed and compressed offsets of the restart point (0 and 0 for
+  // the start of the file), and the bits of the byte before in_offset that
+  // belong to the next block
+  long out_offset, in_offset;
+  int bits;
+  // Output before out_offset, up to 32KB
+  const unsigned char *window;
+  size_t window_len;
+} CORTEX_READER_POINT;
+
+// Returns NULL if the file can't be opened
+CORTEX_READER* cortex_reader_open(const char *path);
+void cortex_reader_close(CORTEX_READER *reader);
+
+// Append the rest of the line, including its '\n', to sbuf.  Returns the
+// number of chars appended: 0 at the end of the file.  Reading again after
+// the end of the file picks up anything written since
+t_buf_pos cortex_reader_readline(CORTEX_READER *reader, StrBuf *sbuf);
+
+// Offset of the next char to be read
+long cortex_reader_tell(const CORTEX_READER *reader);
+// Going back in a gzip file restarts from the nearest restart point, or the
+// start of the file.  Returns 1 on success, 0 on failure
+char cortex_reader_seek(CORTEX_READER *reader, long offset);
+
+// Restart point to get back to offset (which must not be ahead of the
+// reader).  Valid until the next read or seek
+void cortex_reader_point(const CORTEX_READER *reader, long offset,
+                         CORTEX_READER_POINT *point);
+// Continue from a point, possibly saved by another process reading the same
+// file, then skip ahead to offset.  Returns 1 on success, 0 on failure
+char cortex_reader_resume(CORTEX_READER *reader,
+                          const CORTEX_READER_POINT *point, long offset);
+
+#endif
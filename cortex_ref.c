@@ -0,0 +1,1094 @@
+/*
+ cortex_ref.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cortex_ref.h"
+#include "cortex_kmer.h"
+#include "cortex_parallel.h"
+
+#define REF_MAGIC "CTXREF01"
+#define REF_VERSION 1
+
+// Aim for this many entries per directory bucket
+#define REF_BUCKET_ENTRIES 16
+#define REF_MAX_DIR_BITS 28
+
+// Most kmers sorted in memory at once while building
+#define REF_PASS_ENTRIES (1UL<<28)
+
+// Bases unpacked at a time while building
+#define REF_UNPACK_SIZE (1<<20)
+
+// Entries are fingerprint:24 position:39 strand:1.  strand is set if the
+// kmer on the reference's forward strand isn't the canonical kmer
+#define REF_FP_SHIFT 40
+#define REF_FP_MASK 0xffffffUL
+#define REF_POS_BITS 39
+#define REF_POS_MASK ((1UL << REF_POS_BITS) - 1)
+
+// Flank kmers looked up per flank, those nearest the branches
+#define REF_MAX_LOOKUPS 16
+
+// Bubbles read per batch in cortex_ref_anchor_file() and anchored per task
+#define REF_BATCH_SIZE 4096
+#define REF_CHUNK_SIZE 64
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version, kmer_size, dir_bits, padding;
+  uint64_t num_chroms, seq_length, names_size, num_entries;
+} REF_HEADER;
+
+typedef struct
+{
+  // Start in the concatenated sequence, length and start of name in names
+  uint64_t offset, length, name;
+} REF_CHROM;
+
+struct CORTEX_REF
+{
+  void *map;
+  size_t map_size;
+  const REF_HEADER *header;
+  const REF_CHROM *chroms;
+  const char *names;
+  const uint64_t *seq, *directory, *entries;
+};
+
+// Reference being indexed.  Bases are packed 2 bits each into seq, with
+// non-ACGT bases marked in nmask
+typedef struct
+{
+  unsigned int kmer_size;
+  REF_CHROM *chroms;
+  size_t num_chroms, chroms_capacity;
+  StrBuf *names;
+  uint64_t *seq, *nmask;
+  uint64_t seq_length, seq_words;
+  uint64_t num_kmers, valid_run;
+} REF_BUILD;
+
+typedef struct
+{
+  uint64_t hash, entry;
+} REF_BUILD_ENTRY;
+
+// Repeated kmers are found by sorting entries with the same hash on kmer
+typedef struct
+{
+  CORTEX_KMER kmer;
+  uint64_t entry;
+} REF_KMER_ENTRY;
+
+typedef struct
+{
+  long chrom;
+  char strand;
+  long long pos;
+} REF_VOTE;
+
+typedef struct
+{
+  const CORTEX_REF *ref;
+  CORTEX_BUBBLE **bubbles;
+  CORTEX_ANCHOR *anchors;
+  size_t num_bubbles;
+} REF_BATCH;
+
+unsigned int _ref_base_code(char c)
+{
+  switch(c)
+  {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    default: return 4;
+  }
+}
+
+// Unpack len bases starting at pos.  nmask may be NULL if there are no Ns
+void _ref_unpack(const uint64_t *seq, const uint64_t *nmask, uint64_t pos,
+                 size_t len, char *out)
+{
+  size_t i;
+
+  for(i = 0; i < len; i++, pos++)
+  {
+    if(nmask != NULL && ((nmask[pos / 64] >> (pos % 64)) & 1))
+    {
+      out[i] = 'N';
+    }
+    else
+    {
+      out[i] = "ACGT"[(seq[pos / 32] >> (2 * (pos % 32))) & 3];
+    }
+  }
+}
+
+int _ref_kmer_entry_cmp(const void *ptr1, const void *ptr2)
+{
+  const REF_KMER_ENTRY *a = (const REF_KMER_ENTRY*)ptr1;
+  const REF_KMER_ENTRY *b = (const REF_KMER_ENTRY*)ptr2;
+  return cortex_kmer_cmp(&a->kmer, &b->kmer);
+}
+
+int _ref_build_entry_cmp(const void *ptr1, const void *ptr2)
+{
+  const REF_BUILD_ENTRY *a = (const REF_BUILD_ENTRY*)ptr1;
+  const REF_BUILD_ENTRY *b = (const REF_BUILD_ENTRY*)ptr2;
+
+  if(a->hash != b->hash)
+  {
+    return a->hash < b->hash ? -1 : 1;
+  }
+
+  return a->entry < b->entry ? -1 : (a->entry > b->entry);
+}
+
+int _ref_vote_cmp(const void *ptr1, const void *ptr2)
+{
+  const REF_VOTE *a = (const REF_VOTE*)ptr1, *b = (const REF_VOTE*)ptr2;
+
+  if(a->chrom != b->chrom)
+  {
+    return a->chrom < b->chrom ? -1 : 1;
+  }
+
+  if(a->strand != b->strand)
+  {
+    return a->strand < b->strand ? -1 : 1;
+  }
+
+  return a->pos < b->pos ? -1 : (a->pos > b->pos);
+}
+
+//
+// Building
+//
+
+void _ref_add_chrom(REF_BUILD *build, const char *header)
+{
+  if(build->num_chroms == build->chroms_capacity)
+  {
+    build->chroms_capacity *= 2;
+    build->chroms = (REF_CHROM*) realloc(build->chroms,
+                                         build->chroms_capacity *
+                                         sizeof(REF_CHROM));
+
+    if(build->chroms == NULL)
+    {
+      fprintf(stderr, "cortex_ref.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Name is up to the first whitespace
+  size_t name_len = 0;
+
+  while(header[name_len] != '\0' && !isspace(header[name_len]))
+  {
+    name_len++;
+  }
+
+  REF_CHROM *chrom = &build->chroms[build->num_chroms++];
+  chrom->offset = build->seq_length;
+  chrom->length = 0;
+  chrom->name = strbuf_len(build->names);
+
+  strbuf_append_strn(build->names, header, name_len);
+  strbuf_append_char(build->names, '\0');
+
+  build->valid_run = 0;
+}
+
+void _ref_add_base(REF_BUILD *build, char base)
+{
+  uint64_t pos = build->seq_length;
+
+  if(pos == build->seq_words * 32)
+  {
+    uint64_t old_words = build->seq_words;
+    build->seq_words = old_words == 0 ? 1024 : old_words * 2;
+
+    build->seq = (uint64_t*) realloc(build->seq,
+                                     build->seq_words * sizeof(uint64_t));
+    build->nmask = (uint64_t*) realloc(build->nmask,
+                                       build->seq_words / 2 * sizeof(uint64_t));
+
+    if(build->seq == NULL || build->nmask == NULL)
+    {
+      fprintf(stderr, "cortex_ref.c: out of memory [%lu bases]\n",
+              (unsigned long)pos);
+      exit(EXIT_FAILURE);
+    }
+
+    memset(build->seq + old_words, 0,
+           (build->seq_words - old_words) * sizeof(uint64_t));
+    memset(build->nmask + old_words / 2, 0,
+           (build->seq_words - old_words) / 2 * sizeof(uint64_t));
+  }
+
+  unsigned int code = _ref_base_code(base);
+
+  if(code > 3)
+  {
+    build->nmask[pos / 64] |= (uint64_t)1 << (pos % 64);
+    build->valid_run = 0;
+  }
+  else
+  {
+    build->seq[pos / 32] |= (uint64_t)code << (2 * (pos % 32));
+
+    if(++build->valid_run >= build->kmer_size)
+    {
+      build->num_kmers++;
+    }
+  }
+
+  build->chroms[build->num_chroms-1].length++;
+  build->seq_length++;
+}
+
+char _ref_read_fasta(REF_BUILD *build, const char *fasta_path)
+{
+  gzFile file = gzopen(fasta_path, "r");
+
+  if(file == NULL)
+  {
+    fprintf(stderr, "cortex_ref.c: couldn't open file (%s)\n", fasta_path);
+    return 0;
+  }
+
+  StrBuf *line = strbuf_init(1000);
+  unsigned long line_number = 0;
+  char success = 1;
+
+  while(success && strbuf_reset_gzreadline(line, file) > 0)
+  {
+    line_number++;
+    strbuf_chomp(line);
+
+    if(line->buff[0] == '>')
+    {
+      _ref_add_chrom(build, line->buff + 1);
+    }
+    else if(build->num_chroms == 0)
+    {
+      if(!string_is_all_whitespace(line->buff))
+      {
+        fprintf(stderr, "cortex_ref.c: sequence before first '>' (%s:%lu)\n",
+                fasta_path, line_number);
+        success = 0;
+      }
+    }
+    else
+    {
+      const char *str;
+
+      for(str = line->buff; *str != '\0'; str++)
+      {
+        if(!isspace(*str))
+        {
+          _ref_add_base(build, *str);
+        }
+      }
+    }
+  }
+
+  strbuf_free(line);
+  gzclose(file);
+
+  if(success && build->num_chroms == 0)
+  {
+    fprintf(stderr, "cortex_ref.c: no sequences in file (%s)\n", fasta_path);
+    success = 0;
+  }
+
+  if(success && build->seq_length > REF_POS_MASK)
+  {
+    fprintf(stderr, "cortex_ref.c: reference is too long (%s)\n", fasta_path);
+    success = 0;
+  }
+
+  return success;
+}
+
+// Collect the kmers of one pass: those whose hash starts with the pass number
+size_t _ref_pass_kmers(const REF_BUILD *build, uint64_t pass,
+                       unsigned int pass_bits, REF_BUILD_ENTRY **entries_ptr,
+                       size_t *capacity, char *unpacked)
+{
+  REF_BUILD_ENTRY *entries = *entries_ptr;
+  unsigned int kmer_size = build->kmer_size;
+  size_t num_entries = 0, c;
+
+  for(c = 0; c < build->num_chroms; c++)
+  {
+    const REF_CHROM *chrom = &build->chroms[c];
+    uint64_t window;
+
+    // Windows overlap by kmer_size-1 bases, so each kmer is seen once
+    for(window = 0; window < chrom->length; window += REF_UNPACK_SIZE)
+    {
+      uint64_t len = chrom->length - window;
+
+      if(len > REF_UNPACK_SIZE + kmer_size - 1)
+      {
+        len = REF_UNPACK_SIZE + kmer_size - 1;
+      }
+
+      _ref_unpack(build->seq, build->nmask, chrom->offset + window, len,
+                  unpacked);
+
+      CORTEX_KMER_ITER iter;
+      CORTEX_KMER kmer;
+      size_t start;
+
+      cortex_kmer_iter_init(&iter, unpacked, len, kmer_size);
+
+      while(cortex_kmer_iter_next(&iter, &kmer, &start))
+      {
+        uint64_t hash = cortex_kmer_hash(&kmer, 0);
+
+        if(pass_bits > 0 && (hash >> (64 - pass_bits)) != pass)
+        {
+          continue;
+        }
+
+        uint64_t pos = chrom->offset + window + start;
+        uint64_t strand = cortex_kmer_cmp(&kmer, &iter.fw) != 0;
+
+        // Passes are only about the same size
+        if(num_entries == *capacity)
+        {
+          *capacity *= 2;
+          entries = (REF_BUILD_ENTRY*) realloc(entries, *capacity *
+                                               sizeof(REF_BUILD_ENTRY));
+
+          if(entries == NULL)
+          {
+            fprintf(stderr, "cortex_ref.c: out of memory\n");
+            exit(EXIT_FAILURE);
+          }
+
+          *entries_ptr = entries;
+        }
+
+        entries[num_entries].hash = hash;
+        entries[num_entries].entry = (pos << 1) | strand;
+        num_entries++;
+      }
+    }
+  }
+
+  return num_entries;
+}
+
+// Remove kmers that occur more than once.  entries must be sorted by hash
+size_t _ref_unique_kmers(const REF_BUILD *build, REF_BUILD_ENTRY *entries,
+                         size_t num_entries)
+{
+  unsigned int kmer_size = build->kmer_size;
+  REF_KMER_ENTRY *group = NULL;
+  size_t group_capacity = 0, i, j, end, kept = 0;
+  char str[CORTEX_MAX_KMER_SIZE+1];
+
+  for(i = 0; i < num_entries; i = end)
+  {
+    for(end = i + 1; end < num_entries && entries[end].hash == entries[i].hash;
+        end++);
+
+    if(end - i == 1)
+    {
+      entries[kept++] = entries[i];
+      continue;
+    }
+
+    // Same hash: compare the kmers themselves
+    if(end - i > group_capacity)
+    {
+      group_capacity = end - i;
+      group = (REF_KMER_ENTRY*) realloc(group,
+                                        group_capacity * sizeof(REF_KMER_ENTRY));
+
+      if(group == NULL)
+      {
+        fprintf(stderr, "cortex_ref.c: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    for(j = i; j < end; j++)
+    {
+      CORTEX_KMER kmer;
+      _ref_unpack(build->seq, NULL, entries[j].entry >> 1, kmer_size, str);
+      cortex_kmer_from_str(str, kmer_size, &kmer);
+      cortex_kmer_canonical(&kmer, kmer_size, &group[j-i].kmer);
+      group[j-i].entry = entries[j].entry;
+    }
+
+    qsort(group, end - i, sizeof(REF_KMER_ENTRY), _ref_kmer_entry_cmp);
+
+    for(j = 0; j < end - i; j++)
+    {
+      if((j == 0 || cortex_kmer_cmp(&group[j].kmer, &group[j-1].kmer) != 0) &&
+         (j + 1 == end - i ||
+          cortex_kmer_cmp(&group[j].kmer, &group[j+1].kmer) != 0))
+      {
+        entries[kept].hash = entries[i].hash;
+        entries[kept].entry = group[j].entry;
+        kept++;
+      }
+    }
+  }
+
+  free(group);
+  return kept;
+}
+
+char _ref_write(REF_BUILD *build, const char *index_path)
+{
+  FILE *out = fopen(index_path, "wb");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_ref.c: couldn't open file (%s)\n", index_path);
+    return 0;
+  }
+
+  setvbuf(out, NULL, _IOFBF, 1<<20);
+
+  // Passes split kmers on the top bits of their hash, as does the directory
+  uint64_t num_passes = 1;
+  unsigned int pass_bits = 0, dir_bits = 1;
+
+  while(num_passes * REF_PASS_ENTRIES < build->num_kmers)
+  {
+    num_passes *= 2;
+    pass_bits++;
+  }
+
+  while(dir_bits < REF_MAX_DIR_BITS &&
+        ((uint64_t)1 << dir_bits) * REF_BUCKET_ENTRIES < build->num_kmers)
+  {
+    dir_bits++;
+  }
+
+  if(dir_bits < pass_bits)
+  {
+    dir_bits = pass_bits;
+  }
+
+  size_t num_buckets = (size_t)1 << dir_bits;
+  uint64_t *directory = (uint64_t*) calloc(num_buckets + 1, sizeof(uint64_t));
+  size_t capacity = build->num_kmers / num_passes + 1024;
+  REF_BUILD_ENTRY *entries
+    = (REF_BUILD_ENTRY*) malloc(capacity * sizeof(REF_BUILD_ENTRY));
+  char *unpacked = (char*) malloc(REF_UNPACK_SIZE + CORTEX_MAX_KMER_SIZE);
+
+  if(directory == NULL || entries == NULL || unpacked == NULL)
+  {
+    fprintf(stderr, "cortex_ref.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t seq_words = (build->seq_length + 31) / 32;
+  size_t names_size = (strbuf_len(build->names) + 7) / 8 * 8;
+
+  // Pad names with zeros
+  while(strbuf_len(build->names) < names_size)
+  {
+    strbuf_append_char(build->names, '\0');
+  }
+
+  REF_HEADER header;
+  memset(&header, 0, sizeof(REF_HEADER));
+  memcpy(header.magic, REF_MAGIC, 8);
+  header.version = REF_VERSION;
+  header.kmer_size = build->kmer_size;
+  header.dir_bits = dir_bits;
+  header.num_chroms = build->num_chroms;
+  header.seq_length = build->seq_length;
+  header.names_size = names_size;
+
+  // Header and directory are written again at the end
+  char success
+    = (fwrite(&header, sizeof(REF_HEADER), 1, out) == 1 &&
+       fwrite(build->chroms, sizeof(REF_CHROM), build->num_chroms, out)
+         == build->num_chroms &&
+       fwrite(build->names->buff, 1, names_size, out) == names_size &&
+       fwrite(build->seq, sizeof(uint64_t), seq_words, out) == seq_words &&
+       fwrite(directory, sizeof(uint64_t), num_buckets + 1, out)
+         == num_buckets + 1);
+
+  long directory_offset = sizeof(REF_HEADER) +
+                          build->num_chroms * sizeof(REF_CHROM) +
+                          names_size + seq_words * sizeof(uint64_t);
+
+  uint64_t pass, num_entries = 0;
+  size_t i;
+
+  for(pass = 0; pass < num_passes && success; pass++)
+  {
+    size_t n = _ref_pass_kmers(build, pass, pass_bits, &entries, &capacity,
+                               unpacked);
+
+    qsort(entries, n, sizeof(REF_BUILD_ENTRY), _ref_build_entry_cmp);
+    n = _ref_unique_kmers(build, entries, n);
+
+    for(i = 0; i < n && success; i++)
+    {
+      uint64_t entry = ((entries[i].hash & REF_FP_MASK) << REF_FP_SHIFT) |
+                       entries[i].entry;
+
+      directory[(entries[i].hash >> (64 - dir_bits)) + 1]++;
+      success = (fwrite(&entry, sizeof(uint64_t), 1, out) == 1);
+    }
+
+    num_entries += n;
+  }
+
+  // Counts to bucket starts
+  for(i = 1; i <= num_buckets; i++)
+  {
+    directory[i] += directory[i-1];
+  }
+
+  header.num_entries = num_entries;
+
+  success = success &&
+            fseek(out, 0, SEEK_SET) == 0 &&
+            fwrite(&header, sizeof(REF_HEADER), 1, out) == 1 &&
+            fseek(out, directory_offset, SEEK_SET) == 0 &&
+            fwrite(directory, sizeof(uint64_t), num_buckets + 1, out)
+              == num_buckets + 1;
+
+  success = (fclose(out) == 0) && success;
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_ref.c: couldn't write index (%s)\n", index_path);
+  }
+
+  free(directory);
+  free(entries);
+  free(unpacked);
+
+  return success;
+}
+
+char cortex_ref_build(const char *fasta_path, unsigned int kmer_size,
+                      const char *index_path)
+{
+  if(kmer_size == 0 || kmer_size > CORTEX_MAX_KMER_SIZE)
+  {
+    fprintf(stderr, "cortex_ref.c: unsupported kmer size [%u]\n", kmer_size);
+    return 0;
+  }
+
+  REF_BUILD build;
+  build.kmer_size = kmer_size;
+  build.num_chroms = 0;
+  build.chroms_capacity = 64;
+  build.chroms = (REF_CHROM*) malloc(build.chroms_capacity * sizeof(REF_CHROM));
+  build.names = strbuf_init(1024);
+  build.seq = NULL;
+  build.nmask = NULL;
+  build.seq_length = 0;
+  build.seq_words = 0;
+  build.num_kmers = 0;
+  build.valid_run = 0;
+
+  if(build.chroms == NULL)
+  {
+    fprintf(stderr, "cortex_ref.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char success = _ref_read_fasta(&build, fasta_path) &&
+                 _ref_write(&build, index_path);
+
+  free(build.chroms);
+  strbuf_free(build.names);
+  free(build.seq);
+  free(build.nmask);
+
+  return success;
+}
+
+//
+// Loading
+//
+
+CORTEX_REF* cortex_ref_load(const char *index_path)
+{
+  int fd = open(index_path, O_RDONLY);
+
+  if(fd == -1)
+  {
+    fprintf(stderr, "cortex_ref.c: couldn't open file (%s)\n", index_path);
+    return NULL;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(REF_HEADER))
+  {
+    fprintf(stderr, "cortex_ref.c: not a reference index (%s)\n", index_path);
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+  {
+    fprintf(stderr, "cortex_ref.c: couldn't map file (%s)\n", index_path);
+    return NULL;
+  }
+
+  const REF_HEADER *header = (const REF_HEADER*)map;
+  size_t expected_size = 0;
+
+  if(memcmp(header->magic, REF_MAGIC, 8) == 0 &&
+     header->version == REF_VERSION && header->dir_bits <= REF_MAX_DIR_BITS &&
+     header->names_size % 8 == 0)
+  {
+    expected_size = sizeof(REF_HEADER) +
+                    header->num_chroms * sizeof(REF_CHROM) +
+                    header->names_size +
+                    (header->seq_length + 31) / 32 * sizeof(uint64_t) +
+                    (((size_t)1 << header->dir_bits) + 1) * sizeof(uint64_t) +
+                    header->num_entries * sizeof(uint64_t);
+  }
+
+  if(expected_size != (size_t)st.st_size)
+  {
+    fprintf(stderr, "cortex_ref.c: corrupt or incompatible index (%s)\n",
+            index_path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  CORTEX_REF *ref = (CORTEX_REF*) malloc(sizeof(CORTEX_REF));
+
+  if(ref == NULL)
+  {
+    fprintf(stderr, "cortex_ref.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  ref->map = map;
+  ref->map_size = st.st_size;
+  ref->header = header;
+  ref->chroms = (const REF_CHROM*)(header + 1);
+  ref->names = (const char*)(ref->chroms + header->num_chroms);
+  ref->seq = (const uint64_t*)(ref->names + header->names_size);
+  ref->directory = ref->seq + (header->seq_length + 31) / 32;
+  ref->entries = ref->directory + ((size_t)1 << header->dir_bits) + 1;
+
+  return ref;
+}
+
+void cortex_ref_close(CORTEX_REF *ref)
+{
+  munmap(ref->map, ref->map_size);
+  free(ref);
+}
+
+unsigned int cortex_ref_kmer_size(const CORTEX_REF *ref)
+{
+  return ref->header->kmer_size;
+}
+
+unsigned long cortex_ref_num_chroms(const CORTEX_REF *ref)
+{
+  return ref->header->num_chroms;
+}
+
+const char* cortex_ref_chrom_name(const CORTEX_REF *ref, unsigned long chrom)
+{
+  return ref->names + ref->chroms[chrom].name;
+}
+
+unsigned long cortex_ref_chrom_length(const CORTEX_REF *ref,
+                                      unsigned long chrom)
+{
+  return ref->chroms[chrom].length;
+}
+
+//
+// Anchoring
+//
+
+// Kmer at pos on the reference's forward strand
+void _ref_kmer_at(const uint64_t *seq, uint64_t pos, unsigned int kmer_size,
+                  CORTEX_KMER *kmer)
+{
+  unsigned int i;
+
+  kmer->b[0] = kmer->b[1] = 0;
+
+  for(i = 0; i < kmer_size; i++, pos++)
+  {
+    kmer->b[0] = (kmer->b[0] << 2) | (kmer->b[1] >> 62);
+    kmer->b[1] = (kmer->b[1] << 2) | ((seq[pos / 32] >> (2 * (pos % 32))) & 3);
+  }
+}
+
+// Look up a canonical kmer with the given hash, and its other orientation.
+// Returns 1 and sets pos and strand (see REF_FP_SHIFT) if it occurs once in
+// the reference
+char _ref_lookup(const CORTEX_REF *ref, const CORTEX_KMER *kmer,
+                 const CORTEX_KMER *other, uint64_t hash,
+                 uint64_t *pos, char *strand)
+{
+  unsigned int kmer_size = ref->header->kmer_size;
+  uint64_t bucket = hash >> (64 - ref->header->dir_bits);
+  uint64_t fingerprint = hash & REF_FP_MASK, i;
+
+  for(i = ref->directory[bucket]; i < ref->directory[bucket+1]; i++)
+  {
+    uint64_t entry = ref->entries[i];
+
+    if((entry >> REF_FP_SHIFT) != fingerprint)
+    {
+      continue;
+    }
+
+    // Check against the reference, which has the other orientation if
+    // strand is set
+    CORTEX_KMER ref_kmer;
+    uint64_t ref_pos = (entry >> 1) & REF_POS_MASK;
+
+    _ref_kmer_at(ref->seq, ref_pos, kmer_size, &ref_kmer);
+
+    if(cortex_kmer_cmp(&ref_kmer, (entry & 1) ? other : kmer) == 0)
+    {
+      *pos = ref_pos;
+      *strand = entry & 1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+long _ref_find_chrom(const CORTEX_REF *ref, uint64_t pos)
+{
+  long lo = 0, hi = (long)ref->header->num_chroms - 1;
+
+  // Last chromosome starting at or before pos
+  while(lo < hi)
+  {
+    long mid = lo + (hi - lo + 1) / 2;
+
+    if(ref->chroms[mid].offset <= pos)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid - 1;
+    }
+  }
+
+  return lo;
+}
+
+// Each unique flank kmer votes for where the flank ends next to the
+// branches: the first reference base after a 5' flank on '+' (the last
+// before it on '-'), or the first base of a 3' flank on '+' (the one after
+// it on '-')
+size_t _ref_flank_votes(const CORTEX_REF *ref, const StrBuf *flank,
+                        char is_5p, REF_VOTE *votes)
+{
+  unsigned int kmer_size = ref->header->kmer_size;
+  size_t len = strbuf_len(flank), first = 0, num_votes = 0;
+
+  if(len < kmer_size)
+  {
+    return 0;
+  }
+
+  size_t num_kmers = len - kmer_size + 1;
+
+  if(num_kmers > REF_MAX_LOOKUPS)
+  {
+    first = is_5p ? num_kmers - REF_MAX_LOOKUPS : 0;
+    num_kmers = REF_MAX_LOOKUPS;
+  }
+
+  // Gather the kmers, then look them up in steps, prefetching what the next
+  // step needs so that the cache misses of different kmers overlap
+  CORTEX_KMER kmers[REF_MAX_LOOKUPS], others[REF_MAX_LOOKUPS];
+  uint64_t hashes[REF_MAX_LOOKUPS];
+  size_t offsets[REF_MAX_LOOKUPS], n = 0, i;
+  char query_strands[REF_MAX_LOOKUPS];
+
+  CORTEX_KMER_ITER iter;
+  size_t start;
+  unsigned int dir_bits = ref->header->dir_bits;
+
+  cortex_kmer_iter_init(&iter, flank->buff + first,
+                        num_kmers + kmer_size - 1, kmer_size);
+
+  while(cortex_kmer_iter_next(&iter, &kmers[n], &start))
+  {
+    query_strands[n] = cortex_kmer_cmp(&kmers[n], &iter.fw) != 0;
+    others[n] = query_strands[n] ? iter.fw : iter.rv;
+    offsets[n] = first + start;
+    hashes[n] = cortex_kmer_hash(&kmers[n], 0);
+    __builtin_prefetch(&ref->directory[hashes[n] >> (64 - dir_bits)]);
+    n++;
+  }
+
+  for(i = 0; i < n; i++)
+  {
+    __builtin_prefetch(&ref->entries[ref->directory[hashes[i] >>
+                                                    (64 - dir_bits)]]);
+  }
+
+  for(i = 0; i < n; i++)
+  {
+    uint64_t pos;
+    char ref_strand;
+
+    if(!_ref_lookup(ref, &kmers[i], &others[i], hashes[i], &pos, &ref_strand))
+    {
+      continue;
+    }
+
+    char reverse = ref_strand != query_strands[i];
+
+    long chrom = _ref_find_chrom(ref, pos);
+    long long r = (long long)(pos - ref->chroms[chrom].offset);
+    long long o = (long long)offsets[i], k = kmer_size, l = len;
+
+    votes[num_votes].chrom = chrom;
+    votes[num_votes].strand = reverse ? '-' : '+';
+
+    if(is_5p)
+    {
+      votes[num_votes].pos = reverse ? r + o + k - l : r - o + l;
+    }
+    else
+    {
+      votes[num_votes].pos = reverse ? r + o + k : r - o;
+    }
+
+    num_votes++;
+  }
+
+  return num_votes;
+}
+
+// Returns the number of votes for the winner, 0 if none or a tie
+unsigned int _ref_best_vote(REF_VOTE *votes, size_t num_votes, REF_VOTE *best)
+{
+  unsigned int best_count = 0, count;
+  char tie = 0;
+  size_t i, j;
+
+  qsort(votes, num_votes, sizeof(REF_VOTE), _ref_vote_cmp);
+
+  for(i = 0; i < num_votes; i = j)
+  {
+    for(j = i + 1; j < num_votes && _ref_vote_cmp(&votes[i], &votes[j]) == 0;
+        j++);
+
+    count = (unsigned int)(j - i);
+
+    if(count > best_count)
+    {
+      best_count = count;
+      *best = votes[i];
+      tie = 0;
+    }
+    else if(count == best_count)
+    {
+      tie = 1;
+    }
+  }
+
+  return tie ? 0 : best_count;
+}
+
+char cortex_ref_anchor(const CORTEX_REF *ref, const CORTEX_BUBBLE *bubble,
+                       CORTEX_ANCHOR *anchor)
+{
+  REF_VOTE votes_5p[REF_MAX_LOOKUPS], votes_3p[REF_MAX_LOOKUPS];
+  REF_VOTE best_5p, best_3p;
+
+  size_t num_5p = _ref_flank_votes(ref, bubble->flank_5p.seq, 1, votes_5p);
+  size_t num_3p = _ref_flank_votes(ref, bubble->flank_3p.seq, 0, votes_3p);
+
+  unsigned int count_5p = _ref_best_vote(votes_5p, num_5p, &best_5p);
+  unsigned int count_3p = _ref_best_vote(votes_3p, num_3p, &best_3p);
+
+  // Flanks must agree on chromosome and strand
+  if(count_5p > 0 && count_3p > 0 &&
+     (best_5p.chrom != best_3p.chrom || best_5p.strand != best_3p.strand))
+  {
+    if(count_5p >= count_3p)
+    {
+      count_3p = 0;
+    }
+    else
+    {
+      count_5p = 0;
+    }
+  }
+
+  anchor->votes_5p = count_5p;
+  anchor->votes_3p = count_3p;
+
+  if(count_5p == 0 && count_3p == 0)
+  {
+    anchor->chrom = -1;
+    anchor->strand = '+';
+    anchor->start = anchor->end = 0;
+    return 0;
+  }
+
+  const REF_VOTE *best = count_5p > 0 ? &best_5p : &best_3p;
+  long long ref_len = (long long)strbuf_len(bubble->branches[0].seq);
+  long long start, end;
+
+  // On '+' the 5' flank gives the start and the 3' flank the end, and the
+  // other way round on '-'
+  long long pos_5p = count_5p > 0 ? best_5p.pos
+                                  : (best->strand == '+' ? best_3p.pos - ref_len
+                                                         : best_3p.pos + ref_len);
+  long long pos_3p = count_3p > 0 ? best_3p.pos
+                                  : (best->strand == '+' ? best_5p.pos + ref_len
+                                                         : best_5p.pos - ref_len);
+
+  start = best->strand == '+' ? pos_5p : pos_3p;
+  end = best->strand == '+' ? pos_3p : pos_5p;
+
+  long long chrom_len = (long long)ref->chroms[best->chrom].length;
+
+  start = start < 0 ? 0 : (start > chrom_len ? chrom_len : start);
+  end = end < start ? start : (end > chrom_len ? chrom_len : end);
+
+  anchor->chrom = best->chrom;
+  anchor->strand = best->strand;
+  anchor->start = (unsigned long)start;
+  anchor->end = (unsigned long)end;
+
+  return 1;
+}
+
+void _ref_anchor_chunk(size_t chunk, void *ptr)
+{
+  REF_BATCH *batch = (REF_BATCH*)ptr;
+  size_t i = chunk * REF_CHUNK_SIZE, end = i + REF_CHUNK_SIZE;
+
+  if(end > batch->num_bubbles)
+  {
+    end = batch->num_bubbles;
+  }
+
+  for(; i < end; i++)
+  {
+    cortex_ref_anchor(batch->ref, batch->bubbles[i], &batch->anchors[i]);
+  }
+}
+
+long cortex_ref_anchor_file(const CORTEX_REF *ref, CORTEX_FILE *c_file,
+                            cortex_ref_anchor_func func, void *arg,
+                            unsigned int num_threads)
+{
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_ref.c: not a bubble file (%s)\n", c_file->path);
+    return -1;
+  }
+
+  REF_BATCH batch;
+  batch.ref = ref;
+  batch.num_bubbles = 0;
+  batch.bubbles
+    = (CORTEX_BUBBLE**) malloc(REF_BATCH_SIZE * sizeof(CORTEX_BUBBLE*));
+  batch.anchors
+    = (CORTEX_ANCHOR*) malloc(REF_BATCH_SIZE * sizeof(CORTEX_ANCHOR));
+
+  if(batch.bubbles == NULL || batch.anchors == NULL)
+  {
+    fprintf(stderr, "cortex_ref.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t i;
+
+  for(i = 0; i < REF_BATCH_SIZE; i++)
+  {
+    batch.bubbles[i] = cortex_bubble_create(c_file);
+  }
+
+  long num_bubbles = 0;
+
+  do
+  {
+    for(batch.num_bubbles = 0; batch.num_bubbles < REF_BATCH_SIZE &&
+        cortex_read_bubble(batch.bubbles[batch.num_bubbles], c_file);
+        batch.num_bubbles++);
+
+    size_t num_chunks = (batch.num_bubbles + REF_CHUNK_SIZE - 1) /
+                        REF_CHUNK_SIZE;
+
+    cortex_parallel_for(num_chunks, num_threads, _ref_anchor_chunk, &batch);
+
+    for(i = 0; i < batch.num_bubbles; i++)
+    {
+      func(batch.bubbles[i], &batch.anchors[i], arg);
+    }
+
+    num_bubbles += batch.num_bubbles;
+  }
+  while(batch.num_bubbles == REF_BATCH_SIZE);
+
+  for(i = 0; i < REF_BATCH_SIZE; i++)
+  {
+    cortex_bubble_free(batch.bubbles[i], c_file);
+  }
+
+  free(batch.bubbles);
+  free(batch.anchors);
+
+  return num_bubbles;
+}
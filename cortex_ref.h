@@ -0,0 +1,97 @@
+/*
+ cortex_ref.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_REF_H_SEEN
+#define CORTEX_REF_H_SEEN
+
+#include "cortex.h"
+
+//
+// Anchoring bubbles on a reference
+//
+// A reference index holds the reference (FASTA, optionally gzipped) packed 2
+// bits per base, and a hash of the canonical kmers that occur exactly once in
+// it.  Each hash entry is 8 bytes: the kmer's position and strand plus a
+// fingerprint of its hash, checked against the packed reference on a match.
+// Like cortex_index.h, the index is memory mapped and uses the host's byte
+// order.
+//
+// A bubble is anchored by looking up the kmers of each flank nearest the
+// branches (up to 16 per flank).  Each unique kmer votes for a chromosome,
+// strand and the position where the flank ends; the most popular vote wins
+// (a tie means that flank isn't anchored).  If only one flank anchors, or
+// the flanks disagree (the flank with fewer votes is dropped), the other end
+// is placed assuming branches[0] is the reference allele.
+//
+
+typedef struct CORTEX_REF CORTEX_REF;
+
+typedef struct
+{
+  // Index of the chromosome or -1 if the bubble couldn't be anchored
+  long chrom;
+  // '+' if the 5' flank is on the forward strand, '-' otherwise
+  char strand;
+  // Reference bases between the flanks, 0-based and half open, on the
+  // forward strand (start == end for an insertion)
+  unsigned long start, end;
+  // Votes for the position of each flank (0 if it wasn't anchored)
+  unsigned int votes_5p, votes_3p;
+} CORTEX_ANCHOR;
+
+// Called in file order from cortex_ref_anchor_file()
+typedef void (*cortex_ref_anchor_func)(const CORTEX_BUBBLE *bubble,
+                                       const CORTEX_ANCHOR *anchor,
+                                       void *arg);
+
+// Index the reference in fasta_path using kmers of kmer_size (normally
+// c_file->kmer_size).  Memory use is about 3 bits per reference base plus 16
+// bytes per kmer, for up to 2^28 kmers at a time (larger references are
+// indexed in several passes).  Returns 1 on success, 0 on failure
+char cortex_ref_build(const char *fasta_path, unsigned int kmer_size,
+                      const char *index_path);
+
+// Returns NULL on failure
+CORTEX_REF* cortex_ref_load(const char *index_path);
+void cortex_ref_close(CORTEX_REF *ref);
+
+unsigned int cortex_ref_kmer_size(const CORTEX_REF *ref);
+unsigned long cortex_ref_num_chroms(const CORTEX_REF *ref);
+const char* cortex_ref_chrom_name(const CORTEX_REF *ref, unsigned long chrom);
+unsigned long cortex_ref_chrom_length(const CORTEX_REF *ref,
+                                      unsigned long chrom);
+
+// Anchor a single bubble.  Safe to call from many threads at once.
+// Returns 1 if the bubble was anchored, 0 otherwise
+char cortex_ref_anchor(const CORTEX_REF *ref, const CORTEX_BUBBLE *bubble,
+                       CORTEX_ANCHOR *anchor);
+
+// Anchor all remaining bubbles in c_file.  Bubbles are read in batches and
+// anchored on up to num_threads threads (0 means one per cpu), then passed
+// to func in order.  Returns the number of bubbles read or -1 on failure
+long cortex_ref_anchor_file(const CORTEX_REF *ref, CORTEX_FILE *c_file,
+                            cortex_ref_anchor_func func, void *arg,
+                            unsigned int num_threads);
+
+#endif
@@ -0,0 +1,748 @@
+/*
+ cortex_sort.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "cortex_sort.h"
+#include "cortex_pack.h"
+#include "cortex_parallel.h"
+
+// Smallest run we'll bother with, whatever max_memory says
+#define SORT_MIN_RUN_SIZE (1<<20)
+// stdio buffer for each spilled run while merging
+#define SORT_MERGE_BUFFER (1<<18)
+
+typedef struct
+{
+  enum CORTEX_SORT_KEY key;
+  unsigned long colour;
+  cortex_sort_key_func func;
+  void *arg;
+} _SORT_SPEC;
+
+// One bubble in a run.  String keys and the packed bubble live in the run's
+// packed buffer (str is only set once the run is full and won't move)
+typedef struct
+{
+  double num;
+  const unsigned char *str;
+  size_t str_offset, str_len, rec_offset, rec_len;
+  unsigned long index;
+} _SORT_ENTRY;
+
+typedef struct
+{
+  CORTEX_PACKED packed;
+  _SORT_ENTRY *entries;
+  size_t num_entries, capacity;
+  const _SORT_SPEC *spec;
+
+  FILE *spill;
+  char failed;
+
+  pthread_t thread;
+  char thread_running;
+} _SORT_RUN;
+
+//
+// Keys
+//
+
+double _sort_llk_margin(const CORTEX_BUBBLE *bubble, const CORTEX_FILE *c_file,
+                        unsigned long col)
+{
+  float hom1 = bubble->llk_hom_br1[col], hom2 = bubble->llk_hom_br2[col];
+
+  if(!c_file->is_diploid)
+  {
+    return fabs(hom1 - hom2);
+  }
+
+  float het = bubble->llk_het[col];
+  float best = hom1, second = het;
+
+  if(het > hom1)
+  {
+    best = het;
+    second = hom1;
+  }
+
+  if(hom2 > best)
+  {
+    second = best;
+    best = hom2;
+  }
+  else if(hom2 > second)
+  {
+    second = hom2;
+  }
+
+  return (double)best - second;
+}
+
+double _sort_numeric_key(const CORTEX_BUBBLE *bubble, const CORTEX_FILE *c_file,
+                         const _SORT_SPEC *spec)
+{
+  if(spec->func != NULL)
+  {
+    return spec->func(bubble, c_file, spec->arg);
+  }
+
+  unsigned long col, i;
+  int branch;
+  double total = 0;
+
+  switch(spec->key)
+  {
+    case SORT_VAR_NUM:
+      return (double)bubble->var_num;
+    case SORT_BRANCH_LENGTH:
+      return (double)(bubble->branches[0].seq_length >
+                      bubble->branches[1].seq_length ?
+                      bubble->branches[0].seq_length :
+                      bubble->branches[1].seq_length);
+    case SORT_LLK_MARGIN:
+      return _sort_llk_margin(bubble, c_file, spec->colour);
+    case SORT_TOTAL_COVG:
+      for(branch = 0; branch < 2; branch++)
+      {
+        for(col = 0; col < c_file->num_of_colours; col++)
+        {
+          const COLOUR_COVG *covgs = bubble->branches_colour_covgs[branch][col];
+
+          for(i = 0; i < covgs->length; i++)
+          {
+            total += covgs->colour_covgs[i];
+          }
+        }
+      }
+      return total;
+    default:
+      return 0;
+  }
+}
+
+// Compare keys; NaN sorts last
+int _sort_cmp_keys(double num_a, const unsigned char *str_a, size_t len_a,
+                   double num_b, const unsigned char *str_b, size_t len_b,
+                   const _SORT_SPEC *spec)
+{
+  if(spec->func == NULL && spec->key == SORT_FLANK_5P)
+  {
+    int cmp = memcmp(str_a, str_b, len_a < len_b ? len_a : len_b);
+
+    if(cmp != 0)
+    {
+      return cmp;
+    }
+
+    return len_a < len_b ? -1 : (len_a > len_b);
+  }
+
+  if(num_a < num_b || (!isnan(num_a) && isnan(num_b)))
+  {
+    return -1;
+  }
+
+  if(num_a > num_b || (isnan(num_a) && !isnan(num_b)))
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+int _sort_cmp_entries(const void *a, const void *b)
+{
+  const _SORT_ENTRY *entry_a = (const _SORT_ENTRY*)a;
+  const _SORT_ENTRY *entry_b = (const _SORT_ENTRY*)b;
+
+  // qsort passes no context, but str is only set when sorting on a string
+  // key, so entries tell us which key type to compare
+  int cmp;
+
+  if(entry_a->str != NULL)
+  {
+    size_t len = entry_a->str_len < entry_b->str_len ?
+                 entry_a->str_len : entry_b->str_len;
+
+    cmp = memcmp(entry_a->str, entry_b->str, len);
+
+    if(cmp == 0)
+    {
+      cmp = entry_a->str_len < entry_b->str_len ? -1 :
+            (entry_a->str_len > entry_b->str_len);
+    }
+  }
+  else
+  {
+    double num_a = entry_a->num, num_b = entry_b->num;
+    cmp = (num_a < num_b || (!isnan(num_a) && isnan(num_b))) ? -1 :
+          (num_a > num_b || (isnan(num_a) && !isnan(num_b))) ? 1 : 0;
+  }
+
+  if(cmp != 0)
+  {
+    return cmp;
+  }
+
+  // Stable
+  return entry_a->index < entry_b->index ? -1 : 1;
+}
+
+//
+// Runs
+//
+
+_SORT_RUN* _sort_run_create(const _SORT_SPEC *spec)
+{
+  _SORT_RUN *run = (_SORT_RUN*) malloc(sizeof(_SORT_RUN));
+
+  if(run == NULL)
+  {
+    fprintf(stderr, "cortex_sort.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  cortex_packed_init(&run->packed);
+  run->capacity = 1024;
+  run->entries = (_SORT_ENTRY*) malloc(run->capacity * sizeof(_SORT_ENTRY));
+  run->num_entries = 0;
+  run->spec = spec;
+  run->spill = NULL;
+  run->failed = 0;
+  run->thread_running = 0;
+
+  return run;
+}
+
+void _sort_run_free(_SORT_RUN *run)
+{
+  cortex_packed_free(&run->packed);
+  free(run->entries);
+
+  if(run->spill != NULL)
+  {
+    fclose(run->spill);
+  }
+
+  free(run);
+}
+
+size_t _sort_run_size(const _SORT_RUN *run)
+{
+  return run->packed.len + run->num_entries * sizeof(_SORT_ENTRY);
+}
+
+void _sort_run_add(_SORT_RUN *run, const CORTEX_BUBBLE *bubble,
+                   const CORTEX_FILE *c_file, unsigned long index)
+{
+  if(run->num_entries == run->capacity)
+  {
+    run->capacity *= 2;
+    run->entries = (_SORT_ENTRY*) realloc(run->entries,
+                                          run->capacity * sizeof(_SORT_ENTRY));
+
+    if(run->entries == NULL)
+    {
+      fprintf(stderr, "cortex_sort.c: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  _SORT_ENTRY *entry = &run->entries[run->num_entries++];
+  const _SORT_SPEC *spec = run->spec;
+
+  entry->index = index;
+  entry->str = NULL;
+  entry->str_offset = run->packed.len;
+  entry->str_len = 0;
+
+  if(spec->func == NULL && spec->key == SORT_FLANK_5P)
+  {
+    entry->num = 0;
+    entry->str_len = strbuf_len(bubble->flank_5p.seq);
+    cortex_packed_append(&run->packed, bubble->flank_5p.seq->buff,
+                         entry->str_len);
+  }
+  else
+  {
+    entry->num = _sort_numeric_key(bubble, c_file, spec);
+  }
+
+  entry->rec_offset = run->packed.len;
+  cortex_bubble_pack(&run->packed, bubble, c_file);
+  entry->rec_len = run->packed.len - entry->rec_offset;
+}
+
+// Point string keys into the buffer and sort
+void _sort_run_sort(_SORT_RUN *run)
+{
+  size_t i;
+  char has_str = (run->spec->func == NULL && run->spec->key == SORT_FLANK_5P);
+
+  for(i = 0; i < run->num_entries; i++)
+  {
+    _SORT_ENTRY *entry = &run->entries[i];
+    // Empty strings still need a non-NULL pointer to be compared as strings
+    entry->str = has_str ? run->packed.data + entry->str_offset : NULL;
+  }
+
+  qsort(run->entries, run->num_entries, sizeof(_SORT_ENTRY),
+        _sort_cmp_entries);
+}
+
+// Spilled record: double key, uint32 string length, uint32 packed length,
+// string, packed bubble
+void* _sort_run_spill(void *ptr)
+{
+  _SORT_RUN *run = (_SORT_RUN*)ptr;
+  size_t i;
+
+  _sort_run_sort(run);
+
+  if((run->spill = tmpfile()) == NULL)
+  {
+    fprintf(stderr, "cortex_sort.c: couldn't create temporary file\n");
+    run->failed = 1;
+    return NULL;
+  }
+
+  for(i = 0; i < run->num_entries && !run->failed; i++)
+  {
+    const _SORT_ENTRY *entry = &run->entries[i];
+    uint32_t lens[2] = {(uint32_t)entry->str_len, (uint32_t)entry->rec_len};
+
+    if(fwrite(&entry->num, sizeof(double), 1, run->spill) != 1 ||
+       fwrite(lens, sizeof(uint32_t), 2, run->spill) != 2 ||
+       fwrite(run->packed.data + entry->str_offset, 1, entry->str_len,
+              run->spill) != entry->str_len ||
+       fwrite(run->packed.data + entry->rec_offset, 1, entry->rec_len,
+              run->spill) != entry->rec_len)
+    {
+      fprintf(stderr, "cortex_sort.c: couldn't write temporary file\n");
+      run->failed = 1;
+    }
+  }
+
+  if(fflush(run->spill) != 0)
+  {
+    fprintf(stderr, "cortex_sort.c: couldn't write temporary file\n");
+    run->failed = 1;
+  }
+
+  rewind(run->spill);
+
+  // Only the file is needed from now on
+  cortex_packed_free(&run->packed);
+  free(run->entries);
+  run->entries = NULL;
+  run->capacity = 0;
+
+  return NULL;
+}
+
+void _sort_run_start(_SORT_RUN *run)
+{
+  run->thread_running
+    = (pthread_create(&run->thread, NULL, _sort_run_spill, run) == 0);
+
+  if(!run->thread_running)
+  {
+    _sort_run_spill(run);
+  }
+}
+
+void _sort_run_wait(_SORT_RUN *run)
+{
+  if(run->thread_running)
+  {
+    pthread_join(run->thread, NULL);
+    run->thread_running = 0;
+  }
+}
+
+//
+// Merging
+//
+
+typedef struct
+{
+  FILE *fh;
+  char *vbuf;
+  double num;
+  size_t str_len, rec_len;
+  CORTEX_PACKED buf; // string then packed bubble
+} _MERGE_INPUT;
+
+// Returns 1 if a record was read, 0 at end of run, -1 if the run is truncated
+int _merge_read(_MERGE_INPUT *input)
+{
+  uint32_t lens[2];
+
+  if(fread(&input->num, sizeof(double), 1, input->fh) != 1 ||
+     fread(lens, sizeof(uint32_t), 2, input->fh) != 2)
+  {
+    return 0;
+  }
+
+  input->str_len = lens[0];
+  input->rec_len = lens[1];
+
+  cortex_packed_reset(&input->buf);
+  cortex_packed_ensure(&input->buf, input->str_len + input->rec_len);
+
+  if(fread(input->buf.data, 1, input->str_len + input->rec_len, input->fh)
+       != input->str_len + input->rec_len)
+  {
+    fprintf(stderr, "cortex_sort.c: temporary file truncated\n");
+    return -1;
+  }
+
+  input->buf.len = input->str_len + input->rec_len;
+
+  return 1;
+}
+
+// Runs hold consecutive parts of the input, so ties go to the earlier run
+char _merge_less(const _MERGE_INPUT *inputs, size_t a, size_t b,
+                 const _SORT_SPEC *spec)
+{
+  int cmp = _sort_cmp_keys(inputs[a].num, inputs[a].buf.data, inputs[a].str_len,
+                           inputs[b].num, inputs[b].buf.data, inputs[b].str_len,
+                           spec);
+
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+void _merge_sift_down(size_t *heap, size_t heap_size, size_t pos,
+                      const _MERGE_INPUT *inputs, const _SORT_SPEC *spec)
+{
+  size_t top = heap[pos];
+
+  while(1)
+  {
+    size_t child = 2 * pos + 1;
+
+    if(child >= heap_size)
+    {
+      break;
+    }
+
+    if(child + 1 < heap_size &&
+       _merge_less(inputs, heap[child+1], heap[child], spec))
+    {
+      child++;
+    }
+
+    if(!_merge_less(inputs, heap[child], top, spec))
+    {
+      break;
+    }
+
+    heap[pos] = heap[child];
+    pos = child;
+  }
+
+  heap[pos] = top;
+}
+
+long _sort_merge(_SORT_RUN **runs, size_t num_runs, const _SORT_SPEC *spec,
+                 CORTEX_BUBBLE *bubble, const CORTEX_FILE *c_file, FILE *out)
+{
+  _MERGE_INPUT *inputs = (_MERGE_INPUT*) malloc(num_runs * sizeof(_MERGE_INPUT));
+  size_t *heap = (size_t*) malloc(num_runs * sizeof(size_t));
+  size_t heap_size = 0, i;
+  long num_written = 0;
+  int status;
+
+  for(i = 0; i < num_runs; i++)
+  {
+    inputs[i].fh = runs[i]->spill;
+    inputs[i].vbuf = (char*) malloc(SORT_MERGE_BUFFER);
+    setvbuf(inputs[i].fh, inputs[i].vbuf, _IOFBF, SORT_MERGE_BUFFER);
+    cortex_packed_init(&inputs[i].buf);
+
+    if((status = _merge_read(&inputs[i])) == 1)
+    {
+      heap[heap_size++] = i;
+    }
+    else if(status < 0)
+    {
+      num_written = -1;
+    }
+  }
+
+  if(num_written < 0)
+  {
+    // Don't merge anything, but still close every run below
+    heap_size = 0;
+  }
+
+  // Heapify
+  for(i = heap_size / 2; i-- > 0; )
+  {
+    _merge_sift_down(heap, heap_size, i, inputs, spec);
+  }
+
+  while(heap_size > 0)
+  {
+    _MERGE_INPUT *input = &inputs[heap[0]];
+
+    if(cortex_bubble_unpack(bubble, c_file, input->buf.data + input->str_len,
+                            input->rec_len) == 0)
+    {
+      fprintf(stderr, "cortex_sort.c: corrupt temporary file\n");
+      num_written = -1;
+      break;
+    }
+
+    cortex_fprint_bubble(out, bubble, c_file);
+    num_written++;
+
+    if((status = _merge_read(input)) < 0)
+    {
+      num_written = -1;
+      break;
+    }
+    else if(status == 0)
+    {
+      heap[0] = heap[--heap_size];
+    }
+
+    if(heap_size > 0)
+    {
+      _merge_sift_down(heap, heap_size, 0, inputs, spec);
+    }
+  }
+
+  for(i = 0; i < num_runs; i++)
+  {
+    // Detach our buffer before freeing it
+    fclose(runs[i]->spill);
+    runs[i]->spill = NULL;
+    free(inputs[i].vbuf);
+    cortex_packed_free(&inputs[i].buf);
+  }
+
+  free(inputs);
+  free(heap);
+
+  return num_written;
+}
+
+// Write a single in-memory run straight to the output
+long _sort_write_run(_SORT_RUN *run, CORTEX_BUBBLE *bubble,
+                     const CORTEX_FILE *c_file, FILE *out)
+{
+  size_t i;
+
+  _sort_run_sort(run);
+
+  for(i = 0; i < run->num_entries; i++)
+  {
+    const _SORT_ENTRY *entry = &run->entries[i];
+
+    if(cortex_bubble_unpack(bubble, c_file, run->packed.data + entry->rec_offset,
+                            entry->rec_len) == 0)
+    {
+      fprintf(stderr, "cortex_sort.c: corrupt packed bubble\n");
+      return -1;
+    }
+
+    cortex_fprint_bubble(out, bubble, c_file);
+  }
+
+  return (long)run->num_entries;
+}
+
+//
+// Sort
+//
+
+long _sort_bubbles(CORTEX_FILE *c_file, const char *out_path,
+                   const _SORT_SPEC *spec, size_t max_memory,
+                   unsigned int num_threads)
+{
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_sort.c: not a bubble file (%s)\n", c_file->path);
+    return -1;
+  }
+
+  if(spec->func == NULL && spec->key == SORT_LLK_MARGIN &&
+     (!c_file->has_likelihoods || spec->colour >= c_file->num_of_colours))
+  {
+    fprintf(stderr, "cortex_sort.c: no likelihoods for colour index %lu (%s)\n",
+            spec->colour, c_file->path);
+    return -1;
+  }
+
+  FILE *out = fopen(out_path, "w");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_sort.c: couldn't open output file (%s)\n",
+            out_path);
+    return -1;
+  }
+
+  if(num_threads == 0)
+  {
+    num_threads = cortex_num_cpus();
+  }
+
+  // Memory is shared between the run being filled and those being sorted
+  size_t run_limit = max_memory / num_threads;
+
+  if(run_limit < SORT_MIN_RUN_SIZE)
+  {
+    run_limit = SORT_MIN_RUN_SIZE;
+  }
+
+  size_t runs_capacity = 16, num_runs = 0, num_waited = 0;
+  _SORT_RUN **runs = (_SORT_RUN**) malloc(runs_capacity * sizeof(_SORT_RUN*));
+  _SORT_RUN *run = _sort_run_create(spec);
+  CORTEX_BUBBLE *bubble = cortex_bubble_create(c_file);
+  unsigned long index = 0;
+  long num_written = 0;
+  char failed = 0;
+
+  while(cortex_read_bubble(bubble, c_file))
+  {
+    _sort_run_add(run, bubble, c_file, index++);
+
+    if(_sort_run_size(run) >= run_limit)
+    {
+      if(num_runs == runs_capacity)
+      {
+        runs_capacity *= 2;
+        runs = (_SORT_RUN**) realloc(runs, runs_capacity * sizeof(_SORT_RUN*));
+      }
+
+      runs[num_runs++] = run;
+      _sort_run_start(run);
+
+      // Wait for the oldest runs so that at most num_threads are in memory
+      // including the next one we fill
+      while(num_runs - num_waited >= num_threads)
+      {
+        _sort_run_wait(runs[num_waited++]);
+      }
+
+      run = _sort_run_create(spec);
+    }
+  }
+
+  while(num_waited < num_runs)
+  {
+    _sort_run_wait(runs[num_waited++]);
+  }
+
+  size_t i;
+
+  for(i = 0; i < num_runs; i++)
+  {
+    failed |= runs[i]->failed;
+  }
+
+  if(failed)
+  {
+    num_written = -1;
+  }
+  else if(num_runs == 0)
+  {
+    // Everything fitted in memory
+    num_written = _sort_write_run(run, bubble, c_file, out);
+  }
+  else
+  {
+    if(run->num_entries > 0)
+    {
+      if(num_runs == runs_capacity)
+      {
+        runs = (_SORT_RUN**) realloc(runs, (num_runs+1) * sizeof(_SORT_RUN*));
+      }
+
+      runs[num_runs++] = run;
+      _sort_run_spill(run);
+      run = NULL;
+    }
+
+    if(num_runs > 0 && runs[num_runs-1]->failed)
+    {
+      num_written = -1;
+    }
+    else
+    {
+      num_written = _sort_merge(runs, num_runs, spec, bubble, c_file, out);
+    }
+  }
+
+  if(run != NULL)
+  {
+    _sort_run_free(run);
+  }
+
+  for(i = 0; i < num_runs; i++)
+  {
+    _sort_run_free(runs[i]);
+  }
+
+  free(runs);
+  cortex_bubble_free(bubble, c_file);
+
+  // Catch write errors from earlier records as well as the final flush
+  char write_failed = (fflush(out) != 0 || ferror(out));
+
+  if(fclose(out) != 0 || write_failed)
+  {
+    fprintf(stderr, "cortex_sort.c: couldn't write output file (%s)\n",
+            out_path);
+    num_written = -1;
+  }
+
+  return num_written;
+}
+
+long cortex_sort_bubbles(CORTEX_FILE *c_file, const char *out_path,
+                         enum CORTEX_SORT_KEY key, unsigned long colour,
+                         size_t max_memory, unsigned int num_threads)
+{
+  _SORT_SPEC spec = {key, colour, NULL, NULL};
+  return _sort_bubbles(c_file, out_path, &spec, max_memory, num_threads);
+}
+
+long cortex_sort_bubbles_by(CORTEX_FILE *c_file, const char *out_path,
+                            cortex_sort_key_func func, void *arg,
+                            size_t max_memory, unsigned int num_threads)
+{
+  _SORT_SPEC spec = {SORT_VAR_NUM, 0, func, arg};
+  return _sort_bubbles(c_file, out_path, &spec, max_memory, num_threads);
+}
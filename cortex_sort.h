@@ -0,0 +1,67 @@
+/*
+ cortex_sort.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_SORT_H_SEEN
+#define CORTEX_SORT_H_SEEN
+
+#include <stddef.h>
+
+#include "cortex.h"
+
+//
+// Sort bubble files larger than memory
+//
+// Bubbles are packed (see cortex_pack.h) into runs of at most max_memory /
+// num_threads bytes.  Full runs are sorted and spilled to temporary files on
+// their own threads while reading carries on, then the runs are merged into
+// the output.  The sort is stable: bubbles with equal keys keep their order.
+// Output is a text bubble file, as written by cortex_print_bubble().
+//
+
+enum CORTEX_SORT_KEY
+{
+  SORT_VAR_NUM,
+  SORT_FLANK_5P,       // 5' flank sequence, alphabetically
+  SORT_BRANCH_LENGTH,  // length of the longer branch
+  SORT_LLK_MARGIN,     // best minus second best likelihood in one colour
+  SORT_TOTAL_COVG      // sum of all coverages on both branches in all colours
+};
+
+// Custom numeric sort key
+typedef double (*cortex_sort_key_func)(const CORTEX_BUBBLE *bubble,
+                                       const CORTEX_FILE *c_file, void *arg);
+
+// Sort the remaining bubbles of c_file into out_path.  colour is the colour
+// index used by SORT_LLK_MARGIN.  num_threads == 0 means one per cpu.
+// Returns the number of bubbles written, or -1 on error
+long cortex_sort_bubbles(CORTEX_FILE *c_file, const char *out_path,
+                         enum CORTEX_SORT_KEY key, unsigned long colour,
+                         size_t max_memory, unsigned int num_threads);
+
+// Same but sorting on func(bubble, c_file, arg), smallest first
+long cortex_sort_bubbles_by(CORTEX_FILE *c_file, const char *out_path,
+                            cortex_sort_key_func func, void *arg,
+                            size_t max_memory, unsigned int num_threads);
+
+#endif
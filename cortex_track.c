@@ -0,0 +1,397 @@
+/*
+ cortex_track.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cortex_track.h"
+#include "cortex_parallel.h"
+
+// Alignments read before handing a batch to the writers: up to this many,
+// or until they hold TRACK_BATCH_RUNS coverage runs
+#define TRACK_BATCH_SIZE 256
+#define TRACK_BATCH_RUNS (1<<20)
+
+// stdio buffer for each output file
+#define TRACK_OUT_BUFFER (1<<20)
+
+typedef struct
+{
+  FILE *out;
+  char *buffer;
+} _TRACK_OUT;
+
+typedef struct
+{
+  unsigned long col_index;
+  _TRACK_OUT track;
+  _TRACK_OUT *zooms;
+  char failed;
+} _TRACK_COLOUR;
+
+typedef struct
+{
+  const CORTEX_FILE *c_file;
+  _TRACK_COLOUR *colours;
+  const unsigned long *zoom_bins;
+  size_t num_zooms;
+  CORTEX_ALIGNMENT_RUNS **batch;
+  size_t batch_size;
+} _TRACK_ARGS;
+
+// Summary of a zoom bin
+typedef struct
+{
+  unsigned long bin, valid;
+  uint32_t min, max;
+  unsigned long long sum;
+  double sum_squares;
+} _TRACK_ZOOM_BIN;
+
+char _track_out_open(_TRACK_OUT *out, const char *path)
+{
+  out->buffer = NULL;
+
+  if((out->out = fopen(path, "w")) == NULL)
+  {
+    fprintf(stderr, "cortex_track.c: couldn't open output file (%s)\n", path);
+    return 0;
+  }
+
+  if((out->buffer = (char*) malloc(TRACK_OUT_BUFFER)) != NULL)
+  {
+    setvbuf(out->out, out->buffer, _IOFBF, TRACK_OUT_BUFFER);
+  }
+
+  return 1;
+}
+
+// Returns 1 on success, 0 if anything failed to write
+char _track_out_close(_TRACK_OUT *out)
+{
+  char success = 1;
+
+  if(out->out != NULL)
+  {
+    success = !ferror(out->out);
+    success = (fclose(out->out) == 0) && success;
+  }
+
+  free(out->buffer);
+  out->out = NULL;
+  out->buffer = NULL;
+
+  return success;
+}
+
+void _track_zoom_emit(FILE *out, const char *name, unsigned long bin_size,
+                      unsigned long length, const _TRACK_ZOOM_BIN *bin)
+{
+  unsigned long start = bin->bin * bin_size;
+  unsigned long end = start + bin_size < length ? start + bin_size : length;
+
+  fprintf(out, "%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%llu\t%.17g\n", name, start, end,
+          bin->valid, (unsigned long)bin->min, (unsigned long)bin->max,
+          bin->sum, bin->sum_squares);
+}
+
+// Walk runs and bins together, so each is visited once
+void _track_write_zoom(FILE *out, const char *name,
+                       const COLOUR_COVG_RUNS *runs, unsigned long bin_size)
+{
+  _TRACK_ZOOM_BIN bin;
+  unsigned long r, start, end;
+  char have_bin = 0;
+
+  for(r = 0; r < runs->num_runs; r++)
+  {
+    uint32_t value = runs->values[r];
+
+    if(value == 0)
+    {
+      continue;
+    }
+
+    start = r == 0 ? 0 : runs->ends[r-1];
+    end = runs->ends[r];
+
+    while(start < end)
+    {
+      unsigned long bin_num = start / bin_size;
+      unsigned long bin_end = (bin_num + 1) * bin_size;
+      unsigned long len = (end < bin_end ? end : bin_end) - start;
+
+      if(have_bin && bin.bin != bin_num)
+      {
+        _track_zoom_emit(out, name, bin_size, runs->length, &bin);
+        have_bin = 0;
+      }
+
+      if(!have_bin)
+      {
+        bin.bin = bin_num;
+        bin.valid = 0;
+        bin.min = value;
+        bin.max = value;
+        bin.sum = 0;
+        bin.sum_squares = 0;
+        have_bin = 1;
+      }
+
+      bin.valid += len;
+      bin.min = value < bin.min ? value : bin.min;
+      bin.max = value > bin.max ? value : bin.max;
+      bin.sum += (unsigned long long)value * len;
+      bin.sum_squares += (double)value * value * len;
+
+      start += len;
+    }
+  }
+
+  if(have_bin)
+  {
+    _track_zoom_emit(out, name, bin_size, runs->length, &bin);
+  }
+}
+
+void _track_write_colour(size_t i, void *ptr)
+{
+  _TRACK_ARGS *args = (_TRACK_ARGS*)ptr;
+  _TRACK_COLOUR *colour = &args->colours[i];
+  size_t a, z;
+  unsigned long r;
+
+  for(a = 0; a < args->batch_size; a++)
+  {
+    const CORTEX_ALIGNMENT_RUNS *alignment = args->batch[a];
+    const COLOUR_COVG_RUNS *runs = alignment->colour_runs[colour->col_index];
+    const char *name = alignment->name->buff;
+    FILE *out = colour->track.out;
+
+    for(r = 0; r < runs->num_runs; r++)
+    {
+      if(runs->values[r] > 0)
+      {
+        fprintf(out, "%s\t%lu\t%lu\t%lu\n", name,
+                r == 0 ? 0 : (unsigned long)runs->ends[r-1],
+                (unsigned long)runs->ends[r],
+                (unsigned long)runs->values[r]);
+      }
+    }
+
+    for(z = 0; z < args->num_zooms; z++)
+    {
+      _track_write_zoom(colour->zooms[z].out, name, runs, args->zoom_bins[z]);
+    }
+  }
+
+  if(ferror(colour->track.out))
+  {
+    colour->failed = 1;
+  }
+}
+
+// Open a colour's track and zoom files
+char _track_colour_open(_TRACK_COLOUR *colour, const CORTEX_FILE *c_file,
+                        const char *prefix, const unsigned long *zoom_bins,
+                        size_t num_zooms)
+{
+  unsigned long colour_num = c_file->colour_arr[colour->col_index];
+  size_t path_len = strlen(prefix) + 100, z;
+  char *path = (char*) malloc(path_len);
+  char success;
+
+  colour->zooms = (_TRACK_OUT*) calloc(num_zooms, sizeof(_TRACK_OUT));
+  colour->failed = 0;
+
+  if(path == NULL || (num_zooms > 0 && colour->zooms == NULL))
+  {
+    fprintf(stderr, "cortex_track.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  sprintf(path, "%s.colour%lu.bedGraph", prefix, colour_num);
+  success = _track_out_open(&colour->track, path);
+
+  if(success)
+  {
+    fprintf(colour->track.out, "track type=bedGraph name=\"%s colour %lu\"\n",
+            c_file->path, colour_num);
+  }
+
+  for(z = 0; z < num_zooms && success; z++)
+  {
+    sprintf(path, "%s.colour%lu.zoom%lu.txt", prefix, colour_num,
+            zoom_bins[z]);
+    success = _track_out_open(&colour->zooms[z], path);
+
+    if(success)
+    {
+      fprintf(colour->zooms[z].out, "#chrom\tstart\tend\tvalid_count\tmin\t"
+                                    "max\tsum\tsum_squares\n");
+    }
+  }
+
+  free(path);
+  return success;
+}
+
+// Returns 1 if everything was written
+char _track_colour_close(_TRACK_COLOUR *colour, size_t num_zooms)
+{
+  char success = !colour->failed;
+  size_t z;
+
+  success = _track_out_close(&colour->track) && success;
+
+  for(z = 0; z < num_zooms; z++)
+  {
+    success = _track_out_close(&colour->zooms[z]) && success;
+  }
+
+  free(colour->zooms);
+  return success;
+}
+
+long cortex_track_export(CORTEX_FILE *c_file, const char *prefix,
+                         const unsigned long *colours, size_t num_colours,
+                         const unsigned long *zoom_bins, size_t num_zooms,
+                         unsigned int num_threads)
+{
+  size_t i, opened = 0;
+  char success = 1;
+
+  if(c_file->filetype != ALIGNMENT_FILE)
+  {
+    fprintf(stderr, "cortex_track.c: not an alignment file (%s)\n",
+            c_file->path);
+    return -1;
+  }
+
+  for(i = 0; i < num_zooms; i++)
+  {
+    if(zoom_bins[i] == 0)
+    {
+      fprintf(stderr, "cortex_track.c: zoom bin size must be > 0\n");
+      return -1;
+    }
+  }
+
+  if(colours == NULL)
+  {
+    num_colours = c_file->num_of_colours;
+  }
+
+  _TRACK_ARGS args;
+  args.c_file = c_file;
+  args.zoom_bins = zoom_bins;
+  args.num_zooms = num_zooms;
+  args.batch_size = 0;
+  args.colours = (_TRACK_COLOUR*) calloc(num_colours, sizeof(_TRACK_COLOUR));
+  args.batch = (CORTEX_ALIGNMENT_RUNS**)
+               malloc(TRACK_BATCH_SIZE * sizeof(CORTEX_ALIGNMENT_RUNS*));
+
+  if((num_colours > 0 && args.colours == NULL) || args.batch == NULL)
+  {
+    fprintf(stderr, "cortex_track.c: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < num_colours && success; i++)
+  {
+    long col_index = (long)i;
+
+    if(colours != NULL &&
+       (col_index = cortex_file_get_colour_index(colours[i], c_file)) < 0)
+    {
+      fprintf(stderr, "cortex_track.c: colour %lu is not in file (%s)\n",
+              colours[i], c_file->path);
+      success = 0;
+      break;
+    }
+
+    args.colours[i].col_index = (unsigned long)col_index;
+    success = _track_colour_open(&args.colours[i], c_file, prefix,
+                                 zoom_bins, num_zooms);
+    opened++;
+  }
+
+  for(i = 0; i < TRACK_BATCH_SIZE; i++)
+  {
+    args.batch[i] = cortex_alignment_runs_create(c_file);
+  }
+
+  long num_alignments = 0;
+
+  while(success)
+  {
+    // Fill a batch
+    unsigned long batch_runs = 0;
+    args.batch_size = 0;
+
+    while(args.batch_size < TRACK_BATCH_SIZE && batch_runs < TRACK_BATCH_RUNS &&
+          cortex_read_alignment_runs(args.batch[args.batch_size], c_file))
+    {
+      unsigned long col;
+      for(col = 0; col < c_file->num_of_colours; col++)
+      {
+        batch_runs += args.batch[args.batch_size]->colour_runs[col]->num_runs;
+      }
+
+      args.batch_size++;
+    }
+
+    if(args.batch_size == 0)
+    {
+      break;
+    }
+
+    cortex_parallel_for(num_colours, num_threads, _track_write_colour, &args);
+    num_alignments += args.batch_size;
+  }
+
+  // Clean up
+  for(i = 0; i < opened; i++)
+  {
+    success = _track_colour_close(&args.colours[i], num_zooms) && success;
+  }
+
+  for(i = 0; i < TRACK_BATCH_SIZE; i++)
+  {
+    cortex_alignment_runs_free(args.batch[i], c_file);
+  }
+
+  free(args.batch);
+  free(args.colours);
+
+  if(!success)
+  {
+    fprintf(stderr, "cortex_track.c: failed to export tracks (%s)\n",
+            c_file->path);
+    return -1;
+  }
+
+  return num_alignments;
+}
@@ -0,0 +1,57 @@
+/*
+ cortex_track.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_TRACK_H_SEEN
+#define CORTEX_TRACK_H_SEEN
+
+#include <stddef.h>
+
+#include "cortex.h"
+
+//
+// Coverage tracks from alignment files
+//
+// Each selected colour is written to <prefix>.colour<N>.bedGraph, with one
+// line per run of equal, non-zero coverage.  Positions are kmer start
+// offsets in the alignment's sequence, and the alignment name is used as the
+// chromosome.
+//
+// For each zoom bin size B, <prefix>.colour<N>.zoom<B>.txt summarises the
+// track in bins of B kmers, like bigWig zoom levels:
+//   chrom start end valid_count min max sum sum_squares
+// over the kmers with non-zero coverage.  Bins without coverage are left out.
+//
+
+// Export the remaining alignments in c_file in a single pass.  colours are
+// colour numbers from the file (NULL for all colours).  zoom_bins may be NULL
+// if num_zooms is 0.  Alignments are read in batches and each colour's output
+// is formatted and written on its own thread, using up to num_threads
+// threads (0 means one per cpu).  Returns the number of alignments written or
+// -1 on failure
+long cortex_track_export(CORTEX_FILE *c_file, const char *prefix,
+                         const unsigned long *colours, size_t num_colours,
+                         const unsigned long *zoom_bins, size_t num_zooms,
+                         unsigned int num_threads);
+
+#endif
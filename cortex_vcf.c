@@ -0,0 +1,607 @@
+/*
+ cortex_vcf.c
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "cortex_vcf.h"
+#include "cortex_parallel.h"
+
+// log10(e) - converts natural log likelihoods to log10
+#define VCF_LOG10E 0.43429448190325182765
+
+// Flush the write buffer once it gets this big
+#define VCF_FLUSH_SIZE (1<<20)
+
+// Upper bound on memory held by the bubbles of one batch in
+// cortex_vcf_convert(), and on the number of bubbles in a batch
+#define VCF_BATCH_MEMORY (1UL<<28)
+#define VCF_MAX_BATCH_SIZE 4096
+
+// Largest number of chars a colour's sample column can use
+#define VCF_MAX_SAMPLE_LEN 128
+
+struct CORTEX_VCF_WRITER
+{
+  gzFile out;
+  StrBuf *buffer;
+  const CORTEX_FILE *c_file;
+  // Set once a write fails; nothing more is written
+  char failed;
+};
+
+//
+// Formatting
+//
+
+char* _vcf_write_ulong(char *pos, unsigned long value)
+{
+  char digits[20];
+  int num_digits = 0;
+
+  do
+  {
+    digits[num_digits++] = '0' + (value % 10);
+    value /= 10;
+  }
+  while(value > 0);
+
+  while(num_digits > 0)
+  {
+    *(pos++) = digits[--num_digits];
+  }
+
+  return pos;
+}
+
+// Print a non-negative value to two decimal places
+char* _vcf_write_fixed2(char *pos, double value)
+{
+  unsigned long hundredths = (unsigned long)(value * 100 + 0.5);
+
+  pos = _vcf_write_ulong(pos, hundredths / 100);
+  *(pos++) = '.';
+  *(pos++) = '0' + (hundredths / 10) % 10;
+  *(pos++) = '0' + hundredths % 10;
+
+  return pos;
+}
+
+char* _vcf_write_str(char *pos, const char *str, size_t len)
+{
+  memcpy(pos, str, len);
+  return pos + len;
+}
+
+double _vcf_mean_covg(const COLOUR_COVG *covgs)
+{
+  if(covgs->length == 0)
+  {
+    return 0;
+  }
+
+  unsigned long i, sum = 0;
+
+  for(i = 0; i < covgs->length; i++)
+  {
+    sum += covgs->colour_covgs[i];
+  }
+
+  return (double)sum / covgs->length;
+}
+
+// Convert log likelihoods into phred-scaled likelihoods and write them
+// comma separated, followed by ':GQ'.  Both are '.' if any llk isn't finite
+char* _vcf_write_pl_gq(char *pos, const float *llks, int num_llks)
+{
+  float max_llk = llks[0];
+  unsigned long pls[3];
+  int i;
+
+  for(i = 0; i < num_llks; i++)
+  {
+    if(!isfinite(llks[i]))
+    {
+      return _vcf_write_str(pos, ".:.", 3);
+    }
+  }
+
+  for(i = 1; i < num_llks; i++)
+  {
+    if(llks[i] > max_llk)
+    {
+      max_llk = llks[i];
+    }
+  }
+
+  // Smallest and second smallest PL
+  unsigned long best = (unsigned long)-1, second = (unsigned long)-1;
+
+  for(i = 0; i < num_llks; i++)
+  {
+    double pl = -10.0 * VCF_LOG10E * ((double)llks[i] - max_llk);
+    pls[i] = (pl > 999999999.0) ? 999999999UL : (unsigned long)(pl + 0.5);
+
+    if(pls[i] < best)
+    {
+      second = best;
+      best = pls[i];
+    }
+    else if(pls[i] < second)
+    {
+      second = pls[i];
+    }
+
+    if(i > 0)
+    {
+      *(pos++) = ',';
+    }
+
+    pos = _vcf_write_ulong(pos, pls[i]);
+  }
+
+  unsigned long gq = second - best;
+
+  *(pos++) = ':';
+  pos = _vcf_write_ulong(pos, gq > 99 ? 99 : gq);
+
+  return pos;
+}
+
+char* _vcf_write_gt(char *pos, HETEROGENEITY call, char is_diploid)
+{
+  const char *gt;
+
+  switch(call)
+  {
+    case HOM1:
+      gt = is_diploid ? "0/0" : "0";
+      break;
+    case HET:
+      gt = "0/1";
+      break;
+    case HOM2:
+      gt = is_diploid ? "1/1" : "1";
+      break;
+    default:
+      gt = is_diploid ? "./." : ".";
+      break;
+  }
+
+  return _vcf_write_str(pos, gt, strlen(gt));
+}
+
+void cortex_vcf_format_bubble(StrBuf *sbuf, const CORTEX_BUBBLE *bubble,
+                              const CORTEX_FILE *c_file)
+{
+  const StrBuf *flank = bubble->flank_5p.seq;
+  const StrBuf *ref = bubble->branches[0].seq;
+  const StrBuf *alt = bubble->branches[1].seq;
+
+  t_buf_pos flank_len = strbuf_len(flank);
+  char anchor = flank_len > 0 ? flank->buff[flank_len-1] : 'N';
+
+  // Reserve enough space for the whole line then write into it directly
+  size_t max_len = 200 + strbuf_len(ref) + strbuf_len(alt) +
+                   c_file->num_of_colours * VCF_MAX_SAMPLE_LEN;
+
+  strbuf_ensure_capacity(sbuf, strbuf_len(sbuf) + max_len);
+
+  char *pos = sbuf->buff + sbuf->len;
+
+  // CHROM POS ID
+  pos = _vcf_write_str(pos, "var_", 4);
+  pos = _vcf_write_ulong(pos, bubble->var_num);
+  *(pos++) = '\t';
+  pos = _vcf_write_ulong(pos, flank_len > 0 ? flank_len : 1);
+  pos = _vcf_write_str(pos, "\tvar_", 5);
+  pos = _vcf_write_ulong(pos, bubble->var_num);
+
+  // REF ALT
+  *(pos++) = '\t';
+  *(pos++) = anchor;
+  pos = _vcf_write_str(pos, ref->buff, strbuf_len(ref));
+  *(pos++) = '\t';
+  *(pos++) = anchor;
+  pos = _vcf_write_str(pos, alt->buff, strbuf_len(alt));
+
+  // QUAL FILTER INFO FORMAT
+  if(c_file->has_likelihoods)
+  {
+    const char fields[] = "\t.\t.\t.\tGT:PL:GQ:COVG";
+    pos = _vcf_write_str(pos, fields, strlen(fields));
+  }
+  else
+  {
+    const char fields[] = "\t.\t.\t.\tCOVG";
+    pos = _vcf_write_str(pos, fields, strlen(fields));
+  }
+
+  unsigned long col;
+
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    *(pos++) = '\t';
+
+    if(c_file->has_likelihoods)
+    {
+      pos = _vcf_write_gt(pos, bubble->calls[col], c_file->is_diploid);
+      *(pos++) = ':';
+
+      float llks[3];
+      int num_llks = 0;
+
+      llks[num_llks++] = bubble->llk_hom_br1[col];
+
+      if(c_file->is_diploid)
+      {
+        llks[num_llks++] = bubble->llk_het[col];
+      }
+
+      llks[num_llks++] = bubble->llk_hom_br2[col];
+
+      pos = _vcf_write_pl_gq(pos, llks, num_llks);
+      *(pos++) = ':';
+    }
+
+    pos = _vcf_write_fixed2(pos,
+            _vcf_mean_covg(bubble->branches_colour_covgs[0][col]));
+    *(pos++) = ',';
+    pos = _vcf_write_fixed2(pos,
+            _vcf_mean_covg(bubble->branches_colour_covgs[1][col]));
+  }
+
+  *(pos++) = '\n';
+  *pos = '\0';
+
+  sbuf->len = pos - sbuf->buff;
+}
+
+//
+// Writer
+//
+
+char _vcf_write(CORTEX_VCF_WRITER *vcf, const char *str, size_t len)
+{
+  if(vcf->failed)
+  {
+    return 0;
+  }
+
+  if(len > 0 && gzwrite(vcf->out, str, len) != (int)len)
+  {
+    fprintf(stderr, "cortex_vcf.c: write failed\n");
+    vcf->failed = 1;
+    return 0;
+  }
+
+  return 1;
+}
+
+char _vcf_flush(CORTEX_VCF_WRITER *vcf)
+{
+  char success = _vcf_write(vcf, vcf->buffer->buff, strbuf_len(vcf->buffer));
+  strbuf_reset(vcf->buffer);
+  return success;
+}
+
+void _vcf_print_header(CORTEX_VCF_WRITER *vcf)
+{
+  const CORTEX_FILE *c_file = vcf->c_file;
+  StrBuf *sbuf = vcf->buffer;
+
+  strbuf_append_str(sbuf, "##fileformat=VCFv4.1\n");
+  strbuf_append_str(sbuf, "##source=CortexLib\n");
+  strbuf_sprintf(sbuf, "##cortex_file=%s\n", c_file->path);
+  strbuf_sprintf(sbuf, "##cortex_kmer_size=%u\n", c_file->kmer_size);
+
+  if(c_file->has_likelihoods)
+  {
+    strbuf_append_str(sbuf, "##FORMAT=<ID=GT,Number=1,Type=String,"
+                            "Description=\"Genotype\">\n");
+    strbuf_append_str(sbuf, "##FORMAT=<ID=PL,Number=G,Type=Integer,"
+                            "Description=\"Phred-scaled genotype "
+                            "likelihoods\">\n");
+    strbuf_append_str(sbuf, "##FORMAT=<ID=GQ,Number=1,Type=Integer,"
+                            "Description=\"Genotype quality\">\n");
+  }
+
+  strbuf_append_str(sbuf, "##FORMAT=<ID=COVG,Number=R,Type=Float,"
+                          "Description=\"Mean kmer coverage of each "
+                          "branch\">\n");
+
+  strbuf_append_str(sbuf, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO"
+                          "\tFORMAT");
+
+  unsigned long col;
+  for(col = 0; col < c_file->num_of_colours; col++)
+  {
+    strbuf_sprintf(sbuf, "\tcolour_%lu", c_file->colour_arr[col]);
+  }
+
+  strbuf_append_char(sbuf, '\n');
+}
+
+CORTEX_VCF_WRITER* cortex_vcf_open(const char *path, const CORTEX_FILE *c_file,
+                                   char compress)
+{
+  if(c_file->filetype != BUBBLE_FILE)
+  {
+    fprintf(stderr, "cortex_vcf.c: can only write VCF from a bubble file "
+                    "(%s)\n", c_file->path);
+    return NULL;
+  }
+
+  // 'T' writes without gzip compression
+  gzFile out = gzopen(path, compress ? "wb" : "wbT");
+
+  if(out == NULL)
+  {
+    fprintf(stderr, "cortex_vcf.c: couldn't open file (%s)\n", path);
+    return NULL;
+  }
+
+  gzbuffer(out, 1<<17);
+
+  CORTEX_VCF_WRITER *vcf = (CORTEX_VCF_WRITER*) malloc(sizeof(CORTEX_VCF_WRITER));
+  vcf->out = out;
+  vcf->buffer = strbuf_init(VCF_FLUSH_SIZE + 4096);
+  vcf->c_file = c_file;
+  vcf->failed = 0;
+
+  _vcf_print_header(vcf);
+
+  return vcf;
+}
+
+char cortex_vcf_close(CORTEX_VCF_WRITER *vcf)
+{
+  char success = _vcf_flush(vcf);
+
+  if(gzclose(vcf->out) != Z_OK)
+  {
+    fprintf(stderr, "cortex_vcf.c: couldn't close file\n");
+    success = 0;
+  }
+
+  strbuf_free(vcf->buffer);
+  free(vcf);
+
+  return success;
+}
+
+void cortex_vcf_write_bubble(CORTEX_VCF_WRITER *vcf,
+                             const CORTEX_BUBBLE *bubble)
+{
+  cortex_vcf_format_bubble(vcf->buffer, bubble, vcf->c_file);
+
+  if(strbuf_len(vcf->buffer) >= VCF_FLUSH_SIZE)
+  {
+    _vcf_flush(vcf);
+  }
+}
+
+//
+// Parallel conversion
+//
+
+typedef struct
+{
+  CORTEX_BUBBLE **bubbles;
+  unsigned long num_bubbles;
+  // Formatted output, one buffer per chunk of chunk_size bubbles
+  StrBuf **chunks;
+  unsigned long chunk_size;
+  CORTEX_VCF_WRITER *vcf;
+  unsigned int num_threads;
+} VCF_BATCH;
+
+void _vcf_format_chunk(size_t chunk, void *arg)
+{
+  VCF_BATCH *batch = (VCF_BATCH*)arg;
+  StrBuf *sbuf = batch->chunks[chunk];
+
+  unsigned long i = chunk * batch->chunk_size;
+  unsigned long end = i + batch->chunk_size;
+
+  if(end > batch->num_bubbles)
+  {
+    end = batch->num_bubbles;
+  }
+
+  strbuf_reset(sbuf);
+
+  for(; i < end; i++)
+  {
+    cortex_vcf_format_bubble(sbuf, batch->bubbles[i], batch->vcf->c_file);
+  }
+}
+
+// Format a batch in parallel, then write chunks in order
+void* _vcf_write_batch(void *ptr)
+{
+  VCF_BATCH *batch = (VCF_BATCH*)ptr;
+
+  size_t num_chunks = (batch->num_bubbles + batch->chunk_size - 1) /
+                      batch->chunk_size;
+
+  cortex_parallel_for(num_chunks, batch->num_threads, _vcf_format_chunk, batch);
+
+  size_t i;
+  for(i = 0; i < num_chunks &&
+             _vcf_write(batch->vcf, batch->chunks[i]->buff,
+                        strbuf_len(batch->chunks[i])); i++);
+
+  return NULL;
+}
+
+unsigned long cortex_vcf_convert(CORTEX_FILE *c_file, const char *path,
+                                 char compress, unsigned int num_threads)
+{
+  CORTEX_VCF_WRITER *vcf = cortex_vcf_open(path, c_file, compress);
+
+  if(vcf == NULL)
+  {
+    return 0;
+  }
+
+  if(!_vcf_flush(vcf))
+  {
+    cortex_vcf_close(vcf);
+    return 0;
+  }
+
+  if(num_threads == 0)
+  {
+    num_threads = cortex_num_cpus();
+  }
+
+  // Each colour holds two coverage arrays of ~200 values per bubble
+  unsigned long bytes_per_bubble = 1024 + c_file->num_of_colours *
+                                   2 * (sizeof(COLOUR_COVG) +
+                                        200 * sizeof(unsigned long));
+
+  unsigned long batch_size = VCF_BATCH_MEMORY / bytes_per_bubble;
+
+  if(batch_size > VCF_MAX_BATCH_SIZE)
+  {
+    batch_size = VCF_MAX_BATCH_SIZE;
+  }
+  else if(batch_size < 8)
+  {
+    batch_size = 8;
+  }
+
+  // Aim for several chunks per thread so the work balances
+  unsigned long chunk_size = batch_size / (8 * num_threads);
+
+  if(chunk_size == 0)
+  {
+    chunk_size = 1;
+  }
+
+  unsigned long num_chunks = (batch_size + chunk_size - 1) / chunk_size;
+
+  // Two batches: one being read while the other is formatted and written
+  VCF_BATCH batches[2];
+  unsigned long i;
+  int b;
+
+  for(b = 0; b < 2; b++)
+  {
+    batches[b].bubbles
+      = (CORTEX_BUBBLE**) malloc(batch_size * sizeof(CORTEX_BUBBLE*));
+    batches[b].chunks = (StrBuf**) malloc(num_chunks * sizeof(StrBuf*));
+    batches[b].num_bubbles = 0;
+    batches[b].chunk_size = chunk_size;
+    batches[b].vcf = vcf;
+    batches[b].num_threads = num_threads;
+
+    for(i = 0; i < batch_size; i++)
+    {
+      batches[b].bubbles[i] = cortex_bubble_create(c_file);
+    }
+
+    for(i = 0; i < num_chunks; i++)
+    {
+      batches[b].chunks[i] = strbuf_init(chunk_size * 512);
+    }
+  }
+
+  pthread_t writer;
+  char writer_running = 0;
+  unsigned long num_written = 0;
+  int curr = 0;
+
+  while(1)
+  {
+    VCF_BATCH *batch = &batches[curr];
+
+    for(batch->num_bubbles = 0; batch->num_bubbles < batch_size &&
+        cortex_read_bubble(batch->bubbles[batch->num_bubbles], c_file);
+        batch->num_bubbles++);
+
+    if(writer_running)
+    {
+      pthread_join(writer, NULL);
+      writer_running = 0;
+    }
+
+    if(batch->num_bubbles == 0 || vcf->failed)
+    {
+      break;
+    }
+
+    num_written += batch->num_bubbles;
+
+    if(num_threads > 1 &&
+       pthread_create(&writer, NULL, _vcf_write_batch, batch) == 0)
+    {
+      writer_running = 1;
+    }
+    else
+    {
+      _vcf_write_batch(batch);
+    }
+
+    if(batch->num_bubbles < batch_size)
+    {
+      break;
+    }
+
+    curr = !curr;
+  }
+
+  if(writer_running)
+  {
+    pthread_join(writer, NULL);
+  }
+
+  for(b = 0; b < 2; b++)
+  {
+    for(i = 0; i < batch_size; i++)
+    {
+      cortex_bubble_free(batches[b].bubbles[i], c_file);
+    }
+
+    for(i = 0; i < num_chunks; i++)
+    {
+      strbuf_free(batches[b].chunks[i]);
+    }
+
+    free(batches[b].bubbles);
+    free(batches[b].chunks);
+  }
+
+  if(!cortex_vcf_close(vcf))
+  {
+    return 0;
+  }
+
+  return num_written;
+}
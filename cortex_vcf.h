@@ -0,0 +1,70 @@
+/*
+ cortex_vcf.h
+ project: Cortex Library
+ author: Isaac Turner <turner.isaac@gmail.com>
+
+ Copyright (c) 2012, Isaac Turner
+ All rights reserved.
+
+ see: README
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORTEX_VCF_H_SEEN
+#define CORTEX_VCF_H_SEEN
+
+#include "cortex.h"
+
+//
+// VCF export of bubble calls
+//
+// Bubbles have no reference coordinates, so each record is placed on its own
+// 'chromosome' var_<var_num>, at the position of the last base of the 5' flank.
+// That base is the anchor base prepended to both alleles:
+//   REF = anchor + branches[0]   ALT = anchor + branches[1]
+// One sample column per colour, with FORMAT fields:
+//   GT   genotype from calls[col] (only if the file has likelihoods)
+//   PL   phred-scaled llk_hom_br1,[llk_het,]llk_hom_br2 (with likelihoods)
+//   GQ   difference between the two smallest PLs, capped at 99
+//   COVG mean kmer coverage of branch 1 and branch 2 in this colour
+//
+
+typedef struct CORTEX_VCF_WRITER CORTEX_VCF_WRITER;
+
+// Open a VCF file for writing and print the header.  c_file is the bubble
+// file records will come from.  If compress is non-zero output is gzipped.
+// Returns NULL on failure.
+CORTEX_VCF_WRITER* cortex_vcf_open(const char *path, const CORTEX_FILE *c_file,
+                                   char compress);
+// Flushes remaining output and frees the writer.  Returns 0 if any write or
+// closing the file failed, 1 otherwise
+char cortex_vcf_close(CORTEX_VCF_WRITER *vcf);
+
+// Buffered write of a single bubble
+void cortex_vcf_write_bubble(CORTEX_VCF_WRITER *vcf,
+                             const CORTEX_BUBBLE *bubble);
+
+// Append a VCF line for a bubble (including the '\n') to sbuf
+void cortex_vcf_format_bubble(StrBuf *sbuf, const CORTEX_BUBBLE *bubble,
+                              const CORTEX_FILE *c_file);
+
+// Convert all remaining bubbles in c_file to VCF.  Records are read on the
+// calling thread while the previous batch is formatted on num_threads threads
+// (0 => one per cpu) and written in the original order.
+// Returns the number of records written, or 0 if writing failed.
+unsigned long cortex_vcf_convert(CORTEX_FILE *c_file, const char *path,
+                                 char compress, unsigned int num_threads);
+
+#endif